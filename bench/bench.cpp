@@ -0,0 +1,1737 @@
+// Copyright (C) 2023 - Bruno Sanches. See the COPYRIGHT
+// file at the top-level directory of this distribution.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+//
+// This Source Code Form is "Incompatible With Secondary Licenses", as
+// defined by the Mozilla Public License, v. 2.0.
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+
+#include <ldmonitor/DirectoryMonitor.h>
+
+//the bench is built as C++20 when the compiler supports it
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+	#define LDMONITOR_BENCH_COROUTINES
+	#include <ldmonitor/EventStream.h>
+#endif
+
+namespace fs = ldmonitor::fs;
+
+typedef std::chrono::steady_clock Clock_t;
+
+/**
+* Blocks the monitor thread on the first event until all the events of the scenario are queued on the kernel
+*
+* This way the benchmark measures how fast the library drains and dispatches events, not how fast we can create files
+*
+*/
+class Gate
+{
+	public:
+		void Wait()
+		{
+			std::unique_lock lock{m_clLock};
+
+			m_clCondition.wait(lock, [this] { return m_fOpen; });
+		}
+
+		void Open()
+		{
+			{
+				std::lock_guard lock{m_clLock};
+
+				m_fOpen = true;
+				m_tStart = Clock_t::now();
+			}
+
+			m_clCondition.notify_all();
+		}
+
+		void Done()
+		{
+			{
+				std::lock_guard lock{m_clLock};
+
+				m_fDone = true;
+				m_tEnd = Clock_t::now();
+			}
+
+			m_clCondition.notify_all();
+		}
+
+		double WaitDone()
+		{
+			std::unique_lock lock{m_clLock};
+
+			m_clCondition.wait(lock, [this] { return m_fDone; });
+
+			return std::chrono::duration<double>(m_tEnd - m_tStart).count();
+		}
+
+	private:
+		std::mutex				m_clLock;
+		std::condition_variable	m_clCondition;
+
+		Clock_t::time_point		m_tStart;
+		Clock_t::time_point		m_tEnd;
+
+		bool m_fOpen = false;
+		bool m_fDone = false;
+};
+
+static fs::path MakeBenchDir(const char *name)
+{
+	auto path = fs::temp_directory_path();
+
+	path.append("ldmonitor_bench");
+	path.append(name);
+
+	fs::remove_all(path);
+	fs::create_directories(path);
+
+	return path;
+}
+
+static void CreateFiles(const fs::path &dir, size_t count)
+{
+	auto base = dir.string() + "/file_";
+
+	for (size_t i = 0; i < count; ++i)
+	{
+		auto name = base + std::to_string(i);
+
+		int fd = open(name.c_str(), O_CREAT | O_WRONLY, 0644);
+		if (fd != -1)
+			close(fd);
+	}
+}
+
+static size_t GetEnvSize(const char *name, size_t defaultValue)
+{
+	auto value = getenv(name);
+
+	return value ? std::stoul(value) : defaultValue;
+}
+
+struct Result
+{
+	std::string m_strScenario;
+	std::string m_strMetric;
+	double		m_dValue;
+	std::string m_strUnit;
+};
+
+//--json: results are kept and written at the end
+static bool g_fJson = false;
+static std::vector<Result> g_vecResults;
+
+static void Report(const char *scenario, const char *metric, double value, const char *unit)
+{
+	if (g_fJson)
+	{
+		g_vecResults.push_back(Result{ scenario, metric, value, unit });
+
+		return;
+	}
+
+	std::cout << scenario << ' ' << metric << ' ' << value << ' ' << unit << '\n';
+}
+
+//
+//
+// Delivery: per event callbacks vs event views vs batch callbacks
+//
+//
+
+static const size_t DELIVERY_EVENTS = 10000;
+
+static void BenchPerEventDelivery()
+{
+	auto path = MakeBenchDir("per_event");
+
+	Gate gate;
+	size_t received = 0;
+
+	ldmonitor::Watch(
+		path,
+		[&gate, &received](const fs::path &, std::string, uint32_t, std::chrono::milliseconds)
+		{
+			if (received == 0)
+				gate.Wait();
+
+			if (++received == DELIVERY_EVENTS)
+				gate.Done();
+		},
+		ldmonitor::MONITOR_ACTION_FILE_CREATE
+	);
+
+	CreateFiles(path, DELIVERY_EVENTS);
+	gate.Open();
+
+	auto seconds = gate.WaitDone();
+
+	ldmonitor::Unwatch(path);
+
+	Report("delivery_per_event", "events_per_sec", DELIVERY_EVENTS / seconds, "ev/s");
+}
+
+static void BenchEventViewDelivery()
+{
+	auto path = MakeBenchDir("event_view");
+
+	Gate gate;
+	size_t received = 0;
+
+	ldmonitor::WatchEvents(
+		path,
+		[&gate, &received](const ldmonitor::Event &)
+		{
+			if (received == 0)
+				gate.Wait();
+
+			if (++received == DELIVERY_EVENTS)
+				gate.Done();
+		},
+		ldmonitor::MONITOR_ACTION_FILE_CREATE
+	);
+
+	CreateFiles(path, DELIVERY_EVENTS);
+	gate.Open();
+
+	auto seconds = gate.WaitDone();
+
+	ldmonitor::Unwatch(path);
+
+	Report("delivery_event_view", "events_per_sec", DELIVERY_EVENTS / seconds, "ev/s");
+}
+
+static void BenchBatchDelivery()
+{
+	auto path = MakeBenchDir("batch");
+
+	Gate gate;
+	size_t received = 0;
+	size_t batches = 0;
+
+	ldmonitor::WatchBatch(
+		path,
+		[&gate, &received, &batches](const fs::path &, const ldmonitor::Event *, size_t count, std::chrono::milliseconds)
+		{
+			if (received == 0)
+				gate.Wait();
+
+			++batches;
+			received += count;
+			if (received == DELIVERY_EVENTS)
+				gate.Done();
+		},
+		ldmonitor::MONITOR_ACTION_FILE_CREATE
+	);
+
+	CreateFiles(path, DELIVERY_EVENTS);
+	gate.Open();
+
+	auto seconds = gate.WaitDone();
+
+	ldmonitor::Unwatch(path);
+
+	Report("delivery_batch", "events_per_sec", DELIVERY_EVENTS / seconds, "ev/s");
+	Report("delivery_batch", "events_per_batch", static_cast<double>(DELIVERY_EVENTS) / batches, "ev");
+}
+
+//
+//
+// Read buffer: system calls needed for draining a burst with different buffer limits
+//
+//
+
+static void BenchReadBuffer()
+{
+	const size_t arLimits[] = { 4 * 1024, 64 * 1024, 256 * 1024, 1024 * 1024 };
+
+	for (auto limit : arLimits)
+	{
+		auto path = MakeBenchDir("read_buffer");
+
+		ldmonitor::MonitorOptions monitorOptions;
+		monitorOptions.m_szMaxReadBuffer = limit;
+
+		ldmonitor::Monitor monitor{ monitorOptions };
+
+		Gate gate;
+		size_t received = 0;
+		size_t reads = 0;
+
+		//a batch callback is called once per read
+		monitor.WatchBatch(
+			path,
+			[&gate, &received, &reads](const fs::path &, const ldmonitor::Event *, size_t count, std::chrono::milliseconds)
+			{
+				if (received == 0)
+					gate.Wait();
+
+				++reads;
+				received += count;
+				if (received == DELIVERY_EVENTS)
+					gate.Done();
+			},
+			ldmonitor::MONITOR_ACTION_FILE_CREATE
+		);
+
+		CreateFiles(path, DELIVERY_EVENTS);
+		gate.Open();
+
+		auto seconds = gate.WaitDone();
+
+		monitor.Unwatch(path);
+
+		const auto scenario = "read_buffer_" + std::to_string(limit / 1024) + "k";
+
+		//each read is a poll, an ioctl(FIONREAD) and the read itself
+		Report(scenario.c_str(), "events_per_read", static_cast<double>(DELIVERY_EVENTS) / reads, "ev");
+		Report(scenario.c_str(), "syscalls_per_event", 3.0 * reads / DELIVERY_EVENTS, "calls/ev");
+		Report(scenario.c_str(), "events_per_sec", DELIVERY_EVENTS / seconds, "ev/s");
+	}
+}
+
+//
+//
+// Coalescing: how many callbacks a write storm turns into
+//
+//
+
+static void BenchCoalescing()
+{
+	const size_t numFiles = 1000;
+	const size_t writesPerFile = 10;
+
+	auto path = MakeBenchDir("coalesce");
+
+	ldmonitor::WatchOptions options;
+	options.m_tCoalesceWindow = std::chrono::milliseconds{ 20 };
+
+	std::atomic_size_t received = 0;
+
+	ldmonitor::Watch(
+		path,
+		[&received](const fs::path &, std::string, uint32_t, std::chrono::milliseconds) { ++received; },
+		ldmonitor::MONITOR_ACTION_FILE_CREATE | ldmonitor::MONITOR_ACTION_FILE_MODIFY,
+		options
+	);
+
+	auto base = path.string() + "/file_";
+
+	auto start = Clock_t::now();
+
+	for (size_t i = 0; i < numFiles; ++i)
+	{
+		auto name = base + std::to_string(i);
+
+		int fd = open(name.c_str(), O_CREAT | O_WRONLY, 0644);
+		for (size_t j = 0; j < writesPerFile; ++j)
+			write(fd, "x", 1);
+
+		close(fd);
+	}
+
+	while (received < numFiles)
+		std::this_thread::sleep_for(std::chrono::milliseconds{ 1 });
+
+	auto end = Clock_t::now();
+
+	ldmonitor::Unwatch(path);
+
+	Report("coalescing", "file_operations", static_cast<double>(numFiles * (writesPerFile + 1)), "ops");
+	Report("coalescing", "callbacks", static_cast<double>(received), "calls");
+	Report("coalescing", "time", std::chrono::duration<double, std::milli>(end - start).count(), "ms");
+}
+
+//
+//
+// Recursive registration: time for walking and watching a whole tree
+//
+//
+
+/**
+* Creates count directories below path, each one with up to fanout children
+*
+*/
+static void CreateTree(const fs::path &path, size_t count, size_t fanout)
+{
+	std::vector<std::string> dirs{ path.string() };
+
+	for (size_t i = 0, created = 0; created < count; ++i)
+	{
+		for (size_t j = 0; (j < fanout) && (created < count); ++j, ++created)
+		{
+			auto dir = dirs[i] + "/d" + std::to_string(j);
+
+			mkdir(dir.c_str(), 0755);
+			dirs.push_back(std::move(dir));
+		}
+	}
+}
+
+static void BenchRecursiveRegistration()
+{
+	//default stays bellow the usual fs.inotify.max_user_watches
+	const auto numDirs = GetEnvSize("LDMONITOR_BENCH_TREE_DIRS", 10000);
+
+	auto path = MakeBenchDir("recursive");
+	CreateTree(path, numDirs, 10);
+
+	ldmonitor::WatchOptions options;
+	options.m_fRecursive = true;
+
+	auto start = Clock_t::now();
+
+	ldmonitor::Watch(path, [](const fs::path &, std::string, uint32_t, std::chrono::milliseconds) {}, ldmonitor::MONITOR_ACTION_FILE_CREATE, options);
+
+	auto registered = Clock_t::now();
+
+	ldmonitor::Unwatch(path);
+
+	auto end = Clock_t::now();
+
+	Report("recursive_registration", "directories", static_cast<double>(numDirs), "dirs");
+	Report("recursive_registration", "watch_time", std::chrono::duration<double, std::milli>(registered - start).count(), "ms");
+	Report("recursive_registration", "unwatch_time", std::chrono::duration<double, std::milli>(end - registered).count(), "ms");
+	Report("recursive_registration", "dirs_per_sec", numDirs / std::chrono::duration<double>(registered - start).count(), "dirs/s");
+
+	fs::remove_all(path);
+}
+
+//
+//
+// Watch registration: cost of Watch / Unwatch as the number of watched directories grows
+//
+//
+
+static size_t ReadMaxUserWatches()
+{
+	std::ifstream file("/proc/sys/fs/inotify/max_user_watches");
+
+	size_t value = 0;
+	file >> value;
+
+	return value;
+}
+
+static void BenchWatchRegistration()
+{
+	const size_t arCounts[] = { 1000, 10000, 100000 };
+
+	const auto maxWatches = ReadMaxUserWatches();
+
+	auto path = MakeBenchDir("registration");
+
+	std::vector<fs::path> dirs;
+
+	for (auto count : arCounts)
+	{
+		if (maxWatches && (count > maxWatches))
+		{
+			std::cerr << "watch_registration: " << count << " watches is above fs.inotify.max_user_watches (" << maxWatches << "), skipped\n";
+
+			continue;
+		}
+
+		while (dirs.size() < count)
+		{
+			auto dir = path / ("d" + std::to_string(dirs.size()));
+
+			mkdir(dir.string().c_str(), 0755);
+			dirs.push_back(std::move(dir));
+		}
+
+		auto start = Clock_t::now();
+
+		for (size_t i = 0; i < count; ++i)
+			ldmonitor::Watch(dirs[i], [](const fs::path &, std::string, uint32_t, std::chrono::milliseconds) {}, ldmonitor::MONITOR_ACTION_FILE_CREATE);
+
+		auto registered = Clock_t::now();
+
+		//duplicate checks with everything registered
+		const size_t step = std::max<size_t>(1, count / 1000);
+		size_t numChecks = 0;
+
+		for (size_t i = 0; i < count; i += step, ++numChecks)
+		{
+			try
+			{
+				ldmonitor::Watch(dirs[i], [](const fs::path &, std::string, uint32_t, std::chrono::milliseconds) {}, ldmonitor::MONITOR_ACTION_FILE_CREATE);
+			}
+			catch (const std::invalid_argument &)
+			{
+				//expected
+			}
+		}
+
+		auto checked = Clock_t::now();
+
+		for (size_t i = 0; i < count; ++i)
+			ldmonitor::Unwatch(dirs[i]);
+
+		auto end = Clock_t::now();
+
+		const auto scenario = "watch_registration_" + std::to_string(count);
+
+		Report(scenario.c_str(), "watch_time", std::chrono::duration<double, std::milli>(registered - start).count(), "ms");
+		Report(scenario.c_str(), "watch_cost", std::chrono::duration<double, std::micro>(registered - start).count() / count, "us/watch");
+		Report(scenario.c_str(), "duplicate_check_cost", std::chrono::duration<double, std::micro>(checked - registered).count() / numChecks, "us/check");
+		Report(scenario.c_str(), "unwatch_cost", std::chrono::duration<double, std::micro>(end - checked).count() / count, "us/unwatch");
+	}
+
+	fs::remove_all(path);
+}
+
+//
+//
+// Sharding: delivery throughput as directories are spread over more inotify instances and threads
+//
+//
+
+static void BenchShardedDelivery()
+{
+	//stays bellow the default fs.inotify.max_queued_events even with a single shard
+	const size_t numDirs = 16;
+	const size_t eventsPerDir = 1000;
+	const size_t numEvents = numDirs * eventsPerDir;
+
+	auto path = MakeBenchDir("sharded");
+
+	std::vector<fs::path> dirs;
+	for (size_t i = 0; i < numDirs; ++i)
+		dirs.push_back(path / ("d" + std::to_string(i)));
+
+	const size_t arShards[] = { 1, 2, 4, 8 };
+
+	for (auto numShards : arShards)
+	{
+		Gate gate;
+		std::atomic_bool open = false;
+		std::atomic_size_t received = 0;
+
+		//files from the previous round would not generate creates
+		for (auto &dir : dirs)
+		{
+			fs::remove_all(dir);
+			fs::create_directories(dir);
+		}
+
+		ldmonitor::ShardedMonitor monitor{ numShards };
+
+		for (size_t i = 0; i < numDirs; ++i)
+		{
+			//round robin, so all shards get the same load
+			monitor.Watch(
+				i % numShards,
+				dirs[i],
+				[&gate, &open, &received](const fs::path &, std::string, uint32_t, std::chrono::milliseconds)
+				{
+					if (!open)
+						gate.Wait();
+
+					if (++received == numEvents)
+						gate.Done();
+				},
+				ldmonitor::MONITOR_ACTION_FILE_CREATE
+			);
+		}
+
+		for (auto &dir : dirs)
+			CreateFiles(dir, eventsPerDir);
+
+		gate.Open();
+		open = true;
+
+		auto seconds = gate.WaitDone();
+
+		for (auto &dir : dirs)
+			monitor.Unwatch(dir);
+
+		const auto scenario = "sharded_delivery_" + std::to_string(numShards);
+
+		Report(scenario.c_str(), "events_per_sec", numEvents / seconds, "ev/s");
+	}
+
+	fs::remove_all(path);
+}
+
+//
+//
+// Threadless: wake up latency and CPU per event of ProcessEvents on our own loop vs the monitor thread
+//
+//
+
+static double GetCpuSeconds()
+{
+	rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+
+	return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+/**
+* Creates files one at a time, waiting for each one to be delivered, returns the average latency in us
+*
+*/
+static double MeasureLatency(const fs::path &path, std::atomic<int64_t> &delivered, size_t count)
+{
+	double total = 0;
+
+	for (size_t i = 0; i < count; ++i)
+	{
+		delivered = 0;
+
+		auto name = path.string() + "/latency_" + std::to_string(i);
+		auto start = Clock_t::now();
+
+		int fd = open(name.c_str(), O_CREAT | O_WRONLY, 0644);
+		close(fd);
+
+		while (delivered == 0)
+			std::this_thread::yield();
+
+		total += (delivered - start.time_since_epoch().count()) / 1000.0;
+	}
+
+	return total / count;
+}
+
+static void BenchThreadless()
+{
+	const size_t numLatency = 1000;
+
+	for (int threadless = 0; threadless < 2; ++threadless)
+	{
+		auto path = MakeBenchDir("threadless");
+
+		ldmonitor::MonitorOptions monitorOptions;
+		monitorOptions.m_fThreadless = threadless != 0;
+
+		ldmonitor::Monitor monitor{ monitorOptions };
+
+		std::atomic<int64_t> delivered = 0;
+		std::atomic_size_t received = 0;
+
+		//holds the monitor thread or our loop while a burst is queued
+		std::atomic_bool paused = false;
+
+		monitor.WatchEvents(
+			path,
+			[&delivered, &received, &paused](const ldmonitor::Event &)
+			{
+				while (paused)
+					std::this_thread::sleep_for(std::chrono::milliseconds{ 1 });
+
+				++received;
+				delivered = Clock_t::now().time_since_epoch().count();
+			},
+			ldmonitor::MONITOR_ACTION_FILE_CREATE
+		);
+
+		//threadless: our own event loop
+		std::atomic_bool stop = false;
+		std::thread loop;
+
+		if (threadless)
+		{
+			loop = std::thread{ [&monitor, &stop, &paused]()
+			{
+				pollfd pfd = {};
+				pfd.fd = monitor.GetFileDescriptor();
+				pfd.events = POLLIN;
+
+				while (!stop)
+				{
+					if (paused)
+					{
+						std::this_thread::sleep_for(std::chrono::milliseconds{ 1 });
+
+						continue;
+					}
+
+					poll(&pfd, 1, 10);
+					monitor.ProcessEvents();
+				}
+			} };
+		}
+
+		const auto latency = MeasureLatency(path, delivered, numLatency);
+
+		//
+		//CPU: queue a burst while paused and measure only the drain
+		paused = true;
+
+		const auto target = received + DELIVERY_EVENTS;
+
+		CreateFiles(path, DELIVERY_EVENTS);
+
+		const auto cpuStart = GetCpuSeconds();
+
+		paused = false;
+
+		while (received < target)
+			std::this_thread::sleep_for(std::chrono::microseconds{ 100 });
+
+		const auto cpuEnd = GetCpuSeconds();
+
+		stop = true;
+		if (loop.joinable())
+			loop.join();
+
+		monitor.Unwatch(path);
+
+		const char *scenario = threadless ? "threadless" : "threaded";
+
+		Report(scenario, "wakeup_latency", latency, "us");
+		Report(scenario, "cpu_per_event", (cpuEnd - cpuStart) * 1e6 / DELIVERY_EVENTS, "us");
+	}
+}
+
+//
+//
+// io_uring: multishot reads into provided buffers vs poll + read on the monitor thread
+//
+//
+
+static void BenchIoUring()
+{
+	const size_t numLatency = 1000;
+
+	for (int useRing = 0; useRing < 2; ++useRing)
+	{
+		ldmonitor::MonitorOptions monitorOptions;
+		monitorOptions.m_fUseIoUring = useRing != 0;
+
+		ldmonitor::Monitor monitor{ monitorOptions };
+
+		if (useRing && !monitor.IsUsingIoUring())
+		{
+			std::cout << "io_uring not available, skipped\n";
+
+			continue;
+		}
+
+		auto path = MakeBenchDir("io_uring");
+
+		Gate gate;
+		std::atomic<int64_t> delivered = 0;
+		std::atomic_size_t received = 0;
+
+		//the gate only holds the burst, latency is measured with it open
+		std::atomic_size_t target = 0;
+		std::atomic_bool gated = false;
+
+		monitor.WatchEvents(
+			path,
+			[&](const ldmonitor::Event &)
+			{
+				if (gated && (received == 0))
+					gate.Wait();
+
+				delivered = Clock_t::now().time_since_epoch().count();
+				if (++received == target)
+					gate.Done();
+			},
+			ldmonitor::MONITOR_ACTION_FILE_CREATE
+		);
+
+		const auto latency = MeasureLatency(path, delivered, numLatency);
+
+		//
+		//Burst: queued while the monitor thread is held, so only the drain is measured
+		received = 0;
+		target = DELIVERY_EVENTS;
+		gated = true;
+
+		CreateFiles(path, DELIVERY_EVENTS);
+
+		const auto cpuStart = GetCpuSeconds();
+		gate.Open();
+
+		auto seconds = gate.WaitDone();
+		const auto cpuEnd = GetCpuSeconds();
+
+		monitor.Unwatch(path);
+
+		const char *scenario = useRing ? "io_uring" : "poll";
+
+		Report(scenario, "wakeup_latency", latency, "us");
+		Report(scenario, "events_per_sec", DELIVERY_EVENTS / seconds, "ev/s");
+		Report(scenario, "cpu_per_event", (cpuEnd - cpuStart) * 1e6 / DELIVERY_EVENTS, "us");
+	}
+}
+
+//
+//
+// Filters: drain cost when most of the churn is temp files, dropped by the watch filter vs by the callback
+//
+//
+
+static void BenchFilter()
+{
+	for (int useFilter = 0; useFilter < 2; ++useFilter)
+	{
+		auto path = MakeBenchDir("filter");
+
+		//threadless, so the drain is timed on this thread
+		ldmonitor::MonitorOptions monitorOptions;
+		monitorOptions.m_fThreadless = true;
+
+		ldmonitor::Monitor monitor{ monitorOptions };
+
+		ldmonitor::WatchOptions options;
+		if (useFilter)
+			options.m_vecExclude = { "*.tmp", ".~lock*" };
+
+		size_t received = 0;
+
+		monitor.Watch(
+			path,
+			[&received, useFilter](const ldmonitor::fs::path &, std::string fileName, uint32_t, std::chrono::milliseconds)
+			{
+				if (!useFilter && (fileName.size() >= 4) && !fileName.compare(fileName.size() - 4, 4, ".tmp"))
+					return;
+
+				++received;
+			},
+			ldmonitor::MONITOR_ACTION_FILE_CREATE | ldmonitor::MONITOR_ACTION_FILE_MODIFY,
+			options
+		);
+
+		//99% temp files
+		auto base = path.string() + '/';
+		for (size_t i = 0; i < DELIVERY_EVENTS; ++i)
+		{
+			auto name = base + ((i % 100) ? "file_" + std::to_string(i) + ".tmp" : "data_" + std::to_string(i) + ".txt");
+
+			int fd = open(name.c_str(), O_CREAT | O_WRONLY, 0644);
+			if (fd != -1)
+				close(fd);
+		}
+
+		auto start = Clock_t::now();
+
+		size_t processed = 0;
+		while (auto count = monitor.ProcessEvents())
+			processed += count;
+
+		auto seconds = std::chrono::duration<double>(Clock_t::now() - start).count();
+
+		monitor.Unwatch(path);
+
+		const char *scenario = useFilter ? "filter_watch" : "filter_callback";
+
+		Report(scenario, "ns_per_event", seconds * 1e9 / processed, "ns");
+		Report(scenario, "delivered", static_cast<double>(received), "ev");
+	}
+}
+
+//
+//
+// Event queue: push + pop cost with one (SPSC) and several (MPSC) producers
+//
+//
+
+static void BenchEventQueue()
+{
+	const size_t numEvents = 1000000;
+
+	for (size_t numProducers : { 1, 2, 4 })
+	{
+		ldmonitor::QueueOptions options;
+		options.m_szCapacity = 4096;
+
+		ldmonitor::EventQueue queue{ options };
+
+		const std::string name = "a_file_name.txt";
+		const size_t perProducer = numEvents / numProducers;
+
+		auto start = Clock_t::now();
+
+		std::vector<std::thread> producers;
+		for (size_t i = 0; i < numProducers; ++i)
+		{
+			producers.emplace_back([&queue, &name, perProducer]()
+			{
+				ldmonitor::Event event;
+				event.m_svFileName = name;
+				event.m_u32Action = ldmonitor::MONITOR_ACTION_FILE_MODIFY;
+
+				for (size_t j = 0; j < perProducer; ++j)
+					queue.Push(event);
+			});
+		}
+
+		ldmonitor::QueuedEvent events[64];
+
+		for (size_t received = 0; received < perProducer * numProducers;)
+		{
+			auto count = queue.PopBatch(events, 64);
+			if (!count)
+				std::this_thread::yield();
+
+			received += count;
+		}
+
+		auto seconds = std::chrono::duration<double>(Clock_t::now() - start).count();
+
+		for (auto &producer : producers)
+			producer.join();
+
+		const auto scenario = "event_queue_" + std::to_string(numProducers) + "p";
+
+		Report(scenario.c_str(), "events_per_sec", perProducer * numProducers / seconds, "ev/s");
+		Report(scenario.c_str(), "ns_per_event", seconds * 1e9 / (perProducer * numProducers), "ns");
+	}
+}
+
+//
+//
+// Checkpoint: restarting from a saved state vs rescanning a tree
+//
+//
+
+static void BenchCheckpoint()
+{
+	//1M files is the real target, but takes a while to create
+	const auto numFiles = GetEnvSize("LDMONITOR_BENCH_CHECKPOINT_FILES", 100000);
+	const size_t numDirs = 100;
+
+	//one in a hundred files changed while offline
+	const size_t numChanged = numFiles / 100;
+
+	auto path = MakeBenchDir("checkpoint");
+
+	auto checkpointPath = path.parent_path() / "checkpoint.ckpt";
+	fs::remove(checkpointPath);
+
+	for (size_t i = 0; i < numDirs; ++i)
+	{
+		auto dir = path / ("d" + std::to_string(i));
+
+		fs::create_directory(dir);
+		CreateFiles(dir, numFiles / numDirs);
+	}
+
+	std::atomic<size_t> received = 0;
+
+	auto callback = [&received](const fs::path &, std::string, uint32_t, std::chrono::milliseconds) { ++received; };
+
+	ldmonitor::WatchOptions options;
+	options.m_fRecursive = true;
+	options.m_fKeepIndex = true;
+
+	ldmonitor::Monitor monitor;
+
+	//what a restart costs without a checkpoint: scanning everything, so everything must be processed again
+	auto start = Clock_t::now();
+	monitor.Watch(path, callback, ldmonitor::MONITOR_ACTION_FILE_MODIFY, options);
+	auto rescan = Clock_t::now() - start;
+
+	monitor.Unwatch(path);
+
+	options.m_pthCheckpoint = checkpointPath;
+
+	monitor.Watch(path, callback, ldmonitor::MONITOR_ACTION_FILE_MODIFY, options);
+
+	start = Clock_t::now();
+	monitor.Unwatch(path);
+	auto save = Clock_t::now() - start;
+
+	for (size_t i = 0; i < numChanged; ++i)
+	{
+		auto name = path.string() + "/d" + std::to_string(i % numDirs) + "/file_" + std::to_string(i / numDirs);
+
+		int fd = open(name.c_str(), O_WRONLY | O_APPEND);
+		if (fd == -1)
+			continue;
+
+		write(fd, "x", 1);
+		close(fd);
+	}
+
+	received = 0;
+
+	start = Clock_t::now();
+	monitor.Watch(path, callback, ldmonitor::MONITOR_ACTION_FILE_MODIFY, options);
+	auto restart = Clock_t::now() - start;
+
+	while (received < numChanged)
+		std::this_thread::yield();
+
+	auto delivered = Clock_t::now() - start;
+
+	monitor.Unwatch(path);
+
+	Report("checkpoint", "files", static_cast<double>(numFiles), "files");
+	Report("checkpoint", "file_size", static_cast<double>(fs::file_size(checkpointPath)) / (1024 * 1024), "MiB");
+	Report("checkpoint", "rescan_time", std::chrono::duration<double, std::milli>(rescan).count(), "ms");
+	Report("checkpoint", "rescan_events_needed", static_cast<double>(numFiles), "ev");
+	Report("checkpoint", "save_time", std::chrono::duration<double, std::milli>(save).count(), "ms");
+	Report("checkpoint", "restart_time", std::chrono::duration<double, std::milli>(restart).count(), "ms");
+	Report("checkpoint", "restart_events", static_cast<double>(received), "ev");
+	Report("checkpoint", "changes_delivered_time", std::chrono::duration<double, std::milli>(delivered).count(), "ms");
+
+	fs::remove_all(path);
+	fs::remove(checkpointPath);
+}
+
+//
+//
+// Polling: cost of a scan (getdents64 + statx) per 100k entries, with the stats spread over threads
+//
+//
+
+static void BenchPollScan()
+{
+	const auto numFiles = GetEnvSize("LDMONITOR_BENCH_POLL_FILES", 100000);
+
+	//one big directory, where the pool helps, and many small ones, where it does not
+	for (size_t numDirs : { 1, 100 })
+	{
+		auto path = MakeBenchDir("poll_scan");
+
+		for (size_t i = 0; i < numDirs; ++i)
+		{
+			auto dir = path / ("d" + std::to_string(i));
+
+			fs::create_directory(dir);
+			CreateFiles(dir, numFiles / numDirs);
+		}
+
+		for (size_t numThreads : { 0, 2, 4 })
+		{
+			ldmonitor::MonitorOptions monitorOptions;
+			monitorOptions.m_szPollThreads = numThreads;
+
+			ldmonitor::Monitor monitor{ monitorOptions };
+
+			ldmonitor::WatchOptions options;
+			options.m_fRecursive = true;
+			options.m_fPolling = true;
+			options.m_tPollInterval = std::chrono::hours{ 1 };
+
+			//warm the caches, the scans of a polling watch always find them warm
+			monitor.Watch(path, [](const fs::path &, std::string, uint32_t, std::chrono::milliseconds) {}, ldmonitor::MONITOR_ACTION_FILE_CREATE, options);
+			monitor.Unwatch(path);
+
+			//Watch does the first scan
+			auto start = Clock_t::now();
+			monitor.Watch(path, [](const fs::path &, std::string, uint32_t, std::chrono::milliseconds) {}, ldmonitor::MONITOR_ACTION_FILE_CREATE, options);
+			auto elapsed = Clock_t::now() - start;
+
+			monitor.Unwatch(path);
+
+			const auto scenario = "poll_scan_" + std::to_string(numDirs) + "d_" + std::to_string(numThreads) + "t";
+
+			Report(scenario.c_str(), "scan_time", std::chrono::duration<double, std::milli>(elapsed).count(), "ms");
+			Report(scenario.c_str(), "cost_per_100k", std::chrono::duration<double, std::milli>(elapsed).count() * 100000 / numFiles, "ms");
+		}
+
+		fs::remove_all(path);
+	}
+}
+
+//
+//
+// Storms: sustained throughput and latency from the file operation to the callback
+//
+//
+
+//operations not delivered yet, keeps the kernel queue bellow the default fs.inotify.max_queued_events
+static const size_t STORM_WINDOW = 4096;
+
+static const std::chrono::seconds STORM_TIMEOUT{ 60 };
+
+static int64_t GetTimestamp()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock_t::now().time_since_epoch()).count();
+}
+
+/**
+* Start and delivery time of each operation of a storm, operation i is on a file named with i after a one letter prefix
+*
+* Start is called by the producer right before the operation and Deliver by the monitor thread that got the event,
+* a file is always on the same watch, so each delivery time is written by a single thread
+*
+*/
+class LatencyRecorder
+{
+	public:
+		explicit LatencyRecorder(size_t count) :
+			m_vecStart(count),
+			m_vecEnd(count)
+		{
+			//empty
+		}
+
+		void Reset()
+		{
+			for (auto &start : m_vecStart)
+				start = 0;
+
+			std::fill(m_vecEnd.begin(), m_vecEnd.end(), 0);
+
+			m_szDelivered = 0;
+		}
+
+		inline void Start(size_t index)
+		{
+			m_vecStart[index] = GetTimestamp();
+		}
+
+		/**
+		* Records the delivery of the event for number (the name without the prefix), repeated events are ignored
+		*
+		*/
+		void Deliver(std::string_view number)
+		{
+			size_t index = 0;
+
+			for (auto c : number)
+			{
+				if ((c < '0') || (c > '9'))
+					return;
+
+				index = index * 10 + (c - '0');
+			}
+
+			if (number.empty() || (index >= m_vecEnd.size()) || (m_vecStart[index] == 0) || m_vecEnd[index])
+				return;
+
+			m_vecEnd[index] = GetTimestamp();
+			++m_szDelivered;
+		}
+
+		inline size_t GetDelivered() const noexcept
+		{
+			return m_szDelivered;
+		}
+
+		/**
+		* Waits until count operations were delivered, false on timeout (events lost to a queue overflow)
+		*
+		*/
+		bool WaitDelivered(size_t count) const
+		{
+			const auto deadline = Clock_t::now() + STORM_TIMEOUT;
+
+			while (m_szDelivered < count)
+			{
+				if (Clock_t::now() > deadline)
+					return false;
+
+				std::this_thread::sleep_for(std::chrono::microseconds{ 100 });
+			}
+
+			return true;
+		}
+
+		/**
+		* Reports the events per second from the first operation to the last delivery and the latency percentiles
+		*
+		*/
+		void ReportResults(const std::string &scenario) const
+		{
+			std::vector<double> latencies;
+			latencies.reserve(m_vecEnd.size());
+
+			int64_t first = INT64_MAX;
+			int64_t last = 0;
+
+			for (size_t i = 0; i < m_vecEnd.size(); ++i)
+			{
+				if (!m_vecEnd[i])
+					continue;
+
+				const int64_t start = m_vecStart[i];
+
+				latencies.push_back((m_vecEnd[i] - start) / 1000.0);
+
+				first = std::min(first, start);
+				last = std::max(last, m_vecEnd[i]);
+			}
+
+			if (latencies.empty())
+				return;
+
+			std::sort(latencies.begin(), latencies.end());
+
+			auto percentile = [&latencies](double q)
+			{
+				return latencies[std::min(latencies.size() - 1, static_cast<size_t>(q * latencies.size()))];
+			};
+
+			Report(scenario.c_str(), "events_per_sec", latencies.size() / ((last - first) / 1e9), "ev/s");
+			Report(scenario.c_str(), "p50_latency", percentile(0.5), "us");
+			Report(scenario.c_str(), "p99_latency", percentile(0.99), "us");
+			Report(scenario.c_str(), "p999_latency", percentile(0.999), "us");
+		}
+
+	private:
+		std::vector<std::atomic<int64_t>>	m_vecStart;
+		std::vector<int64_t>				m_vecEnd;
+
+		std::atomic_size_t					m_szDelivered = 0;
+};
+
+struct StormOperation
+{
+	const char	*m_pszName;
+	uint32_t	m_u32Action;
+
+	//of the names the operation creates
+	char		m_chPrefix;
+};
+
+//each storm starts from the files left by the previous one
+static const StormOperation g_arStormOperations[] =
+{
+	{"create", ldmonitor::MONITOR_ACTION_FILE_CREATE, 'f'},
+	{"modify", ldmonitor::MONITOR_ACTION_FILE_MODIFY, 'f'},
+	{"rename", ldmonitor::MONITOR_ACTION_FILE_RENAME_NEW_NAME, 'r'},
+	{"delete", ldmonitor::MONITOR_ACTION_FILE_DELETE, 'r'}
+};
+
+static void RunStormOperation(const StormOperation &operation, const std::string &dir, size_t index, LatencyRecorder &recorder)
+{
+	const auto number = std::to_string(index);
+	const auto name = dir + "/f" + number;
+
+	switch (operation.m_u32Action)
+	{
+		case ldmonitor::MONITOR_ACTION_FILE_CREATE:
+		{
+			recorder.Start(index);
+
+			int fd = open(name.c_str(), O_CREAT | O_WRONLY, 0644);
+			if (fd != -1)
+				close(fd);
+
+			break;
+		}
+
+		case ldmonitor::MONITOR_ACTION_FILE_MODIFY:
+		{
+			recorder.Start(index);
+
+			int fd = open(name.c_str(), O_WRONLY | O_APPEND);
+			if (fd != -1)
+			{
+				[[maybe_unused]] auto written = write(fd, "x", 1);
+				close(fd);
+			}
+
+			break;
+		}
+
+		case ldmonitor::MONITOR_ACTION_FILE_RENAME_NEW_NAME:
+		{
+			const auto newName = dir + "/r" + number;
+
+			recorder.Start(index);
+			rename(name.c_str(), newName.c_str());
+
+			break;
+		}
+
+		case ldmonitor::MONITOR_ACTION_FILE_DELETE:
+		{
+			const auto oldName = dir + "/r" + number;
+
+			recorder.Start(index);
+			unlink(oldName.c_str());
+
+			break;
+		}
+	}
+}
+
+static void BenchStorm()
+{
+	const size_t numEvents = GetEnvSize("LDMONITOR_BENCH_STORM_EVENTS", 20000);
+	const size_t maxDirs = GetEnvSize("LDMONITOR_BENCH_STORM_MAX_DIRS", 100000);
+
+	const size_t arDirs[] = { 1, 100, 10000, 100000 };
+
+	const auto maxWatches = ReadMaxUserWatches();
+
+	LatencyRecorder recorder{ numEvents };
+
+	for (auto numDirs : arDirs)
+	{
+		if (numDirs > maxDirs)
+			continue;
+
+		if (maxWatches && (numDirs > maxWatches))
+		{
+			std::cerr << "storm: " << numDirs << " watches is above fs.inotify.max_user_watches (" << maxWatches << "), skipped\n";
+
+			continue;
+		}
+
+		auto path = MakeBenchDir("storm");
+
+		std::vector<std::string> dirs;
+		dirs.reserve(numDirs);
+
+		for (size_t i = 0; i < numDirs; ++i)
+		{
+			dirs.push_back(path.string() + "/d" + std::to_string(i));
+
+			mkdir(dirs.back().c_str(), 0755);
+		}
+
+		{
+			ldmonitor::Monitor monitor;
+
+			//the storm running now, events of the others are ignored
+			std::atomic<const StormOperation *> current = nullptr;
+
+			auto callback = [&recorder, &current](const ldmonitor::Event &event)
+			{
+				auto operation = current.load();
+
+				if (operation && (event.m_u32Action == operation->m_u32Action) && !event.m_svFileName.empty() && (event.m_svFileName[0] == operation->m_chPrefix))
+					recorder.Deliver(event.m_svFileName.substr(1));
+			};
+
+			const uint32_t actions = ldmonitor::MONITOR_ACTION_FILE_CREATE | ldmonitor::MONITOR_ACTION_FILE_MODIFY | ldmonitor::MONITOR_ACTION_FILE_RENAME_NEW_NAME | ldmonitor::MONITOR_ACTION_FILE_DELETE;
+
+			try
+			{
+				for (auto &dir : dirs)
+					monitor.WatchEvents(dir, callback, actions);
+			}
+			catch (const std::exception &e)
+			{
+				std::cerr << "storm: cannot watch " << numDirs << " directories, skipped: " << e.what() << '\n';
+
+				dirs.clear();
+			}
+
+			for (size_t i = 0; !dirs.empty() && (i < std::size(g_arStormOperations)); ++i)
+			{
+				auto &operation = g_arStormOperations[i];
+
+				//late events of the previous storm
+				std::this_thread::sleep_for(std::chrono::milliseconds{ 50 });
+
+				recorder.Reset();
+				current = &operation;
+
+				for (size_t j = 0; j < numEvents; ++j)
+				{
+					while (j - recorder.GetDelivered() >= STORM_WINDOW)
+						std::this_thread::yield();
+
+					RunStormOperation(operation, dirs[j % numDirs], j, recorder);
+				}
+
+				const bool delivered = recorder.WaitDelivered(numEvents);
+
+				current = nullptr;
+
+				const auto scenario = std::string{ "storm_" } + operation.m_pszName + "_" + std::to_string(numDirs);
+
+				if (!delivered)
+					std::cerr << scenario << ": only " << recorder.GetDelivered() << " of " << numEvents << " events delivered\n";
+
+				recorder.ReportResults(scenario);
+			}
+		}
+
+		fs::remove_all(path);
+	}
+}
+
+//
+//
+// Slow callbacks: latency of a fast watch while another one blocks its callbacks, on the same or on another thread
+//
+//
+
+static const size_t CONTENTION_EVENTS = 5000;
+
+static void BenchSlowCallback()
+{
+	const std::chrono::microseconds callbackTime{ GetEnvSize("LDMONITOR_BENCH_SLOW_CALLBACK_US", 200) };
+
+	auto path = MakeBenchDir("slow_callback");
+
+	const auto fastDir = path.string() + "/fast";
+	const auto slowDir = path.string() + "/slow";
+
+	const auto &create = g_arStormOperations[0];
+
+	for (size_t numShards = 1; numShards <= 2; ++numShards)
+	{
+		fs::remove_all(fastDir);
+		fs::remove_all(slowDir);
+
+		mkdir(fastDir.c_str(), 0755);
+		mkdir(slowDir.c_str(), 0755);
+
+		LatencyRecorder fast{ CONTENTION_EVENTS };
+		LatencyRecorder slow{ CONTENTION_EVENTS };
+
+		ldmonitor::ShardedMonitor monitor{ numShards };
+
+		monitor.WatchEvents(
+			0,
+			fastDir,
+			[&fast](const ldmonitor::Event &event)
+			{
+				fast.Deliver(event.m_svFileName.substr(1));
+			},
+			ldmonitor::MONITOR_ACTION_FILE_CREATE
+		);
+
+		//the last shard, the same one when there is only one
+		monitor.WatchEvents(
+			numShards - 1,
+			slowDir,
+			[&slow, callbackTime](const ldmonitor::Event &event)
+			{
+				std::this_thread::sleep_for(callbackTime);
+
+				slow.Deliver(event.m_svFileName.substr(1));
+			},
+			ldmonitor::MONITOR_ACTION_FILE_CREATE
+		);
+
+		for (size_t i = 0; i < CONTENTION_EVENTS; ++i)
+		{
+			while (i - std::min(fast.GetDelivered(), slow.GetDelivered()) >= STORM_WINDOW / 2)
+				std::this_thread::yield();
+
+			RunStormOperation(create, fastDir, i, fast);
+			RunStormOperation(create, slowDir, i, slow);
+		}
+
+		const auto scenario = "slow_callback_" + std::to_string(numShards) + (numShards == 1 ? "_shard" : "_shards");
+
+		if (!fast.WaitDelivered(CONTENTION_EVENTS) || !slow.WaitDelivered(CONTENTION_EVENTS))
+			std::cerr << scenario << ": events lost\n";
+
+		monitor.Unwatch(fastDir);
+		monitor.Unwatch(slowDir);
+
+		fast.ReportResults(scenario + "_fast");
+		slow.ReportResults(scenario + "_slow");
+	}
+
+	fs::remove_all(path);
+}
+
+//
+//
+// Metrics: cost of timing callbacks and of taking a snapshot, counters are always on
+//
+//
+
+static void BenchMetrics()
+{
+	const int numRounds = 5;
+
+	double arBest[2] = {};
+
+	for (int timed = 0; timed < 2; ++timed)
+	{
+		ldmonitor::MonitorOptions monitorOptions;
+		monitorOptions.m_fTimeCallbacks = timed != 0;
+
+		ldmonitor::Monitor monitor{ monitorOptions };
+
+		for (int round = 0; round < numRounds; ++round)
+		{
+			auto path = MakeBenchDir("metrics");
+
+			Gate gate;
+			size_t received = 0;
+
+			monitor.WatchEvents(
+				path,
+				[&gate, &received](const ldmonitor::Event &)
+				{
+					if (received == 0)
+						gate.Wait();
+
+					if (++received == DELIVERY_EVENTS)
+						gate.Done();
+				},
+				ldmonitor::MONITOR_ACTION_FILE_CREATE
+			);
+
+			CreateFiles(path, DELIVERY_EVENTS);
+			gate.Open();
+
+			const auto seconds = gate.WaitDone();
+
+			monitor.Unwatch(path);
+
+			//best round, the others were disturbed by something else
+			if ((round == 0) || (seconds < arBest[timed]))
+				arBest[timed] = seconds;
+		}
+
+		const char *scenario = timed ? "metrics_timed" : "metrics_counters";
+
+		Report(scenario, "events_per_sec", DELIVERY_EVENTS / arBest[timed], "ev/s");
+		Report(scenario, "cost_per_event", arBest[timed] * 1e9 / DELIVERY_EVENTS, "ns");
+
+		if (!timed)
+			continue;
+
+		Report(scenario, "timing_overhead", (arBest[1] - arBest[0]) * 1e9 / DELIVERY_EVENTS, "ns/event");
+
+		const size_t numSnapshots = 10000;
+		uint64_t total = 0;
+
+		auto start = Clock_t::now();
+
+		for (size_t i = 0; i < numSnapshots; ++i)
+			total += monitor.GetMetrics().m_u64Events;
+
+		auto elapsed = std::chrono::duration<double, std::nano>(Clock_t::now() - start).count();
+
+		//keeps the loop
+		if (total == 0)
+			std::cerr << "metrics: no events counted\n";
+
+		Report("metrics_snapshot", "get_metrics_cost", elapsed / numSnapshots, "ns");
+	}
+}
+
+//
+//
+// Event stream: latency of resuming a coroutine vs calling a callback
+//
+//
+
+#ifdef LDMONITOR_BENCH_COROUTINES
+
+struct BenchTask
+{
+	struct promise_type
+	{
+		BenchTask get_return_object() noexcept { return {}; }
+
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+
+		void return_void() noexcept {}
+		void unhandled_exception() noexcept { std::terminate(); }
+	};
+};
+
+static BenchTask ConsumeStream(ldmonitor::EventStream &stream, std::atomic<int64_t> &delivered)
+{
+	while (auto event = co_await stream.Next())
+		delivered = Clock_t::now().time_since_epoch().count();
+}
+
+static void BenchEventStream()
+{
+	const size_t numLatency = 1000;
+
+	const char *arScenarios[] = { "callback", "stream_inline", "stream_executor" };
+
+	for (int mode = 0; mode < 3; ++mode)
+	{
+		auto path = MakeBenchDir("event_stream");
+
+		ldmonitor::Monitor monitor;
+
+		std::atomic<int64_t> delivered = 0;
+		double latency;
+
+		if (mode == 0)
+		{
+			monitor.WatchEvents(path, [&delivered](const ldmonitor::Event &) { delivered = Clock_t::now().time_since_epoch().count(); }, ldmonitor::MONITOR_ACTION_FILE_CREATE);
+
+			latency = MeasureLatency(path, delivered, numLatency);
+
+			monitor.Unwatch(path);
+		}
+		else
+		{
+			ldmonitor::StreamOptions options;
+			if (mode == 2)
+				options.m_spExecutor = std::make_shared<ldmonitor::ThreadPool>(1);
+
+			ldmonitor::EventStream stream{ monitor, path, ldmonitor::MONITOR_ACTION_FILE_CREATE, options };
+
+			ConsumeStream(stream, delivered);
+
+			latency = MeasureLatency(path, delivered, numLatency);
+		}
+
+		Report(arScenarios[mode], "wakeup_latency", latency, "us");
+	}
+}
+
+#endif
+
+//
+//
+//
+//
+//
+
+struct Scenario
+{
+	const char *m_pszName;
+	void (*m_pfnRun)();
+};
+
+static const Scenario g_arScenarios[] =
+{
+	{"delivery_per_event", BenchPerEventDelivery},
+	{"delivery_event_view", BenchEventViewDelivery},
+	{"delivery_batch", BenchBatchDelivery},
+	{"read_buffer", BenchReadBuffer},
+	{"coalescing", BenchCoalescing},
+	{"recursive_registration", BenchRecursiveRegistration},
+	{"watch_registration", BenchWatchRegistration},
+	{"sharded_delivery", BenchShardedDelivery},
+	{"threadless", BenchThreadless},
+	{"io_uring", BenchIoUring},
+	{"filter", BenchFilter},
+	{"event_queue", BenchEventQueue},
+	{"checkpoint", BenchCheckpoint},
+	{"poll_scan", BenchPollScan},
+	{"storm", BenchStorm},
+	{"slow_callback", BenchSlowCallback},
+	{"metrics", BenchMetrics},
+#ifdef LDMONITOR_BENCH_COROUTINES
+	{"event_stream", BenchEventStream}
+#endif
+};
+
+static void WriteJsonString(std::ostream &out, std::string_view str)
+{
+	out << '"';
+
+	for (auto c : str)
+	{
+		if ((c == '"') || (c == '\\'))
+			out << '\\';
+
+		out << c;
+	}
+
+	out << '"';
+}
+
+/**
+* Writes the results with what is needed to compare runs: library version, kernel and number of cores
+*
+*/
+static void WriteJson(std::ostream &out)
+{
+	utsname name;
+	uname(&name);
+
+	out << "{\n\t\"version\": ";
+	WriteJsonString(out, LDMONITOR_VERSION);
+
+	out << ",\n\t\"timestamp\": " << std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+
+	out << ",\n\t\"kernel\": ";
+	WriteJsonString(out, name.release);
+
+	out << ",\n\t\"cores\": " << std::thread::hardware_concurrency();
+	out << ",\n\t\"results\": [";
+
+	out << std::setprecision(9);
+
+	for (size_t i = 0; i < g_vecResults.size(); ++i)
+	{
+		auto &result = g_vecResults[i];
+
+		out << (i ? ",\n\t\t{ \"scenario\": " : "\n\t\t{ \"scenario\": ");
+		WriteJsonString(out, result.m_strScenario);
+
+		out << ", \"metric\": ";
+		WriteJsonString(out, result.m_strMetric);
+
+		//no inf or nan on json
+		out << ", \"value\": ";
+		if (std::isfinite(result.m_dValue))
+			out << result.m_dValue;
+		else
+			out << "null";
+
+		out << ", \"unit\": ";
+		WriteJsonString(out, result.m_strUnit);
+
+		out << " }";
+	}
+
+	out << "\n\t]\n}\n";
+}
+
+int main(int argc, char **argv)
+{
+	const char *filter = nullptr;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "--json") == 0)
+			g_fJson = true;
+		else
+			filter = argv[i];
+	}
+
+	bool found = false;
+
+	for (auto &scenario : g_arScenarios)
+	{
+		//no filter, run everything
+		if (filter && strncmp(scenario.m_pszName, filter, strlen(filter)))
+			continue;
+
+		found = true;
+		scenario.m_pfnRun();
+	}
+
+	if (!found)
+	{
+		std::cerr << "Unknown scenario: " << filter << '\n';
+
+		return 1;
+	}
+
+	if (g_fJson)
+		WriteJson(std::cout);
+
+	return 0;
+}
@@ -8,8 +8,19 @@
 // This Source Code Form is "Incompatible With Secondary Licenses", as
 // defined by the Mozilla Public License, v. 2.0.
 
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
 #include <functional>
+#include <memory>
+#include <mutex>
 #include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
 
 #ifdef WIN32
 	#include <filesystem>
@@ -37,11 +48,215 @@ namespace ldmonitor
 		MONITOR_ACTION_FILE_DELETE = 0x02,
 		MONITOR_ACTION_FILE_MODIFY = 0x04,
 		MONITOR_ACTION_FILE_RENAME_OLD_NAME = 0x08,
-		MONITOR_ACTION_FILE_RENAME_NEW_NAME = 0x10
+		MONITOR_ACTION_FILE_RENAME_NEW_NAME = 0x10,
+
+		//the system dropped events, fileName is empty. Watches with WatchOptions::m_fReconcileOnOverflow get the changes after it
+		MONITOR_ACTION_QUEUE_OVERFLOW = 0x20
 	};
 
 	typedef std::function<void(const fs::path &path, std::string fileName, const uint32_t action, std::chrono::milliseconds time)> Callback_t;
 
+	/**
+	* A decoded event as delivered to batch and event callbacks
+	*
+	* m_svFileName points into the monitor read buffer and is only valid while the callback runs
+	*
+	*/
+	struct Event
+	{
+		std::string_view			m_svFileName;
+
+		uint32_t					m_u32Action = 0;
+
+		//inotify watch descriptor and cookie, -1 and 0 for events found by scans or merged by coalescing
+		int							m_iWd = -1;
+		uint32_t					m_u32Cookie = 0;
+
+		std::chrono::milliseconds	m_tTime{ 0 };
+	};
+
+	typedef std::function<void(const fs::path &path, const Event *events, size_t count, std::chrono::milliseconds time)> BatchCallback_t;
+
+	/**
+	* Receives a view of each event, when called from the monitor thread there are no allocations per event
+	*
+	*/
+	typedef std::function<void(const Event &event)> EventCallback_t;
+
+	/**
+	* Both names of a rename, the watches are different when a file was moved between two watched directories
+	*
+	*/
+	struct RenameEvent
+	{
+		fs::path					m_pthOldWatch;
+		std::string					m_strOldName;
+
+		fs::path					m_pthNewWatch;
+		std::string					m_strNewName;
+
+		std::chrono::milliseconds	m_tTime{ 0 };
+	};
+
+	typedef std::function<void(const RenameEvent &event)> RenameCallback_t;
+
+	/**
+	* Runs tasks posted to it, usually on other threads
+	*
+	*/
+	class Executor
+	{
+		public:
+			virtual ~Executor() = default;
+
+			virtual void Post(std::function<void()> task) = 0;
+	};
+
+	/**
+	* Executor with a fixed number of threads, each one with its own queue and stealing work from the others when idle
+	*
+	*/
+	class ThreadPool: public Executor
+	{
+		public:
+			/**
+			* if numThreads is zero, uses one thread per core
+			*
+			*/
+			explicit ThreadPool(size_t numThreads = 0);
+			~ThreadPool();
+
+			ThreadPool(const ThreadPool &) = delete;
+			ThreadPool &operator=(const ThreadPool &) = delete;
+
+			void Post(std::function<void()> task) override;
+
+			size_t GetNumThreads() const noexcept;
+
+		private:
+			struct Impl;
+
+			std::shared_ptr<Impl> m_spImpl;
+	};
+
+	struct WatchOptions
+	{
+		/**
+		* When set, callbacks are called from this executor instead of the monitor thread
+		*
+		* Events of the same watch are still delivered in order and never concurrently, but
+		* callbacks for different watches may run in parallel. Batch callbacks may receive
+		* events from several reads at once.
+		*
+		*/
+		std::shared_ptr<Executor>	m_spExecutor;
+
+		/**
+		* Also watches all subdirectories, including the ones created later. File names are reported relative
+		* to the watched path, like "dir/subdir/file.txt"
+		*
+		* When a directory is created or moved into the tree, its contents are reported as created, because
+		* they may have been added before the directory was watched. So some files may be reported twice.
+		*
+		*/
+		bool						m_fRecursive = false;
+
+		/**
+		* When greater than zero, events of the same file inside this window are merged and reported once
+		* when the window expires, for example a create followed by several modifies is reported as a single
+		* create and a file created and deleted inside the window is not reported at all.
+		*
+		* Renames are never merged. The window starts on the first event, so files that never stop changing
+		* are still reported.
+		*
+		*/
+		std::chrono::milliseconds	m_tCoalesceWindow{ 0 };
+
+		/**
+		* Keeps the last known state of the directory (names, inode, size and modification time), so when the
+		* system drops events the directory is scanned again and the differences are reported as create, delete
+		* and modify events.
+		*
+		* Costs a stat for each event and memory for each file.
+		*
+		*/
+		bool						m_fReconcileOnOverflow = false;
+
+		/**
+		* Glob patterns (*, ?, [a-z], [!a-z] and \ for escaping) checked against the file name, without the
+		* directories of recursive watches. When there are include patterns only names matching one of them are
+		* reported, names matching an exclude pattern never are.
+		*
+		* Patterns are compiled by Watch, which throws std::invalid_argument for malformed ones. Filtered events
+		* are dropped right after being read, before any processing.
+		*
+		*/
+		std::vector<std::string>	m_vecInclude;
+		std::vector<std::string>	m_vecExclude;
+
+		/**
+		* When set, both halves of a rename are matched by their cookie and reported here once, instead of
+		* MONITOR_ACTION_FILE_RENAME_OLD_NAME and MONITOR_ACTION_FILE_RENAME_NEW_NAME. Moves between watches
+		* of the same Monitor are matched too and reported to both watches, if both set it.
+		*
+		* Halves not matched in MonitorOptions::m_tRenameWindow (moved from or to somewhere not watched) are
+		* reported as MONITOR_ACTION_FILE_DELETE or MONITOR_ACTION_FILE_CREATE. Called like the other callbacks,
+		* in order with them.
+		*
+		*/
+		RenameCallback_t			m_pfnRenameCallback;
+
+		/**
+		* MONITOR_ACTION_FILE_MODIFY is only reported when the content changed: files are hashed when closed
+		* after being written, instead of on each write, and compared with the last digest seen. Files created
+		* while watched start with the digest of an empty file, others without one (not written since the watch
+		* was added, or dropped from the cache) are always reported.
+		*
+		* Every close after a write reads the whole file on the monitor thread: the other watches of the Monitor
+		* get no events while a large file is hashed, give watches of big files a Monitor of their own.
+		*
+		*/
+		bool						m_fSkipUnchangedWrites = false;
+
+		//digests kept by m_fSkipUnchangedWrites, the least recently written files are dropped
+		size_t						m_szMaxDigests = 4096;
+
+		/**
+		* Keeps an index of the watched files (name, inode, size and modification time), scanned when the watch is
+		* added and updated from its events, so it can be queried with Monitor::GetIndex instead of reading the
+		* directory. After a queue overflow it is rebuilt with a new scan.
+		*
+		*/
+		bool						m_fKeepIndex = false;
+
+		/**
+		* File where the index is persisted (implies m_fKeepIndex), written by Unwatch and Monitor::Checkpoint
+		*
+		* If it exists when the watch is added, it is compared with the directory and what changed since it was
+		* written is reported as create, delete and modify events. Only events of files changed while Watch reads
+		* the directory come before them, and those files are not reported again. Files written by another root,
+		* recursion mode or version are ignored. Changes not delivered yet when it is written (coalescing or queued
+		* on an executor) are not reported again.
+		*
+		*/
+		fs::path					m_pthCheckpoint;
+
+		/**
+		* The directory is scanned every m_tPollInterval and compared with the last scan, instead of using inotify,
+		* for filesystems where it sees nothing (NFS, FUSE...). Changes are reported as create, delete and modify,
+		* a rename is a delete and a create.
+		*
+		* After each scan without changes the interval doubles, up to m_tMaxPollInterval, so cold directories cost
+		* less. Any change brings it back to m_tPollInterval. Scans run on the monitor thread, with the stats of big
+		* directories spread over MonitorOptions::m_szPollThreads.
+		*
+		*/
+		bool						m_fPolling = false;
+
+		std::chrono::milliseconds	m_tPollInterval{ 1000 };
+		std::chrono::milliseconds	m_tMaxPollInterval{ 30000 };
+	};
+
 	/**
 	* Registers a new watch
 	* 
@@ -50,14 +265,612 @@ namespace ldmonitor
 	*/
 	void Watch(const fs::path &path, Callback_t callback, const uint32_t action);
 
+#ifndef WIN32
+	/**
+	* Registers a new watch that receives all events read for it at once
+	*
+	* Events are grouped per read from the kernel, so the callback is called at most once for each read
+	* with the events in the order they were generated.
+	*
+	* WARNING: Should be always called from the same thread
+	*
+	*/
+	void WatchBatch(const fs::path &path, BatchCallback_t callback, const uint32_t action);
+
+	void Watch(const fs::path &path, Callback_t callback, const uint32_t action, const WatchOptions &options);
+	void WatchBatch(const fs::path &path, BatchCallback_t callback, const uint32_t action, const WatchOptions &options);
+
+	/**
+	* Registers a new watch that receives each event as a view, so names are never copied
+	*
+	* Without an executor the only cost per event is the call itself, names of subdirectories on recursive
+	* watches are built on a buffer that is reused. With an executor events are copied to its queue.
+	*
+	* WARNING: Should be always called from the same thread
+	*
+	*/
+	void WatchEvents(const fs::path &path, EventCallback_t callback, const uint32_t action, const WatchOptions &options = {});
+#endif
+
 	/**
 	* Removes an registered watch, no more events will be generated for it
 	*
+	* If a callback for this watch is running, waits for it to return. Callbacks of other watches
+	* never block this call.
+	*
 	* WARNING: Should be always called from the same thread
 	*
 	*/
 	bool Unwatch(const fs::path &path);
 
+#ifndef WIN32
+	enum QueuePolicies
+	{
+		//the monitor thread waits for the consumers, events stay on the kernel queue meanwhile
+		QUEUE_POLICY_BLOCK,
+
+		QUEUE_POLICY_DROP_OLDEST,
+		QUEUE_POLICY_DROP_NEWEST,
+
+		//events of the same file are merged while the queue is full (like WatchOptions::m_tCoalesceWindow)
+		QUEUE_POLICY_COALESCE
+	};
+
+	struct QueueOptions
+	{
+		//number of slots, rounded up to a power of 2
+		size_t						m_szCapacity = 4096;
+
+		/**
+		* Names are stored on the slots, so this is reserved for each one. Longer names (only possible on recursive
+		* watches) are dropped.
+		*
+		*/
+		size_t						m_szMaxNameLength = 255;
+
+		QueuePolicies				m_ePolicy = QUEUE_POLICY_BLOCK;
+	};
+
+	struct QueuedEvent
+	{
+		std::string					m_strFileName;
+
+		uint32_t					m_u32Action = 0;
+		uint32_t					m_u32Cookie = 0;
+
+		//given to WatchQueue, so consumers of a queue shared by several watches know where the event came from
+		uint32_t					m_u32Source = 0;
+
+		std::chrono::milliseconds	m_tTime{ 0 };
+	};
+
+	struct QueueStats
+	{
+		uint64_t					m_u64Pushed = 0;
+		uint64_t					m_u64Popped = 0;
+
+		//lost because of the policy, a long name or Close
+		uint64_t					m_u64Dropped = 0;
+
+		//merged with a pending event of the same file, QUEUE_POLICY_COALESCE only
+		uint64_t					m_u64Coalesced = 0;
+	};
+
+	/**
+	* Bounded lock-free queue of events with preallocated slots, for consuming events on other threads
+	*
+	* Any number of watches (and monitors) can push to a queue and any number of threads can pop, so it
+	* works as a SPSC or MPSC queue. Pushing and popping never allocate, except when popping a name
+	* bigger than the QueuedEvent string already holds.
+	*
+	*/
+	class EventQueue
+	{
+		public:
+			explicit EventQueue(const QueueOptions &options = {});
+			~EventQueue();
+
+			EventQueue(const EventQueue &) = delete;
+			EventQueue &operator=(const EventQueue &) = delete;
+
+			/**
+			* Called from the watches, returns false if the event was dropped
+			*
+			*/
+			bool Push(const Event &event, uint32_t source = 0);
+
+			bool TryPop(QueuedEvent &event);
+
+			/**
+			* Pops up to maxEvents events, returns how many
+			*
+			*/
+			size_t PopBatch(QueuedEvent *events, size_t maxEvents);
+
+			/**
+			* Releases producers waiting on QUEUE_POLICY_BLOCK, events pushed after it are dropped
+			*
+			* With QUEUE_POLICY_BLOCK the queue must be consumed or closed before Unwatch, it waits for the callback.
+			*
+			*/
+			void Close();
+
+			/**
+			* Events on the queue, approximated while there are pushes or pops running
+			*
+			*/
+			size_t GetSize() const noexcept;
+
+			QueueStats GetStats() const noexcept;
+
+		private:
+			struct Impl;
+
+			std::unique_ptr<Impl> m_upImpl;
+	};
+
+	/**
+	* Registers a new watch that pushes its events to queue
+	*
+	*/
+	void WatchQueue(const fs::path &path, std::shared_ptr<EventQueue> queue, const uint32_t action, const WatchOptions &options = {}, uint32_t source = 0);
+
+	struct MonitorOptions
+	{
+		/**
+		* Limit for the buffer used for reading events. It starts at 4 KiB and grows up to this when more
+		* events are pending, so a burst is read with fewer system calls. Values bellow 4 KiB are rounded up.
+		*
+		*/
+		size_t						m_szMaxReadBuffer = 256 * 1024;
+
+		/**
+		* No thread is created, the caller waits on GetFileDescriptor (or GetTimeout ms) on its own event loop
+		* and calls ProcessEvents, so callbacks run on the caller thread.
+		*
+		*/
+		bool						m_fThreadless = false;
+
+		/**
+		* The monitor thread reads events with io_uring (multishot reads into provided buffers) instead of poll
+		* and read. When the kernel does not support it, the poll path is used. Ignored on threadless mode.
+		*
+		*/
+		bool						m_fUseIoUring = false;
+
+		/**
+		* How long the old name of a rename waits for the new one (WatchOptions::m_pfnRenameCallback), both are
+		* queued together by the kernel, so this only needs to cover a read split between them
+		*
+		*/
+		std::chrono::milliseconds	m_tRenameWindow{ 10 };
+
+		//old names waiting, when full the oldest is reported as deleted
+		size_t						m_szMaxPendingRenames = 1024;
+
+		//threads helping scans of big directories, created with the first polling watch, 0 scans only on the monitor thread
+		size_t						m_szPollThreads = 2;
+
+		/**
+		* Fills the callback time and dispatch delay histograms of Monitor::GetMetrics, it costs two clock reads
+		* per callback. Counters are always kept.
+		*
+		*/
+		bool						m_fTimeCallbacks = false;
+
+		/**
+		* When kernel watches run out (fs.inotify.max_user_watches is shared by every inotify user of the uid) or
+		* m_szMaxWatches is reached, the watches without events for longest are demoted to polling, with their
+		* WatchOptions poll intervals, instead of Watch failing. A new watch that finds no room is polled itself.
+		* A polled watch that sees changes is promoted back to inotify when there is room, replacing watches idle
+		* for m_tColdAfter if needed.
+		*
+		* Only watches whose directories have no other subscribers and without m_pfnRenameCallback or
+		* m_fSkipUnchangedWrites are demoted. While polled, renames are a delete and a create, and changes made
+		* while a watch is switched may be reported twice. Demoted watches are scanned by the monitor thread, so
+		* changes made just before that scan are missed unless the watch keeps a snapshot (m_fReconcileOnOverflow
+		* or m_fKeepIndex).
+		*
+		*/
+		bool						m_fWatchBudget = false;
+
+		//kernel watches this monitor may use, 0 for fs.inotify.max_user_watches less 1/16 left for other programs
+		size_t						m_szMaxWatches = 0;
+
+		std::chrono::milliseconds	m_tColdAfter{ 60000 };
+	};
+
+	/**
+	* A file of a watch index (WatchOptions::m_fKeepIndex), name relative to the watch root
+	*
+	*/
+	struct IndexEntry
+	{
+		std::string					m_strName;
+
+		uint64_t					m_u64Inode = 0;
+		uint64_t					m_u64Size = 0;
+
+		//nanoseconds since epoch
+		int64_t						m_i64ModifiedTime = 0;
+
+		bool						m_fDirectory = false;
+	};
+
+	namespace detail
+	{
+		struct IndexVersion;
+	}
+
+	/**
+	* Immutable state of a watch index at some point
+	*
+	* Changes made by the monitor thread after it was taken are not seen, they copy what they touch, so readers on
+	* any thread never block it nor each other. Cheap to copy, keeping one alive keeps only what changed since alive.
+	*
+	*/
+	class IndexSnapshot
+	{
+		public:
+			IndexSnapshot() noexcept = default;
+			explicit IndexSnapshot(std::shared_ptr<const detail::IndexVersion> version) noexcept;
+
+			/**
+			* Returns the entry with that name or null, valid while this snapshot exists
+			*
+			*/
+			const IndexEntry *Find(std::string_view name) const noexcept;
+
+			/**
+			* Calls func for each entry, in no particular order
+			*
+			*/
+			void ForEach(const std::function<void(const IndexEntry &entry)> &func) const;
+
+			size_t GetSize() const noexcept;
+
+			/**
+			* False for watches without an index
+			*
+			*/
+			inline bool IsValid() const noexcept
+			{
+				return m_spVersion != nullptr;
+			}
+
+		private:
+			std::shared_ptr<const detail::IndexVersion> m_spVersion;
+	};
+
+	/**
+	* Handle of a watch added by Monitor::Subscribe*, only valid on the Monitor that returned it
+	*
+	*/
+	struct Subscription
+	{
+		uint64_t					m_u64Id = 0;
+	};
+
+	/**
+	* Durations in ns, like HdrHistogram: values up to 15 have their own buckets, then each power of 2 is split
+	* in 16 linear ones, so any value is known within 1/16 of it
+	*
+	*/
+	struct LatencyHistogram
+	{
+		static constexpr unsigned SUB_BUCKET_BITS = 4;
+		static constexpr size_t SUB_BUCKETS = size_t{ 1 } << SUB_BUCKET_BITS;
+
+		//covers all of uint64_t
+		static constexpr size_t NUM_BUCKETS = (65 - SUB_BUCKET_BITS) * SUB_BUCKETS;
+
+		std::array<uint64_t, NUM_BUCKETS>	m_arCounts = {};
+
+		uint64_t GetCount() const noexcept;
+
+		/**
+		* Highest value of the bucket holding quantile q (0 to 1), 0 if empty
+		*
+		*/
+		uint64_t GetPercentile(double q) const noexcept;
+
+		void Merge(const LatencyHistogram &other) noexcept;
+
+		/**
+		* Highest value counted on bucket
+		*
+		*/
+		static uint64_t GetBucketLimit(size_t bucket) noexcept;
+	};
+
+	/**
+	* Totals since the Monitor was created, kept by its monitor thread with relaxed atomics, so a snapshot may be
+	* a little behind and its fields taken at slightly different times
+	*
+	*/
+	struct MonitorMetrics
+	{
+		//reads of the inotify fd, or io_uring read completions
+		uint64_t					m_u64Reads = 0;
+		uint64_t					m_u64BytesRead = 0;
+
+		//inotify events read
+		uint64_t					m_u64Events = 0;
+
+		//events for watch descriptors without a watch, usually ones just removed
+		uint64_t					m_u64UnmatchedEvents = 0;
+
+		//rejected by WatchOptions::m_vecInclude / m_vecExclude, once for each watch that rejected it
+		uint64_t					m_u64FilteredEvents = 0;
+
+		//passed to callbacks, batches, executors and queues
+		uint64_t					m_u64DeliveredEvents = 0;
+
+		uint64_t					m_u64Overflows = 0;
+
+		//most bytes found waiting on the kernel queue before a read (not measured with io_uring), how close it
+		//came to fs.inotify.max_queued_events
+		uint64_t					m_u64MaxQueuedBytes = 0;
+
+		//MonitorOptions::m_fWatchBudget: watches moved to polling and back to inotify
+		uint64_t					m_u64Demotions = 0;
+		uint64_t					m_u64Promotions = 0;
+
+		//
+		//MonitorOptions::m_fTimeCallbacks only
+		LatencyHistogram			m_stCallbackTime;
+
+		//from the read that returned an event to its callback, inotify events carry no kernel timestamp.
+		//Events delivered by timers (coalescing, renames, polls) or executors are not counted.
+		LatencyHistogram			m_stDispatchDelay;
+
+		/**
+		* Adds the counters of other, m_u64MaxQueuedBytes is the highest of both
+		*
+		*/
+		void Merge(const MonitorMetrics &other) noexcept;
+	};
+
+	enum TraceFormat
+	{
+		//24 byte header ("LDMTRACE", version, record size, count) followed by 32 byte records
+		TRACE_FORMAT_BINARY,
+
+		//JSON for chrome://tracing and Perfetto
+		TRACE_FORMAT_CHROME
+	};
+
+	struct WatchMetrics
+	{
+		uint64_t					m_u64DeliveredEvents = 0;
+		uint64_t					m_u64FilteredEvents = 0;
+
+		//ns spent on its callbacks, MonitorOptions::m_fTimeCallbacks only
+		uint64_t					m_u64CallbackTime = 0;
+	};
+
+	/**
+	* Kernel watches of a Monitor, see MonitorOptions::m_fWatchBudget
+	*
+	*/
+	struct WatchBudget
+	{
+		//zero when the budget is not enabled
+		size_t						m_szLimit = 0;
+
+		//directories with a kernel watch
+		size_t						m_szUsed = 0;
+
+		//watches polled because there was no room
+		size_t						m_szDemoted = 0;
+	};
+
+	/**
+	* A set of watches with their own inotify instance and monitor thread
+	*
+	* Monitors are independent, so unrelated parts of a program do not compete for a single queue and thread.
+	* The free functions use a default Monitor. Destroying a Monitor removes all its watches and, like Unwatch,
+	* cannot be done from one of its callbacks.
+	*
+	*/
+	class Monitor
+	{
+		public:
+			explicit Monitor(const MonitorOptions &options = {});
+			~Monitor();
+
+			Monitor(const Monitor &) = delete;
+			Monitor &operator=(const Monitor &) = delete;
+
+			void Watch(const fs::path &path, Callback_t callback, const uint32_t action, const WatchOptions &options = {});
+			void WatchBatch(const fs::path &path, BatchCallback_t callback, const uint32_t action, const WatchOptions &options = {});
+			void WatchEvents(const fs::path &path, EventCallback_t callback, const uint32_t action, const WatchOptions &options = {});
+			void WatchQueue(const fs::path &path, std::shared_ptr<EventQueue> queue, const uint32_t action, const WatchOptions &options = {}, uint32_t source = 0);
+
+			/**
+			* Like Watch*, but a directory can have any number of subscribers (and one watch added by Watch*)
+			*
+			* Directories reached by several watches (same path, symlinks, bind mounts or overlapping recursive watches)
+			* share a single kernel watch, each subscriber receives the events with its own flags and options.
+			*
+			*/
+			Subscription Subscribe(const fs::path &path, Callback_t callback, const uint32_t action, const WatchOptions &options = {});
+			Subscription SubscribeBatch(const fs::path &path, BatchCallback_t callback, const uint32_t action, const WatchOptions &options = {});
+			Subscription SubscribeEvents(const fs::path &path, EventCallback_t callback, const uint32_t action, const WatchOptions &options = {});
+
+			bool Unwatch(const fs::path &path);
+
+			/**
+			* Removes only this subscriber, other watches of the same directory keep receiving events
+			*
+			*/
+			bool Unwatch(const Subscription &subscription);
+
+			/**
+			* Current index of a watch with WatchOptions::m_fKeepIndex, it is published after each read of events
+			*
+			* Returns an invalid snapshot if there is no such watch or it does not keep an index.
+			*
+			*/
+			IndexSnapshot GetIndex(const fs::path &path) const;
+			IndexSnapshot GetIndex(const Subscription &subscription) const;
+
+			MonitorMetrics GetMetrics() const;
+
+			/**
+			* Metrics of a single watch, all zero if there is no such watch
+			*
+			*/
+			WatchMetrics GetMetrics(const fs::path &path) const;
+			WatchMetrics GetMetrics(const Subscription &subscription) const;
+
+			WatchBudget GetWatchBudget() const;
+
+			/**
+			* Writes the checkpoint of every watch with WatchOptions::m_pthCheckpoint now, instead of only on Unwatch
+			*
+			* Throws std::runtime_error if one cannot be written, the others are still written.
+			*
+			*/
+			void Checkpoint() const;
+
+			/**
+			* Builds with LDMONITOR_TRACE only: writes the last 64k stages (kernel wait, read, watch lookup, dispatch lock
+			* and callback) recorded by the monitor thread, with their start, duration and the inotify event they belong to
+			*
+			* Returns false if tracing was not built, throws std::runtime_error if the file cannot be written.
+			*
+			*/
+			bool DumpTrace(const fs::path &path, TraceFormat format = TRACE_FORMAT_CHROME) const;
+
+			/**
+			* True if there is any watch, so the monitor thread is running
+			*
+			*/
+			bool IsRunning() const;
+
+			/**
+			* True if io_uring was requested and is available
+			*
+			*/
+			bool IsUsingIoUring() const noexcept;
+
+			/**
+			* Threadless only: fd that becomes readable when there are events, valid while the Monitor exists
+			*
+			*/
+			int GetFileDescriptor() const;
+
+			/**
+			* Threadless only: dispatches up to maxEvents pending events and expired coalescing timers, never blocks
+			*
+			* Returns the number of events read from the kernel that were processed. Must not be called concurrently
+			* and its callbacks cannot Unwatch.
+			*
+			*/
+			size_t ProcessEvents(size_t maxEvents = SIZE_MAX);
+
+			/**
+			* Threadless only: ms until ProcessEvents must be called even without the fd becoming readable, -1 for never
+			*
+			*/
+			int GetTimeout() const;
+
+		private:
+			struct Impl;
+
+			std::unique_ptr<Impl> m_upImpl;
+	};
+
+	/**
+	* Spreads watches over several Monitors, so events of different directories are read and dispatched in parallel
+	*
+	* Directories are assigned to a shard by the hash of their path or explicitly. A directory can have only one watcher
+	* across all shards.
+	*
+	*/
+	class ShardedMonitor
+	{
+		public:
+			/**
+			* if numShards is zero, uses one shard per core
+			*
+			*/
+			explicit ShardedMonitor(size_t numShards = 0, const MonitorOptions &options = {});
+			~ShardedMonitor();
+
+			ShardedMonitor(const ShardedMonitor &) = delete;
+			ShardedMonitor &operator=(const ShardedMonitor &) = delete;
+
+			void Watch(const fs::path &path, Callback_t callback, const uint32_t action, const WatchOptions &options = {});
+			void WatchBatch(const fs::path &path, BatchCallback_t callback, const uint32_t action, const WatchOptions &options = {});
+			void WatchEvents(const fs::path &path, EventCallback_t callback, const uint32_t action, const WatchOptions &options = {});
+			void WatchQueue(const fs::path &path, std::shared_ptr<EventQueue> queue, const uint32_t action, const WatchOptions &options = {}, uint32_t source = 0);
+
+			/**
+			* Watches on the given shard, throws std::out_of_range if shard >= GetNumShards()
+			*
+			*/
+			void Watch(size_t shard, const fs::path &path, Callback_t callback, const uint32_t action, const WatchOptions &options = {});
+			void WatchBatch(size_t shard, const fs::path &path, BatchCallback_t callback, const uint32_t action, const WatchOptions &options = {});
+			void WatchEvents(size_t shard, const fs::path &path, EventCallback_t callback, const uint32_t action, const WatchOptions &options = {});
+			void WatchQueue(size_t shard, const fs::path &path, std::shared_ptr<EventQueue> queue, const uint32_t action, const WatchOptions &options = {}, uint32_t source = 0);
+
+			bool Unwatch(const fs::path &path);
+
+			/**
+			* Shard used for path when none is given
+			*
+			*/
+			size_t GetShard(const fs::path &path) const;
+
+			inline size_t GetNumShards() const noexcept
+			{
+				return m_vecShards.size();
+			}
+
+			/**
+			* Threadless only: epoll fd that becomes readable when any shard has events
+			*
+			*/
+			int GetFileDescriptor() const;
+
+			/**
+			* Metrics of all shards merged
+			*
+			*/
+			MonitorMetrics GetMetrics() const;
+
+			/**
+			* Threadless only: same as Monitor::ProcessEvents, for all shards
+			*
+			*/
+			size_t ProcessEvents(size_t maxEvents = SIZE_MAX);
+
+			int GetTimeout() const;
+
+		private:
+			template <typename F>
+			void AddToShard(size_t shard, const fs::path &path, const F &watch);
+
+		private:
+			std::vector<std::unique_ptr<Monitor>>		m_vecShards;
+
+			//threadless only
+			int											m_iEpollFD = -1;
+
+			//normalized path to shard of every watch
+			std::mutex									m_clLock;
+			std::unordered_map<std::string, size_t>		m_mapShards;
+	};
+
+	/**
+	* Counters and percentiles of the histograms in a single line, for logs
+	*
+	*/
+	std::string FormatMetrics(const MonitorMetrics &metrics);
+#endif
+
 	std::string ActionName(const uint32_t action);
 
 	namespace detail
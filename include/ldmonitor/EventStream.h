@@ -0,0 +1,266 @@
+// Copyright (C) 2023 - Bruno Sanches. See the COPYRIGHT
+// file at the top-level directory of this distribution.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+//
+// This Source Code Form is "Incompatible With Secondary Licenses", as
+// defined by the Mozilla Public License, v. 2.0.
+
+#pragma once
+
+#if !defined(__cpp_impl_coroutine) || !__has_include(<coroutine>)
+	#error "ldmonitor/EventStream.h requires C++20 coroutines"
+#endif
+
+#include <algorithm>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <optional>
+#include <utility>
+
+#include "DirectoryMonitor.h"
+
+#ifndef WIN32
+
+namespace ldmonitor
+{
+	/**
+	* Event received from an EventStream, owns its name
+	*
+	*/
+	struct StreamEvent
+	{
+		std::string					m_strFileName;
+
+		uint32_t					m_u32Action = 0;
+
+		std::chrono::milliseconds	m_tTime{ 0 };
+	};
+
+	struct StreamOptions
+	{
+		/**
+		* Events kept while the consumer is not waiting on Next, when full the monitor thread waits for the consumer
+		*
+		*/
+		size_t						m_szCapacity = 1024;
+
+		/**
+		* When set, the consumer is resumed on it, otherwise it is resumed directly from the thread that delivers
+		* the event (the monitor thread, ProcessEvents or the watch executor)
+		*
+		*/
+		std::shared_ptr<Executor>	m_spExecutor;
+	};
+
+	/**
+	* Watch consumed by coroutines:
+	*
+	*	while (auto event = co_await stream.Next())
+	*		...
+	*
+	* Only one coroutine can wait on Next at a time. Destroying the stream (or Close) unwatches the path and
+	* ends the stream, so like Unwatch it cannot be done from the monitor thread. So consumers resumed directly
+	* by the monitor must not own the stream.
+	*
+	*/
+	class EventStream
+	{
+		private:
+			struct Shared
+			{
+				std::mutex						m_clLock;
+				std::condition_variable			m_clNotFull;
+
+				std::deque<StreamEvent>			m_dqEvents;
+
+				//consumer suspended on Next and where its event goes
+				std::coroutine_handle<>			m_hWaiter;
+				std::optional<StreamEvent>		*m_pWaiterSlot = nullptr;
+
+				StreamOptions					m_stOptions;
+
+				bool							m_fClosed = false;
+
+				void Resume(std::coroutine_handle<> handle)
+				{
+					if (m_stOptions.m_spExecutor)
+						m_stOptions.m_spExecutor->Post([handle]() { handle.resume(); });
+					else
+						handle.resume();
+				}
+
+				void Push(const Event &event)
+				{
+					std::unique_lock lock{ m_clLock };
+
+					//backpressure, events stay on the kernel queue meanwhile
+					m_clNotFull.wait(lock, [this] { return m_fClosed || m_hWaiter || (m_dqEvents.size() < std::max(m_stOptions.m_szCapacity, size_t{ 1 })); });
+
+					if (m_fClosed)
+						return;
+
+					StreamEvent owned{ std::string{ event.m_svFileName }, event.m_u32Action, event.m_tTime };
+
+					if (!m_hWaiter)
+					{
+						m_dqEvents.push_back(std::move(owned));
+
+						return;
+					}
+
+					*m_pWaiterSlot = std::move(owned);
+
+					auto handle = std::exchange(m_hWaiter, nullptr);
+					m_pWaiterSlot = nullptr;
+
+					lock.unlock();
+
+					this->Resume(handle);
+				}
+			};
+
+		public:
+			class NextAwaiter
+			{
+				public:
+					explicit NextAwaiter(Shared &shared) noexcept:
+						m_rclShared{ shared }
+					{
+						//empty
+					}
+
+					bool await_ready() const noexcept
+					{
+						return false;
+					}
+
+					bool await_suspend(std::coroutine_handle<> handle)
+					{
+						std::lock_guard lock{ m_rclShared.m_clLock };
+
+						if (!m_rclShared.m_dqEvents.empty())
+						{
+							m_optEvent = std::move(m_rclShared.m_dqEvents.front());
+							m_rclShared.m_dqEvents.pop_front();
+
+							m_rclShared.m_clNotFull.notify_one();
+
+							return false;
+						}
+
+						if (m_rclShared.m_fClosed)
+							return false;
+
+						m_rclShared.m_hWaiter = handle;
+						m_rclShared.m_pWaiterSlot = &m_optEvent;
+
+						//a full queue is empty now, but the monitor may be waiting for a consumer
+						m_rclShared.m_clNotFull.notify_one();
+
+						return true;
+					}
+
+					/**
+					* Returns the event or nothing when the stream was closed
+					*
+					*/
+					std::optional<StreamEvent> await_resume() noexcept
+					{
+						return std::move(m_optEvent);
+					}
+
+				private:
+					Shared						&m_rclShared;
+
+					std::optional<StreamEvent>	m_optEvent;
+			};
+
+			EventStream(Monitor &monitor, const fs::path &path, const uint32_t action, const StreamOptions &options = {}, const WatchOptions &watchOptions = {}):
+				m_rclMonitor{ monitor },
+				m_pthPath{ path },
+				m_spShared{ std::make_shared<Shared>() }
+			{
+				m_spShared->m_stOptions = options;
+
+				//the callback keeps the state alive, so a late event never sees a destroyed stream
+				m_rclMonitor.WatchEvents(m_pthPath, [shared = m_spShared](const Event &event) { shared->Push(event); }, action, watchOptions);
+			}
+
+			~EventStream()
+			{
+				this->Close();
+			}
+
+			EventStream(const EventStream &) = delete;
+			EventStream &operator=(const EventStream &) = delete;
+
+			/**
+			* Awaitable returning std::optional<StreamEvent>, empty after Close
+			*
+			*/
+			NextAwaiter Next() noexcept
+			{
+				return NextAwaiter{ *m_spShared };
+			}
+
+			/**
+			* Unwatches the path, a waiting consumer is resumed with no event. Pending events are still returned by Next.
+			*
+			*/
+			void Close()
+			{
+				if (m_fUnwatched)
+					return;
+
+				m_fUnwatched = true;
+
+				{
+					//wakes the monitor thread if it is waiting for room, so Unwatch does not wait forever
+					std::lock_guard lock{ m_spShared->m_clLock };
+
+					m_spShared->m_fClosed = true;
+				}
+
+				m_spShared->m_clNotFull.notify_all();
+
+				m_rclMonitor.Unwatch(m_pthPath);
+
+				std::unique_lock lock{ m_spShared->m_clLock };
+
+				if (!m_spShared->m_hWaiter)
+					return;
+
+				auto handle = std::exchange(m_spShared->m_hWaiter, nullptr);
+				m_spShared->m_pWaiterSlot = nullptr;
+
+				lock.unlock();
+
+				m_spShared->Resume(handle);
+			}
+
+			/**
+			* Events waiting for the consumer
+			*
+			*/
+			size_t GetPending() const
+			{
+				std::lock_guard lock{ m_spShared->m_clLock };
+
+				return m_spShared->m_dqEvents.size();
+			}
+
+		private:
+			Monitor						&m_rclMonitor;
+			fs::path					m_pthPath;
+
+			std::shared_ptr<Shared>		m_spShared;
+
+			bool						m_fUnwatched = false;
+	};
+}
+
+#endif
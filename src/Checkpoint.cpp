@@ -0,0 +1,271 @@
+// Copyright (C) 2023 - Bruno Sanches. See the COPYRIGHT
+// file at the top-level directory of this distribution.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+//
+// This Source Code Form is "Incompatible With Secondary Licenses", as
+// defined by the Mozilla Public License, v. 2.0.
+
+#include "Checkpoint.h"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ContentDigest.h"
+
+namespace ldmonitor
+{
+	static constexpr char CHECKPOINT_MAGIC[8] = { 'L', 'D', 'M', 'C', 'K', 'P', 'T', '\0' };
+	static constexpr uint32_t CHECKPOINT_VERSION = 1;
+
+	static constexpr uint32_t CHECKPOINT_RECURSIVE = 1;
+
+	//on m_u32NameSize
+	static constexpr uint32_t RECORD_DIRECTORY = 0x80000000;
+
+	struct CheckpointHeader
+	{
+		char		m_arMagic[8];
+		uint32_t	m_u32Version;
+		uint32_t	m_u32Flags;
+
+		uint64_t	m_u64Count;
+		uint64_t	m_u64RootSize;
+		uint64_t	m_u64NamesSize;
+
+		//Hash64 of everything after the header
+		uint64_t	m_u64Hash;
+	};
+
+	//followed by the root and all names, without terminators
+	struct CheckpointRecord
+	{
+		uint64_t	m_u64Inode;
+		uint64_t	m_u64Size;
+		int64_t		m_i64ModifiedTime;
+
+		//offset on the names
+		uint32_t	m_u32NameOffset;
+		uint32_t	m_u32NameSize;
+	};
+
+	static_assert(sizeof(CheckpointHeader) == 48);
+	static_assert(sizeof(CheckpointRecord) == 32);
+
+	static bool WriteAll(int fd, const char *data, size_t size)
+	{
+		off_t offset = 0;
+
+		while (size > 0)
+		{
+			const auto len = pwrite(fd, data, size, offset);
+			if (len == -1)
+			{
+				if (errno == EINTR)
+					continue;
+
+				return false;
+			}
+
+			data += len;
+			offset += len;
+			size -= static_cast<size_t>(len);
+		}
+
+		return true;
+	}
+
+	bool SaveCheckpoint(const std::string &path, const std::string &root, bool recursive, const detail::IndexVersion &index)
+	{
+		uint64_t namesSize = 0;
+
+		for (auto &shard : index.m_vecShards)
+		{
+			for (auto &entry : *shard)
+				namesSize += entry.m_strName.size();
+		}
+
+		if (namesSize > UINT32_MAX)
+		{
+			errno = EFBIG;
+
+			return false;
+		}
+
+		const size_t recordsSize = index.m_szSize * sizeof(CheckpointRecord);
+		const size_t total = sizeof(CheckpointHeader) + recordsSize + root.size() + namesSize;
+
+		//
+		//Unique, so writers of the same path (Checkpoint racing Unwatch, watches sharing it) never touch each other
+		//file, the last rename wins
+		std::string tempPath = path + ".XXXXXX";
+
+		const int fd = mkostemp(tempPath.data(), O_CLOEXEC);
+		if (fd == -1)
+			return false;
+
+		bool ok;
+
+		{
+			std::vector<char> buffer(total);
+			auto base = buffer.data();
+
+			auto records = reinterpret_cast<CheckpointRecord *>(base + sizeof(CheckpointHeader));
+			auto names = base + sizeof(CheckpointHeader) + recordsSize;
+
+			memcpy(names, root.data(), root.size());
+			names += root.size();
+
+			uint32_t offset = 0;
+
+			for (auto &shard : index.m_vecShards)
+			{
+				for (auto &entry : *shard)
+				{
+					const auto nameSize = static_cast<uint32_t>(entry.m_strName.size());
+
+					*records++ = CheckpointRecord{ entry.m_u64Inode, entry.m_u64Size, entry.m_i64ModifiedTime, offset, nameSize | (entry.m_fDirectory ? RECORD_DIRECTORY : 0) };
+
+					memcpy(names + offset, entry.m_strName.data(), nameSize);
+					offset += nameSize;
+				}
+			}
+
+			CheckpointHeader header;
+
+			memcpy(header.m_arMagic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+			header.m_u32Version = CHECKPOINT_VERSION;
+			header.m_u32Flags = recursive ? CHECKPOINT_RECURSIVE : 0;
+			header.m_u64Count = index.m_szSize;
+			header.m_u64RootSize = root.size();
+			header.m_u64NamesSize = namesSize;
+			header.m_u64Hash = Hash64(base + sizeof(CheckpointHeader), total - sizeof(CheckpointHeader));
+
+			memcpy(base, &header, sizeof(header));
+
+			//mkostemp creates it only readable by us
+			ok = (fchmod(fd, 0644) == 0) && WriteAll(fd, base, total) && (fdatasync(fd) == 0);
+		}
+
+		const int error = errno;
+		close(fd);
+
+		if (ok && (rename(tempPath.c_str(), path.c_str()) == 0))
+			return true;
+
+		const int failure = ok ? errno : error;
+
+		unlink(tempPath.c_str());
+		errno = failure;
+
+		return false;
+	}
+
+	static bool ParseCheckpoint(const char *base, size_t size, const std::string &root, bool recursive, DirectoryIndex &index)
+	{
+		if (size < sizeof(CheckpointHeader))
+			return false;
+
+		CheckpointHeader header;
+		memcpy(&header, base, sizeof(header));
+
+		if (memcmp(header.m_arMagic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) || (header.m_u32Version != CHECKPOINT_VERSION))
+			return false;
+
+		if (((header.m_u32Flags & CHECKPOINT_RECURSIVE) != 0) != recursive)
+			return false;
+
+		//each one checked against what is left, so the sums cannot overflow
+		size_t left = size - sizeof(CheckpointHeader);
+
+		if (header.m_u64Count > left / sizeof(CheckpointRecord))
+			return false;
+
+		left -= header.m_u64Count * sizeof(CheckpointRecord);
+
+		if ((header.m_u64RootSize > left) || (header.m_u64NamesSize != left - header.m_u64RootSize))
+			return false;
+
+		if (Hash64(base + sizeof(CheckpointHeader), size - sizeof(CheckpointHeader)) != header.m_u64Hash)
+			return false;
+
+		auto records = base + sizeof(CheckpointHeader);
+		auto rootStr = records + header.m_u64Count * sizeof(CheckpointRecord);
+		auto names = rootStr + header.m_u64RootSize;
+
+		if (std::string_view{ rootStr, header.m_u64RootSize } != root)
+			return false;
+
+		index.Clear();
+		index.Reserve(header.m_u64Count);
+
+		for (uint64_t i = 0; i < header.m_u64Count; ++i)
+		{
+			CheckpointRecord record;
+			memcpy(&record, records + i * sizeof(CheckpointRecord), sizeof(record));
+
+			const uint32_t nameSize = record.m_u32NameSize & ~RECORD_DIRECTORY;
+
+			if (uint64_t{ record.m_u32NameOffset } + nameSize > header.m_u64NamesSize)
+			{
+				index.Clear();
+
+				return false;
+			}
+
+			IndexEntry entry;
+
+			entry.m_strName.assign(names + record.m_u32NameOffset, nameSize);
+			entry.m_u64Inode = record.m_u64Inode;
+			entry.m_u64Size = record.m_u64Size;
+			entry.m_i64ModifiedTime = record.m_i64ModifiedTime;
+			entry.m_fDirectory = (record.m_u32NameSize & RECORD_DIRECTORY) != 0;
+
+			index.Set(std::move(entry));
+		}
+
+		return true;
+	}
+
+	bool LoadCheckpoint(const std::string &path, const std::string &root, bool recursive, DirectoryIndex &index)
+	{
+		const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd == -1)
+			return false;
+
+		struct stat st;
+		if ((fstat(fd, &st) != 0) || (static_cast<size_t>(st.st_size) < sizeof(CheckpointHeader)))
+		{
+			close(fd);
+
+			return false;
+		}
+
+		const auto size = static_cast<size_t>(st.st_size);
+
+		//checkpoints are replaced by rename, never truncated, so the mapping cannot SIGBUS
+		void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+
+		if (data == MAP_FAILED)
+			return false;
+
+		madvise(data, size, MADV_SEQUENTIAL);
+
+		const bool ok = ParseCheckpoint(static_cast<const char *>(data), size, root, recursive, index);
+
+		munmap(data, size);
+
+		return ok;
+	}
+}
@@ -0,0 +1,36 @@
+// Copyright (C) 2023 - Bruno Sanches. See the COPYRIGHT
+// file at the top-level directory of this distribution.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+//
+// This Source Code Form is "Incompatible With Secondary Licenses", as
+// defined by the Mozilla Public License, v. 2.0.
+
+#pragma once
+
+#include <string>
+
+#include "DirectoryIndex.h"
+
+namespace ldmonitor
+{
+	/**
+	* Writes index to path as a checkpoint of the directory root
+	*
+	* The file is a header, fixed size records and the names, built in memory and written to a temporary file with
+	* a unique name that is synced and renamed over path, so readers never see a partial one and concurrent writers
+	* of the same path do not interfere. Returns false with errno set on failure.
+	*
+	*/
+	bool SaveCheckpoint(const std::string &path, const std::string &root, bool recursive, const detail::IndexVersion &index);
+
+	/**
+	* Reads a checkpoint written by SaveCheckpoint into index
+	*
+	* Returns false if the file does not exist, is corrupted or was written for another root or recursion mode.
+	*
+	*/
+	bool LoadCheckpoint(const std::string &path, const std::string &root, bool recursive, DirectoryIndex &index);
+}
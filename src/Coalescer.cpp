@@ -0,0 +1,167 @@
+// Copyright (C) 2023 - Bruno Sanches. See the COPYRIGHT
+// file at the top-level directory of this distribution.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+//
+// This Source Code Form is "Incompatible With Secondary Licenses", as
+// defined by the Mozilla Public License, v. 2.0.
+
+#include "Coalescer.h"
+
+#include <assert.h>
+
+#include <algorithm>
+
+#include "DirectoryMonitor.h"
+
+namespace ldmonitor
+{
+	uint32_t Coalescer::Merge(uint32_t pending, uint32_t action) noexcept
+	{
+		switch (pending)
+		{
+			case MONITOR_ACTION_FILE_CREATE:
+				//never existed as far as the consumer knows
+				return (action == MONITOR_ACTION_FILE_DELETE) ? 0 : MONITOR_ACTION_FILE_CREATE;
+
+			case MONITOR_ACTION_FILE_DELETE:
+				//deleted and created again: replaced
+				return (action == MONITOR_ACTION_FILE_DELETE) ? MONITOR_ACTION_FILE_DELETE : MONITOR_ACTION_FILE_MODIFY;
+
+			default:
+				return (action == MONITOR_ACTION_FILE_DELETE) ? MONITOR_ACTION_FILE_DELETE : MONITOR_ACTION_FILE_MODIFY;
+		}
+	}
+
+	void Coalescer::Link(Entry &entry, size_t slot)
+	{
+		entry.m_szSlot = slot;
+		entry.m_pPrev = nullptr;
+		entry.m_pNext = m_arSlots[slot];
+
+		if (entry.m_pNext)
+			entry.m_pNext->m_pPrev = &entry;
+
+		m_arSlots[slot] = &entry;
+	}
+
+	void Coalescer::Unlink(Entry &entry)
+	{
+		if (entry.m_pPrev)
+			entry.m_pPrev->m_pNext = entry.m_pNext;
+		else
+			m_arSlots[entry.m_szSlot] = entry.m_pNext;
+
+		if (entry.m_pNext)
+			entry.m_pNext->m_pPrev = entry.m_pPrev;
+	}
+
+	void Coalescer::Push(const std::shared_ptr<DirectoryMonitor> &owner, std::string_view fileName, uint32_t action, Time_t window, Time_t now)
+	{
+		//nothing pending, so no tick since the last one matters
+		if (m_mapEntries.empty())
+			m_u64Tick = now / TICK;
+
+		auto [it, inserted] = m_mapEntries.try_emplace(Key_t{ owner.get(), std::string{fileName} });
+
+		auto &entry = it->second;
+
+		if (!inserted)
+		{
+			entry.m_u32Action = Merge(entry.m_u32Action, action);
+
+			if (entry.m_u32Action == 0)
+			{
+				this->Unlink(entry);
+				m_mapEntries.erase(it);
+			}
+
+			//fixed window since the first event, so a file that keeps changing is still reported
+			return;
+		}
+
+		entry.m_spOwner = owner;
+		entry.m_pKey = &it->first;
+		entry.m_u32Action = action;
+
+		const uint64_t ticks = std::max<uint64_t>(1, (window.count() + TICK.count() - 1) / TICK.count());
+
+		//
+		//Expire may not have run for a while (long scans or callbacks), so the window starts at now, not at the
+		//last tick processed. Rounds still count from the last tick, as Expire walks every slot since it.
+		const uint64_t due = std::max<uint64_t>(m_u64Tick, now / TICK) + ticks;
+
+		entry.m_u32Rounds = static_cast<uint32_t>((due - m_u64Tick - 1) / NUM_SLOTS);
+
+		this->Link(entry, due % NUM_SLOTS);
+	}
+
+	std::optional<uint32_t> Coalescer::Take(DirectoryMonitor &owner, std::string_view fileName)
+	{
+		if (m_mapEntries.empty())
+			return {};
+
+		auto it = m_mapEntries.find(Key_t{ &owner, std::string{fileName} });
+		if (it == m_mapEntries.end())
+			return {};
+
+		auto action = it->second.m_u32Action;
+
+		this->Unlink(it->second);
+		m_mapEntries.erase(it);
+
+		return action;
+	}
+
+	void Coalescer::Expire(Time_t now, const EmitCallback_t &emit)
+	{
+		const uint64_t target = now / TICK;
+
+		while (!m_mapEntries.empty() && (m_u64Tick < target))
+		{
+			++m_u64Tick;
+
+			const auto slot = m_u64Tick % NUM_SLOTS;
+
+			for (Entry *entry = m_arSlots[slot], *next; entry != nullptr; entry = next)
+			{
+				next = entry->m_pNext;
+
+				if (entry->m_u32Rounds > 0)
+				{
+					--entry->m_u32Rounds;
+
+					continue;
+				}
+
+				this->Unlink(*entry);
+
+				auto it = m_mapEntries.find(*entry->m_pKey);
+				assert(it != m_mapEntries.end());
+
+				auto owner = std::move(entry->m_spOwner);
+				auto action = entry->m_u32Action;
+				auto fileName = it->first.second;
+
+				m_mapEntries.erase(it);
+
+				emit(*owner, std::move(fileName), action);
+			}
+		}
+
+		if (m_mapEntries.empty())
+			m_u64Tick = target;
+	}
+
+	int Coalescer::GetTimeout(Time_t now) const noexcept
+	{
+		if (m_mapEntries.empty())
+			return -1;
+
+		auto next = Time_t{ static_cast<Time_t::rep>((m_u64Tick + 1) * TICK.count()) };
+
+		return next > now ? static_cast<int>((next - now).count()) : 0;
+	}
+}
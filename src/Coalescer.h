@@ -0,0 +1,125 @@
+// Copyright (C) 2023 - Bruno Sanches. See the COPYRIGHT
+// file at the top-level directory of this distribution.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+//
+// This Source Code Form is "Incompatible With Secondary Licenses", as
+// defined by the Mozilla Public License, v. 2.0.
+
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace ldmonitor
+{
+	struct DirectoryMonitor;
+
+	/**
+	* Merges events of the same file that happen inside a window, so a burst becomes a single logical change
+	*
+	* Pending changes are expired by a hashed timer wheel, so each tick only touches the entries that are due.
+	*
+	* Not thread safe, owned by the monitor thread.
+	*
+	*/
+	class Coalescer
+	{
+		public:
+			typedef std::chrono::milliseconds Time_t;
+
+			typedef std::function<void(DirectoryMonitor &dirInfo, std::string &&fileName, uint32_t action)> EmitCallback_t;
+
+			//wheel resolution, windows are rounded up to it
+			static constexpr Time_t TICK{ 5 };
+
+			static constexpr size_t NUM_SLOTS = 512;
+
+			Coalescer() = default;
+			Coalescer(const Coalescer &) = delete;
+			Coalescer &operator=(const Coalescer &) = delete;
+
+			/**
+			* Merges action with anything pending for the file, the result is emitted when window expires
+			*
+			*/
+			void Push(const std::shared_ptr<DirectoryMonitor> &owner, std::string_view fileName, uint32_t action, Time_t window, Time_t now);
+
+			/**
+			* Removes a pending change, used when something that cannot be merged happens to the file
+			*
+			*/
+			std::optional<uint32_t> Take(DirectoryMonitor &owner, std::string_view fileName);
+
+			/**
+			* Emits all changes whose window expired until now
+			*
+			*/
+			void Expire(Time_t now, const EmitCallback_t &emit);
+
+			/**
+			* Time in ms until the next tick or -1 if nothing is pending, suitable for poll
+			*
+			*/
+			int GetTimeout(Time_t now) const noexcept;
+
+			inline bool IsEmpty() const noexcept
+			{
+				return m_mapEntries.empty();
+			}
+
+			/**
+			* Merge rules, returns 0 if both cancel each other (a file created and deleted inside the window)
+			*
+			*/
+			static uint32_t Merge(uint32_t pending, uint32_t action) noexcept;
+
+		private:
+			typedef std::pair<DirectoryMonitor *, std::string> Key_t;
+
+			struct KeyHash
+			{
+				size_t operator()(const Key_t &key) const noexcept
+				{
+					return std::hash<std::string>{}(key.second) ^ (std::hash<DirectoryMonitor *>{}(key.first) << 1);
+				}
+			};
+
+			struct Entry
+			{
+				std::shared_ptr<DirectoryMonitor>	m_spOwner;
+				const Key_t							*m_pKey = nullptr;
+
+				uint32_t							m_u32Action = 0;
+
+				//full turns of the wheel before expiring
+				uint32_t							m_u32Rounds = 0;
+				size_t								m_szSlot = 0;
+
+				Entry								*m_pPrev = nullptr;
+				Entry								*m_pNext = nullptr;
+			};
+
+			typedef std::unordered_map<Key_t, Entry, KeyHash> MapEntries_t;
+
+			void Link(Entry &entry, size_t slot);
+			void Unlink(Entry &entry);
+
+		private:
+			MapEntries_t						m_mapEntries;
+
+			std::array<Entry *, NUM_SLOTS>		m_arSlots = {};
+
+			//last tick processed
+			uint64_t							m_u64Tick = 0;
+	};
+}
@@ -0,0 +1,246 @@
+// Copyright (C) 2023 - Bruno Sanches. See the COPYRIGHT
+// file at the top-level directory of this distribution.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+//
+// This Source Code Form is "Incompatible With Secondary Licenses", as
+// defined by the Mozilla Public License, v. 2.0.
+
+#include "ContentDigest.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace ldmonitor
+{
+	static constexpr uint64_t PRIME1 = 0x9E3779B185EBCA87ULL;
+	static constexpr uint64_t PRIME2 = 0xC2B2AE3D27D4EB4FULL;
+	static constexpr uint64_t PRIME3 = 0x165667B19E3779F9ULL;
+	static constexpr uint64_t PRIME4 = 0x85EBCA77C2B2AE63ULL;
+	static constexpr uint64_t PRIME5 = 0x27D4EB2F165667C5ULL;
+
+	//files are streamed, mapping them would raise SIGBUS if the writer truncates it while hashing
+	static constexpr size_t CHUNK_SIZE = 64 * 1024;
+
+	static inline uint64_t Rotl(uint64_t value, int bits) noexcept
+	{
+		return (value << bits) | (value >> (64 - bits));
+	}
+
+	static inline uint64_t Load64(const uint8_t *data) noexcept
+	{
+		uint64_t value;
+		memcpy(&value, data, sizeof(value));
+
+		return value;
+	}
+
+	static inline uint32_t Load32(const uint8_t *data) noexcept
+	{
+		uint32_t value;
+		memcpy(&value, data, sizeof(value));
+
+		return value;
+	}
+
+	static inline uint64_t Round(uint64_t acc, uint64_t input) noexcept
+	{
+		acc += input * PRIME2;
+		acc = Rotl(acc, 31);
+
+		return acc * PRIME1;
+	}
+
+	static inline uint64_t MergeRound(uint64_t acc, uint64_t lane) noexcept
+	{
+		acc ^= Round(0, lane);
+
+		return acc * PRIME1 + PRIME4;
+	}
+
+	uint64_t Hash64(const void *data, size_t len, uint64_t seed) noexcept
+	{
+		auto ptr = static_cast<const uint8_t *>(data);
+		const auto end = ptr + len;
+
+		uint64_t hash;
+
+		if (len >= 32)
+		{
+			uint64_t v1 = seed + PRIME1 + PRIME2;
+			uint64_t v2 = seed + PRIME2;
+			uint64_t v3 = seed;
+			uint64_t v4 = seed - PRIME1;
+
+			const auto limit = end - 32;
+
+			do
+			{
+				v1 = Round(v1, Load64(ptr));
+				v2 = Round(v2, Load64(ptr + 8));
+				v3 = Round(v3, Load64(ptr + 16));
+				v4 = Round(v4, Load64(ptr + 24));
+
+				ptr += 32;
+			} while (ptr <= limit);
+
+			hash = Rotl(v1, 1) + Rotl(v2, 7) + Rotl(v3, 12) + Rotl(v4, 18);
+
+			hash = MergeRound(hash, v1);
+			hash = MergeRound(hash, v2);
+			hash = MergeRound(hash, v3);
+			hash = MergeRound(hash, v4);
+		}
+		else
+		{
+			hash = seed + PRIME5;
+		}
+
+		hash += static_cast<uint64_t>(len);
+
+		for (; ptr + 8 <= end; ptr += 8)
+		{
+			hash ^= Round(0, Load64(ptr));
+			hash = Rotl(hash, 27) * PRIME1 + PRIME4;
+		}
+
+		if (ptr + 4 <= end)
+		{
+			hash ^= static_cast<uint64_t>(Load32(ptr)) * PRIME1;
+			hash = Rotl(hash, 23) * PRIME2 + PRIME3;
+
+			ptr += 4;
+		}
+
+		for (; ptr < end; ++ptr)
+		{
+			hash ^= (*ptr) * PRIME5;
+			hash = Rotl(hash, 11) * PRIME1;
+		}
+
+		hash ^= hash >> 33;
+		hash *= PRIME2;
+		hash ^= hash >> 29;
+		hash *= PRIME3;
+		hash ^= hash >> 32;
+
+		return hash;
+	}
+
+	bool HashFile(const std::string &path, FileDigest &digest)
+	{
+		const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC | O_NOCTTY);
+		if (fd == -1)
+			return false;
+
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+		//not on the stack, threadless callers may have small ones
+		thread_local std::vector<uint8_t> buffer(CHUNK_SIZE);
+
+		uint64_t hash = 0;
+		uint64_t total = 0;
+
+		bool ok;
+
+		for (;;)
+		{
+			auto len = read(fd, buffer.data(), buffer.size());
+			if (len > 0)
+			{
+				//chained, each chunk seeds the next
+				hash = Hash64(buffer.data(), static_cast<size_t>(len), hash);
+				total += static_cast<uint64_t>(len);
+			}
+			else if ((len == 0) || (errno != EINTR))
+			{
+				ok = len == 0;
+
+				break;
+			}
+		}
+
+		const int error = errno;
+		close(fd);
+
+		errno = error;
+
+		if (ok)
+			digest = FileDigest{ total, hash };
+
+		return ok;
+	}
+
+	DigestCache::DigestCache(size_t capacity) :
+		m_szCapacity{ std::max(capacity, size_t{ 1 }) }
+	{
+		//empty
+	}
+
+	bool DigestCache::Update(const std::string &fileName, const FileDigest &digest)
+	{
+		auto it = m_mapEntries.find(fileName);
+
+		if (it != m_mapEntries.end())
+		{
+			m_lstEntries.splice(m_lstEntries.begin(), m_lstEntries, it->second);
+
+			if (it->second->second == digest)
+				return false;
+
+			it->second->second = digest;
+
+			return true;
+		}
+
+		if (m_mapEntries.size() == m_szCapacity)
+		{
+			m_mapEntries.erase(m_lstEntries.back().first);
+			m_lstEntries.pop_back();
+		}
+
+		m_lstEntries.emplace_front(fileName, digest);
+		m_mapEntries.emplace(fileName, m_lstEntries.begin());
+
+		return true;
+	}
+
+	void DigestCache::Erase(const std::string &fileName)
+	{
+		auto it = m_mapEntries.find(fileName);
+		if (it == m_mapEntries.end())
+			return;
+
+		m_lstEntries.erase(it->second);
+		m_mapEntries.erase(it);
+	}
+
+	void DigestCache::ErasePrefix(const std::string &prefix)
+	{
+		for (auto it = m_lstEntries.begin(); it != m_lstEntries.end();)
+		{
+			if (it->first.compare(0, prefix.size(), prefix) != 0)
+			{
+				++it;
+
+				continue;
+			}
+
+			m_mapEntries.erase(it->first);
+			it = m_lstEntries.erase(it);
+		}
+	}
+
+	void DigestCache::Clear() noexcept
+	{
+		m_mapEntries.clear();
+		m_lstEntries.clear();
+	}
+}
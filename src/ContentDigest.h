@@ -0,0 +1,95 @@
+// Copyright (C) 2023 - Bruno Sanches. See the COPYRIGHT
+// file at the top-level directory of this distribution.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+//
+// This Source Code Form is "Incompatible With Secondary Licenses", as
+// defined by the Mozilla Public License, v. 2.0.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <string>
+#include <unordered_map>
+
+namespace ldmonitor
+{
+	struct FileDigest
+	{
+		uint64_t	m_u64Size = 0;
+		uint64_t	m_u64Hash = 0;
+
+		inline bool operator==(const FileDigest &rhs) const noexcept
+		{
+			return (m_u64Size == rhs.m_u64Size) && (m_u64Hash == rhs.m_u64Hash);
+		}
+
+		inline bool operator!=(const FileDigest &rhs) const noexcept
+		{
+			return !(*this == rhs);
+		}
+	};
+
+	/**
+	* XXH64, four independent lanes per 32 bytes, so the main loop keeps the multipliers busy
+	*
+	*/
+	uint64_t Hash64(const void *data, size_t len, uint64_t seed = 0) noexcept;
+
+	/**
+	* Hashes the contents of path, read in chunks
+	*
+	* Returns false with errno set if the file cannot be read
+	*
+	*/
+	bool HashFile(const std::string &path, FileDigest &digest);
+
+	/**
+	* Last known digest of files, when full the least recently used one is dropped
+	*
+	* Not thread safe, owned by the monitor thread.
+	*
+	*/
+	class DigestCache
+	{
+		public:
+			explicit DigestCache(size_t capacity);
+
+			DigestCache(const DigestCache &) = delete;
+			DigestCache &operator=(const DigestCache &) = delete;
+
+			/**
+			* Stores the digest, returns false if it is the one already known
+			*
+			*/
+			bool Update(const std::string &fileName, const FileDigest &digest);
+
+			void Erase(const std::string &fileName);
+
+			/**
+			* Erases all files whose name starts with prefix (a directory that was removed or moved)
+			*
+			*/
+			void ErasePrefix(const std::string &prefix);
+
+			void Clear() noexcept;
+
+			inline size_t GetSize() const noexcept
+			{
+				return m_mapEntries.size();
+			}
+
+		private:
+			typedef std::list<std::pair<std::string, FileDigest>> List_t;
+
+			//most recently used first
+			List_t											m_lstEntries;
+			std::unordered_map<std::string, List_t::iterator>	m_mapEntries;
+
+			size_t											m_szCapacity;
+	};
+}
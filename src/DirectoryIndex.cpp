@@ -0,0 +1,201 @@
+// Copyright (C) 2023 - Bruno Sanches. See the COPYRIGHT
+// file at the top-level directory of this distribution.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+//
+// This Source Code Form is "Incompatible With Secondary Licenses", as
+// defined by the Mozilla Public License, v. 2.0.
+
+#include "DirectoryIndex.h"
+
+#include <algorithm>
+
+namespace ldmonitor
+{
+	static constexpr size_t MIN_SHARDS = 16;
+
+	//average entries per shard before doubling the shards, this is about what a change copies
+	static constexpr size_t MAX_SHARD_AVERAGE = 64;
+
+	static inline bool NameLess(const IndexEntry &entry, std::string_view name) noexcept
+	{
+		return std::string_view{ entry.m_strName } < name;
+	}
+
+	const IndexEntry *detail::IndexVersion::Find(std::string_view name) const noexcept
+	{
+		auto &shard = *m_vecShards[this->GetShard(name)];
+
+		auto it = std::lower_bound(shard.begin(), shard.end(), name, NameLess);
+
+		return ((it != shard.end()) && (it->m_strName == name)) ? &*it : nullptr;
+	}
+
+	DirectoryIndex::DirectoryIndex()
+	{
+		this->Clear();
+	}
+
+	void DirectoryIndex::Set(IndexEntry &&entry)
+	{
+		auto &shard = this->GetShardForWrite(m_spVersion->GetShard(entry.m_strName));
+
+		auto it = std::lower_bound(shard.begin(), shard.end(), std::string_view{ entry.m_strName }, NameLess);
+
+		if ((it != shard.end()) && (it->m_strName == entry.m_strName))
+		{
+			*it = std::move(entry);
+
+			return;
+		}
+
+		shard.insert(it, std::move(entry));
+
+		if (++m_spVersion->m_szSize > m_spVersion->m_vecShards.size() * MAX_SHARD_AVERAGE)
+			this->Grow();
+	}
+
+	bool DirectoryIndex::Erase(std::string_view name)
+	{
+		const auto index = m_spVersion->GetShard(name);
+
+		//check before, so a shared shard is not copied for nothing
+		if (!m_spVersion->Find(name))
+			return false;
+
+		auto &shard = this->GetShardForWrite(index);
+		shard.erase(std::lower_bound(shard.begin(), shard.end(), name, NameLess));
+
+		--m_spVersion->m_szSize;
+
+		return true;
+	}
+
+	void DirectoryIndex::ErasePrefix(std::string_view prefix)
+	{
+		auto matches = [prefix](const IndexEntry &entry) { return std::string_view{ entry.m_strName }.substr(0, prefix.size()) == prefix; };
+
+		for (size_t i = 0; i < m_spVersion->m_vecShards.size(); ++i)
+		{
+			auto &published = *m_spVersion->m_vecShards[i];
+
+			if (std::none_of(published.begin(), published.end(), matches))
+				continue;
+
+			auto &shard = this->GetShardForWrite(i);
+
+			auto it = std::remove_if(shard.begin(), shard.end(), matches);
+
+			m_spVersion->m_szSize -= static_cast<size_t>(shard.end() - it);
+			shard.erase(it, shard.end());
+		}
+	}
+
+	void DirectoryIndex::Clear()
+	{
+		m_spVersion = std::make_shared<detail::IndexVersion>();
+
+		std::vector<std::shared_ptr<Shard_t>> shards(MIN_SHARDS);
+
+		for (auto &shard : shards)
+			shard = std::make_shared<Shard_t>();
+
+		this->ResetShards(std::move(shards));
+	}
+
+	void DirectoryIndex::ResetShards(std::vector<std::shared_ptr<Shard_t>> &&shards)
+	{
+		//all new, nothing published has them
+		m_vecShardGenerations.assign(shards.size(), m_u64Generation);
+
+		m_spVersion->m_vecShards = std::move(shards);
+	}
+
+	void DirectoryIndex::Reserve(size_t count)
+	{
+		while (count > m_spVersion->m_vecShards.size() * MAX_SHARD_AVERAGE)
+			this->Grow();
+	}
+
+	std::shared_ptr<const detail::IndexVersion> DirectoryIndex::Publish() const
+	{
+		//every shard is shared now
+		++m_u64Generation;
+
+		return std::make_shared<const detail::IndexVersion>(*m_spVersion);
+	}
+
+	DirectoryIndex::Shard_t &DirectoryIndex::GetShardForWrite(size_t index)
+	{
+		auto &shard = m_spVersion->m_vecShards[index];
+
+		if (m_vecShardGenerations[index] != m_u64Generation)
+		{
+			shard = std::make_shared<Shard_t>(*shard);
+
+			m_vecShardGenerations[index] = m_u64Generation;
+		}
+
+		return *shard;
+	}
+
+	void DirectoryIndex::Grow()
+	{
+		const auto numShards = m_spVersion->m_vecShards.size();
+
+		std::vector<std::shared_ptr<Shard_t>> shards(numShards * 2);
+
+		for (auto &shard : shards)
+			shard = std::make_shared<Shard_t>();
+
+		//
+		//Entries of new shards i and i + numShards all come from shard i, in order, so they stay sorted
+		for (size_t i = 0; i < numShards; ++i)
+		{
+			for (auto &entry : *m_spVersion->m_vecShards[i])
+			{
+				auto index = std::hash<std::string_view>{}(entry.m_strName) & (shards.size() - 1);
+
+				shards[index]->push_back(entry);
+			}
+		}
+
+		this->ResetShards(std::move(shards));
+	}
+
+	//
+	//
+	// IndexSnapshot
+	//
+	//
+
+	IndexSnapshot::IndexSnapshot(std::shared_ptr<const detail::IndexVersion> version) noexcept :
+		m_spVersion{ std::move(version) }
+	{
+		//empty
+	}
+
+	const IndexEntry *IndexSnapshot::Find(std::string_view name) const noexcept
+	{
+		return m_spVersion ? m_spVersion->Find(name) : nullptr;
+	}
+
+	void IndexSnapshot::ForEach(const std::function<void(const IndexEntry &entry)> &func) const
+	{
+		if (!m_spVersion)
+			return;
+
+		for (auto &shard : m_spVersion->m_vecShards)
+		{
+			for (auto &entry : *shard)
+				func(entry);
+		}
+	}
+
+	size_t IndexSnapshot::GetSize() const noexcept
+	{
+		return m_spVersion ? m_spVersion->m_szSize : 0;
+	}
+}
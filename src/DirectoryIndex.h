@@ -0,0 +1,137 @@
+// Copyright (C) 2023 - Bruno Sanches. See the COPYRIGHT
+// file at the top-level directory of this distribution.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+//
+// This Source Code Form is "Incompatible With Secondary Licenses", as
+// defined by the Mozilla Public License, v. 2.0.
+
+#pragma once
+
+#include <memory>
+#include <string_view>
+#include <vector>
+
+#include "DirectoryMonitor.h"
+
+namespace ldmonitor
+{
+	namespace detail
+	{
+		/**
+		* Entries split in shards by the hash of the name, each one a vector sorted by name
+		*
+		* Published versions are never changed, they share the shards with the index that created them.
+		*
+		*/
+		struct IndexVersion
+		{
+			typedef std::vector<IndexEntry> Shard_t;
+
+			//power of 2
+			std::vector<std::shared_ptr<Shard_t>>	m_vecShards;
+
+			size_t									m_szSize = 0;
+
+			const IndexEntry *Find(std::string_view name) const noexcept;
+
+			inline size_t GetShard(std::string_view name) const noexcept
+			{
+				return std::hash<std::string_view>{}(name) & (m_vecShards.size() - 1);
+			}
+		};
+	}
+
+	/**
+	* Entries of a directory, changed by the monitor thread and read by others through published versions
+	*
+	* Like WatchTable, publishing copies only the shard pointers and a shard is copied before its first change
+	* after each publish, as published versions may still use it. Shards are kept small, so a change costs copying
+	* a few entries.
+	*
+	* Not thread safe, the versions returned by Publish are.
+	*
+	*/
+	class DirectoryIndex
+	{
+		public:
+			typedef detail::IndexVersion::Shard_t Shard_t;
+
+			DirectoryIndex();
+
+			inline const IndexEntry *Find(std::string_view name) const noexcept
+			{
+				return m_spVersion->Find(name);
+			}
+
+			/**
+			* Adds or replaces the entry with the same name
+			*
+			*/
+			void Set(IndexEntry &&entry);
+
+			bool Erase(std::string_view name);
+
+			/**
+			* Erases all names starting with prefix (everything bellow a directory)
+			*
+			*/
+			void ErasePrefix(std::string_view prefix);
+
+			void Clear();
+
+			/**
+			* Makes room for count entries without growing again
+			*
+			*/
+			void Reserve(size_t count);
+
+			/**
+			* Calls func(entry) for every entry, in no particular order
+			*
+			*/
+			template <typename F>
+			void ForEach(F &&func) const
+			{
+				for (auto &shard : m_spVersion->m_vecShards)
+				{
+					for (auto &entry : *shard)
+						func(entry);
+				}
+			}
+
+			inline size_t GetSize() const noexcept
+			{
+				return m_spVersion->m_szSize;
+			}
+
+			/**
+			* Returns an immutable copy of the current state
+			*
+			*/
+			std::shared_ptr<const detail::IndexVersion> Publish() const;
+
+		private:
+			/**
+			* Returns the shard ready to be changed, copying it if the last published version may have it
+			*
+			*/
+			Shard_t &GetShardForWrite(size_t index);
+
+			void Grow();
+
+			void ResetShards(std::vector<std::shared_ptr<Shard_t>> &&shards);
+
+		private:
+			//never published itself, only copies of it
+			std::shared_ptr<detail::IndexVersion>	m_spVersion;
+
+			//
+			//Shards of m_spVersion created since the last Publish are only ours, they have its generation. Counting
+			//owners would not do, readers drop their versions on other threads at any time.
+			mutable uint64_t						m_u64Generation = 0;
+			std::vector<uint64_t>					m_vecShardGenerations;
+	};
+}
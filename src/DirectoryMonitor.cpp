@@ -29,5 +29,8 @@ std::string ldmonitor::ActionName(const uint32_t action)
 	if (action & MONITOR_ACTION_FILE_RENAME_NEW_NAME)
 		name.append("FILE_RENAME_NEW_NAME");
 
+	if (action & MONITOR_ACTION_QUEUE_OVERFLOW)
+		name.append("QUEUE_OVERFLOW");
+
 	return name.empty() ? "NULL" : name;
 }
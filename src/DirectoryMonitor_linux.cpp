@@ -10,347 +10,3683 @@
 
 #include "DirectoryMonitor.h"
 
+#include "Checkpoint.h"
+#include "Coalescer.h"
+#include "ContentDigest.h"
+#include "DirectorySnapshot.h"
+#include "IoUring.h"
+#include "Metrics.h"
+#include "NameFilter.h"
+#include "RenameMatcher.h"
+#include "Trace.h"
+#include "WatchTable.h"
+
 #include <assert.h>
-#include <array>
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <deque>
+#include <fstream>
 #include <mutex>
-#include <map>
+#include <limits>
+#include <memory>
+#include <queue>
 #include <sstream>
 #include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h> 
 #include <poll.h>
 #include <unistd.h>
+#include <sys/epoll.h>
 #include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
 
 //https://qualapps.blogspot.com/2010/05/understanding-readdirectorychangesw.html
 
 namespace ldmonitor
 {	
-	struct DirectoryMonitor
-	{								
-		std::array<uint8_t, 1024 * 4>	m_arBuffer;
+	/**
+	* An event waiting on a strand to be dispatched by an executor, so it owns its data
+	*
+	*/
+	struct PendingEvent
+	{
+		std::string					m_strFileName;
+		uint32_t					m_u32Action;
+		std::chrono::milliseconds	m_tTime;
+
+		int							m_iWd;
+		uint32_t					m_u32Cookie;
+	};
 
+	struct DirectoryMonitor: std::enable_shared_from_this<DirectoryMonitor>
+	{								
 		fs::path						m_pthPath;
 
 		Callback_t						m_pfnCallback;
+		BatchCallback_t					m_pfnBatchCallback;
+		EventCallback_t					m_pfnEventCallback;
 
-		uint32_t						m_u32Flags = 0;				
+		//events collected during a single read for m_pfnBatchCallback or for the executor
+		std::vector<Event>				m_vecBatch;
 
-		DirectoryMonitor() = default;
-		DirectoryMonitor(fs::path path, Callback_t callback, uint32_t flags) :
-			m_pthPath{ std::move(path) },
-			m_pfnCallback{ callback },
-			m_u32Flags{ flags }
-		{
-			//empty
-		}
-	};	
+		//storage for m_vecBatch names that are not in the read buffer (subdirectories), deque so they never move
+		std::deque<std::string>			m_dqBatchNames;
 
-	typedef std::map<int, DirectoryMonitor> MapWatchers_t;
-	
-	static void CheckThreadConflict();
-	static void RemoveWatcher(MapWatchers_t::iterator it, std::unique_lock<std::mutex> lock);
+		//paired renames on m_vecBatch, there they are events with action 0 and the index as cookie
+		std::vector<RenameEvent>		m_vecBatchRenames;
 
-	struct State
-	{
-		std::mutex m_clLock;
-		MapWatchers_t m_mapWatchers;
+		uint32_t						m_u32Flags = 0;				
 
-		int g_iNotifyFD = -1;
+		//inotify mask used for all directories of this watch
+		uint32_t						m_u32Mask = 0;
 
-		int	m_arPipefd[2] = { -1, -1 };
+		//m_pthPath as string ending with '/'
+		std::string						m_strRoot;
 
-		std::thread	m_thMonitorThread;		
+		//last known state, for m_fReconcileOnOverflow and m_fKeepIndex, only used by the monitor thread after Watch
+		std::unique_ptr<DirectorySnapshot>	m_upSnapshot;
 
-		MapWatchers_t::iterator TryFindDirectory(const fs::path &path)
-		{
-			for (MapWatchers_t::iterator it = m_mapWatchers.begin(); it != m_mapWatchers.end(); ++it)
-			{
-				if (it->second.m_pthPath == path)
-					return it;
-			}
+		//
+		//Watch scans it after publishing the watch, without State::m_clLock. Until the monitor thread gets the scan
+		//the changes it sees are kept here and applied to it, an overflow meanwhile reconciles it once it arrives.
+		//Pending is set before publishing and cleared by the monitor thread, the rest is only used by it.
+		std::atomic_bool				m_fScanPending = false;
+		bool							m_fScanOverflowed = false;
+		std::vector<std::pair<std::string, uint32_t>>	m_vecScanChanges;
 
-			return m_mapWatchers.end();
-		}
+		//
+		//m_fKeepIndex: m_upSnapshot as last published for GetIndex, always accessed with std::atomic_load / std::atomic_store.
+		//Dirty is only used by the monitor thread, set when the snapshot changed after it.
+		std::shared_ptr<const detail::IndexVersion>	m_spIndex;
+		bool							m_fIndexDirty = false;
 
-		State() = default;
-		State(const State &rhs) = delete;
-		State(State &&rhs) = delete;
+		//m_fPolling: current interval, grows while the directory is cold, only used by the monitor thread after Watch
+		std::chrono::milliseconds		m_tPollInterval{ 0 };
 
-		~State()
-		{
-			CheckThreadConflict();
+		//compiled m_vecInclude / m_vecExclude, null when there are none
+		std::unique_ptr<NameFilter>		m_upFilter;
 
-			while (!m_mapWatchers.empty())
-			{
-				std::unique_lock l{m_clLock};
+		//written by the monitor thread, read by Monitor::GetMetrics
+		WatchCounters					m_stCounters;
 
-				auto it = m_mapWatchers.begin();
+		//m_fSkipUnchangedWrites, only used by the monitor thread after Watch
+		std::unique_ptr<DigestCache>	m_upDigests;
 
-				RemoveWatcher(it, std::move(l));
-			}
-		}		
-	};
+		WatchOptions					m_stOptions;
 
-	static State g_State;
+		//
+		//wds of the root and of all subdirectories (recursive) it subscribes to, protected by State::m_clLock
+		std::unordered_set<int>			m_setWds;
 
-	static inline uint32_t Flags2Filter(const uint32_t flags) noexcept
-	{			
-		uint32_t filter = (flags & MONITOR_ACTION_FILE_CREATE) ? (IN_CREATE) : 0;
+		//key on State::m_mapWatches, returned to the caller as its Subscription
+		uint64_t						m_u64Id = 0;
 
-		filter = filter | ((flags & MONITOR_ACTION_FILE_DELETE) ? IN_DELETE | IN_DELETE_SELF : 0);
+		//set by Unwatch with State::m_clLock held, so the monitor thread stops adding subdirectories
+		bool							m_fUnregistered = false;
 
-		filter = filter | ((flags & MONITOR_ACTION_FILE_MODIFY) ? IN_MODIFY : 0);
+		//
+		//MonitorOptions::m_fWatchBudget: ms (monitor thread clock) of the last read or poll with changes, stored
+		//only when it changes and read by Watch for finding the coldest watches. Demoted is set with
+		//State::m_clLock held while the watch is polled because there was no room for its kernel watches.
+		std::atomic<int64_t>			m_i64LastActivity{ 0 };
+		std::atomic_bool				m_fDemoted = false;
 
-		filter = filter | ((flags & MONITOR_ACTION_FILE_RENAME_OLD_NAME) ? IN_MOVED_FROM : 0);
-		filter = filter | ((flags & MONITOR_ACTION_FILE_RENAME_NEW_NAME) ? IN_MOVED_TO : 0);
+		//held while callbacks run, so Unwatch can wait for them
+		std::mutex						m_clDispatchLock;
 
-		return filter;
-	}	
-	
-	uint32_t ReadActions2Flags(uint32_t action) 
-	{
-		switch(action)
-		{
-			case IN_CREATE:
-				return MONITOR_ACTION_FILE_CREATE;
+		//thread holding m_clDispatchLock, allows a callback running on an executor to Unwatch itself
+		std::atomic<std::thread::id>	m_tidDispatcher{ std::thread::id{} };
 
-			case IN_DELETE:
-			case IN_DELETE_SELF:
-				return MONITOR_ACTION_FILE_DELETE;
+		//set by Unwatch with m_clDispatchLock held, no callbacks after it
+		bool							m_fRemoved = false;
 
-			case IN_MOVED_FROM:
-				return MONITOR_ACTION_FILE_RENAME_OLD_NAME;
+		//
+		//Strand: events waiting for the executor, only one task per watch is posted at a time, so callbacks
+		//are serialized and ordered
+		std::mutex						m_clStrandLock;
+		std::vector<PendingEvent>		m_vecStrand;
+		std::vector<RenameEvent>		m_vecStrandRenames;
+		bool							m_fStrandScheduled = false;
 
-			case IN_MOVED_TO:
-				return MONITOR_ACTION_FILE_RENAME_NEW_NAME;
+		//has a snapshot or is getting one
+		inline bool IsTracked() const noexcept
+		{
+			return m_upSnapshot || m_fScanPending;
+		}
 
-			case IN_MODIFY:
-				return MONITOR_ACTION_FILE_MODIFY;
+		DirectoryMonitor(fs::path path, Callback_t callback, uint32_t flags, const WatchOptions &options) :
+			m_pthPath{ std::move(path) },
+			m_pfnCallback{ callback },
+			m_u32Flags{ flags },
+			m_stOptions{ options }
+		{
+			//empty
+		}
 
-			default:
-				{
-					std::stringstream stream;
+		DirectoryMonitor(fs::path path, BatchCallback_t callback, uint32_t flags, const WatchOptions &options) :
+			m_pthPath{ std::move(path) },
+			m_pfnBatchCallback{ callback },
+			m_u32Flags{ flags },
+			m_stOptions{ options }
+		{
+			//empty
+		}
 
-					stream << "[DirectoryMonitor::ReadActions2Flags] Unexpected action: " << action;
+		DirectoryMonitor(fs::path path, EventCallback_t callback, uint32_t flags, const WatchOptions &options) :
+			m_pthPath{ std::move(path) },
+			m_pfnEventCallback{ callback },
+			m_u32Flags{ flags },
+			m_stOptions{ options }
+		{
+			//empty
+		}
 
-					throw std::runtime_error(stream.str());
-				}				
-				return 0;
+		/**
+		* Checks the filters, name is the last component only
+		*
+		*/
+		inline bool Accepts(std::string_view name) const noexcept
+		{
+			return !m_upFilter || m_upFilter->Match(name);
 		}
-	}
 
-	static void CloseINotify()
-	{		
-		assert(g_State.g_iNotifyFD != -1);
+		/**
+		* Events of a read share the time, so the line is written once per read, not per event
+		*
+		*/
+		inline void MarkActive(std::chrono::milliseconds time) noexcept
+		{
+			if (m_i64LastActivity.load(std::memory_order_relaxed) != time.count())
+				m_i64LastActivity.store(time.count(), std::memory_order_relaxed);
+		}
 
-		close(g_State.g_iNotifyFD);
-		g_State.g_iNotifyFD = -1;
-	}
+		/**
+		* Watches with these need the kernel events, they cannot be demoted to polling
+		*
+		*/
+		inline bool CanPoll() const noexcept
+		{
+			return !m_stOptions.m_pfnRenameCallback && !m_stOptions.m_fSkipUnchangedWrites;
+		}
 
-	static void ThreadProc()
-	{					
-		//See https://man7.org/linux/man-pages/man7/inotify.7.html
-		/* Some systems cannot read integer variables if they are not
-			  properly aligned. On other systems, incorrect alignment may
-			  decrease performance. Hence, the buffer used for reading from
-			  the inotify file descriptor should have the same alignment as
-			  struct inotify_event. */
+		void Enqueue(std::chrono::milliseconds time);
 
-		char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
-		const struct inotify_event *event;
-		ssize_t len;				
+		void DrainStrand();
 
-		pollfd pollfd[2];
+		void Deliver(std::vector<PendingEvent> &events, const std::vector<RenameEvent> &renames);
 
-		pollfd[0].events = POLLIN;		
-		pollfd[0].fd = g_State.g_iNotifyFD;
+		/**
+		* Calls the batch callback, split on paired renames so everything is delivered in order
+		*
+		*/
+		void DeliverBatch(const Event *events, size_t count, std::chrono::milliseconds time, const std::vector<RenameEvent> &renames);
+	};	
 
-		pollfd[1].events = POLLIN;		
-		pollfd[1].fd = g_State.m_arPipefd[0];
+	void DirectoryMonitor::Enqueue(std::chrono::milliseconds time)
+	{
+		bool schedule;
 
-		for (;;)
-		{			
-			pollfd[0].revents = 0;
-			pollfd[1].revents = 0;
+		{
+			std::lock_guard lock{m_clStrandLock};
 
-			auto retval = poll(pollfd, 2, -1);			
-			if (retval == -1)
+			for (auto &event : m_vecBatch)
 			{
-				//acording to man it may happen...
-				if (errno == EAGAIN)
-					continue;
+				auto cookie = event.m_u32Cookie;
 
-				std::stringstream stream;
+				if (event.m_u32Action == 0)
+				{
+					cookie = static_cast<uint32_t>(m_vecStrandRenames.size());
+					m_vecStrandRenames.push_back(std::move(m_vecBatchRenames[event.m_u32Cookie]));
+				}
 
-				stream << "[FileMonitor::ThreadProc] select failed, ec: " << errno << ' ' << std::system_category().message(errno);
+				m_vecStrand.push_back(PendingEvent{ std::string{event.m_svFileName}, event.m_u32Action, time, event.m_iWd, cookie });
+			}
 
-				throw std::runtime_error(stream.str());
-			}			
+			schedule = !m_fStrandScheduled;
+			m_fStrandScheduled = true;
+		}
 
-			if (pollfd[1].revents)
+		if (schedule)
+		{
+			//weak, so a removed watch is not kept alive by the executor queue
+			m_stOptions.m_spExecutor->Post([weakSelf = this->weak_from_this()]()
 			{
-				//data on the pipe... game over... finish it
-				break;
-			}
+				if (auto self = weakSelf.lock())
+					self->DrainStrand();
+			});
+		}
+	}
 
-			assert(pollfd[0].revents);
+	void DirectoryMonitor::DrainStrand()
+	{
+		std::vector<PendingEvent> events;
+		std::vector<RenameEvent> renames;
 
-			//
-			//no data on pipe, got something....
-			len = read(g_State.g_iNotifyFD, buf, sizeof(buf));
-			if (len == -1)
-			{
-				std::stringstream stream;
+		{
+			std::lock_guard lock{m_clStrandLock};
 
-				stream << "[FileMonitor::ThreadProc] Read failed, ec: " << errno << ' ' << std::system_category().message(errno);
+			events.swap(m_vecStrand);
+			renames.swap(m_vecStrandRenames);
+		}
 
-				throw std::runtime_error(stream.str());				
-			}								
+		{
+			std::lock_guard lock{m_clDispatchLock};
 
-			/* Loop over all events in the buffer. */
-			for (char *ptr = buf; ptr < buf + len; ptr += sizeof(struct inotify_event) + event->len) 
-			{
-				event = (const struct inotify_event *)ptr;
+			if (m_fRemoved)
+				return;
 
-				std::lock_guard lock{g_State.m_clLock};
-				//may it was removed?
-				auto it = g_State.m_mapWatchers.find(event->wd);
-				if (it == g_State.m_mapWatchers.end())
-					continue;
+			m_tidDispatcher = std::this_thread::get_id();
+			this->Deliver(events, renames);
+			m_tidDispatcher = std::thread::id{};
 
-				auto action = ReadActions2Flags(event->mask);
+			//Unwatch from the callback
+			if (m_fRemoved)
+				return;
+		}
 
-				auto &dirInfo = it->second;
-				if (dirInfo.m_u32Flags & action)
-				{
-					auto now = std::chrono::steady_clock::now();
-					dirInfo.m_pfnCallback(dirInfo.m_pthPath, event->name, action, std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()));
-				}					
-			}
-		}	
-	}
+		bool reschedule;
 
-	void Watch(const fs::path &path, Callback_t callback, uint32_t flags)
-	{		
-		std::lock_guard lock{g_State.m_clLock};	
-		
-		if(g_State.TryFindDirectory(path) != g_State.m_mapWatchers.end())
 		{
-			std::stringstream stream;
-			stream << "[WatchFile] Directory already has a watcher: " << path;
+			std::lock_guard lock{m_clStrandLock};
 
-			throw std::invalid_argument(stream.str());
+			reschedule = !m_vecStrand.empty();
+			m_fStrandScheduled = reschedule;
 		}
-		else
+
+		//more events arrived, post again instead of looping so other watches get a chance to run
+		if (reschedule)
 		{
-			if (g_State.g_iNotifyFD == -1)
+			m_stOptions.m_spExecutor->Post([weakSelf = this->weak_from_this()]()
 			{
-				assert(g_State.m_mapWatchers.empty());
+				if (auto self = weakSelf.lock())
+					self->DrainStrand();
+			});
+		}
+	}
 
-				g_State.g_iNotifyFD = inotify_init();
-				if (g_State.g_iNotifyFD == -1)
-				{
-					std::stringstream stream;
-					stream << "[WatchFile] Cannot create inotify instance: " << std::system_category().message(errno);
+	void DirectoryMonitor::Deliver(std::vector<PendingEvent> &events, const std::vector<RenameEvent> &renames)
+	{
+		if (m_pfnCallback)
+		{
+			for (auto &event : events)
+			{
+				if (event.m_u32Action == 0)
+					m_stOptions.m_pfnRenameCallback(renames[event.m_u32Cookie]);
+				else
+					m_pfnCallback(m_pthPath, std::move(event.m_strFileName), event.m_u32Action, event.m_tTime);
 
-					throw std::runtime_error(stream.str());
-				}
+				if (m_fRemoved)
+					return;
 			}
 
-			auto pathStr = path.string();
+			return;
+		}
 
-			auto wd = inotify_add_watch(g_State.g_iNotifyFD, pathStr.c_str(), Flags2Filter(flags));
-			if (wd == -1)
+		if (m_pfnEventCallback)
+		{
+			for (auto &event : events)
 			{
-				std::stringstream stream;
-				stream << "[WatchFile] Cannot add watch: " << pathStr << ", error " << std::system_category().message(errno);
-
-				if (g_State.m_mapWatchers.empty())
-				{
-					CloseINotify();					
-				}
+				if (event.m_u32Action == 0)
+					m_stOptions.m_pfnRenameCallback(renames[event.m_u32Cookie]);
+				else
+					m_pfnEventCallback(Event{ event.m_strFileName, event.m_u32Action, event.m_iWd, event.m_u32Cookie, event.m_tTime });
 
-				throw std::invalid_argument(stream.str());
+				if (m_fRemoved)
+					return;
 			}
 
-			g_State.m_mapWatchers.insert(std::make_pair(wd, DirectoryMonitor{ path, callback, flags }));
+			return;
+		}
 
-			//
-			//start work thread?
-			if (!g_State.m_thMonitorThread.joinable())
-			{
-				if (pipe2(g_State.m_arPipefd, O_DIRECT) == -1)
-				{
-					std::stringstream stream;
-					stream << "[WatchFile] Cannot create pipe: " << pathStr << ", error " << std::system_category().message(errno);					
+		std::vector<Event> batch;
+		batch.reserve(events.size());
 
-					throw std::runtime_error(stream.str());
-				}
+		for (auto &event : events)
+			batch.push_back(Event{ event.m_strFileName, event.m_u32Action, event.m_iWd, event.m_u32Cookie, event.m_tTime });
 
-				g_State.m_thMonitorThread = std::thread{ ThreadProc };
-			}			
+		this->DeliverBatch(batch.data(), batch.size(), events.front().m_tTime, renames);
+	}
+
+	void DirectoryMonitor::DeliverBatch(const Event *events, size_t count, std::chrono::milliseconds time, const std::vector<RenameEvent> &renames)
+	{
+		size_t begin = 0;
+
+		for (size_t i = 0; i < count; ++i)
+		{
+			if (events[i].m_u32Action != 0)
+				continue;
+
+			if (i > begin)
+				m_pfnBatchCallback(m_pthPath, events + begin, i - begin, time);
+
+			if (m_fRemoved)
+				return;
+
+			m_stOptions.m_pfnRenameCallback(renames[events[i].m_u32Cookie]);
+
+			if (m_fRemoved)
+				return;
+
+			begin = i + 1;
 		}
+
+		if (count > begin)
+			m_pfnBatchCallback(m_pthPath, events + begin, count - begin, time);
 	}
 
-	static void CheckThreadConflict()
+	/**
+	* A watch that receives events of a directory, as its root or as one of its subdirectories on recursive watches
+	*
+	*/
+	struct Subscriber
+	{
+		std::shared_ptr<DirectoryMonitor>	m_spMonitor;
+
+		//path relative to the watch root with a trailing '/', empty for the root
+		std::string							m_strPrefix;
+	};
+
+	/**
+	* A directory watched by inotify
+	*
+	* The kernel has a single watch (and wd) per inode, so watches reaching the same directory (same path subscribed
+	* twice, symlinks, bind mounts or overlapping recursive watches) share it. Its mask is the union of the subscribers
+	* masks (IN_MASK_ADD, set again without the ones that left), each one filters the events with its own flags.
+	*
+	*/
+	struct WatchNode
 	{
-		if (std::this_thread::get_id() == g_State.m_thMonitorThread.get_id())
+		//usually only one
+		std::vector<Subscriber>				m_vecSubscribers;
+
+		const Subscriber *TryFindSubscriber(const DirectoryMonitor &dirInfo) const noexcept
 		{
-			//called from the callback? - not supported
-			throw std::logic_error("[[FileMonitor::UnwatchFile] Cannot remove watcher from the thread!");
+			for (auto &subscriber : m_vecSubscribers)
+			{
+				if (subscriber.m_spMonitor.get() == &dirInfo)
+					return &subscriber;
+			}
+
+			return nullptr;
 		}
+	};
+
+	//
+	//The watchers table is never changed after being published, Watch and Unwatch create a new copy and
+	//swap it, so the monitor thread can dispatch events without holding m_clLock
+	typedef WatchTable<WatchNode> WatchersTable_t;
+	typedef std::shared_ptr<const WatchersTable_t> WatchersSnapshot_t;
+	
+	typedef std::vector<std::pair<int, std::string>> NewNodes_t;
+
+	/**
+	* Scan of a new watch made by Watch, with what changed since its checkpoint was written, installed by the
+	* monitor thread
+	*
+	*/
+	struct WatchScan
+	{
+		std::shared_ptr<DirectoryMonitor>					m_spMonitor;
+		std::unique_ptr<DirectorySnapshot>					m_upSnapshot;
+		std::vector<std::pair<std::string, uint32_t>>		m_vecChanges;
+	};
+
+	/**
+	* Adds dirInfo to the subscribers of wd, returns false if it already is one
+	*
+	*/
+	static bool AddSubscriber(WatchersTable_t &watchers, int wd, std::shared_ptr<DirectoryMonitor> dirInfo, std::string prefix)
+	{
+		auto node = watchers.Find(wd);
+		if (node == nullptr)
+			return watchers.Insert(wd, std::make_shared<const WatchNode>(WatchNode{ { Subscriber{ std::move(dirInfo), std::move(prefix) } } }));
+
+		if (node->TryFindSubscriber(*dirInfo))
+			return false;
+
+		//published nodes are never changed
+		auto updated = std::make_shared<WatchNode>(*node);
+		updated->m_vecSubscribers.push_back(Subscriber{ std::move(dirInfo), std::move(prefix) });
+
+		watchers.Replace(wd, std::move(updated));
+
+		return true;
 	}
 
-	static void RemoveWatcher(MapWatchers_t::iterator it, std::unique_lock<std::mutex> lock)
-	{						
-		inotify_rm_watch(g_State.g_iNotifyFD, it->first);			
-		
-		g_State.m_mapWatchers.erase(it);
+	/**
+	* Removes dirInfo from the subscribers of wd, returns true if it was the last one, so the kernel watch must be removed
+	*
+	*/
+	static bool RemoveSubscriber(WatchersTable_t &watchers, int wd, const DirectoryMonitor &dirInfo)
+	{
+		auto node = watchers.Find(wd);
+		if ((node == nullptr) || !node->TryFindSubscriber(dirInfo))
+			return false;
 
-		if (g_State.m_mapWatchers.empty())
+		if (node->m_vecSubscribers.size() == 1)
 		{
-			//notify the thread...
-			write(g_State.m_arPipefd[1], "c", 1);
+			watchers.Erase(wd);
 
-			lock.unlock();
-						
-			g_State.m_thMonitorThread.join();
+			return true;
+		}
 
-			CloseINotify();
+		auto updated = std::make_shared<WatchNode>();
+		updated->m_vecSubscribers.reserve(node->m_vecSubscribers.size() - 1);
 
-			for (int i = 0; i < 2; ++i)
-			{
-				close(g_State.m_arPipefd[i]);
-				g_State.m_arPipefd[i] = -1;
-			}			
+		for (auto &subscriber : node->m_vecSubscribers)
+		{
+			if (subscriber.m_spMonitor.get() != &dirInfo)
+				updated->m_vecSubscribers.push_back(subscriber);
 		}
+
+		watchers.Replace(wd, std::move(updated));
+
+		return false;
 	}
 
-	bool Unwatch(const fs::path &path)
+	/**
+	* Key for the paths index: repeated separators, "." components and trailing separators are dropped
+	*
+	* ".." is kept, removing it lexically would be wrong when the previous component is a symlink
+	*
+	*/
+	static std::string NormalizePath(const fs::path &path)
 	{
-		CheckThreadConflict();
+		const auto str = path.string();
+		const bool absolute = !str.empty() && (str[0] == '/');
 
-		std::unique_lock lock{g_State.m_clLock};
+		std::string normalized;
+		normalized.reserve(str.size());
 
-		auto it = g_State.TryFindDirectory(path);
+		for (size_t pos = 0; pos < str.size();)
+		{
+			auto end = str.find('/', pos);
+			if (end == std::string::npos)
+				end = str.size();
 
-		if (it == g_State.m_mapWatchers.end())
-			return false;
+			std::string_view component{ str.data() + pos, end - pos };
+			pos = end + 1;
 
-		RemoveWatcher(it, std::move(lock));
+			if (component.empty() || (component == "."))
+				continue;
 
-		return true;
+			if (absolute || !normalized.empty())
+				normalized.push_back('/');
+
+			normalized.append(component);
+		}
+
+		if (normalized.empty())
+			normalized = absolute ? "/" : ".";
+
+		return normalized;
 	}
 
-	namespace detail
+	//smallest read buffer, always enough for at least one event with the longest name
+	static constexpr size_t MIN_READ_BUFFER = 4096;
+
+	//
+	//io_uring: requests in flight are the read, a stop and a cancel, buffers are recycled after each dispatch
+	static constexpr unsigned URING_ENTRIES = 8;
+	static constexpr unsigned URING_BUFFERS = 8;
+
+	enum RingRequests: uint64_t
 	{
-		std::optional<bool> IsThreadWaiting(const fs::path &path)
+		URING_READ = 1,
+		URING_STOP,
+		URING_CANCEL,
+		URING_WAKE
+	};
+
+	class EventDispatcher;
+
+	/**
+	* One inotify instance with its thread and watches
+	*
+	*/
+	struct State
+	{
+		const MonitorOptions m_stOptions;
+
+		//only used by the monitor thread (or ProcessEvents), grows up to m_stOptions.m_szMaxReadBuffer
+		std::vector<char> m_vecReadBuffer;
+
+		//
+		//Threadless: events read but not dispatched yet because ProcessEvents reached maxEvents
+		size_t m_szReadOffset = 0;
+		size_t m_szReadLength = 0;
+
+		//threadless: created with the monitor, so it keeps its state between calls to ProcessEvents
+		std::unique_ptr<EventDispatcher> m_upDispatcher;
+
+		//threadless: thread inside ProcessEvents, its callbacks cannot Unwatch
+		std::atomic<std::thread::id> m_tidProcessing{ std::thread::id{} };
+
+		//serializes writers (Watch and Unwatch), readers only use m_spWatchers
+		std::mutex m_clLock;
+
+		//always accessed with std::atomic_load / std::atomic_store
+		WatchersSnapshot_t m_spWatchers = std::make_shared<const WatchersTable_t>();
+
+		//
+		//Protected by m_clLock: all watches by id and the ones added by Watch* by normalized path, so a path
+		//has only one of those, subscriptions are not on it
+		std::unordered_map<uint64_t, std::shared_ptr<DirectoryMonitor>> m_mapWatches;
+		std::unordered_map<std::string, uint64_t> m_mapPaths;
+
+		//
+		//Work for the monitor thread, protected by m_clLock: scans of new watches, with their checkpoint changes, to
+		//install (and schedule when polled). The flag is set while any is not empty, so the thread checks it without locking.
+		std::vector<WatchScan> m_vecScans;
+		std::atomic_bool m_fPendingWork = false;
+
+		//watches demoted by MonitorOptions::m_fWatchBudget, the monitor thread scans them, also pending work
+		std::vector<std::shared_ptr<DirectoryMonitor>> m_vecDemotions;
+
+		//polling watches, changed with m_clLock held, the thread runs while there are watches of any kind
+		std::atomic<size_t> m_szPolling = 0;
+
+		//
+		//MonitorOptions::m_fWatchBudget, protected by m_clLock: kernel watches we may use, nodes of demoted watches
+		//whose kernel watch was removed but are kept until its IN_IGNORED and watches demoted now
+		size_t m_szWatchLimit = 0;
+		size_t m_szDemotedWds = 0;
+		size_t m_szDemoted = 0;
+
+		//helps scans of big directories, created with the first polling watch and never destroyed before the thread
+		std::unique_ptr<ThreadPool> m_upScanPool;
+
+		//written by the monitor thread (or ProcessEvents), read by Monitor::GetMetrics
+		MonitorCounters m_stMetrics;
+
+		//LDMONITOR_TRACE: stages of the monitor thread, empty otherwise
+		TraceRing m_clTrace;
+
+		int m_iNotifyFD = -1;
+
+		//wakes and stops the poll thread, non blocking and open as long as the monitor, so it is written without m_clLock
+		int	m_arPipefd[2] = { -1, -1 };
+
+		//a wake is on the way, so a burst of Watch calls does not fill the pipe (or the ring), cleared by the monitor thread
+		std::atomic_bool m_fWakePending = false;
+
+		//io_uring: reads the inotify fd instead of poll, null when not requested or not available
+		std::unique_ptr<IoUring> m_upRing;
+
+		//serializes submissions, the monitor thread re-arms reads while Unwatch may stop it
+		std::mutex m_clRingLock;
+
+		std::thread	m_thMonitorThread;		
+
+		inline WatchersSnapshot_t GetWatchers() const
 		{
-			std::unique_lock lock{g_State.m_clLock};
+			return std::atomic_load(&m_spWatchers);
+		}
 
-			return !g_State.m_mapWatchers.empty();			
+		inline void PublishWatchers(std::shared_ptr<WatchersTable_t> watchers)
+		{
+			std::atomic_store(&m_spWatchers, WatchersSnapshot_t{ std::move(watchers) });
+		}
+
+		/**
+		* Returns the watch added by Watch* for the directory or null if not found, must be called with m_clLock held
+		*
+		*/
+		std::shared_ptr<DirectoryMonitor> TryFindDirectory(const fs::path &path) const
+		{
+			auto it = m_mapPaths.find(NormalizePath(path));
+
+			return it != m_mapPaths.end() ? m_mapWatches.at(it->second) : nullptr;
+		}
+
+		explicit State(const MonitorOptions &options);
+
+		State(const State &rhs) = delete;
+		State(State &&rhs) = delete;
+
+		~State();
+
+		/**
+		* Returns the id of the watch, if subscription is false the path cannot have other watches added by Watch*
+		*
+		*/
+		uint64_t AddWatcher(const fs::path &path, std::shared_ptr<DirectoryMonitor> dirInfo, bool subscription = false);
+
+		/**
+		* Must be called with m_clLock held, it is released before waiting for the thread and callbacks
+		*
+		*/
+		void RemoveWatcher(std::shared_ptr<DirectoryMonitor> dirInfo, std::unique_lock<std::mutex> lock);
+
+		bool Unwatch(const fs::path &path);
+		bool Unwatch(uint64_t id);
+
+		/**
+		* Null if there is no watch with an index, the path one only looks at watches added by Watch*
+		*
+		*/
+		std::shared_ptr<const detail::IndexVersion> FindIndex(const fs::path &path);
+		std::shared_ptr<const detail::IndexVersion> FindIndex(uint64_t id);
+
+		WatchMetrics GetWatchMetrics(const fs::path &path);
+		WatchMetrics GetWatchMetrics(uint64_t id);
+
+		void Checkpoint();
+
+		/**
+		* Wakes the monitor thread, so it takes the pending work, called after releasing m_clLock. Never blocks, wakes
+		* already on the way are not repeated
+		*
+		*/
+		void WakeThread();
+
+		/**
+		* Publishes subdirectories found by the monitor thread
+		*
+		*/
+		void RegisterNodes(DirectoryMonitor &dirInfo, const NewNodes_t &nodes);
+
+		/**
+		* Removes the node of wd and, if subtree is true, all nodes bellow it
+		*
+		* If removeWatch is false the kernel already dropped the watches (directory deleted)
+		*
+		*/
+		void UnregisterNodes(DirectoryMonitor &dirInfo, int wd, const std::string &prefix, bool subtree, bool removeWatch);
+
+		/**
+		* m_fWatchBudget: kernel watches in use, must be called with m_clLock held
+		*
+		*/
+		inline size_t GetWatchUsage(const WatchersTable_t &watchers) const noexcept
+		{
+			return watchers.GetSize() - m_szDemotedWds;
+		}
+
+		/**
+		* m_fWatchBudget: demotes the watches idle for longest (and at least minIdle), except keep, until count kernel
+		* watches are freed. If partial is false nothing is demoted when that many cannot be freed.
+		*
+		* Only removes their kernel watches, the monitor thread scans them for the polls. Their nodes stay until their
+		* IN_IGNORED, so events already queued are still delivered. Must be called with m_clLock held, returns how
+		* many were freed.
+		*
+		* Does not wake the monitor thread: AddWatcher does it after releasing m_clLock, the others run on it.
+		*
+		*/
+		size_t DemoteColdWatches(const WatchersTable_t &watchers, size_t count, const DirectoryMonitor *keep, std::chrono::milliseconds minIdle, bool partial);
+
+		/**
+		* m_fWatchBudget: moves a demoted watch with that many directories back to inotify, demoting watches idle
+		* for m_tColdAfter if there is no room. Called by the monitor thread, returns false if it must keep polling.
+		*
+		*/
+		bool PromoteWatch(DirectoryMonitor &dirInfo, size_t directories);
+
+		void CheckThreadConflict() const;
+
+		void OpenINotify();
+		void CloseINotify();
+
+		void ThreadProc();
+
+		/**
+		* ThreadProc for io_uring, stopped by an URING_STOP nop instead of the pipe
+		*
+		*/
+		void ThreadProcUring();
+
+		/**
+		* Submits the read of the inotify fd, multishot keeps it armed until it fails or is cancelled
+		*
+		*/
+		void SubmitRingRequest(uint8_t opcode, uint64_t userData, uint64_t addr = 0, uint32_t len = 0);
+
+		size_t ProcessEvents(size_t maxEvents);
+
+		int GetTimeout() const;
+
+		/**
+		* Reads what is pending on the inotify fd, growing the buffer if there is more than it holds
+		*
+		*/
+		ssize_t ReadEvents();
+	};
+
+	static inline uint32_t Flags2Filter(const uint32_t flags) noexcept
+	{			
+		uint32_t filter = (flags & MONITOR_ACTION_FILE_CREATE) ? (IN_CREATE) : 0;
+
+		filter = filter | ((flags & MONITOR_ACTION_FILE_DELETE) ? IN_DELETE | IN_DELETE_SELF : 0);
+
+		filter = filter | ((flags & MONITOR_ACTION_FILE_MODIFY) ? IN_MODIFY : 0);
+
+		filter = filter | ((flags & MONITOR_ACTION_FILE_RENAME_OLD_NAME) ? IN_MOVED_FROM : 0);
+		filter = filter | ((flags & MONITOR_ACTION_FILE_RENAME_NEW_NAME) ? IN_MOVED_TO : 0);
+
+		return filter;
+	}	
+	
+	//always needed on recursive watches for tracking the subdirectories
+	static constexpr uint32_t RECURSIVE_MASK = IN_CREATE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF;
+
+	//everything that changes the directory state, for keeping the snapshot up to date
+	static constexpr uint32_t RECONCILE_MASK = IN_CREATE | IN_DELETE | IN_MODIFY | IN_MOVED_FROM | IN_MOVED_TO;
+
+	//writes are checked when the file is closed, the others replace or remove files, so their digests are dropped
+	static constexpr uint32_t DIGEST_MASK = IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO;
+
+	uint32_t ReadActions2Flags(uint32_t action) 
+	{
+		switch(action & ~IN_ISDIR)
+		{
+			case IN_CREATE:
+				return MONITOR_ACTION_FILE_CREATE;
+
+			case IN_DELETE:
+			case IN_DELETE_SELF:
+				return MONITOR_ACTION_FILE_DELETE;
+
+			case IN_MOVED_FROM:
+				return MONITOR_ACTION_FILE_RENAME_OLD_NAME;
+
+			case IN_MOVED_TO:
+				return MONITOR_ACTION_FILE_RENAME_NEW_NAME;
+
+			case IN_MODIFY:
+				return MONITOR_ACTION_FILE_MODIFY;
+
+			default:
+				//IN_UNMOUNT, IN_MOVE_SELF... nothing we report, do not kill the monitor thread because of them
+				return 0;
+		}
+	}
+
+	void State::CloseINotify()
+	{		
+		assert(m_iNotifyFD != -1);
+
+		close(m_iNotifyFD);
+		m_iNotifyFD = -1;
+	}
+
+	static inline std::string MakeRootString(const fs::path &path)
+	{
+		auto root = path.string();
+		if (root.empty() || (root.back() != '/'))
+			root.push_back('/');
+
+		return root;
+	}
+
+	/**
+	* Adds watches to all subdirectories of prefix (relative to the watch root), prefix itself must be already watched
+	* 
+	* Each directory is watched before being read, so anything created on it after the read generates an event
+	*
+	* If found is not null, all entries found are stored on it (relative to the root), parents before children
+	*
+	* Returns how many directories were not watched because the kernel watches ran out (their subtrees are not counted)
+	*
+	*/
+	static size_t WatchTree(int notifyFd, const std::string &root, uint32_t mask, std::string prefix, NewNodes_t &nodes, std::vector<std::string> *found)
+	{
+		size_t exhausted = 0;
+
+		std::vector<std::string> pending;
+		pending.push_back(std::move(prefix));
+
+		std::string fullPath;
+
+		while (!pending.empty())
+		{
+			auto current = std::move(pending.back());
+			pending.pop_back();
+
+			fullPath = root;
+			fullPath.append(current);
+
+			DIR *dir = opendir(fullPath.c_str());
+			if (dir == nullptr)
+			{
+				//removed before we got here, its parent reports it
+				continue;
+			}
+
+			while (auto entry = readdir(dir))
+			{
+				if ((entry->d_name[0] == '.') && ((entry->d_name[1] == '\0') || ((entry->d_name[1] == '.') && (entry->d_name[2] == '\0'))))
+					continue;
+
+				bool isDir = entry->d_type == DT_DIR;
+				if (entry->d_type == DT_UNKNOWN)
+				{
+					struct stat st;
+					isDir = (fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0) && S_ISDIR(st.st_mode);
+				}
+
+				if (found)
+					found->push_back(current + entry->d_name);
+
+				if (!isDir)
+					continue;
+
+				auto child = current + entry->d_name + '/';
+
+				fullPath = root;
+				fullPath.append(child);
+
+				auto wd = inotify_add_watch(notifyFd, fullPath.c_str(), mask | IN_ONLYDIR | IN_DONT_FOLLOW | IN_MASK_ADD);
+				if (wd == -1)
+				{
+					if (errno == ENOSPC)
+						++exhausted;
+
+					continue;
+				}
+
+				nodes.emplace_back(wd, child);
+				pending.push_back(std::move(child));
+			}
+
+			closedir(dir);
+		}
+
+		return exhausted;
+	}
+
+	/**
+	* Removes the kernel watches of nodes that were not published, directories of other watches stay
+	*
+	*/
+	static void DropNewNodes(int notifyFd, const WatchersTable_t &watchers, const NewNodes_t &nodes)
+	{
+		for (auto &node : nodes)
+		{
+			if (!watchers.Find(node.first))
+				inotify_rm_watch(notifyFd, node.first);
+		}
+	}
+
+	/**
+	* Union of the masks of the subscribers of a node
+	*
+	*/
+	static uint32_t GetNodeMask(const WatchNode &node) noexcept
+	{
+		uint32_t mask = 0;
+
+		for (auto &subscriber : node.m_vecSubscribers)
+			mask |= subscriber.m_spMonitor->m_u32Mask;
+
+		return mask;
+	}
+
+	/**
+	* After a subscriber of wd left, sets its kernel mask to the union of the ones left, so they stop receiving
+	* events only it wanted. Must be called with State::m_clLock held, watchers is the table just published.
+	*
+	*/
+	static void ShrinkMask(int notifyFd, const WatchersTable_t &watchers, int wd)
+	{
+		auto node = watchers.Find(wd);
+		if (node == nullptr)
+			return;
+
+		//roots may be symlinks, subdirectories are never followed
+		const Subscriber *source = &node->m_vecSubscribers.front();
+		for (auto &subscriber : node->m_vecSubscribers)
+		{
+			if (subscriber.m_strPrefix.empty())
+			{
+				source = &subscriber;
+				break;
+			}
+		}
+
+		const auto path = source->m_spMonitor->m_strRoot + source->m_strPrefix;
+		const uint32_t flags = source->m_strPrefix.empty() ? 0 : (IN_ONLYDIR | IN_DONT_FOLLOW);
+
+		//without IN_MASK_ADD, so it replaces the mask
+		const auto current = inotify_add_watch(notifyFd, path.c_str(), GetNodeMask(*node) | flags);
+		if ((current == -1) || (current == wd))
+			return;
+
+		//moved since it was added, the path reaches another directory: give it back its own mask or drop the new watch
+		if (auto other = watchers.Find(current))
+			inotify_add_watch(notifyFd, path.c_str(), GetNodeMask(*other) | flags);
+		else
+			inotify_rm_watch(notifyFd, current);
+	}
+
+	void State::RegisterNodes(DirectoryMonitor &dirInfo, const NewNodes_t &nodes)
+	{
+		if (nodes.empty())
+			return;
+
+		std::lock_guard lock{m_clLock};
+
+		//demoted ones are polled, their subdirectories are found by the scans
+		if (dirInfo.m_fUnregistered || dirInfo.m_fDemoted)
+		{
+			DropNewNodes(m_iNotifyFD, *this->GetWatchers(), nodes);
+
+			return;
+		}
+
+		auto watchers = std::make_shared<WatchersTable_t>(*this->GetWatchers());
+		auto self = dirInfo.shared_from_this();
+
+		for (auto &node : nodes)
+		{
+			const bool shared = watchers->Find(node.first) != nullptr;
+
+			//already subscribed, we raced with our own scan
+			if (!AddSubscriber(*watchers, node.first, self, node.second))
+				continue;
+
+			dirInfo.m_setWds.insert(node.first);
+
+			//the watch was added without the lock, a subscriber leaving since may have shrunk the mask
+			if (shared)
+				inotify_add_watch(m_iNotifyFD, (dirInfo.m_strRoot + node.second).c_str(), dirInfo.m_u32Mask | IN_ONLYDIR | IN_DONT_FOLLOW | IN_MASK_ADD);
+		}
+
+		this->PublishWatchers(std::move(watchers));
+	}
+
+	void State::UnregisterNodes(DirectoryMonitor &dirInfo, int wd, const std::string &prefix, bool subtree, bool removeWatch)
+	{
+		std::lock_guard lock{m_clLock};
+
+		if (dirInfo.m_fUnregistered)
+			return;
+
+		auto watchers = std::make_shared<WatchersTable_t>(*this->GetWatchers());
+
+		std::vector<int> removed;
+
+		if (subtree)
+		{
+			for (auto nodeWd : dirInfo.m_setWds)
+			{
+				auto node = watchers->Find(nodeWd);
+				auto subscriber = node ? node->TryFindSubscriber(dirInfo) : nullptr;
+
+				if (subscriber && (subscriber->m_strPrefix.compare(0, prefix.size(), prefix) == 0))
+					removed.push_back(nodeWd);
+			}
+		}
+		else if (dirInfo.m_setWds.count(wd))
+		{
+			removed.push_back(wd);
+		}
+
+		//only directories no other watch subscribes to, the others keep what is left of their mask
+		std::vector<int> released;
+		std::vector<int> shared;
+
+		for (auto nodeWd : removed)
+		{
+			if (RemoveSubscriber(*watchers, nodeWd, dirInfo))
+				released.push_back(nodeWd);
+			else if (watchers->Find(nodeWd))
+				shared.push_back(nodeWd);
+
+			dirInfo.m_setWds.erase(nodeWd);
+		}
+
+		//the demotion already removed their kernel watches
+		if (dirInfo.m_fDemoted)
+		{
+			m_szDemotedWds -= removed.size();
+			removeWatch = false;
+		}
+
+		this->PublishWatchers(std::move(watchers));
+
+		if (removeWatch)
+		{
+			for (auto nodeWd : released)
+				inotify_rm_watch(m_iNotifyFD, nodeWd);
+
+			auto published = this->GetWatchers();
+
+			for (auto nodeWd : shared)
+				ShrinkMask(m_iNotifyFD, *published, nodeWd);
+		}
+	}
+
+	/**
+	* Turns the contents of a read into callbacks (or queues them for batch / executor delivery)
+	*
+	*/
+	class EventDispatcher
+	{
+		public:
+			explicit EventDispatcher(State &state) :
+				m_rclState{ state },
+				m_clRenames{ state.m_stOptions.m_szMaxPendingRenames }
+			{
+				//empty
+			}
+
+			/**
+			* Dispatches up to maxEvents events of buf, decrementing it, returns the number of bytes used
+			*
+			*/
+			size_t Dispatch(const char *buf, size_t len, size_t &maxEvents);
+
+			/**
+			* Emits coalesced events whose window expired and old names of renames that were not matched
+			*
+			*/
+			void ExpireTimers();
+
+			/**
+			* Delivers everything collected for batches and executors, must be called after Dispatch / ExpireTimers
+			*
+			*/
+			void Flush();
+
+			/**
+			* Timeout for the next poll, -1 if there is nothing waiting for a timer
+			*
+			*/
+			int GetTimeout() const;
+
+			/**
+			* Delivers changes found on checkpoints by Watch and schedules new polling watches, must be called before
+			* any event is dispatched
+			*
+			*/
+			void TakePendingWork();
+
+			/**
+			* Scans the polling watches whose interval expired
+			*
+			*/
+			void Poll();
+
+			//clock of event times, also used by the watch budget
+			static inline std::chrono::milliseconds Now()
+			{
+				return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch());
+			}
+
+		private:
+			bool LockDispatch(DirectoryMonitor &dirInfo);
+			void UnlockDispatch();
+
+			/**
+			* Entry point for every event, applies the filters and coalescing
+			*
+			* source is the kernel event that generated it, null for synthetic ones
+			*
+			*/
+			void Emit(DirectoryMonitor &dirInfo, const std::string &prefix, std::string_view name, uint32_t action, const inotify_event *source, bool track = true);
+
+			/**
+			* Emit for names that are not in the read buffer, they are kept until Flush if needed
+			*
+			* Synthetic events (found by scans) set track to false when the snapshot already has them
+			*
+			*/
+			void EmitOwned(DirectoryMonitor &dirInfo, std::string &&fileName, uint32_t action, bool track);
+
+			/**
+			* Emit for IN_MOVED_FROM / IN_MOVED_TO, pairs them when the watch or the one of the old name asked for it
+			*
+			*/
+			void EmitRename(DirectoryMonitor &dirInfo, const WatchNode &node, const std::string &prefix, std::string_view name, uint32_t action, const inotify_event *source);
+
+			/**
+			* Updates the snapshot of m_fReconcileOnOverflow watches
+			*
+			*/
+			void Track(DirectoryMonitor &dirInfo, const std::string &fileName, uint32_t action);
+
+			/**
+			* m_fKeepIndex: schedules publishing the snapshot on the next Flush
+			*
+			*/
+			void MarkIndexDirty(DirectoryMonitor &dirInfo);
+
+			/**
+			* m_fSkipUnchangedWrites: IN_CLOSE_WRITE, emits a modify if the digest of the file changed
+			*
+			*/
+			void EmitIfChanged(DirectoryMonitor &dirInfo, const std::string &prefix, std::string_view name, const inotify_event *source);
+
+			/**
+			* m_fSkipUnchangedWrites: drops digests of files replaced, removed or moved by the event
+			*
+			*/
+			static void InvalidateDigests(DirectoryMonitor &dirInfo, const std::string &prefix, std::string_view name, const inotify_event *source);
+
+			/**
+			* Calls the callback or queues the event for the batch / executor
+			*
+			*/
+			void Deliver(DirectoryMonitor &dirInfo, const std::string &prefix, std::string_view name, uint32_t action, const inotify_event *source = nullptr);
+			void Deliver(DirectoryMonitor &dirInfo, std::string &&fileName, uint32_t action);
+			void DeliverRename(DirectoryMonitor &dirInfo, const RenameEvent &event);
+
+			/**
+			* Rejected by the name filters of dirInfo
+			*
+			*/
+			inline void CountFiltered(DirectoryMonitor &dirInfo) noexcept
+			{
+				m_rclState.m_stMetrics.m_clFilteredEvents.Add(1);
+				dirInfo.m_stCounters.m_clFilteredEvents.Add(1);
+			}
+
+			inline void CountDelivered(DirectoryMonitor &dirInfo) noexcept
+			{
+				m_rclState.m_stMetrics.m_clDeliveredEvents.Add(1);
+				dirInfo.m_stCounters.m_clDeliveredEvents.Add(1);
+			}
+
+			/**
+			* MonitorOptions::m_fTimeCallbacks: returns the time the callback started and records how long count
+			* events waited since their read, fromRead is false for events not read now. Zero if not timing.
+			*
+			*/
+			inline uint64_t BeginCallback(bool fromRead, uint64_t count = 1) noexcept
+			{
+				if (!m_rclState.m_stOptions.m_fTimeCallbacks)
+					return 0;
+
+				const auto now = GetTimestamp();
+
+				if (fromRead && m_u64ReadTime)
+					m_rclState.m_stMetrics.m_clDispatchDelay.Record(now - m_u64ReadTime, count);
+
+				return now;
+			}
+
+			inline void EndCallback(DirectoryMonitor &dirInfo, uint64_t start) noexcept
+			{
+				if (!start)
+					return;
+
+				const auto elapsed = GetTimestamp() - start;
+
+				m_rclState.m_stMetrics.m_clCallbackTime.Record(elapsed);
+				dirInfo.m_stCounters.m_clCallbackTime.Add(elapsed);
+			}
+
+			void OnSubdirectoryAdded(const Subscriber &subscriber, std::string_view name);
+
+			void OnOverflow(const WatchersTable_t &watchers);
+
+			void Reconcile(DirectoryMonitor &dirInfo);
+
+			/**
+			* Replaces the snapshot with current, reporting the differences if report is set, returns how many there are
+			*
+			*/
+			size_t ReplaceSnapshot(DirectoryMonitor &dirInfo, std::unique_ptr<DirectorySnapshot> current, bool report);
+
+			/**
+			* m_fWatchBudget: dirInfo is hot, moves it back to inotify if there is room, returns false if still polled
+			*
+			*/
+			bool Promote(DirectoryMonitor &dirInfo);
+
+		private:
+			State							&m_rclState;
+
+			Coalescer						m_clCoalescer;
+
+			//old names waiting for the new ones
+			RenameMatcher					m_clRenames;
+
+			struct ScheduledPoll
+			{
+				std::chrono::milliseconds			m_tDue;
+				std::shared_ptr<DirectoryMonitor>	m_spMonitor;
+
+				inline bool operator>(const ScheduledPoll &rhs) const noexcept
+				{
+					return m_tDue > rhs.m_tDue;
+				}
+			};
+
+			//polling watches, soonest first, removed ones are dropped when they are due
+			std::priority_queue<ScheduledPoll, std::vector<ScheduledPoll>, std::greater<ScheduledPoll>> m_clPolls;
+
+			//directories with events pending on m_vecBatch
+			std::vector<DirectoryMonitor *> m_vecBatches;
+
+			//indexes changed since the last Flush, owned so they can be published after an Unwatch
+			std::vector<std::shared_ptr<DirectoryMonitor>> m_vecIndexes;
+
+			//dispatch lock held while consecutive events go to the same watch
+			DirectoryMonitor				*m_pLockedMonitor = nullptr;
+			std::unique_lock<std::mutex>	m_clDispatchLock;
+
+			std::chrono::milliseconds		m_tTime;
+
+			//m_fTimeCallbacks: ns timestamp of the last read, zero after its batches are flushed
+			uint64_t						m_u64ReadTime = 0;
+
+			//reused for building names of Event callbacks, so it stops allocating once big enough
+			std::string						m_strName;
+	};
+
+	bool EventDispatcher::LockDispatch(DirectoryMonitor &dirInfo)
+	{
+		if (m_pLockedMonitor != &dirInfo)
+		{
+			this->UnlockDispatch();
+
+			TraceScope trace{ m_rclState.m_clTrace, TRACE_LOCK };
+
+			m_clDispatchLock = std::unique_lock{ dirInfo.m_clDispatchLock };
+			m_pLockedMonitor = &dirInfo;
+		}
+
+		//Unwatch already returned? Ignore everything else from it
+		return !dirInfo.m_fRemoved;
+	}
+
+	void EventDispatcher::UnlockDispatch()
+	{
+		if (m_clDispatchLock)
+			m_clDispatchLock.unlock();
+
+		m_pLockedMonitor = nullptr;
+	}
+
+	void EventDispatcher::Emit(DirectoryMonitor &dirInfo, const std::string &prefix, std::string_view name, uint32_t action, const inotify_event *source, bool track)
+	{
+		if (track && dirInfo.IsTracked())
+		{
+			std::string fileName{ prefix };
+			fileName.append(name);
+
+			this->Track(dirInfo, fileName, action);
+		}
+
+		if (!(dirInfo.m_u32Flags & action))
+			return;
+
+		const auto window = dirInfo.m_stOptions.m_tCoalesceWindow;
+		if (window.count() <= 0)
+		{
+			this->Deliver(dirInfo, prefix, name, action, source);
+
+			return;
+		}
+
+		std::string fileName{ prefix };
+		fileName.append(name);
+
+		if (action & (MONITOR_ACTION_FILE_CREATE | MONITOR_ACTION_FILE_DELETE | MONITOR_ACTION_FILE_MODIFY))
+		{
+			m_clCoalescer.Push(dirInfo.shared_from_this(), fileName, action, window, m_tTime);
+
+			return;
+		}
+
+		//renames are not merged, but anything pending for the file must be reported before it
+		if (auto pending = m_clCoalescer.Take(dirInfo, fileName))
+			this->Deliver(dirInfo, std::string{ fileName }, *pending);
+
+		this->Deliver(dirInfo, std::move(fileName), action);
+	}
+
+	void EventDispatcher::Track(DirectoryMonitor &dirInfo, const std::string &fileName, uint32_t action)
+	{
+		if (!dirInfo.m_upSnapshot)
+		{
+			//applied once the scan arrives, it may have missed it
+			if (dirInfo.m_fScanPending)
+				dirInfo.m_vecScanChanges.emplace_back(fileName, action);
+
+			return;
+		}
+
+		if (action & (MONITOR_ACTION_FILE_DELETE | MONITOR_ACTION_FILE_RENAME_OLD_NAME))
+			dirInfo.m_upSnapshot->Erase(fileName);
+		else if (!fileName.empty())
+			dirInfo.m_upSnapshot->Update(dirInfo.m_strRoot, fileName);
+
+		this->MarkIndexDirty(dirInfo);
+	}
+
+	void EventDispatcher::MarkIndexDirty(DirectoryMonitor &dirInfo)
+	{
+		if (!dirInfo.m_stOptions.m_fKeepIndex || dirInfo.m_fIndexDirty)
+			return;
+
+		dirInfo.m_fIndexDirty = true;
+		m_vecIndexes.push_back(dirInfo.shared_from_this());
+	}
+
+	void EventDispatcher::EmitIfChanged(DirectoryMonitor &dirInfo, const std::string &prefix, std::string_view name, const inotify_event *source)
+	{
+		std::string fileName{ prefix };
+		fileName.append(name);
+
+		FileDigest digest;
+
+		//big files take a while, an Unwatch of the watch must not wait for them, Deliver checks it again
+		this->UnlockDispatch();
+
+		if (!HashFile(dirInfo.m_strRoot + fileName, digest))
+		{
+			//gone already, its delete comes next
+			if (errno == ENOENT)
+				return;
+
+			//cannot tell, so report it
+			dirInfo.m_upDigests->Erase(fileName);
+		}
+		else if (!dirInfo.m_upDigests->Update(fileName, digest))
+		{
+			return;
+		}
+
+		this->Emit(dirInfo, prefix, name, MONITOR_ACTION_FILE_MODIFY, source);
+	}
+
+	void EventDispatcher::InvalidateDigests(DirectoryMonitor &dirInfo, const std::string &prefix, std::string_view name, const inotify_event *source)
+	{
+		std::string fileName{ prefix };
+		fileName.append(name);
+
+		if (source->mask & IN_ISDIR)
+		{
+			fileName.push_back('/');
+
+			dirInfo.m_upDigests->ErasePrefix(fileName);
+		}
+		else if (source->mask & IN_CREATE)
+		{
+			//created empty, closing it without writing is not a change
+			dirInfo.m_upDigests->Update(fileName, FileDigest{});
+		}
+		else
+		{
+			dirInfo.m_upDigests->Erase(fileName);
+		}
+	}
+
+	void EventDispatcher::EmitRename(DirectoryMonitor &dirInfo, const WatchNode &node, const std::string &prefix, std::string_view name, uint32_t action, const inotify_event *source)
+	{
+		const bool pairing = static_cast<bool>(dirInfo.m_stOptions.m_pfnRenameCallback);
+
+		if (pairing)
+		{
+			std::string fileName{ prefix };
+			fileName.append(name);
+
+			this->Track(dirInfo, fileName, action);
+
+			//the half waits for its pair, coalesced events of the name go out first
+			if (auto pending = m_clCoalescer.Take(dirInfo, fileName))
+				this->Deliver(dirInfo, std::string{ fileName }, *pending);
+
+			if (source->mask & IN_MOVED_FROM)
+			{
+				if (auto evicted = m_clRenames.Push(source->cookie, dirInfo.shared_from_this(), std::move(fileName), m_tTime + m_rclState.m_stOptions.m_tRenameWindow))
+					this->EmitOwned(*evicted->m_spOwner, std::move(evicted->m_strFileName), MONITOR_ACTION_FILE_DELETE, false);
+
+				return;
+			}
+		}
+		else
+		{
+			//old names are only kept for watches that want them
+			this->Emit(dirInfo, prefix, name, action, source);
+
+			if (source->mask & IN_MOVED_FROM)
+				return;
+		}
+
+		if (m_clRenames.IsEmpty())
+		{
+			if (pairing)
+				this->EmitOwned(dirInfo, std::string{ prefix } + std::string{ name }, MONITOR_ACTION_FILE_CREATE, false);
+
+			return;
+		}
+
+		//
+		//The old name of the same watch first, otherwise from a watch that never sees this half (moved between watches)
+		std::optional<RenameMatcher::Half> half;
+
+		if (pairing)
+			half = m_clRenames.Take(source->cookie, [&dirInfo](const DirectoryMonitor &owner) { return &owner == &dirInfo; });
+
+		if (!half)
+			half = m_clRenames.Take(source->cookie, [&node](const DirectoryMonitor &owner) { return node.TryFindSubscriber(owner) == nullptr; });
+
+		std::string fileName{ prefix };
+		fileName.append(name);
+
+		if (!half)
+		{
+			//moved from somewhere not watched
+			if (pairing)
+				this->EmitOwned(dirInfo, std::move(fileName), MONITOR_ACTION_FILE_CREATE, false);
+
+			return;
+		}
+
+		RenameEvent event{ half->m_spOwner->m_pthPath, std::move(half->m_strFileName), dirInfo.m_pthPath, std::move(fileName), m_tTime };
+
+		this->DeliverRename(*half->m_spOwner, event);
+
+		if (pairing && (half->m_spOwner.get() != &dirInfo))
+			this->DeliverRename(dirInfo, event);
+	}
+
+	void EventDispatcher::EmitOwned(DirectoryMonitor &dirInfo, std::string &&fileName, uint32_t action, bool track)
+	{
+		static const std::string noPrefix;
+
+		//found by scans, so the name may have the subdirectories
+		const auto slash = fileName.rfind('/');
+		if (!dirInfo.Accepts(slash == std::string::npos ? std::string_view{ fileName } : std::string_view{ fileName }.substr(slash + 1)))
+		{
+			this->CountFiltered(dirInfo);
+
+			return;
+		}
+
+		//coalesced events are copied, for the others the name must live until Flush on batches
+		const bool queued = (dirInfo.m_pfnBatchCallback || dirInfo.m_stOptions.m_spExecutor) && (dirInfo.m_stOptions.m_tCoalesceWindow.count() <= 0);
+
+		std::string_view name = queued ? dirInfo.m_dqBatchNames.emplace_back(std::move(fileName)) : fileName;
+
+		this->Emit(dirInfo, noPrefix, name, action, nullptr, track);
+	}
+
+	void EventDispatcher::Deliver(DirectoryMonitor &dirInfo, std::string &&fileName, uint32_t action)
+	{
+		static const std::string noPrefix;
+
+		if (dirInfo.m_pfnBatchCallback || dirInfo.m_stOptions.m_spExecutor)
+		{
+			//on batches the name must live until Flush
+			this->Deliver(dirInfo, noPrefix, dirInfo.m_dqBatchNames.emplace_back(std::move(fileName)), action);
+		}
+		else
+		{
+			this->Deliver(dirInfo, noPrefix, fileName, action);
+		}
+	}
+
+	void EventDispatcher::Deliver(DirectoryMonitor &dirInfo, const std::string &prefix, std::string_view name, uint32_t action, const inotify_event *source)
+	{
+		const int wd = source ? source->wd : -1;
+		const uint32_t cookie = source ? source->cookie : 0;
+
+		if (dirInfo.m_pfnBatchCallback || dirInfo.m_stOptions.m_spExecutor)
+		{
+			if (dirInfo.m_vecBatch.empty())
+				m_vecBatches.push_back(&dirInfo);
+
+			if (!prefix.empty())
+			{
+				auto &fullName = dirInfo.m_dqBatchNames.emplace_back(prefix);
+				fullName.append(name);
+
+				name = fullName;
+			}
+
+			dirInfo.m_vecBatch.push_back(Event{ name, action, wd, cookie, m_tTime });
+
+			this->CountDelivered(dirInfo);
+		}
+		else if (!this->LockDispatch(dirInfo))
+		{
+			//removed
+			return;
+		}
+		else if (dirInfo.m_pfnEventCallback)
+		{
+			this->CountDelivered(dirInfo);
+
+			if (!prefix.empty())
+			{
+				m_strName.assign(prefix);
+				m_strName.append(name);
+
+				name = m_strName;
+			}
+
+			TraceScope trace{ m_rclState.m_clTrace, TRACE_CALLBACK, wd };
+
+			const auto start = this->BeginCallback(source != nullptr);
+
+			dirInfo.m_pfnEventCallback(Event{ name, action, wd, cookie, m_tTime });
+
+			this->EndCallback(dirInfo, start);
+		}
+		else
+		{
+			this->CountDelivered(dirInfo);
+
+			std::string fileName{ prefix };
+			fileName.append(name);
+
+			TraceScope trace{ m_rclState.m_clTrace, TRACE_CALLBACK, wd };
+
+			const auto start = this->BeginCallback(source != nullptr);
+
+			dirInfo.m_pfnCallback(dirInfo.m_pthPath, std::move(fileName), action, m_tTime);
+
+			this->EndCallback(dirInfo, start);
+		}
+	}
+
+	void EventDispatcher::DeliverRename(DirectoryMonitor &dirInfo, const RenameEvent &event)
+	{
+		if (dirInfo.m_pfnBatchCallback || dirInfo.m_stOptions.m_spExecutor)
+		{
+			if (dirInfo.m_vecBatch.empty())
+				m_vecBatches.push_back(&dirInfo);
+
+			dirInfo.m_vecBatch.push_back(Event{ std::string_view{}, 0, -1, static_cast<uint32_t>(dirInfo.m_vecBatchRenames.size()), m_tTime });
+			dirInfo.m_vecBatchRenames.push_back(event);
+
+			this->CountDelivered(dirInfo);
+		}
+		else if (this->LockDispatch(dirInfo))
+		{
+			this->CountDelivered(dirInfo);
+
+			TraceScope trace{ m_rclState.m_clTrace, TRACE_CALLBACK };
+
+			//unmatched halves come from timers, so no dispatch delay
+			const auto start = this->BeginCallback(false);
+
+			dirInfo.m_stOptions.m_pfnRenameCallback(event);
+
+			this->EndCallback(dirInfo, start);
+		}
+	}
+
+	void EventDispatcher::OnSubdirectoryAdded(const Subscriber &subscriber, std::string_view name)
+	{
+		auto &dirInfo = *subscriber.m_spMonitor;
+
+		//events queued before its demotion, the scans see the directory
+		if (dirInfo.m_fDemoted)
+			return;
+
+		auto prefix = subscriber.m_strPrefix;
+		prefix.append(name);
+		prefix.push_back('/');
+
+		const auto &root = dirInfo.m_strRoot;
+		const auto path = root + prefix;
+
+		auto wd = inotify_add_watch(m_rclState.m_iNotifyFD, path.c_str(), dirInfo.m_u32Mask | IN_ONLYDIR | IN_DONT_FOLLOW | IN_MASK_ADD);
+		if ((wd == -1) && (errno == ENOSPC) && m_rclState.m_stOptions.m_fWatchBudget)
+		{
+			{
+				std::lock_guard lock{ m_rclState.m_clLock };
+
+				m_rclState.DemoteColdWatches(*m_rclState.GetWatchers(), 1, &dirInfo, std::chrono::milliseconds{ 0 }, false);
+			}
+
+			wd = inotify_add_watch(m_rclState.m_iNotifyFD, path.c_str(), dirInfo.m_u32Mask | IN_ONLYDIR | IN_DONT_FOLLOW | IN_MASK_ADD);
+		}
+
+		if (wd == -1)
+		{
+			//gone already
+			return;
+		}
+
+		NewNodes_t nodes;
+		nodes.emplace_back(wd, prefix);
+
+		//
+		//Anything created before the watch was added is only visible by reading the directory
+		std::vector<std::string> found;
+		WatchTree(m_rclState.m_iNotifyFD, root, dirInfo.m_u32Mask, prefix, nodes, &found);
+
+		m_rclState.RegisterNodes(dirInfo, nodes);
+
+		for (auto &entry : found)
+			this->EmitOwned(dirInfo, std::move(entry), MONITOR_ACTION_FILE_CREATE, true);
+	}
+
+	void EventDispatcher::OnOverflow(const WatchersTable_t &watchers)
+	{
+		static const std::string noPrefix;
+
+		watchers.ForEach([this](int wd, const WatchNode &node)
+		{
+			for (auto &subscriber : node.m_vecSubscribers)
+			{
+				auto &dirInfo = *subscriber.m_spMonitor;
+
+				//its kernel watches are gone and their IN_IGNORED may have been lost, the polls catch up
+				if (dirInfo.m_fDemoted)
+				{
+					m_rclState.UnregisterNodes(dirInfo, wd, subscriber.m_strPrefix, false, false);
+
+					continue;
+				}
+
+				//only roots, so each watch is handled once
+				if (!subscriber.m_strPrefix.empty())
+					continue;
+
+				if (dirInfo.m_u32Flags & MONITOR_ACTION_QUEUE_OVERFLOW)
+					this->Deliver(dirInfo, noPrefix, std::string_view{}, MONITOR_ACTION_QUEUE_OVERFLOW);
+
+				//files may have been replaced without us seeing it
+				if (dirInfo.m_upDigests)
+					dirInfo.m_upDigests->Clear();
+
+				if (dirInfo.m_upSnapshot)
+					this->Reconcile(dirInfo);
+				else if (dirInfo.m_fScanPending)
+					dirInfo.m_fScanOverflowed = true;
+			}
+		});
+	}
+
+	void EventDispatcher::Reconcile(DirectoryMonitor &dirInfo)
+	{
+		const bool recursive = dirInfo.m_stOptions.m_fRecursive;
+
+		//directories created while events were lost are not watched yet
+		if (recursive)
+		{
+			NewNodes_t nodes;
+			WatchTree(m_rclState.m_iNotifyFD, dirInfo.m_strRoot, dirInfo.m_u32Mask, std::string{}, nodes, nullptr);
+
+			m_rclState.RegisterNodes(dirInfo, nodes);
+		}
+
+		auto current = std::make_unique<DirectorySnapshot>();
+		current->Scan(dirInfo.m_strRoot, recursive, m_rclState.m_upScanPool.get());
+
+		//index only watches just want it rebuilt
+		this->ReplaceSnapshot(dirInfo, std::move(current), dirInfo.m_stOptions.m_fReconcileOnOverflow);
+	}
+
+	size_t EventDispatcher::ReplaceSnapshot(DirectoryMonitor &dirInfo, std::unique_ptr<DirectorySnapshot> current, bool report)
+	{
+		std::vector<std::pair<std::string, uint32_t>> changes;
+
+		if (report)
+		{
+			dirInfo.m_upSnapshot->Diff(*current, [&changes](const std::string &fileName, uint32_t action)
+			{
+				changes.emplace_back(fileName, action);
+			});
+		}
+
+		dirInfo.m_upSnapshot = std::move(current);
+		this->MarkIndexDirty(dirInfo);
+
+		for (auto &change : changes)
+			this->EmitOwned(dirInfo, std::move(change.first), change.second, false);
+
+		return changes.size();
+	}
+
+	size_t EventDispatcher::Dispatch(const char *buf, size_t len, size_t &maxEvents)
+	{
+		const struct inotify_event *event;
+		const char *ptr;
+
+		//keep the snapshot alive until all events of this read are dispatched, no lock needed
+		auto watchers = m_rclState.GetWatchers();
+
+		//watches are published after their changes are queued, so any on this snapshot is found
+		this->TakePendingWork();
+
+		//one timestamp for the whole read, all events arrived together
+		m_tTime = Now();
+
+		if (m_rclState.m_stOptions.m_fTimeCallbacks)
+			m_u64ReadTime = GetTimestamp();
+
+		auto &metrics = m_rclState.m_stMetrics;
+
+		//most reads carry several events for the same directory, so avoid looking it up again
+		int lastWd = -1;
+		const WatchNode *node = nullptr;
+
+		for (ptr = buf; (ptr < buf + len) && (maxEvents > 0); ptr += sizeof(struct inotify_event) + event->len, --maxEvents) 
+		{
+			event = (const struct inotify_event *)ptr;
+
+			metrics.m_clEvents.Add(1);
+			m_rclState.m_clTrace.NextEvent();
+
+			if (event->mask & IN_Q_OVERFLOW)
+			{
+				metrics.m_clOverflows.Add(1);
+
+				this->OnOverflow(*watchers);
+
+				continue;
+			}
+				
+			if (event->wd != lastWd)
+			{
+				lastWd = event->wd;
+
+				TraceScope trace{ m_rclState.m_clTrace, TRACE_LOOKUP, event->wd };
+
+				node = watchers->Find(event->wd);
+			}
+
+			//may it was removed?
+			if (node == nullptr)
+			{
+				metrics.m_clUnmatchedEvents.Add(1);
+
+				continue;
+			}
+
+			std::string_view name{ event->len ? event->name : "" };
+
+			const auto action = ReadActions2Flags(event->mask);
+
+			//the node belongs to the snapshot, so changes made bellow never affect this loop
+			for (auto &subscriber : node->m_vecSubscribers)
+			{
+				auto &dirInfo = *subscriber.m_spMonitor;
+				const bool subdirectory = !subscriber.m_strPrefix.empty();
+
+				if (event->mask & IN_IGNORED)
+				{
+					//kernel confirming the watch removal, for subdirectories it means they are gone
+					if (subdirectory || dirInfo.m_fDemoted)
+						m_rclState.UnregisterNodes(dirInfo, event->wd, subscriber.m_strPrefix, false, false);
+
+					continue;
+				}
+
+				dirInfo.MarkActive(m_tTime);
+
+				//parent directory already reported it
+				if (subdirectory && (event->mask & IN_DELETE_SELF))
+					continue;
+
+				if (dirInfo.m_upDigests)
+				{
+					if (event->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO))
+					{
+						InvalidateDigests(dirInfo, subscriber.m_strPrefix, name, event);
+					}
+					else if (event->mask & (IN_MODIFY | IN_CLOSE_WRITE))
+					{
+						//writes are only known to be done when the file is closed, IN_MODIFY is here for snapshots
+						if (event->mask & IN_CLOSE_WRITE)
+						{
+							if (dirInfo.Accepts(name))
+								this->EmitIfChanged(dirInfo, subscriber.m_strPrefix, name, event);
+							else
+								this->CountFiltered(dirInfo);
+						}
+						else if (dirInfo.IsTracked())
+						{
+							this->Track(dirInfo, subscriber.m_strPrefix + std::string{ name }, action);
+						}
+
+						continue;
+					}
+				}
+
+				//filtered on the raw event, subdirectories are still tracked bellow
+				if ((action != 0) && dirInfo.Accepts(name))
+				{
+					if (event->mask & (IN_MOVED_FROM | IN_MOVED_TO))
+						this->EmitRename(dirInfo, *node, subscriber.m_strPrefix, name, action, event);
+					else
+						this->Emit(dirInfo, subscriber.m_strPrefix, name, action, event);
+				}
+				else if (action != 0)
+				{
+					this->CountFiltered(dirInfo);
+
+					//scans see every file, so the snapshot must too
+					if (dirInfo.IsTracked())
+						this->Track(dirInfo, subscriber.m_strPrefix + std::string{ name }, action);
+				}
+
+				if (!dirInfo.m_stOptions.m_fRecursive || !(event->mask & IN_ISDIR))
+					continue;
+
+				if (event->mask & (IN_CREATE | IN_MOVED_TO))
+				{
+					this->OnSubdirectoryAdded(subscriber, name);
+				}
+				else if (event->mask & IN_MOVED_FROM)
+				{
+					//watches follow the directory, so forget them, if it was moved inside the tree it will be added again
+					m_rclState.UnregisterNodes(dirInfo, -1, subscriber.m_strPrefix + std::string{ name } + '/', true, true);
+				}
+			}
+		}
+
+		this->UnlockDispatch();
+
+		return ptr - buf;
+	}
+
+	void EventDispatcher::TakePendingWork()
+	{
+		if (!m_rclState.m_fPendingWork)
+			return;
+
+		std::vector<WatchScan> scans;
+		std::vector<std::shared_ptr<DirectoryMonitor>> demotions;
+
+		{
+			std::lock_guard lock{ m_rclState.m_clLock };
+
+			scans.swap(m_rclState.m_vecScans);
+			demotions.swap(m_rclState.m_vecDemotions);
+
+			m_rclState.m_fPendingWork = false;
+		}
+
+		m_tTime = Now();
+
+		for (auto &scan : scans)
+		{
+			auto &dirInfo = *scan.m_spMonitor;
+
+			//Unwatch returned, forget it
+			const bool removed = !this->LockDispatch(dirInfo);
+			this->UnlockDispatch();
+
+			if (removed)
+				continue;
+
+			dirInfo.m_upSnapshot = std::move(scan.m_upSnapshot);
+			dirInfo.m_fScanPending = false;
+
+			//seen while Watch was scanning, stated again in case the scan got them before the change
+			std::unordered_set<std::string> reported;
+
+			for (auto &change : dirInfo.m_vecScanChanges)
+			{
+				this->Track(dirInfo, change.first, change.second);
+
+				reported.insert(std::move(change.first));
+			}
+
+			std::vector<std::pair<std::string, uint32_t>>{}.swap(dirInfo.m_vecScanChanges);
+
+			//since the checkpoint, the names already reported by their events are not repeated
+			for (auto &change : scan.m_vecChanges)
+			{
+				if (!reported.count(change.first))
+					this->EmitOwned(dirInfo, std::move(change.first), change.second, false);
+			}
+
+			if (dirInfo.m_fScanOverflowed)
+			{
+				dirInfo.m_fScanOverflowed = false;
+
+				this->Reconcile(dirInfo);
+			}
+
+			if (dirInfo.m_stOptions.m_fPolling || dirInfo.m_fDemoted)
+				m_clPolls.push(ScheduledPoll{ m_tTime + dirInfo.m_tPollInterval, std::move(scan.m_spMonitor) });
+		}
+
+		//scanned here, not by whoever ran out of watches while holding the lock
+		for (auto &dirInfo : demotions)
+		{
+			//Unwatch returned, forget it
+			const bool removed = !this->LockDispatch(*dirInfo);
+			this->UnlockDispatch();
+
+			if (removed)
+				continue;
+
+			auto current = std::make_unique<DirectorySnapshot>();
+			current->Scan(dirInfo->m_strRoot, dirInfo->m_stOptions.m_fRecursive, m_rclState.m_upScanPool.get());
+
+			//a tracked snapshot catches what changed since the kernel watches went away, others start from here
+			this->ReplaceSnapshot(*dirInfo, std::move(current), dirInfo->m_upSnapshot != nullptr);
+
+			m_tTime = Now();
+
+			dirInfo->m_tPollInterval = dirInfo->m_stOptions.m_tPollInterval;
+
+			m_clPolls.push(ScheduledPoll{ m_tTime + dirInfo->m_tPollInterval, std::move(dirInfo) });
+		}
+
+		this->UnlockDispatch();
+	}
+
+	void EventDispatcher::Poll()
+	{
+		if (m_clPolls.empty() || (m_clPolls.top().m_tDue > Now()))
+			return;
+
+		const auto now = Now();
+
+		while (!m_clPolls.empty() && (m_clPolls.top().m_tDue <= now))
+		{
+			auto dirInfo = m_clPolls.top().m_spMonitor;
+			m_clPolls.pop();
+
+			//Unwatch returned, forget it
+			const bool removed = !this->LockDispatch(*dirInfo);
+			this->UnlockDispatch();
+
+			if (removed)
+				continue;
+
+			auto current = std::make_unique<DirectorySnapshot>();
+			current->Scan(dirInfo->m_strRoot, dirInfo->m_stOptions.m_fRecursive, m_rclState.m_upScanPool.get());
+
+			m_tTime = Now();
+
+			//cold directories are scanned less and less
+			if (this->ReplaceSnapshot(*dirInfo, std::move(current), true) > 0)
+			{
+				dirInfo->m_tPollInterval = dirInfo->m_stOptions.m_tPollInterval;
+				dirInfo->MarkActive(m_tTime);
+
+				//hot again, inotify is cheaper
+				if (dirInfo->m_fDemoted && this->Promote(*dirInfo))
+					continue;
+			}
+			else
+			{
+				dirInfo->m_tPollInterval = std::min(dirInfo->m_tPollInterval * 2, std::max(dirInfo->m_stOptions.m_tMaxPollInterval, dirInfo->m_stOptions.m_tPollInterval));
+			}
+
+			const auto due = m_tTime + dirInfo->m_tPollInterval;
+
+			m_clPolls.push(ScheduledPoll{ due, std::move(dirInfo) });
+		}
+
+		this->UnlockDispatch();
+	}
+
+	bool EventDispatcher::Promote(DirectoryMonitor &dirInfo)
+	{
+		size_t directories = 1;
+
+		if (dirInfo.m_stOptions.m_fRecursive)
+		{
+			dirInfo.m_upSnapshot->GetIndex().ForEach([&directories](const IndexEntry &entry)
+			{
+				directories += entry.m_fDirectory;
+			});
+		}
+
+		if (!m_rclState.PromoteWatch(dirInfo, directories))
+			return false;
+
+		//the watches demoted to make room
+		this->TakePendingWork();
+
+		//changes made since the last poll, now that the watches are in place
+		auto current = std::make_unique<DirectorySnapshot>();
+		current->Scan(dirInfo.m_strRoot, dirInfo.m_stOptions.m_fRecursive, m_rclState.m_upScanPool.get());
+
+		this->ReplaceSnapshot(dirInfo, std::move(current), true);
+
+		//counted once the switch is over, nothing is missed by the watches involved from here on
+		m_rclState.m_stMetrics.m_clPromotions.Add(1);
+
+		//only the polls needed it
+		if (!dirInfo.m_stOptions.m_fReconcileOnOverflow && !dirInfo.m_stOptions.m_fKeepIndex)
+			dirInfo.m_upSnapshot.reset();
+
+		return true;
+	}
+
+	void EventDispatcher::ExpireTimers()
+	{
+		//also runs when the thread is woken without events
+		this->TakePendingWork();
+		this->Poll();
+
+		if (m_clCoalescer.IsEmpty() && m_clRenames.IsEmpty())
+			return;
+
+		m_tTime = Now();
+
+		m_clCoalescer.Expire(m_tTime, [this](DirectoryMonitor &dirInfo, std::string &&fileName, uint32_t action)
+		{
+			this->Deliver(dirInfo, std::move(fileName), action);
+		});
+
+		//the new name never came, moved out of the watches
+		m_clRenames.Expire(m_tTime, [this](RenameMatcher::Half &&half)
+		{
+			this->EmitOwned(*half.m_spOwner, std::move(half.m_strFileName), MONITOR_ACTION_FILE_DELETE, false);
+		});
+
+		this->UnlockDispatch();
+	}
+
+	int EventDispatcher::GetTimeout() const
+	{
+		if (m_rclState.m_fPendingWork)
+			return 0;
+
+		const auto now = Now();
+
+		int timeout = -1;
+
+		for (auto next : { m_clCoalescer.GetTimeout(now), m_clRenames.GetTimeout(now), m_clPolls.empty() ? -1 : static_cast<int>(std::max(std::chrono::milliseconds{ 0 }, m_clPolls.top().m_tDue - now).count()) })
+		{
+			if ((next >= 0) && ((timeout < 0) || (next < timeout)))
+				timeout = next;
+		}
+
+		return timeout;
+	}
+
+	void EventDispatcher::Flush()
+	{
+		for (auto dirInfo : m_vecBatches)
+		{
+			if (dirInfo->m_stOptions.m_spExecutor)
+			{
+				dirInfo->Enqueue(m_tTime);
+			}
+			else
+			{
+				std::lock_guard lock{ dirInfo->m_clDispatchLock };
+
+				if (!dirInfo->m_fRemoved)
+				{
+					TraceScope trace{ m_rclState.m_clTrace, TRACE_CALLBACK };
+
+					//timers also add to batches, but most come from the read
+					const auto start = this->BeginCallback(true, dirInfo->m_vecBatch.size());
+
+					dirInfo->DeliverBatch(dirInfo->m_vecBatch.data(), dirInfo->m_vecBatch.size(), m_tTime, dirInfo->m_vecBatchRenames);
+
+					this->EndCallback(*dirInfo, start);
+				}
+			}
+
+			dirInfo->m_vecBatch.clear();
+			dirInfo->m_dqBatchNames.clear();
+			dirInfo->m_vecBatchRenames.clear();
+		}
+
+		m_vecBatches.clear();
+
+		m_u64ReadTime = 0;
+
+		for (auto &dirInfo : m_vecIndexes)
+		{
+			std::atomic_store(&dirInfo->m_spIndex, dirInfo->m_upSnapshot->GetIndex().Publish());
+
+			dirInfo->m_fIndexDirty = false;
+		}
+
+		m_vecIndexes.clear();
+	}
+
+	/**
+	* fs.inotify.max_user_watches, 0 if it cannot be read
+	*
+	*/
+	static size_t ReadMaxUserWatches()
+	{
+		std::ifstream file("/proc/sys/fs/inotify/max_user_watches");
+
+		size_t limit = 0;
+		if (!(file >> limit))
+			return 0;
+
+		return limit;
+	}
+
+	State::State(const MonitorOptions &options) :
+		m_stOptions{ options }
+	{
+		if (m_stOptions.m_fWatchBudget)
+		{
+			m_szWatchLimit = m_stOptions.m_szMaxWatches;
+
+			if (m_szWatchLimit == 0)
+			{
+				const auto max = ReadMaxUserWatches();
+
+				//unknown: only running out (ENOSPC) demotes watches
+				m_szWatchLimit = max ? max - max / 16 : SIZE_MAX;
+			}
+		}
+
+		if (!m_stOptions.m_fThreadless)
+		{
+			//without it (old kernel, disabled by sysctl or seccomp) the monitor thread uses poll
+			if (m_stOptions.m_fUseIoUring)
+				m_upRing = IoUring::TryCreate(URING_ENTRIES, URING_BUFFERS, std::max(MIN_READ_BUFFER, m_stOptions.m_szMaxReadBuffer / URING_BUFFERS));
+
+			if (!m_upRing && (pipe2(m_arPipefd, O_NONBLOCK | O_CLOEXEC) == -1))
+			{
+				std::stringstream stream;
+				stream << "[Monitor] Cannot create pipe, error " << std::system_category().message(errno);
+
+				throw std::runtime_error(stream.str());
+			}
+
+			return;
+		}
+
+		//lives as long as the monitor, so it can be added to the caller event loop once
+		this->OpenINotify();
+
+		m_upDispatcher = std::make_unique<EventDispatcher>(*this);
+	}
+
+	State::~State()
+	{
+		this->CheckThreadConflict();
+
+		for (;;)
+		{
+			std::unique_lock l{m_clLock};
+
+			if (m_mapWatches.empty())
+				break;				
+
+			this->RemoveWatcher(m_mapWatches.begin()->second, std::move(l));
+		}
+
+		//the dispatcher may hold references to watches (coalescing)
+		m_upDispatcher.reset();
+
+		if (m_stOptions.m_fThreadless)
+			this->CloseINotify();
+
+		for (int i = 0; i < 2; ++i)
+		{
+			if (m_arPipefd[i] != -1)
+				close(m_arPipefd[i]);
+		}
+	}
+
+	void State::OpenINotify()
+	{
+		assert(m_iNotifyFD == -1);
+
+		//io_uring only keeps multishot reads armed on non blocking files
+		m_iNotifyFD = inotify_init1(IN_CLOEXEC | ((m_stOptions.m_fThreadless || m_upRing) ? IN_NONBLOCK : 0));
+		if (m_iNotifyFD == -1)
+		{
+			std::stringstream stream;
+			stream << "[WatchFile] Cannot create inotify instance: " << std::system_category().message(errno);
+
+			throw std::runtime_error(stream.str());
+		}
+	}
+
+	ssize_t State::ReadEvents()
+	{
+		//See https://man7.org/linux/man-pages/man7/inotify.7.html
+		/* Some systems cannot read integer variables if they are not
+			  properly aligned. On other systems, incorrect alignment may
+			  decrease performance. Hence, the buffer used for reading from
+			  the inotify file descriptor should have the same alignment as
+			  struct inotify_event. */
+		static_assert(__STDCPP_DEFAULT_NEW_ALIGNMENT__ >= alignof(struct inotify_event));
+
+		if (m_vecReadBuffer.empty())
+			m_vecReadBuffer.resize(MIN_READ_BUFFER);
+
+		//
+		//Never shrinks, so after a burst the following ones are also read with a single call
+		int pending = 0;
+		if (ioctl(m_iNotifyFD, FIONREAD, &pending) == 0)
+		{
+			m_stMetrics.m_clMaxQueuedBytes.SetMax(static_cast<uint64_t>(pending));
+
+			if (static_cast<size_t>(pending) > m_vecReadBuffer.size())
+			{
+				const auto maxSize = std::max(MIN_READ_BUFFER, m_stOptions.m_szMaxReadBuffer);
+
+				m_vecReadBuffer.resize(std::min(static_cast<size_t>(pending), maxSize));
+			}
+		}
+
+		ssize_t len;
+
+		{
+			TraceScope trace{ m_clTrace, TRACE_READ };
+
+			len = read(m_iNotifyFD, m_vecReadBuffer.data(), m_vecReadBuffer.size());
+		}
+
+		m_stMetrics.m_clReads.Add(1);
+
+		if (len > 0)
+			m_stMetrics.m_clBytesRead.Add(static_cast<uint64_t>(len));
+
+		return len;
+	}
+
+	void State::ThreadProc()
+	{					
+		ssize_t len;				
+
+		pollfd pollfd[2];
+
+		pollfd[0].events = POLLIN;		
+		pollfd[0].fd = m_iNotifyFD;
+
+		pollfd[1].events = POLLIN;		
+		pollfd[1].fd = m_arPipefd[0];
+
+		EventDispatcher dispatcher{ *this };
+
+		for (;;)
+		{			
+			pollfd[0].revents = 0;
+			pollfd[1].revents = 0;
+
+			const auto timeout = dispatcher.GetTimeout();
+			int retval;
+
+			{
+				TraceScope trace{ m_clTrace, TRACE_KERNEL_WAIT };
+
+				retval = poll(pollfd, 2, timeout);
+			}
+
+			if (retval == -1)
+			{
+				//acording to man it may happen...
+				if (errno == EAGAIN)
+					continue;
+
+				std::stringstream stream;
+
+				stream << "[FileMonitor::ThreadProc] select failed, ec: " << errno << ' ' << std::system_category().message(errno);
+
+				throw std::runtime_error(stream.str());
+			}			
+
+			if (pollfd[1].revents)
+			{
+				//before reading, so a wake sent after it is not lost
+				m_fWakePending = false;
+
+				//data on the pipe... 'c' is game over... finish it, anything else just wakes us up
+				char commands[16];
+				bool stop = false;
+
+				for (;;)
+				{
+					const auto len = read(m_arPipefd[0], commands, sizeof(commands));
+					if (len <= 0)
+					{
+						if ((len == -1) && (errno == EINTR))
+							continue;
+
+						break;
+					}
+
+					stop = stop || (std::memchr(commands, 'c', static_cast<size_t>(len)) != nullptr);
+				}
+
+				if (stop)
+					break;
+			}
+
+			//
+			//no data on pipe, got something.... or just a timer
+			if (pollfd[0].revents)
+			{
+				len = this->ReadEvents();
+				if (len == -1)
+				{
+					std::stringstream stream;
+
+					stream << "[FileMonitor::ThreadProc] Read failed, ec: " << errno << ' ' << std::system_category().message(errno);
+
+					throw std::runtime_error(stream.str());				
+				}								
+
+				/* Loop over all events in the buffer. */
+				auto maxEvents = std::numeric_limits<size_t>::max();
+				dispatcher.Dispatch(m_vecReadBuffer.data(), len, maxEvents);
+			}
+
+			dispatcher.ExpireTimers();
+			dispatcher.Flush();
+		}	
+	}
+
+	void State::SubmitRingRequest(uint8_t opcode, uint64_t userData, uint64_t addr, uint32_t len)
+	{
+		//never full, at most one request of each kind is in flight
+		auto sqe = m_upRing->GetSqe();
+		assert(sqe);
+
+		sqe->opcode = opcode;
+		sqe->addr = addr;
+		sqe->len = len;
+		sqe->user_data = userData;
+
+		if (userData == URING_READ)
+		{
+			sqe->fd = m_iNotifyFD;
+			sqe->flags = IOSQE_BUFFER_SELECT;
+			sqe->buf_group = 0;
+
+			//not seekable, use the file position
+			sqe->off = static_cast<uint64_t>(-1);
+		}
+
+		if (!m_upRing->Submit())
+		{
+			std::stringstream stream;
+
+			stream << "[FileMonitor::SubmitRingRequest] io_uring submit failed, ec: " << errno << ' ' << std::system_category().message(errno);
+
+			throw std::runtime_error(stream.str());
+		}
+	}
+
+	void State::ThreadProcUring()
+	{
+		auto &ring = *m_upRing;
+
+		EventDispatcher dispatcher{ *this };
+
+		//multishot reads need kernel 6.7, on older ones fail with EINVAL and each read is submitted again
+		bool multishot = true;
+		bool received = false;
+
+		bool armed = false;
+		bool stopping = false;
+
+		for (;;)
+		{
+			if (!armed && !stopping)
+			{
+				std::lock_guard ringLock{ m_clRingLock };
+
+				if (multishot)
+					this->SubmitRingRequest(IoUring::OP_READ_MULTISHOT, URING_READ);
+				else
+					this->SubmitRingRequest(IORING_OP_READ, URING_READ, 0, static_cast<uint32_t>(ring.GetBufferSize()));
+
+				armed = true;
+			}
+
+			const auto timeout = dispatcher.GetTimeout();
+			bool waited;
+
+			{
+				//includes the read, done by the kernel
+				TraceScope trace{ m_clTrace, TRACE_KERNEL_WAIT };
+
+				waited = ring.Wait(timeout);
+			}
+
+			if (!waited)
+			{
+				std::stringstream stream;
+
+				stream << "[FileMonitor::ThreadProcUring] io_uring wait failed, ec: " << errno << ' ' << std::system_category().message(errno);
+
+				throw std::runtime_error(stream.str());
+			}
+
+			ring.ForEachCompletion([&](const io_uring_cqe &cqe)
+			{
+				if (cqe.user_data == URING_STOP)
+				{
+					stopping = true;
+
+					//the read may have a buffer being filled, so wait for it to be cancelled before closing the fd
+					if (armed)
+					{
+						std::lock_guard ringLock{ m_clRingLock };
+
+						this->SubmitRingRequest(IORING_OP_ASYNC_CANCEL, URING_CANCEL, URING_READ);
+					}
+
+					return;
+				}
+
+				if (cqe.user_data == URING_WAKE)
+				{
+					m_fWakePending = false;
+
+					return;
+				}
+
+				//cancel result or a stale one from a previous thread
+				if (cqe.user_data != URING_READ)
+					return;
+
+				if (!(cqe.flags & IORING_CQE_F_MORE))
+					armed = false;
+
+				if (cqe.res > 0)
+				{
+					received = true;
+
+					m_stMetrics.m_clReads.Add(1);
+					m_stMetrics.m_clBytesRead.Add(static_cast<uint64_t>(cqe.res));
+
+					const auto bid = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+
+					auto maxEvents = std::numeric_limits<size_t>::max();
+					dispatcher.Dispatch(ring.GetBuffer(bid), cqe.res, maxEvents);
+
+					ring.RecycleBuffer(bid);
+
+					return;
+				}
+
+				switch (-cqe.res)
+				{
+					case EINVAL:
+						if (multishot && !received)
+						{
+							multishot = false;
+
+							return;
+						}
+						break;
+
+					//all buffers in use, cancelled or interrupted: just submit it again
+					case ENOBUFS:
+					case ECANCELED:
+					case EAGAIN:
+					case EINTR:
+						return;
+				}
+
+				std::stringstream stream;
+
+				stream << "[FileMonitor::ThreadProcUring] Read failed, ec: " << -cqe.res << ' ' << std::system_category().message(-cqe.res);
+
+				throw std::runtime_error(stream.str());
+			});
+
+			if (stopping && !armed)
+				break;
+
+			dispatcher.ExpireTimers();
+			dispatcher.Flush();
+		}
+	}
+
+	size_t State::ProcessEvents(size_t maxEvents)
+	{
+		this->CheckThreadConflict();
+
+		//callbacks are called from here, so they cannot Unwatch
+		struct ProcessingGuard
+		{
+			std::atomic<std::thread::id> &m_rtidProcessing;
+
+			~ProcessingGuard()
+			{
+				m_rtidProcessing = std::thread::id{};
+			}
+		} guard{ m_tidProcessing };
+
+		m_tidProcessing = std::this_thread::get_id();
+
+		auto &dispatcher = *m_upDispatcher;
+		size_t remaining = maxEvents;
+
+		while (remaining > 0)
+		{
+			if (m_szReadOffset == m_szReadLength)
+			{
+				auto len = this->ReadEvents();
+				if (len == -1)
+				{
+					if ((errno == EAGAIN) || (errno == EINTR))
+						break;
+
+					std::stringstream stream;
+
+					stream << "[Monitor::ProcessEvents] Read failed, ec: " << errno << ' ' << std::system_category().message(errno);
+
+					throw std::runtime_error(stream.str());
+				}
+
+				m_szReadOffset = 0;
+				m_szReadLength = len;
+			}
+
+			m_szReadOffset += dispatcher.Dispatch(m_vecReadBuffer.data() + m_szReadOffset, m_szReadLength - m_szReadOffset, remaining);
+		}
+
+		dispatcher.ExpireTimers();
+		dispatcher.Flush();
+
+		return maxEvents - remaining;
+	}
+
+	int State::GetTimeout() const
+	{
+		//events already read and waiting for the next call
+		if (m_szReadOffset < m_szReadLength)
+			return 0;
+
+		return m_upDispatcher->GetTimeout();
+	}
+
+	uint64_t State::AddWatcher(const fs::path &path, std::shared_ptr<DirectoryMonitor> dirInfo, bool subscription)
+	{		
+		//unique across monitors, so a subscription given to the wrong one never removes another watch
+		static std::atomic<uint64_t> g_u64NextId{ 1 };
+
+		std::unique_lock lock{m_clLock};	
+		
+		auto key = NormalizePath(path);
+
+		if(!subscription && m_mapPaths.count(key))
+		{
+			std::stringstream stream;
+			stream << "[WatchFile] Directory already has a watcher: " << path;
+
+			throw std::invalid_argument(stream.str());
+		}
+		else
+		{
+			//before touching the kernel, throws for bad patterns
+			if (!dirInfo->m_stOptions.m_vecInclude.empty() || !dirInfo->m_stOptions.m_vecExclude.empty())
+				dirInfo->m_upFilter = std::make_unique<NameFilter>(dirInfo->m_stOptions.m_vecInclude, dirInfo->m_stOptions.m_vecExclude);
+
+			auto watchers = std::make_shared<WatchersTable_t>(*this->GetWatchers());
+
+			if (m_iNotifyFD == -1)
+			{
+				assert(watchers->IsEmpty());
+
+				this->OpenINotify();
+			}
+
+			auto pathStr = path.string();
+
+			dirInfo->m_strRoot = MakeRootString(path);
+
+			//checkpoints are written from the published index
+			if (!dirInfo->m_stOptions.m_pthCheckpoint.empty())
+				dirInfo->m_stOptions.m_fKeepIndex = true;
+
+			bool polling = dirInfo->m_stOptions.m_fPolling;
+
+			//all need the snapshot
+			bool tracking = dirInfo->m_stOptions.m_fReconcileOnOverflow || dirInfo->m_stOptions.m_fKeepIndex || polling;
+
+			//m_fWatchBudget: polled instead of failing when there is no room
+			const bool budget = m_stOptions.m_fWatchBudget && dirInfo->CanPoll();
+			bool demoted = false;
+
+			NewNodes_t nodes;
+
+			if (polling)
+			{
+				struct stat st;
+				const int error = (stat(pathStr.c_str(), &st) != 0) ? errno : (S_ISDIR(st.st_mode) ? 0 : ENOTDIR);
+
+				if (error != 0)
+				{
+					std::stringstream stream;
+					stream << "[WatchFile] Cannot poll: " << pathStr << ", error " << std::system_category().message(error);
+
+					if (watchers->IsEmpty() && (m_szPolling == 0) && !m_stOptions.m_fThreadless)
+						this->CloseINotify();
+
+					throw std::invalid_argument(stream.str());
+				}
+			}
+			else
+			{
+				dirInfo->m_u32Mask = Flags2Filter(dirInfo->m_u32Flags) | (dirInfo->m_stOptions.m_fRecursive ? RECURSIVE_MASK : 0) | (tracking ? RECONCILE_MASK : 0);
+
+				//renames are paired even when not in the flags, the halves that are not become create / delete
+				if (dirInfo->m_stOptions.m_pfnRenameCallback)
+					dirInfo->m_u32Mask |= IN_MOVED_FROM | IN_MOVED_TO;
+
+				if (dirInfo->m_stOptions.m_fSkipUnchangedWrites && (dirInfo->m_u32Flags & MONITOR_ACTION_FILE_MODIFY))
+				{
+					dirInfo->m_upDigests = std::make_unique<DigestCache>(dirInfo->m_stOptions.m_szMaxDigests);
+
+					//snapshots still want every write
+					if (!tracking)
+						dirInfo->m_u32Mask &= ~IN_MODIFY;
+
+					dirInfo->m_u32Mask |= DIGEST_MASK;
+				}
+
+				//our own limit, room for the root at least, the subdirectories are checked once subscribed
+				if (budget)
+				{
+					const auto used = this->GetWatchUsage(*watchers);
+
+					demoted = (used >= m_szWatchLimit) && !this->DemoteColdWatches(*watchers, used + 1 - m_szWatchLimit, nullptr, std::chrono::milliseconds{ 0 }, false);
+				}
+
+				//budget: the kernel ran out, one more try after demoting others
+				for (int attempt = 0; !demoted; ++attempt)
+				{
+					const bool retry = budget && (attempt == 0);
+
+					//shared with other watches of the same directory, so only adds to its mask
+					auto wd = inotify_add_watch(m_iNotifyFD, pathStr.c_str(), dirInfo->m_u32Mask | IN_MASK_ADD);
+					if (wd == -1)
+					{
+						const int error = errno;
+
+						if (budget && (error == ENOSPC))
+						{
+							if (retry && this->DemoteColdWatches(*watchers, 1, nullptr, std::chrono::milliseconds{ 0 }, false))
+								continue;
+
+							demoted = true;
+							break;
+						}
+
+						std::stringstream stream;
+						stream << "[WatchFile] Cannot add watch: " << pathStr << ", error " << std::system_category().message(error);
+
+						//polling watches keep the thread, and so the fd, in use
+						if (watchers->IsEmpty() && (m_szPolling == 0) && !m_stOptions.m_fThreadless)
+						{
+							this->CloseINotify();					
+						}
+
+						throw std::invalid_argument(stream.str());
+					}
+
+					nodes.emplace_back(wd, std::string{});
+
+					if (!dirInfo->m_stOptions.m_fRecursive)
+						break;
+
+					const auto exhausted = WatchTree(m_iNotifyFD, dirInfo->m_strRoot, dirInfo->m_u32Mask, std::string{}, nodes, nullptr);
+					if (!budget || (exhausted == 0))
+						break;
+
+					//polled as a whole rather than missing directories
+					DropNewNodes(m_iNotifyFD, *watchers, nodes);
+					nodes.clear();
+
+					if (retry && this->DemoteColdWatches(*watchers, exhausted, nullptr, std::chrono::milliseconds{ 0 }, true))
+						continue;
+
+					demoted = true;
+				}
+			}
+
+			if (demoted)
+			{
+				dirInfo->m_fDemoted = true;
+				polling = tracking = true;
+
+				++m_szDemoted;
+				m_stMetrics.m_clDemotions.Add(1);
+			}
+
+			if (polling)
+			{
+				if (!m_upScanPool && (m_stOptions.m_szPollThreads > 0))
+					m_upScanPool = std::make_unique<ThreadPool>(m_stOptions.m_szPollThreads);
+
+				dirInfo->m_tPollInterval = dirInfo->m_stOptions.m_tPollInterval;
+			}
+
+			//scanned once published, so the monitor thread keeps what changes meanwhile
+			dirInfo->m_fScanPending = tracking;
+
+			for (auto &node : nodes)
+			{
+				if (AddSubscriber(*watchers, node.first, dirInfo, std::move(node.second)))
+					dirInfo->m_setWds.insert(node.first);
+			}
+
+			dirInfo->m_u64Id = g_u64NextId.fetch_add(1, std::memory_order_relaxed);
+			dirInfo->m_i64LastActivity = EventDispatcher::Now().count();
+
+			m_mapWatches.emplace(dirInfo->m_u64Id, dirInfo);
+
+			//subdirectories may have gone over our own limit, now their nodes show what is shared
+			if (budget && !polling)
+			{
+				const auto used = this->GetWatchUsage(*watchers);
+
+				if (used > m_szWatchLimit)
+					this->DemoteColdWatches(*watchers, used - m_szWatchLimit, dirInfo.get(), std::chrono::milliseconds{ 0 }, true);
+			}
+
+			if (!subscription)
+				m_mapPaths.emplace(std::move(key), dirInfo->m_u64Id);
+
+			//scheduled once scanned
+			if (polling)
+				++m_szPolling;
+			
+			this->PublishWatchers(std::move(watchers));
+
+			//
+			//start work thread? Anything left on the pipe by the last one is just drained
+			if (!m_stOptions.m_fThreadless && !m_thMonitorThread.joinable())
+			{
+				m_fWakePending = false;
+
+				m_thMonitorThread = std::thread{ m_upRing ? &State::ThreadProcUring : &State::ThreadProc, this };
+			}			
+
+			//demotions
+			const bool wake = m_fPendingWork;
+			const auto id = dirInfo->m_u64Id;
+
+			auto pool = m_upScanPool.get();
+
+			//a busy monitor thread needs the lock to take the work
+			lock.unlock();
+
+			if (wake)
+				this->WakeThread();
+
+			if (!tracking)
+				return id;
+
+			//
+			//Without the lock, a big tree would stop every other watch: the kernel watches are in place, so what
+			//changes while it is read is also seen by the monitor thread and applied to it
+			WatchScan scan;
+			scan.m_upSnapshot = std::make_unique<DirectorySnapshot>();
+			scan.m_upSnapshot->Scan(dirInfo->m_strRoot, dirInfo->m_stOptions.m_fRecursive, pool);
+
+			if (!dirInfo->m_stOptions.m_pthCheckpoint.empty())
+			{
+				DirectorySnapshot saved;
+
+				//first run or not ours: nothing to compare with
+				if (saved.Load(dirInfo->m_stOptions.m_pthCheckpoint.string(), dirInfo->m_strRoot, dirInfo->m_stOptions.m_fRecursive))
+				{
+					saved.Diff(*scan.m_upSnapshot, [&scan](const std::string &fileName, uint32_t action)
+					{
+						scan.m_vecChanges.emplace_back(fileName, action);
+					});
+				}
+			}
+
+			std::shared_ptr<const detail::IndexVersion> index;
+			if (dirInfo->m_stOptions.m_fKeepIndex)
+				index = scan.m_upSnapshot->GetIndex().Publish();
+
+			lock.lock();
+
+			//Unwatch already took it
+			if (dirInfo->m_fUnregistered)
+				return id;
+
+			//readable as soon as Watch returns, the monitor thread publishes it again with what it kept
+			if (index)
+				std::atomic_store(&dirInfo->m_spIndex, std::move(index));
+
+			scan.m_spMonitor = dirInfo;
+			m_vecScans.push_back(std::move(scan));
+
+			m_fPendingWork = true;
+
+			lock.unlock();
+
+			this->WakeThread();
+
+			return id;
+		}
+	}
+
+	void State::CheckThreadConflict() const
+	{
+		const auto tid = std::this_thread::get_id();
+
+		if ((tid == m_thMonitorThread.get_id()) || (tid == m_tidProcessing.load()))
+		{
+			//called from the callback? - not supported
+			throw std::logic_error("[[FileMonitor::UnwatchFile] Cannot remove watcher from the thread!");
+		}
+	}
+
+	/**
+	* Writes the last published index of dirInfo, returns false with errno set on failure
+	*
+	*/
+	static bool WriteCheckpoint(const DirectoryMonitor &dirInfo)
+	{
+		auto index = std::atomic_load(&dirInfo.m_spIndex);
+		if (!index)
+			return true;
+
+		return SaveCheckpoint(dirInfo.m_stOptions.m_pthCheckpoint.string(), dirInfo.m_strRoot, dirInfo.m_stOptions.m_fRecursive, *index);
+	}
+
+	void State::RemoveWatcher(std::shared_ptr<DirectoryMonitor> dirInfo, std::unique_lock<std::mutex> lock)
+	{						
+		auto watchers = std::make_shared<WatchersTable_t>(*this->GetWatchers());
+
+		//directories still used by other watches keep their kernel watch, with the mask of the ones left
+		std::vector<int> released;
+		std::vector<int> shared;
+
+		for (auto nodeWd : dirInfo->m_setWds)
+		{
+			if (RemoveSubscriber(*watchers, nodeWd, *dirInfo))
+				released.push_back(nodeWd);
+			else if (watchers->Find(nodeWd))
+				shared.push_back(nodeWd);
+		}
+
+		m_mapWatches.erase(dirInfo->m_u64Id);
+
+		if (dirInfo->m_stOptions.m_fPolling || dirInfo->m_fDemoted)
+			--m_szPolling;
+
+		//the demotion removed its kernel watches, the nodes left are waiting for their IN_IGNORED
+		if (dirInfo->m_fDemoted)
+		{
+			m_szDemotedWds -= dirInfo->m_setWds.size();
+			--m_szDemoted;
+
+			released.clear();
+		}
+
+		auto it = m_mapPaths.find(NormalizePath(dirInfo->m_pthPath));
+		if ((it != m_mapPaths.end()) && (it->second == dirInfo->m_u64Id))
+			m_mapPaths.erase(it);
+
+		dirInfo->m_fUnregistered = true;
+		
+		const bool empty = watchers->IsEmpty() && (m_szPolling == 0);
+		this->PublishWatchers(std::move(watchers));
+
+		//the thread is stopping, anything it did not take is from removed watches
+		if (empty)
+		{
+			m_vecScans.clear();
+			m_vecDemotions.clear();
+
+			m_fPendingWork = false;
+		}
+
+		//after publishing, so the IN_IGNORED generated by it is never matched to the removed watcher
+		for (auto nodeWd : released)
+			inotify_rm_watch(m_iNotifyFD, nodeWd);
+
+		if (!shared.empty())
+		{
+			auto published = this->GetWatchers();
+
+			for (auto nodeWd : shared)
+				ShrinkMask(m_iNotifyFD, *published, nodeWd);
+		}
+
+		dirInfo->m_setWds.clear();
+
+		if (empty && !m_stOptions.m_fThreadless)
+		{
+			//notify the thread...
+			if (m_upRing)
+			{
+				std::lock_guard ringLock{ m_clRingLock };
+
+				this->SubmitRingRequest(IORING_OP_NOP, URING_STOP);
+			}
+			else
+			{
+				write(m_arPipefd[1], "c", 1);
+			}
+
+			lock.unlock();
+						
+			m_thMonitorThread.join();
+
+			this->CloseINotify();
+		}
+		else
+		{
+			lock.unlock();
+		}
+
+		//best effort, there is no one to report it to, the next Watch just sees more changes
+		if (!dirInfo->m_stOptions.m_pthCheckpoint.empty())
+			WriteCheckpoint(*dirInfo);
+
+		//called from its own callback on an executor thread? We already own the dispatch lock
+		if (dirInfo->m_tidDispatcher.load() == std::this_thread::get_id())
+		{
+			dirInfo->m_fRemoved = true;
+
+			return;
+		}
+
+		//
+		//The monitor thread or the executor may still be dispatching, so wait for any running callback 
+		//of this watcher (and only of this watcher) and make sure no new ones are started
+		std::lock_guard dispatchLock{ dirInfo->m_clDispatchLock };
+
+		dirInfo->m_fRemoved = true;
+	}
+
+	bool State::Unwatch(const fs::path &path)
+	{
+		this->CheckThreadConflict();
+
+		std::unique_lock lock{m_clLock};
+
+		auto dirInfo = this->TryFindDirectory(path);
+
+		if (!dirInfo)
+			return false;
+
+		this->RemoveWatcher(std::move(dirInfo), std::move(lock));
+
+		return true;
+	}
+
+	bool State::Unwatch(uint64_t id)
+	{
+		this->CheckThreadConflict();
+
+		std::unique_lock lock{m_clLock};
+
+		auto it = m_mapWatches.find(id);
+
+		if (it == m_mapWatches.end())
+			return false;
+
+		this->RemoveWatcher(it->second, std::move(lock));
+
+		return true;
+	}
+
+	size_t State::DemoteColdWatches(const WatchersTable_t &watchers, size_t count, const DirectoryMonitor *keep, std::chrono::milliseconds minIdle, bool partial)
+	{
+		const auto idleSince = (EventDispatcher::Now() - minIdle).count();
+
+		//times copied, the monitor thread keeps changing them
+		std::vector<std::pair<int64_t, DirectoryMonitor *>> candidates;
+
+		for (auto &it : m_mapWatches)
+		{
+			auto &dirInfo = *it.second;
+
+			//still being scanned by Watch, the scan would not be the baseline of the polls
+			if ((&dirInfo == keep) || dirInfo.m_fDemoted || dirInfo.m_fScanPending || dirInfo.m_stOptions.m_fPolling || dirInfo.m_setWds.empty() || !dirInfo.CanPoll())
+				continue;
+
+			const auto lastActivity = dirInfo.m_i64LastActivity.load(std::memory_order_relaxed);
+			if (lastActivity > idleSince)
+				continue;
+
+			//a kernel watch shared with other subscribers would not be freed
+			const bool exclusive = std::all_of(dirInfo.m_setWds.begin(), dirInfo.m_setWds.end(), [&watchers](int wd)
+			{
+				auto node = watchers.Find(wd);
+
+				return (node != nullptr) && (node->m_vecSubscribers.size() == 1);
+			});
+
+			if (exclusive)
+				candidates.emplace_back(lastActivity, &dirInfo);
+		}
+
+		//coldest first
+		std::sort(candidates.begin(), candidates.end(), [](const auto &a, const auto &b)
+		{
+			return a.first < b.first;
+		});
+
+		size_t freed = 0;
+		size_t numVictims = 0;
+
+		while ((numVictims < candidates.size()) && (freed < count))
+			freed += candidates[numVictims++].second->m_setWds.size();
+
+		if ((freed == 0) || ((freed < count) && !partial))
+			return 0;
+
+		if (!m_upScanPool && (m_stOptions.m_szPollThreads > 0))
+			m_upScanPool = std::make_unique<ThreadPool>(m_stOptions.m_szPollThreads);
+
+		for (size_t i = 0; i < numVictims; ++i)
+		{
+			auto &dirInfo = *candidates[i].second;
+
+			//set first, so the monitor thread drops the nodes on their IN_IGNORED
+			dirInfo.m_fDemoted = true;
+
+			for (auto wd : dirInfo.m_setWds)
+				inotify_rm_watch(m_iNotifyFD, wd);
+
+			m_szDemotedWds += dirInfo.m_setWds.size();
+
+			++m_szDemoted;
+			++m_szPolling;
+
+			m_stMetrics.m_clDemotions.Add(1);
+
+			m_vecDemotions.push_back(dirInfo.shared_from_this());
+		}
+
+		m_fPendingWork = true;
+
+		return freed;
+	}
+
+	bool State::PromoteWatch(DirectoryMonitor &dirInfo, size_t directories)
+	{
+		std::lock_guard lock{m_clLock};
+
+		//removed or the IN_IGNORED of its old kernel watches still on the way
+		if (dirInfo.m_fUnregistered || !dirInfo.m_setWds.empty())
+			return false;
+
+		auto watchers = std::make_shared<WatchersTable_t>(*this->GetWatchers());
+
+		const auto used = this->GetWatchUsage(*watchers);
+
+		//only watches that are cold for a while make room, so two watches do not keep swapping
+		if ((used + directories > m_szWatchLimit) && !this->DemoteColdWatches(*watchers, used + directories - m_szWatchLimit, &dirInfo, m_stOptions.m_tColdAfter, false))
+			return false;
+
+		auto wd = inotify_add_watch(m_iNotifyFD, dirInfo.m_strRoot.c_str(), dirInfo.m_u32Mask | IN_MASK_ADD);
+		if (wd == -1)
+		{
+			//other programs took them or it is gone, the polls report it
+			return false;
+		}
+
+		NewNodes_t nodes;
+		nodes.emplace_back(wd, std::string{});
+
+		if (dirInfo.m_stOptions.m_fRecursive && WatchTree(m_iNotifyFD, dirInfo.m_strRoot, dirInfo.m_u32Mask, std::string{}, nodes, nullptr))
+		{
+			DropNewNodes(m_iNotifyFD, *watchers, nodes);
+
+			return false;
+		}
+
+		auto self = dirInfo.shared_from_this();
+
+		for (auto &node : nodes)
+		{
+			if (AddSubscriber(*watchers, node.first, self, std::move(node.second)))
+				dirInfo.m_setWds.insert(node.first);
+		}
+
+		dirInfo.m_fDemoted = false;
+
+		--m_szDemoted;
+		--m_szPolling;
+
+		this->PublishWatchers(std::move(watchers));
+
+		return true;
+	}
+
+	void State::WakeThread()
+	{
+		//threadless: GetTimeout already returns 0
+		if (m_stOptions.m_fThreadless || m_fWakePending.exchange(true))
+			return;
+
+		if (m_upRing)
+		{
+			std::lock_guard ringLock{ m_clRingLock };
+
+			this->SubmitRingRequest(IORING_OP_NOP, URING_WAKE);
+		}
+		else
+		{
+			write(m_arPipefd[1], "w", 1);
+		}
+	}
+
+	void State::Checkpoint()
+	{
+		std::vector<std::shared_ptr<DirectoryMonitor>> watches;
+
+		{
+			std::lock_guard lock{m_clLock};
+
+			for (auto &it : m_mapWatches)
+			{
+				if (!it.second->m_stOptions.m_pthCheckpoint.empty())
+					watches.push_back(it.second);
+			}
+		}
+
+		//files are written without the lock, so Watch and Unwatch are not blocked by them
+		std::stringstream errors;
+
+		for (auto &dirInfo : watches)
+		{
+			if (!WriteCheckpoint(*dirInfo))
+				errors << ' ' << dirInfo->m_stOptions.m_pthCheckpoint << ": " << std::system_category().message(errno);
+		}
+
+		if (errors.tellp() > 0)
+		{
+			std::stringstream stream;
+			stream << "[Monitor::Checkpoint] Cannot write checkpoint:" << errors.str();
+
+			throw std::runtime_error(stream.str());
+		}
+	}
+
+	std::shared_ptr<const detail::IndexVersion> State::FindIndex(const fs::path &path)
+	{
+		std::lock_guard lock{m_clLock};
+
+		auto dirInfo = this->TryFindDirectory(path);
+
+		return dirInfo ? std::atomic_load(&dirInfo->m_spIndex) : nullptr;
+	}
+
+	std::shared_ptr<const detail::IndexVersion> State::FindIndex(uint64_t id)
+	{
+		std::lock_guard lock{m_clLock};
+
+		auto it = m_mapWatches.find(id);
+
+		return it != m_mapWatches.end() ? std::atomic_load(&it->second->m_spIndex) : nullptr;
+	}
+
+	WatchMetrics State::GetWatchMetrics(const fs::path &path)
+	{
+		std::lock_guard lock{m_clLock};
+
+		WatchMetrics metrics;
+
+		if (auto dirInfo = this->TryFindDirectory(path))
+			dirInfo->m_stCounters.CopyTo(metrics);
+
+		return metrics;
+	}
+
+	WatchMetrics State::GetWatchMetrics(uint64_t id)
+	{
+		std::lock_guard lock{m_clLock};
+
+		WatchMetrics metrics;
+
+		auto it = m_mapWatches.find(id);
+		if (it != m_mapWatches.end())
+			it->second->m_stCounters.CopyTo(metrics);
+
+		return metrics;
+	}
+
+	//
+	//
+	// Monitor
+	//
+	//
+
+	struct Monitor::Impl: State
+	{
+		using State::State;
+	};
+
+	Monitor::Monitor(const MonitorOptions &options) :
+		m_upImpl{ std::make_unique<Impl>(options) }
+	{
+		//empty
+	}
+
+	Monitor::~Monitor() = default;
+
+	void Monitor::Watch(const fs::path &path, Callback_t callback, const uint32_t action, const WatchOptions &options)
+	{
+		m_upImpl->AddWatcher(path, std::make_shared<DirectoryMonitor>(path, std::move(callback), action, options));
+	}
+
+	void Monitor::WatchBatch(const fs::path &path, BatchCallback_t callback, const uint32_t action, const WatchOptions &options)
+	{
+		m_upImpl->AddWatcher(path, std::make_shared<DirectoryMonitor>(path, std::move(callback), action, options));
+	}
+
+	void Monitor::WatchEvents(const fs::path &path, EventCallback_t callback, const uint32_t action, const WatchOptions &options)
+	{
+		m_upImpl->AddWatcher(path, std::make_shared<DirectoryMonitor>(path, std::move(callback), action, options));
+	}
+
+	static inline EventCallback_t MakeQueueCallback(std::shared_ptr<EventQueue> queue, uint32_t source)
+	{
+		return [queue = std::move(queue), source](const Event &event) { queue->Push(event, source); };
+	}
+
+	void Monitor::WatchQueue(const fs::path &path, std::shared_ptr<EventQueue> queue, const uint32_t action, const WatchOptions &options, uint32_t source)
+	{
+		this->WatchEvents(path, MakeQueueCallback(std::move(queue), source), action, options);
+	}
+
+	Subscription Monitor::Subscribe(const fs::path &path, Callback_t callback, const uint32_t action, const WatchOptions &options)
+	{
+		return Subscription{ m_upImpl->AddWatcher(path, std::make_shared<DirectoryMonitor>(path, std::move(callback), action, options), true) };
+	}
+
+	Subscription Monitor::SubscribeBatch(const fs::path &path, BatchCallback_t callback, const uint32_t action, const WatchOptions &options)
+	{
+		return Subscription{ m_upImpl->AddWatcher(path, std::make_shared<DirectoryMonitor>(path, std::move(callback), action, options), true) };
+	}
+
+	Subscription Monitor::SubscribeEvents(const fs::path &path, EventCallback_t callback, const uint32_t action, const WatchOptions &options)
+	{
+		return Subscription{ m_upImpl->AddWatcher(path, std::make_shared<DirectoryMonitor>(path, std::move(callback), action, options), true) };
+	}
+
+	bool Monitor::Unwatch(const fs::path &path)
+	{
+		return m_upImpl->Unwatch(path);
+	}
+
+	bool Monitor::Unwatch(const Subscription &subscription)
+	{
+		return m_upImpl->Unwatch(subscription.m_u64Id);
+	}
+
+	IndexSnapshot Monitor::GetIndex(const fs::path &path) const
+	{
+		return IndexSnapshot{ m_upImpl->FindIndex(path) };
+	}
+
+	IndexSnapshot Monitor::GetIndex(const Subscription &subscription) const
+	{
+		return IndexSnapshot{ m_upImpl->FindIndex(subscription.m_u64Id) };
+	}
+
+	MonitorMetrics Monitor::GetMetrics() const
+	{
+		MonitorMetrics metrics;
+
+		m_upImpl->m_stMetrics.CopyTo(metrics);
+
+		return metrics;
+	}
+
+	WatchMetrics Monitor::GetMetrics(const fs::path &path) const
+	{
+		return m_upImpl->GetWatchMetrics(path);
+	}
+
+	WatchMetrics Monitor::GetMetrics(const Subscription &subscription) const
+	{
+		return m_upImpl->GetWatchMetrics(subscription.m_u64Id);
+	}
+
+	WatchBudget Monitor::GetWatchBudget() const
+	{
+		std::lock_guard lock{ m_upImpl->m_clLock };
+
+		WatchBudget budget;
+
+		budget.m_szLimit = m_upImpl->m_szWatchLimit;
+		budget.m_szUsed = m_upImpl->GetWatchUsage(*m_upImpl->GetWatchers());
+		budget.m_szDemoted = m_upImpl->m_szDemoted;
+
+		return budget;
+	}
+
+	void Monitor::Checkpoint() const
+	{
+		m_upImpl->Checkpoint();
+	}
+
+	bool Monitor::DumpTrace([[maybe_unused]] const fs::path &path, [[maybe_unused]] TraceFormat format) const
+	{
+#ifdef LDMONITOR_TRACE
+		if (!WriteTrace(path.string(), m_upImpl->m_clTrace.Read(), format))
+		{
+			std::stringstream stream;
+
+			stream << "[Monitor::DumpTrace] Cannot write trace: " << path;
+
+			throw std::runtime_error(stream.str());
+		}
+
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	bool Monitor::IsRunning() const
+	{
+		return !m_upImpl->GetWatchers()->IsEmpty() || (m_upImpl->m_szPolling > 0);
+	}
+
+	bool Monitor::IsUsingIoUring() const noexcept
+	{
+		return m_upImpl->m_upRing != nullptr;
+	}
+
+	static void CheckThreadless(const MonitorOptions &options, const char *func)
+	{
+		if (!options.m_fThreadless)
+		{
+			std::stringstream stream;
+			stream << "[" << func << "] Monitor does not have MonitorOptions::m_fThreadless set";
+
+			throw std::logic_error(stream.str());
+		}
+	}
+
+	int Monitor::GetFileDescriptor() const
+	{
+		CheckThreadless(m_upImpl->m_stOptions, "Monitor::GetFileDescriptor");
+
+		return m_upImpl->m_iNotifyFD;
+	}
+
+	size_t Monitor::ProcessEvents(size_t maxEvents)
+	{
+		CheckThreadless(m_upImpl->m_stOptions, "Monitor::ProcessEvents");
+
+		return m_upImpl->ProcessEvents(maxEvents);
+	}
+
+	int Monitor::GetTimeout() const
+	{
+		CheckThreadless(m_upImpl->m_stOptions, "Monitor::GetTimeout");
+
+		return m_upImpl->GetTimeout();
+	}
+
+	//
+	//
+	// ShardedMonitor
+	//
+	//
+
+	ShardedMonitor::ShardedMonitor(size_t numShards, const MonitorOptions &options)
+	{
+		if (numShards == 0)
+			numShards = std::max(1u, std::thread::hardware_concurrency());
+
+		m_vecShards.reserve(numShards);
+
+		for (size_t i = 0; i < numShards; ++i)
+			m_vecShards.push_back(std::make_unique<Monitor>(options));
+
+		if (!options.m_fThreadless)
+			return;
+
+		m_iEpollFD = epoll_create1(EPOLL_CLOEXEC);
+		if (m_iEpollFD == -1)
+		{
+			std::stringstream stream;
+			stream << "[ShardedMonitor::ShardedMonitor] Cannot create epoll instance: " << std::system_category().message(errno);
+
+			throw std::runtime_error(stream.str());
+		}
+
+		for (size_t i = 0; i < numShards; ++i)
+		{
+			epoll_event ev = {};
+			ev.events = EPOLLIN;
+			ev.data.u64 = i;
+
+			if (epoll_ctl(m_iEpollFD, EPOLL_CTL_ADD, m_vecShards[i]->GetFileDescriptor(), &ev) == -1)
+			{
+				std::stringstream stream;
+				stream << "[ShardedMonitor::ShardedMonitor] Cannot add shard to epoll: " << std::system_category().message(errno);
+
+				close(m_iEpollFD);
+
+				throw std::runtime_error(stream.str());
+			}
+		}
+	}
+
+	ShardedMonitor::~ShardedMonitor()
+	{
+		if (m_iEpollFD != -1)
+			close(m_iEpollFD);
+	}
+
+	int ShardedMonitor::GetFileDescriptor() const
+	{
+		if (m_iEpollFD == -1)
+			throw std::logic_error("[ShardedMonitor::GetFileDescriptor] Monitor does not have MonitorOptions::m_fThreadless set");
+
+		return m_iEpollFD;
+	}
+
+	MonitorMetrics ShardedMonitor::GetMetrics() const
+	{
+		MonitorMetrics metrics;
+
+		for (auto &shard : m_vecShards)
+			metrics.Merge(shard->GetMetrics());
+
+		return metrics;
+	}
+
+	size_t ShardedMonitor::ProcessEvents(size_t maxEvents)
+	{
+		if (m_iEpollFD == -1)
+			throw std::logic_error("[ShardedMonitor::ProcessEvents] Monitor does not have MonitorOptions::m_fThreadless set");
+
+		size_t processed = 0;
+
+		//shards with events on the kernel queue
+		epoll_event events[64];
+
+		auto numReady = epoll_wait(m_iEpollFD, events, 64, 0);
+		for (int i = 0; (i < numReady) && (processed < maxEvents); ++i)
+			processed += m_vecShards[events[i].data.u64]->ProcessEvents(maxEvents - processed);
+
+		//shards with timers due or with events left from a previous call
+		for (size_t i = 0; (i < m_vecShards.size()) && (processed < maxEvents); ++i)
+		{
+			if (m_vecShards[i]->GetTimeout() == 0)
+				processed += m_vecShards[i]->ProcessEvents(maxEvents - processed);
+		}
+
+		return processed;
+	}
+
+	int ShardedMonitor::GetTimeout() const
+	{
+		int timeout = -1;
+
+		for (auto &shard : m_vecShards)
+		{
+			auto shardTimeout = shard->GetTimeout();
+
+			if ((shardTimeout >= 0) && ((timeout < 0) || (shardTimeout < timeout)))
+				timeout = shardTimeout;
+		}
+
+		return timeout;
+	}
+
+	size_t ShardedMonitor::GetShard(const fs::path &path) const
+	{
+		return std::hash<std::string>{}(NormalizePath(path)) % m_vecShards.size();
+	}
+
+	template <typename F>
+	void ShardedMonitor::AddToShard(size_t shard, const fs::path &path, const F &watch)
+	{
+		if (shard >= m_vecShards.size())
+		{
+			std::stringstream stream;
+			stream << "[ShardedMonitor::Watch] Invalid shard " << shard << " for " << path << ", number of shards: " << m_vecShards.size();
+
+			throw std::out_of_range(stream.str());
+		}
+
+		auto key = NormalizePath(path);
+
+		{
+			std::lock_guard lock{ m_clLock };
+
+			//checked here, another shard would accept it
+			if (!m_mapShards.emplace(key, shard).second)
+			{
+				std::stringstream stream;
+				stream << "[ShardedMonitor::Watch] Directory already has a watcher: " << path;
+
+				throw std::invalid_argument(stream.str());
+			}
+		}
+
+		try
+		{
+			watch(*m_vecShards[shard]);
+		}
+		catch (...)
+		{
+			std::lock_guard lock{ m_clLock };
+
+			m_mapShards.erase(key);
+
+			throw;
+		}
+	}
+
+	void ShardedMonitor::Watch(const fs::path &path, Callback_t callback, const uint32_t action, const WatchOptions &options)
+	{
+		this->Watch(this->GetShard(path), path, std::move(callback), action, options);
+	}
+
+	void ShardedMonitor::WatchBatch(const fs::path &path, BatchCallback_t callback, const uint32_t action, const WatchOptions &options)
+	{
+		this->WatchBatch(this->GetShard(path), path, std::move(callback), action, options);
+	}
+
+	void ShardedMonitor::Watch(size_t shard, const fs::path &path, Callback_t callback, const uint32_t action, const WatchOptions &options)
+	{
+		this->AddToShard(shard, path, [&](Monitor &monitor)
+		{
+			monitor.Watch(path, std::move(callback), action, options);
+		});
+	}
+
+	void ShardedMonitor::WatchBatch(size_t shard, const fs::path &path, BatchCallback_t callback, const uint32_t action, const WatchOptions &options)
+	{
+		this->AddToShard(shard, path, [&](Monitor &monitor)
+		{
+			monitor.WatchBatch(path, std::move(callback), action, options);
+		});
+	}
+
+	void ShardedMonitor::WatchEvents(const fs::path &path, EventCallback_t callback, const uint32_t action, const WatchOptions &options)
+	{
+		this->WatchEvents(this->GetShard(path), path, std::move(callback), action, options);
+	}
+
+	void ShardedMonitor::WatchEvents(size_t shard, const fs::path &path, EventCallback_t callback, const uint32_t action, const WatchOptions &options)
+	{
+		this->AddToShard(shard, path, [&](Monitor &monitor)
+		{
+			monitor.WatchEvents(path, std::move(callback), action, options);
+		});
+	}
+
+	void ShardedMonitor::WatchQueue(const fs::path &path, std::shared_ptr<EventQueue> queue, const uint32_t action, const WatchOptions &options, uint32_t source)
+	{
+		this->WatchQueue(this->GetShard(path), path, std::move(queue), action, options, source);
+	}
+
+	void ShardedMonitor::WatchQueue(size_t shard, const fs::path &path, std::shared_ptr<EventQueue> queue, const uint32_t action, const WatchOptions &options, uint32_t source)
+	{
+		this->WatchEvents(shard, path, MakeQueueCallback(std::move(queue), source), action, options);
+	}
+
+	bool ShardedMonitor::Unwatch(const fs::path &path)
+	{
+		size_t shard;
+
+		{
+			std::lock_guard lock{ m_clLock };
+
+			auto it = m_mapShards.find(NormalizePath(path));
+			if (it == m_mapShards.end())
+				return false;
+
+			shard = it->second;
+			m_mapShards.erase(it);
+		}
+
+		//without the lock, it waits for running callbacks and those may call us
+		return m_vecShards[shard]->Unwatch(path);
+	}
+
+	//
+	//
+	// Default instance used by the free functions
+	//
+	//
+
+	static Monitor g_DefaultMonitor;
+
+	void Watch(const fs::path &path, Callback_t callback, uint32_t flags)
+	{
+		g_DefaultMonitor.Watch(path, std::move(callback), flags);
+	}
+
+	void WatchBatch(const fs::path &path, BatchCallback_t callback, uint32_t flags)
+	{
+		g_DefaultMonitor.WatchBatch(path, std::move(callback), flags);
+	}
+
+	void Watch(const fs::path &path, Callback_t callback, uint32_t flags, const WatchOptions &options)
+	{
+		g_DefaultMonitor.Watch(path, std::move(callback), flags, options);
+	}
+
+	void WatchBatch(const fs::path &path, BatchCallback_t callback, uint32_t flags, const WatchOptions &options)
+	{
+		g_DefaultMonitor.WatchBatch(path, std::move(callback), flags, options);
+	}
+
+	void WatchEvents(const fs::path &path, EventCallback_t callback, uint32_t flags, const WatchOptions &options)
+	{
+		g_DefaultMonitor.WatchEvents(path, std::move(callback), flags, options);
+	}
+
+	void WatchQueue(const fs::path &path, std::shared_ptr<EventQueue> queue, uint32_t flags, const WatchOptions &options, uint32_t source)
+	{
+		g_DefaultMonitor.WatchQueue(path, std::move(queue), flags, options, source);
+	}
+
+	bool Unwatch(const fs::path &path)
+	{
+		return g_DefaultMonitor.Unwatch(path);
+	}
+
+	namespace detail
+	{
+		std::optional<bool> IsThreadWaiting(const fs::path &path)
+		{
+			return g_DefaultMonitor.IsRunning();
 		}
 	}
-}
+}
\ No newline at end of file
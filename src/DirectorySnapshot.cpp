@@ -0,0 +1,284 @@
+// Copyright (C) 2023 - Bruno Sanches. See the COPYRIGHT
+// file at the top-level directory of this distribution.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+//
+// This Source Code Form is "Incompatible With Secondary Licenses", as
+// defined by the Mozilla Public License, v. 2.0.
+
+#include "DirectorySnapshot.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "Checkpoint.h"
+#include "DirectoryMonitor.h"
+
+namespace ldmonitor
+{
+	//glibc has no wrapper for getdents64 before 2.30
+	struct Dirent64
+	{
+		uint64_t		d_ino;
+		int64_t			d_off;
+		unsigned short	d_reclen;
+		unsigned char	d_type;
+		char			d_name[1];
+	};
+
+	static constexpr size_t DIRENT_BUFFER = 64 * 1024;
+
+	//directories smaller than this are not worth waking the pool
+	static constexpr size_t PARALLEL_STAT_MIN = 2048;
+	static constexpr size_t STAT_BATCH = 512;
+
+	static inline IndexEntry MakeEntry(std::string name, const struct stat &st) noexcept
+	{
+		IndexEntry info;
+
+		info.m_strName = std::move(name);
+		info.m_u64Inode = st.st_ino;
+		info.m_u64Size = st.st_size;
+		info.m_i64ModifiedTime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+		info.m_fDirectory = S_ISDIR(st.st_mode);
+
+		return info;
+	}
+
+	static inline bool SameState(const IndexEntry &lhs, const IndexEntry &rhs) noexcept
+	{
+		return (lhs.m_u64Inode == rhs.m_u64Inode) && (lhs.m_u64Size == rhs.m_u64Size) && (lhs.m_i64ModifiedTime == rhs.m_i64ModifiedTime) && (lhs.m_fDirectory == rhs.m_fDirectory);
+	}
+
+	/**
+	* Reads all names of the directory with getdents64, fewer and bigger reads than readdir
+	*
+	*/
+	static void ReadNames(int fd, std::vector<char> &buffer, std::vector<IndexEntry> &entries)
+	{
+		for (;;)
+		{
+			auto len = syscall(SYS_getdents64, fd, buffer.data(), buffer.size());
+			if (len <= 0)
+			{
+				//interrupted or removed while reading, keep what we got
+				if ((len == -1) && (errno == EINTR))
+					continue;
+
+				return;
+			}
+
+			for (long pos = 0; pos < len;)
+			{
+				auto entry = reinterpret_cast<const Dirent64 *>(buffer.data() + pos);
+				pos += entry->d_reclen;
+
+				const char *name = entry->d_name;
+				if ((name[0] == '.') && ((name[1] == '\0') || ((name[1] == '.') && (name[2] == '\0'))))
+					continue;
+
+				entries.emplace_back().m_strName = name;
+			}
+		}
+	}
+
+	/**
+	* Fills the entries in [begin, end), names still relative to fd, the ones gone while reading get an empty name
+	*
+	*/
+	static void StatNames(int fd, IndexEntry *begin, IndexEntry *end)
+	{
+		struct statx st;
+
+		for (auto entry = begin; entry != end; ++entry)
+		{
+			if (statx(fd, entry->m_strName.c_str(), AT_SYMLINK_NOFOLLOW, STATX_TYPE | STATX_INO | STATX_SIZE | STATX_MTIME, &st) != 0)
+			{
+				entry->m_strName.clear();
+
+				continue;
+			}
+
+			entry->m_u64Inode = st.stx_ino;
+			entry->m_u64Size = st.stx_size;
+			entry->m_i64ModifiedTime = static_cast<int64_t>(st.stx_mtime.tv_sec) * 1000000000 + st.stx_mtime.tv_nsec;
+			entry->m_fDirectory = S_ISDIR(st.stx_mode);
+		}
+	}
+
+	/**
+	* StatNames for all entries, big directories are split in batches shared with the pool threads
+	*
+	*/
+	static void StatNames(int fd, std::vector<IndexEntry> &entries, ThreadPool *pool)
+	{
+		const size_t numBatches = (entries.size() + STAT_BATCH - 1) / STAT_BATCH;
+
+		if ((pool == nullptr) || (entries.size() < PARALLEL_STAT_MIN))
+		{
+			StatNames(fd, entries.data(), entries.data() + entries.size());
+
+			return;
+		}
+
+		struct Shared
+		{
+			std::atomic<size_t>		m_szNextBatch = 0;
+
+			std::mutex				m_clLock;
+			std::condition_variable	m_clDone;
+			size_t					m_szRunning = 0;
+		} shared;
+
+		//everyone, this thread included, takes batches until there are none left
+		auto work = [fd, &entries, &shared, numBatches]()
+		{
+			for (;;)
+			{
+				const auto batch = shared.m_szNextBatch.fetch_add(1, std::memory_order_relaxed);
+				if (batch >= numBatches)
+					return;
+
+				auto begin = entries.data() + batch * STAT_BATCH;
+				StatNames(fd, begin, std::min(begin + STAT_BATCH, entries.data() + entries.size()));
+			}
+		};
+
+		const auto numHelpers = std::min(pool->GetNumThreads(), numBatches - 1);
+		shared.m_szRunning = numHelpers;
+
+		for (size_t i = 0; i < numHelpers; ++i)
+		{
+			pool->Post([&work, &shared]()
+			{
+				work();
+
+				std::lock_guard lock{ shared.m_clLock };
+
+				if (--shared.m_szRunning == 0)
+					shared.m_clDone.notify_one();
+			});
+		}
+
+		work();
+
+		//helpers reference our stack
+		std::unique_lock lock{ shared.m_clLock };
+		shared.m_clDone.wait(lock, [&shared]() { return shared.m_szRunning == 0; });
+	}
+
+	void DirectorySnapshot::Scan(const std::string &root, bool recursive, ThreadPool *pool)
+	{
+		m_clIndex.Clear();
+
+		std::vector<std::string> pending;
+		pending.emplace_back();
+
+		std::string fullPath;
+
+		std::vector<char> buffer(DIRENT_BUFFER);
+		std::vector<IndexEntry> entries;
+
+		while (!pending.empty())
+		{
+			auto current = std::move(pending.back());
+			pending.pop_back();
+
+			fullPath = root;
+			fullPath.append(current);
+
+			const int fd = open(fullPath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			if (fd == -1)
+				continue;
+
+			entries.clear();
+
+			ReadNames(fd, buffer, entries);
+			StatNames(fd, entries, pool);
+
+			close(fd);
+
+			for (auto &entry : entries)
+			{
+				//gone while we were reading
+				if (entry.m_strName.empty())
+					continue;
+
+				entry.m_strName.insert(0, current);
+
+				if (recursive && entry.m_fDirectory)
+					pending.push_back(entry.m_strName + '/');
+
+				m_clIndex.Set(std::move(entry));
+			}
+		}
+	}
+
+	bool DirectorySnapshot::Load(const std::string &path, const std::string &root, bool recursive)
+	{
+		return LoadCheckpoint(path, root, recursive, m_clIndex);
+	}
+
+	void DirectorySnapshot::Update(const std::string &root, const std::string &fileName)
+	{
+		struct stat st;
+
+		if (fstatat(AT_FDCWD, (root + fileName).c_str(), &st, AT_SYMLINK_NOFOLLOW) != 0)
+		{
+			m_clIndex.Erase(fileName);
+
+			return;
+		}
+
+		m_clIndex.Set(MakeEntry(fileName, st));
+	}
+
+	void DirectorySnapshot::Erase(const std::string &fileName)
+	{
+		auto entry = m_clIndex.Find(fileName);
+		if (entry == nullptr)
+			return;
+
+		const bool directory = entry->m_fDirectory;
+		m_clIndex.Erase(fileName);
+
+		if (directory)
+			m_clIndex.ErasePrefix(fileName + '/');
+	}
+
+	void DirectorySnapshot::Diff(const DirectorySnapshot &current, const DiffCallback_t &callback) const
+	{
+		m_clIndex.ForEach([&current, &callback](const IndexEntry &entry)
+		{
+			if (!current.m_clIndex.Find(entry.m_strName))
+				callback(entry.m_strName, MONITOR_ACTION_FILE_DELETE);
+		});
+
+		current.m_clIndex.ForEach([this, &callback](const IndexEntry &entry)
+		{
+			auto previous = m_clIndex.Find(entry.m_strName);
+
+			if (previous == nullptr)
+			{
+				callback(entry.m_strName, MONITOR_ACTION_FILE_CREATE);
+			}
+			else if (!SameState(*previous, entry))
+			{
+				//directory times change with its contents, those are reported on their own
+				if (!entry.m_fDirectory || !previous->m_fDirectory)
+					callback(entry.m_strName, MONITOR_ACTION_FILE_MODIFY);
+			}
+		});
+	}
+}
@@ -0,0 +1,80 @@
+// Copyright (C) 2023 - Bruno Sanches. See the COPYRIGHT
+// file at the top-level directory of this distribution.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+//
+// This Source Code Form is "Incompatible With Secondary Licenses", as
+// defined by the Mozilla Public License, v. 2.0.
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+
+#include "DirectoryIndex.h"
+
+namespace ldmonitor
+{
+	/**
+	* Last known state of a watched directory, names relative to the watch root
+	*
+	* Kept up to date from the events, so after events are lost it can be compared with a fresh scan. The
+	* entries are kept on a DirectoryIndex, so they can also be published to readers on other threads.
+	*
+	*/
+	class DirectorySnapshot
+	{
+		public:
+			typedef std::function<void(const std::string &fileName, uint32_t action)> DiffCallback_t;
+
+			/**
+			* Reads the directory (and its subdirectories if recursive), root must end with '/'
+			*
+			* Names are read with getdents64 and stated with statx relative to the directory, when a pool is given
+			* big directories have the stats split between its threads and the caller.
+			*
+			*/
+			void Scan(const std::string &root, bool recursive, ThreadPool *pool = nullptr);
+
+			/**
+			* Replaces the entries with a checkpoint of root, returns false if there is no valid one
+			*
+			*/
+			bool Load(const std::string &path, const std::string &root, bool recursive);
+
+			/**
+			* Stats fileName and stores it, or removes it if does not exist anymore
+			*
+			*/
+			void Update(const std::string &root, const std::string &fileName);
+
+			/**
+			* Removes fileName and, if it is a directory, everything bellow it
+			*
+			*/
+			void Erase(const std::string &fileName);
+
+			/**
+			* Reports what changed from this to current as MONITOR_ACTION_FILE_* actions
+			*
+			*/
+			void Diff(const DirectorySnapshot &current, const DiffCallback_t &callback) const;
+
+			inline const DirectoryIndex &GetIndex() const noexcept
+			{
+				return m_clIndex;
+			}
+
+			inline size_t GetSize() const noexcept
+			{
+				return m_clIndex.GetSize();
+			}
+
+		private:
+			DirectoryIndex m_clIndex;
+	};
+}
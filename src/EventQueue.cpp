@@ -0,0 +1,448 @@
+// Copyright (C) 2023 - Bruno Sanches. See the COPYRIGHT
+// file at the top-level directory of this distribution.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+//
+// This Source Code Form is "Incompatible With Secondary Licenses", as
+// defined by the Mozilla Public License, v. 2.0.
+
+#include <atomic>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <unordered_map>
+
+#include "Coalescer.h"
+#include "DirectoryMonitor.h"
+
+namespace ldmonitor
+{
+	//keeps the positions and each slot header on their own cache lines
+	static constexpr size_t CACHE_LINE = 64;
+
+	/**
+	* Header of each slot, the name follows it on the same slot
+	*
+	* The sequence tells who owns the slot (see Dmitry Vyukov bounded queue): equal to the position when it is free
+	* for the producer of that position, position + 1 when it holds an event for the consumer.
+	*
+	*/
+	struct SlotHeader
+	{
+		std::atomic<size_t>		m_szSequence;
+
+		uint32_t				m_u32Action;
+		uint32_t				m_u32Cookie;
+		uint32_t				m_u32Source;
+		uint32_t				m_u32NameLength;
+
+		int64_t					m_i64Time;
+	};
+
+	/**
+	* Event waiting for room on the ring, QUEUE_POLICY_COALESCE only
+	*
+	*/
+	struct CoalescedEvent
+	{
+		std::string					m_strFileName;
+
+		uint32_t					m_u32Action;
+		uint32_t					m_u32Cookie;
+		uint32_t					m_u32Source;
+
+		std::chrono::milliseconds	m_tTime;
+	};
+
+	struct PendingKeyHash
+	{
+		size_t operator()(const std::pair<uint32_t, std::string> &key) const noexcept
+		{
+			return std::hash<std::string>{}(key.second) ^ (std::hash<uint32_t>{}(key.first) << 1);
+		}
+	};
+
+	static inline bool IsMergeable(uint32_t action) noexcept
+	{
+		return (action == MONITOR_ACTION_FILE_CREATE) || (action == MONITOR_ACTION_FILE_DELETE) || (action == MONITOR_ACTION_FILE_MODIFY);
+	}
+
+	struct EventQueue::Impl
+	{
+		const QueueOptions		m_stOptions;
+
+		size_t					m_szMask;
+		size_t					m_szStride;
+
+		char					*m_pSlots = nullptr;
+
+		alignas(CACHE_LINE) std::atomic<size_t>		m_szEnqueuePos{ 0 };
+		alignas(CACHE_LINE) std::atomic<size_t>		m_szDequeuePos{ 0 };
+
+		alignas(CACHE_LINE) std::atomic<uint64_t>	m_u64Pushed{ 0 };
+		std::atomic<uint64_t>						m_u64Popped{ 0 };
+		std::atomic<uint64_t>						m_u64Dropped{ 0 };
+		std::atomic<uint64_t>						m_u64Coalesced{ 0 };
+
+		std::atomic_bool							m_fClosed{ false };
+
+		//
+		//Coalescing, only used while the ring is full
+		std::atomic_bool							m_fHasPending{ false };
+
+		std::mutex									m_clPendingLock;
+		std::deque<CoalescedEvent>					m_dqPending;
+
+		//position of the first event on m_dqPending, keys map to absolute positions
+		size_t										m_szPendingBase = 0;
+
+		//entries of m_dqPending still to be delivered, the ones merged into nothing wait there until flushed
+		size_t										m_szLivePending = 0;
+		std::unordered_map<std::pair<uint32_t, std::string>, size_t, PendingKeyHash> m_mapPending;
+
+		explicit Impl(const QueueOptions &options) :
+			m_stOptions{ options }
+		{
+			size_t capacity = 2;
+			while (capacity < m_stOptions.m_szCapacity)
+				capacity <<= 1;
+
+			m_szMask = capacity - 1;
+			m_szStride = (sizeof(SlotHeader) + m_stOptions.m_szMaxNameLength + CACHE_LINE - 1) & ~(CACHE_LINE - 1);
+
+			m_pSlots = static_cast<char *>(::operator new(capacity * m_szStride, std::align_val_t{ CACHE_LINE }));
+
+			for (size_t i = 0; i < capacity; ++i)
+				new (this->GetSlot(i)) SlotHeader{ {i}, 0, 0, 0, 0, 0 };
+		}
+
+		~Impl()
+		{
+			::operator delete(m_pSlots, std::align_val_t{ CACHE_LINE });
+		}
+
+		inline SlotHeader *GetSlot(size_t pos) const noexcept
+		{
+			return reinterpret_cast<SlotHeader *>(m_pSlots + (pos & m_szMask) * m_szStride);
+		}
+
+		/**
+		* Returns false if the ring is full
+		*
+		*/
+		bool TryPush(std::string_view name, uint32_t action, uint32_t cookie, uint32_t source, std::chrono::milliseconds time) noexcept
+		{
+			auto pos = m_szEnqueuePos.load(std::memory_order_relaxed);
+
+			SlotHeader *slot;
+
+			for (;;)
+			{
+				slot = this->GetSlot(pos);
+
+				const auto seq = slot->m_szSequence.load(std::memory_order_acquire);
+				const auto diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+
+				if (diff == 0)
+				{
+					if (m_szEnqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+						break;
+				}
+				else if (diff < 0)
+				{
+					//consumers did not release it yet
+					return false;
+				}
+				else
+				{
+					//another producer took it
+					pos = m_szEnqueuePos.load(std::memory_order_relaxed);
+				}
+			}
+
+			slot->m_u32Action = action;
+			slot->m_u32Cookie = cookie;
+			slot->m_u32Source = source;
+			slot->m_u32NameLength = static_cast<uint32_t>(name.size());
+			slot->m_i64Time = time.count();
+
+			memcpy(reinterpret_cast<char *>(slot + 1), name.data(), name.size());
+
+			slot->m_szSequence.store(pos + 1, std::memory_order_release);
+
+			m_u64Pushed.fetch_add(1, std::memory_order_relaxed);
+
+			return true;
+		}
+
+		/**
+		* Returns false if the ring is empty, event may be null for dropping the oldest one
+		*
+		*/
+		bool TryPop(QueuedEvent *event)
+		{
+			auto pos = m_szDequeuePos.load(std::memory_order_relaxed);
+
+			SlotHeader *slot;
+
+			for (;;)
+			{
+				slot = this->GetSlot(pos);
+
+				const auto seq = slot->m_szSequence.load(std::memory_order_acquire);
+				const auto diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+
+				if (diff == 0)
+				{
+					if (m_szDequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+						break;
+				}
+				else if (diff < 0)
+				{
+					return false;
+				}
+				else
+				{
+					pos = m_szDequeuePos.load(std::memory_order_relaxed);
+				}
+			}
+
+			if (event)
+			{
+				event->m_strFileName.assign(reinterpret_cast<const char *>(slot + 1), slot->m_u32NameLength);
+				event->m_u32Action = slot->m_u32Action;
+				event->m_u32Cookie = slot->m_u32Cookie;
+				event->m_u32Source = slot->m_u32Source;
+				event->m_tTime = std::chrono::milliseconds{ slot->m_i64Time };
+
+				m_u64Popped.fetch_add(1, std::memory_order_relaxed);
+			}
+
+			//free for the producer of the next turn
+			slot->m_szSequence.store(pos + m_szMask + 1, std::memory_order_release);
+
+			return true;
+		}
+
+		/**
+		* Moves pending events to the ring while there is room, must be called with m_clPendingLock held
+		*
+		*/
+		void FlushPending()
+		{
+			while (!m_dqPending.empty())
+			{
+				auto &pending = m_dqPending.front();
+
+				//merged into nothing (created and deleted)
+				if (pending.m_u32Action)
+				{
+					if (!this->TryPush(pending.m_strFileName, pending.m_u32Action, pending.m_u32Cookie, pending.m_u32Source, pending.m_tTime))
+						break;
+
+					--m_szLivePending;
+				}
+
+				auto it = m_mapPending.find(std::make_pair(pending.m_u32Source, pending.m_strFileName));
+				if ((it != m_mapPending.end()) && (it->second == m_szPendingBase))
+					m_mapPending.erase(it);
+
+				m_dqPending.pop_front();
+				++m_szPendingBase;
+			}
+
+			m_fHasPending.store(!m_dqPending.empty(), std::memory_order_release);
+		}
+
+		/**
+		* Keeps the event until there is room, merging it with a pending one of the same file
+		*
+		*/
+		bool AddPending(const Event &event, uint32_t source)
+		{
+			std::lock_guard lock{ m_clPendingLock };
+
+			this->FlushPending();
+
+			//order is kept, so it cannot go to the ring before the pending ones
+			if (m_dqPending.empty() && this->TryPush(event.m_svFileName, event.m_u32Action, event.m_u32Cookie, source, event.m_tTime))
+				return true;
+
+			auto key = std::make_pair(source, std::string{ event.m_svFileName });
+
+			auto it = m_mapPending.find(key);
+			if (it != m_mapPending.end())
+			{
+				auto &pending = m_dqPending[it->second - m_szPendingBase];
+
+				if (IsMergeable(event.m_u32Action) && IsMergeable(pending.m_u32Action))
+				{
+					pending.m_u32Action = Coalescer::Merge(pending.m_u32Action, event.m_u32Action);
+					pending.m_tTime = event.m_tTime;
+
+					if (!pending.m_u32Action)
+					{
+						m_mapPending.erase(it);
+						--m_szLivePending;
+					}
+
+					m_u64Coalesced.fetch_add(1, std::memory_order_relaxed);
+
+					return true;
+				}
+
+				//renames are never merged, later events of the file go after it
+				m_mapPending.erase(it);
+			}
+
+			if (m_szLivePending > m_szMask)
+			{
+				m_u64Dropped.fetch_add(1, std::memory_order_relaxed);
+
+				return false;
+			}
+
+			m_dqPending.push_back(CoalescedEvent{ key.second, event.m_u32Action, event.m_u32Cookie, source, event.m_tTime });
+			++m_szLivePending;
+			m_mapPending.emplace(std::move(key), m_szPendingBase + m_dqPending.size() - 1);
+
+			m_fHasPending.store(true, std::memory_order_release);
+
+			return true;
+		}
+
+		void TryFlushPending()
+		{
+			if (!m_fHasPending.load(std::memory_order_acquire))
+				return;
+
+			//a producer is already doing it
+			std::unique_lock lock{ m_clPendingLock, std::try_to_lock };
+			if (lock)
+				this->FlushPending();
+		}
+	};
+
+	EventQueue::EventQueue(const QueueOptions &options) :
+		m_upImpl{ std::make_unique<Impl>(options) }
+	{
+		//empty
+	}
+
+	EventQueue::~EventQueue() = default;
+
+	bool EventQueue::Push(const Event &event, uint32_t source)
+	{
+		auto &impl = *m_upImpl;
+
+		if (impl.m_fClosed.load(std::memory_order_relaxed) || (event.m_svFileName.size() > impl.m_stOptions.m_szMaxNameLength))
+		{
+			impl.m_u64Dropped.fetch_add(1, std::memory_order_relaxed);
+
+			return false;
+		}
+
+		if (impl.m_stOptions.m_ePolicy == QUEUE_POLICY_COALESCE)
+		{
+			if (!impl.m_fHasPending.load(std::memory_order_acquire) && impl.TryPush(event.m_svFileName, event.m_u32Action, event.m_u32Cookie, source, event.m_tTime))
+				return true;
+
+			return impl.AddPending(event, source);
+		}
+
+		for (unsigned attempt = 0;; ++attempt)
+		{
+			if (impl.TryPush(event.m_svFileName, event.m_u32Action, event.m_u32Cookie, source, event.m_tTime))
+				return true;
+
+			switch (impl.m_stOptions.m_ePolicy)
+			{
+				case QUEUE_POLICY_DROP_OLDEST:
+					//a consumer may have emptied it meanwhile
+					if (impl.TryPop(nullptr))
+						impl.m_u64Dropped.fetch_add(1, std::memory_order_relaxed);
+					break;
+
+				case QUEUE_POLICY_BLOCK:
+					if (impl.m_fClosed.load(std::memory_order_relaxed))
+					{
+						impl.m_u64Dropped.fetch_add(1, std::memory_order_relaxed);
+
+						return false;
+					}
+
+					//spin a little, consumers usually catch up fast, then stop burning the core
+					if (attempt < 64)
+						std::this_thread::yield();
+					else
+						std::this_thread::sleep_for(std::chrono::microseconds{ 50 });
+					break;
+
+				default:
+					impl.m_u64Dropped.fetch_add(1, std::memory_order_relaxed);
+
+					return false;
+			}
+		}
+	}
+
+	bool EventQueue::TryPop(QueuedEvent &event)
+	{
+		auto &impl = *m_upImpl;
+
+		if (impl.TryPop(&event))
+		{
+			impl.TryFlushPending();
+
+			return true;
+		}
+
+		if (!impl.m_fHasPending.load(std::memory_order_acquire))
+			return false;
+
+		impl.TryFlushPending();
+
+		return impl.TryPop(&event);
+	}
+
+	size_t EventQueue::PopBatch(QueuedEvent *events, size_t maxEvents)
+	{
+		size_t count = 0;
+
+		while ((count < maxEvents) && this->TryPop(events[count]))
+			++count;
+
+		return count;
+	}
+
+	void EventQueue::Close()
+	{
+		m_upImpl->m_fClosed.store(true, std::memory_order_relaxed);
+	}
+
+	size_t EventQueue::GetSize() const noexcept
+	{
+		const auto tail = m_upImpl->m_szEnqueuePos.load(std::memory_order_relaxed);
+		const auto head = m_upImpl->m_szDequeuePos.load(std::memory_order_relaxed);
+
+		return tail > head ? tail - head : 0;
+	}
+
+	QueueStats EventQueue::GetStats() const noexcept
+	{
+		auto &impl = *m_upImpl;
+
+		QueueStats stats;
+
+		stats.m_u64Pushed = impl.m_u64Pushed.load(std::memory_order_relaxed);
+		stats.m_u64Popped = impl.m_u64Popped.load(std::memory_order_relaxed);
+		stats.m_u64Dropped = impl.m_u64Dropped.load(std::memory_order_relaxed);
+		stats.m_u64Coalesced = impl.m_u64Coalesced.load(std::memory_order_relaxed);
+
+		return stats;
+	}
+}
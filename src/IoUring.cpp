@@ -0,0 +1,224 @@
+// Copyright (C) 2023 - Bruno Sanches. See the COPYRIGHT
+// file at the top-level directory of this distribution.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+//
+// This Source Code Form is "Incompatible With Secondary Licenses", as
+// defined by the Mozilla Public License, v. 2.0.
+
+#include "IoUring.h"
+
+#include <cstring>
+
+#include <errno.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace ldmonitor
+{
+	static inline int SysSetup(unsigned entries, io_uring_params *params) noexcept
+	{
+		return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+	}
+
+	static inline int SysEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags, const void *arg, size_t argSize) noexcept
+	{
+		return static_cast<int>(syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, arg, argSize));
+	}
+
+	static inline int SysRegister(int fd, unsigned opcode, const void *arg, unsigned numArgs) noexcept
+	{
+		return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, numArgs));
+	}
+
+	std::unique_ptr<IoUring> IoUring::TryCreate(unsigned entries, unsigned numBuffers, size_t bufferSize)
+	{
+		std::unique_ptr<IoUring> ring{ new IoUring() };
+
+		if (!ring->Init(entries, numBuffers, bufferSize))
+			return nullptr;
+
+		return ring;
+	}
+
+	bool IoUring::Init(unsigned entries, unsigned numBuffers, size_t bufferSize)
+	{
+		io_uring_params params;
+		memset(&params, 0, sizeof(params));
+
+		m_iRingFD = SysSetup(entries, &params);
+		if (m_iRingFD < 0)
+			return false;
+
+		//
+		//Single mmap for both rings (5.4) and timeouts on io_uring_enter (5.11), older kernels use the poll path
+		if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG))
+			return false;
+
+		m_szSqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+		m_szCqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+		if (m_szCqRingSize > m_szSqRingSize)
+			m_szSqRingSize = m_szCqRingSize;
+
+		m_pSqRing = mmap(nullptr, m_szSqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_iRingFD, IORING_OFF_SQ_RING);
+		if (m_pSqRing == MAP_FAILED)
+		{
+			m_pSqRing = nullptr;
+
+			return false;
+		}
+
+		//same mapping, only unmapped once
+		m_pCqRing = m_pSqRing;
+
+		m_szSqesSize = params.sq_entries * sizeof(io_uring_sqe);
+		auto sqes = mmap(nullptr, m_szSqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_iRingFD, IORING_OFF_SQES);
+		if (sqes == MAP_FAILED)
+			return false;
+
+		m_pSqes = static_cast<io_uring_sqe *>(sqes);
+
+		auto sqBase = static_cast<char *>(m_pSqRing);
+
+		m_pu32SqHead = reinterpret_cast<unsigned *>(sqBase + params.sq_off.head);
+		m_pu32SqTail = reinterpret_cast<unsigned *>(sqBase + params.sq_off.tail);
+		m_pu32SqMask = reinterpret_cast<unsigned *>(sqBase + params.sq_off.ring_mask);
+		m_pu32SqArray = reinterpret_cast<unsigned *>(sqBase + params.sq_off.array);
+		m_u32SqEntries = params.sq_entries;
+
+		//sqes are always used in order, so the indirection array never changes
+		for (unsigned i = 0; i < m_u32SqEntries; ++i)
+			m_pu32SqArray[i] = i;
+
+		auto cqBase = static_cast<char *>(m_pCqRing);
+
+		m_pu32CqHead = reinterpret_cast<unsigned *>(cqBase + params.cq_off.head);
+		m_pu32CqTail = reinterpret_cast<unsigned *>(cqBase + params.cq_off.tail);
+		m_pu32CqMask = reinterpret_cast<unsigned *>(cqBase + params.cq_off.ring_mask);
+		m_pCqes = reinterpret_cast<io_uring_cqe *>(cqBase + params.cq_off.cqes);
+
+		//
+		//Provided buffers (5.19)
+		m_szBufRingSize = numBuffers * sizeof(io_uring_buf);
+
+		auto bufRing = mmap(nullptr, m_szBufRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (bufRing == MAP_FAILED)
+			return false;
+
+		m_pBufRing = static_cast<io_uring_buf_ring *>(bufRing);
+
+		io_uring_buf_reg reg;
+		memset(&reg, 0, sizeof(reg));
+
+		reg.ring_addr = reinterpret_cast<uint64_t>(m_pBufRing);
+		reg.ring_entries = numBuffers;
+		reg.bgid = 0;
+
+		if (SysRegister(m_iRingFD, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+			return false;
+
+		m_u16BufMask = static_cast<uint16_t>(numBuffers - 1);
+		m_szBufferSize = bufferSize;
+		m_vecBuffers.resize(numBuffers * bufferSize);
+
+		for (unsigned i = 0; i < numBuffers; ++i)
+			this->RecycleBuffer(static_cast<uint16_t>(i));
+
+		return true;
+	}
+
+	IoUring::~IoUring()
+	{
+		//the kernel drops the registered buffer ring with the ring fd
+		if (m_iRingFD >= 0)
+			close(m_iRingFD);
+
+		if (m_pBufRing)
+			munmap(m_pBufRing, m_szBufRingSize);
+
+		if (m_pSqes)
+			munmap(m_pSqes, m_szSqesSize);
+
+		if (m_pSqRing)
+			munmap(m_pSqRing, m_szSqRingSize);
+	}
+
+	io_uring_sqe *IoUring::GetSqe()
+	{
+		const unsigned head = __atomic_load_n(m_pu32SqHead, __ATOMIC_ACQUIRE);
+		const unsigned tail = *m_pu32SqTail + m_u32SqPending;
+
+		if (tail - head >= m_u32SqEntries)
+			return nullptr;
+
+		auto sqe = m_pSqes + (tail & *m_pu32SqMask);
+		memset(sqe, 0, sizeof(io_uring_sqe));
+
+		++m_u32SqPending;
+
+		return sqe;
+	}
+
+	bool IoUring::Submit()
+	{
+		if (!m_u32SqPending)
+			return true;
+
+		const unsigned count = m_u32SqPending;
+		m_u32SqPending = 0;
+
+		__atomic_store_n(m_pu32SqTail, *m_pu32SqTail + count, __ATOMIC_RELEASE);
+
+		for (;;)
+		{
+			if (SysEnter(m_iRingFD, count, 0, 0, nullptr, 0) >= 0)
+				return true;
+
+			if (errno != EINTR)
+				return false;
+		}
+	}
+
+	bool IoUring::Wait(int timeoutMs)
+	{
+		//completions already posted, no need to enter the kernel
+		if (*m_pu32CqHead != __atomic_load_n(m_pu32CqTail, __ATOMIC_ACQUIRE))
+			return true;
+
+		timespec ts;
+		ts.tv_sec = timeoutMs / 1000;
+		ts.tv_nsec = static_cast<long>(timeoutMs % 1000) * 1000000;
+
+		io_uring_getevents_arg arg;
+		memset(&arg, 0, sizeof(arg));
+
+		arg.sigmask_sz = _NSIG / 8;
+		arg.ts = timeoutMs < 0 ? 0 : reinterpret_cast<uint64_t>(&ts);
+
+		if (SysEnter(m_iRingFD, 0, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg)) >= 0)
+			return true;
+
+		//timeout expired or a signal, let the caller check its timers
+		return (errno == ETIME) || (errno == EINTR);
+	}
+
+	void IoUring::RecycleBuffer(uint16_t bid)
+	{
+		//not using bufs, __DECLARE_FLEX_ARRAY of older headers moves it to offset 8 on C++
+		auto &buf = reinterpret_cast<io_uring_buf *>(m_pBufRing)[m_u16BufTail & m_u16BufMask];
+
+		buf.addr = reinterpret_cast<uint64_t>(this->GetBuffer(bid));
+		buf.len = static_cast<uint32_t>(m_szBufferSize);
+		buf.bid = bid;
+
+		++m_u16BufTail;
+
+		__atomic_store_n(&m_pBufRing->tail, m_u16BufTail, __ATOMIC_RELEASE);
+	}
+}
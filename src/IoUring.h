@@ -0,0 +1,148 @@
+// Copyright (C) 2023 - Bruno Sanches. See the COPYRIGHT
+// file at the top-level directory of this distribution.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+//
+// This Source Code Form is "Incompatible With Secondary Licenses", as
+// defined by the Mozilla Public License, v. 2.0.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include <linux/io_uring.h>
+
+namespace ldmonitor
+{
+	/**
+	* Minimal io_uring, just what the monitor needs: a submission queue, waiting for completions with a timeout
+	* and a ring of provided buffers (group 0) for reads. Uses the raw system calls, so no liburing needed.
+	*
+	* Submission (GetSqe / Submit) must be serialized by the caller, completions must be consumed by a single thread.
+	*
+	*/
+	class IoUring
+	{
+		public:
+			//not available on older kernel headers, kernel 6.7+
+			static constexpr uint8_t OP_READ_MULTISHOT = 49;
+
+			/**
+			* Returns null if io_uring or any required feature is not available (old kernel, disabled by sysctl or seccomp)
+			*
+			* numBuffers must be a power of 2
+			*
+			*/
+			static std::unique_ptr<IoUring> TryCreate(unsigned entries, unsigned numBuffers, size_t bufferSize);
+
+			~IoUring();
+
+			IoUring(const IoUring &) = delete;
+			IoUring &operator=(const IoUring &) = delete;
+
+			/**
+			* Returns a cleared sqe or null if the queue is full, it is sent on the next Submit
+			*
+			*/
+			io_uring_sqe *GetSqe();
+
+			/**
+			* Sends all sqes returned by GetSqe, returns false on failure (errno is set)
+			*
+			*/
+			bool Submit();
+
+			/**
+			* Waits for at least one completion or timeoutMs (-1 forever), returns false on failure (errno is set)
+			*
+			*/
+			bool Wait(int timeoutMs);
+
+			/**
+			* Calls func(const io_uring_cqe &) for each available completion
+			*
+			*/
+			template <typename F>
+			unsigned ForEachCompletion(F &&func)
+			{
+				unsigned head = *m_pu32CqHead;
+				const unsigned tail = __atomic_load_n(m_pu32CqTail, __ATOMIC_ACQUIRE);
+
+				const unsigned count = tail - head;
+
+				for (; head != tail; ++head)
+				{
+					//copy, so the slot can be released before the callback runs
+					const io_uring_cqe cqe = m_pCqes[head & *m_pu32CqMask];
+
+					__atomic_store_n(m_pu32CqHead, head + 1, __ATOMIC_RELEASE);
+
+					func(cqe);
+				}
+
+				return count;
+			}
+
+			inline char *GetBuffer(uint16_t bid) noexcept
+			{
+				return m_vecBuffers.data() + static_cast<size_t>(bid) * m_szBufferSize;
+			}
+
+			inline size_t GetBufferSize() const noexcept
+			{
+				return m_szBufferSize;
+			}
+
+			/**
+			* Gives a buffer back to the kernel after its data was used
+			*
+			*/
+			void RecycleBuffer(uint16_t bid);
+
+		private:
+			IoUring() = default;
+
+			bool Init(unsigned entries, unsigned numBuffers, size_t bufferSize);
+
+		private:
+			int						m_iRingFD = -1;
+
+			void					*m_pSqRing = nullptr;
+			size_t					m_szSqRingSize = 0;
+
+			void					*m_pCqRing = nullptr;
+			size_t					m_szCqRingSize = 0;
+
+			io_uring_sqe			*m_pSqes = nullptr;
+			size_t					m_szSqesSize = 0;
+
+			unsigned				*m_pu32SqHead = nullptr;
+			unsigned				*m_pu32SqTail = nullptr;
+			unsigned				*m_pu32SqMask = nullptr;
+			unsigned				*m_pu32SqArray = nullptr;
+			unsigned				m_u32SqEntries = 0;
+
+			//sqes returned by GetSqe and not submitted yet
+			unsigned				m_u32SqPending = 0;
+
+			unsigned				*m_pu32CqHead = nullptr;
+			unsigned				*m_pu32CqTail = nullptr;
+			unsigned				*m_pu32CqMask = nullptr;
+			io_uring_cqe			*m_pCqes = nullptr;
+
+			//
+			//Provided buffers
+			io_uring_buf_ring		*m_pBufRing = nullptr;
+			size_t					m_szBufRingSize = 0;
+			uint16_t				m_u16BufTail = 0;
+			uint16_t				m_u16BufMask = 0;
+
+			std::vector<char>		m_vecBuffers;
+			size_t					m_szBufferSize = 0;
+	};
+}
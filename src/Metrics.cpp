@@ -0,0 +1,191 @@
+// Copyright (C) 2023 - Bruno Sanches. See the COPYRIGHT
+// file at the top-level directory of this distribution.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+//
+// This Source Code Form is "Incompatible With Secondary Licenses", as
+// defined by the Mozilla Public License, v. 2.0.
+
+#include "Metrics.h"
+
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+
+namespace ldmonitor
+{
+	//
+	//
+	// LatencyHistogram
+	//
+	//
+
+	uint64_t LatencyHistogram::GetBucketLimit(size_t bucket) noexcept
+	{
+		const size_t group = bucket / SUB_BUCKETS;
+		const uint64_t sub = bucket % SUB_BUCKETS;
+
+		if (group == 0)
+			return sub;
+
+		const unsigned shift = static_cast<unsigned>(group - 1);
+
+		//in this order, so the last bucket ends at UINT64_MAX without overflowing
+		return ((SUB_BUCKETS + sub) << shift) + ((uint64_t{ 1 } << shift) - 1);
+	}
+
+	uint64_t LatencyHistogram::GetCount() const noexcept
+	{
+		uint64_t count = 0;
+
+		for (auto bucket : m_arCounts)
+			count += bucket;
+
+		return count;
+	}
+
+	uint64_t LatencyHistogram::GetPercentile(double q) const noexcept
+	{
+		const auto count = this->GetCount();
+		if (count == 0)
+			return 0;
+
+		//rank of the value, 1 based, so q = 0 is the lowest and q = 1 the highest
+		const auto rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(std::clamp(q, 0.0, 1.0) * count)));
+
+		uint64_t seen = 0;
+
+		for (size_t i = 0; i < NUM_BUCKETS; ++i)
+		{
+			seen += m_arCounts[i];
+
+			if (seen >= rank)
+				return GetBucketLimit(i);
+		}
+
+		return GetBucketLimit(NUM_BUCKETS - 1);
+	}
+
+	void LatencyHistogram::Merge(const LatencyHistogram &other) noexcept
+	{
+		for (size_t i = 0; i < NUM_BUCKETS; ++i)
+			m_arCounts[i] += other.m_arCounts[i];
+	}
+
+	void Histogram::CopyTo(LatencyHistogram &histogram) const noexcept
+	{
+		for (size_t i = 0; i < LatencyHistogram::NUM_BUCKETS; ++i)
+			histogram.m_arCounts[i] = m_arCounts[i].load(std::memory_order_relaxed);
+	}
+
+	//
+	//
+	// Counters
+	//
+	//
+
+	void MonitorMetrics::Merge(const MonitorMetrics &other) noexcept
+	{
+		m_u64Reads += other.m_u64Reads;
+		m_u64BytesRead += other.m_u64BytesRead;
+		m_u64Events += other.m_u64Events;
+		m_u64UnmatchedEvents += other.m_u64UnmatchedEvents;
+		m_u64FilteredEvents += other.m_u64FilteredEvents;
+		m_u64DeliveredEvents += other.m_u64DeliveredEvents;
+		m_u64Overflows += other.m_u64Overflows;
+		m_u64Demotions += other.m_u64Demotions;
+		m_u64Promotions += other.m_u64Promotions;
+
+		//each shard has its own queue
+		m_u64MaxQueuedBytes = std::max(m_u64MaxQueuedBytes, other.m_u64MaxQueuedBytes);
+
+		m_stCallbackTime.Merge(other.m_stCallbackTime);
+		m_stDispatchDelay.Merge(other.m_stDispatchDelay);
+	}
+
+	void MonitorCounters::CopyTo(MonitorMetrics &metrics) const noexcept
+	{
+		metrics.m_u64Reads = m_clReads.Get();
+		metrics.m_u64BytesRead = m_clBytesRead.Get();
+		metrics.m_u64Events = m_clEvents.Get();
+		metrics.m_u64UnmatchedEvents = m_clUnmatchedEvents.Get();
+		metrics.m_u64FilteredEvents = m_clFilteredEvents.Get();
+		metrics.m_u64DeliveredEvents = m_clDeliveredEvents.Get();
+		metrics.m_u64Overflows = m_clOverflows.Get();
+		metrics.m_u64MaxQueuedBytes = m_clMaxQueuedBytes.Get();
+		metrics.m_u64Demotions = m_clDemotions.Get();
+		metrics.m_u64Promotions = m_clPromotions.Get();
+
+		m_clCallbackTime.CopyTo(metrics.m_stCallbackTime);
+		m_clDispatchDelay.CopyTo(metrics.m_stDispatchDelay);
+	}
+
+	void WatchCounters::CopyTo(WatchMetrics &metrics) const noexcept
+	{
+		metrics.m_u64DeliveredEvents = m_clDeliveredEvents.Get();
+		metrics.m_u64FilteredEvents = m_clFilteredEvents.Get();
+		metrics.m_u64CallbackTime = m_clCallbackTime.Get();
+	}
+
+	//
+	//
+	// FormatMetrics
+	//
+	//
+
+	static void FormatDuration(std::ostream &stream, uint64_t ns)
+	{
+		if (ns < 1000)
+			stream << ns << "ns";
+		else if (ns < 1000000)
+			stream << ns / 1e3 << "us";
+		else if (ns < 1000000000)
+			stream << ns / 1e6 << "ms";
+		else
+			stream << ns / 1e9 << 's';
+	}
+
+	static void FormatHistogram(std::ostream &stream, const char *name, const LatencyHistogram &histogram)
+	{
+		const auto count = histogram.GetCount();
+		if (count == 0)
+			return;
+
+		stream << ' ' << name << ": " << count << " p50 ";
+		FormatDuration(stream, histogram.GetPercentile(0.5));
+
+		stream << " p99 ";
+		FormatDuration(stream, histogram.GetPercentile(0.99));
+
+		stream << " p999 ";
+		FormatDuration(stream, histogram.GetPercentile(0.999));
+
+		stream << " max ";
+		FormatDuration(stream, histogram.GetPercentile(1));
+	}
+
+	std::string FormatMetrics(const MonitorMetrics &metrics)
+	{
+		std::stringstream stream;
+
+		stream.precision(3);
+
+		stream << "reads: " << metrics.m_u64Reads
+			<< " bytes: " << metrics.m_u64BytesRead
+			<< " events: " << metrics.m_u64Events
+			<< " unmatched: " << metrics.m_u64UnmatchedEvents
+			<< " filtered: " << metrics.m_u64FilteredEvents
+			<< " delivered: " << metrics.m_u64DeliveredEvents
+			<< " overflows: " << metrics.m_u64Overflows
+			<< " max_queued_bytes: " << metrics.m_u64MaxQueuedBytes
+			<< " demotions: " << metrics.m_u64Demotions
+			<< " promotions: " << metrics.m_u64Promotions;
+
+		FormatHistogram(stream, "callback_time", metrics.m_stCallbackTime);
+		FormatHistogram(stream, "dispatch_delay", metrics.m_stDispatchDelay);
+
+		return stream.str();
+	}
+}
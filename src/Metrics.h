@@ -0,0 +1,130 @@
+// Copyright (C) 2023 - Bruno Sanches. See the COPYRIGHT
+// file at the top-level directory of this distribution.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+//
+// This Source Code Form is "Incompatible With Secondary Licenses", as
+// defined by the Mozilla Public License, v. 2.0.
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#include "DirectoryMonitor.h"
+
+namespace ldmonitor
+{
+	/**
+	* Counter written by a single thread (the monitor thread or the ProcessEvents caller) and read by any other
+	*
+	* A relaxed load and store instead of a locked add, readers may see it a little behind.
+	*
+	*/
+	class Counter
+	{
+		public:
+			inline void Add(uint64_t value) noexcept
+			{
+				m_u64Value.store(m_u64Value.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+			}
+
+			inline void SetMax(uint64_t value) noexcept
+			{
+				if (value > m_u64Value.load(std::memory_order_relaxed))
+					m_u64Value.store(value, std::memory_order_relaxed);
+			}
+
+			inline uint64_t Get() const noexcept
+			{
+				return m_u64Value.load(std::memory_order_relaxed);
+			}
+
+		private:
+			std::atomic<uint64_t> m_u64Value{ 0 };
+	};
+
+	/**
+	* Writer side of LatencyHistogram, with a single writer like Counter
+	*
+	*/
+	class Histogram
+	{
+		public:
+			static inline size_t GetBucket(uint64_t value) noexcept
+			{
+				if (value < LatencyHistogram::SUB_BUCKETS)
+					return static_cast<size_t>(value);
+
+				//highest bit set, at least SUB_BUCKET_BITS
+				const unsigned exponent = 63 - __builtin_clzll(value);
+				const unsigned shift = exponent - LatencyHistogram::SUB_BUCKET_BITS;
+
+				//the bits after the highest one select the linear sub bucket
+				return (shift + 1) * LatencyHistogram::SUB_BUCKETS + static_cast<size_t>((value >> shift) - LatencyHistogram::SUB_BUCKETS);
+			}
+
+			inline void Record(uint64_t value, uint64_t count = 1) noexcept
+			{
+				auto &bucket = m_arCounts[GetBucket(value)];
+
+				bucket.store(bucket.load(std::memory_order_relaxed) + count, std::memory_order_relaxed);
+			}
+
+			void CopyTo(LatencyHistogram &histogram) const noexcept;
+
+		private:
+			std::array<std::atomic<uint64_t>, LatencyHistogram::NUM_BUCKETS> m_arCounts = {};
+	};
+
+	/**
+	* Everything MonitorMetrics reports, kept by State
+	*
+	*/
+	struct MonitorCounters
+	{
+		Counter		m_clReads;
+		Counter		m_clBytesRead;
+		Counter		m_clEvents;
+		Counter		m_clUnmatchedEvents;
+		Counter		m_clFilteredEvents;
+		Counter		m_clDeliveredEvents;
+		Counter		m_clOverflows;
+		Counter		m_clMaxQueuedBytes;
+
+		//written by Watch and the monitor thread, always with State::m_clLock held, so still one writer at a time
+		Counter		m_clDemotions;
+		Counter		m_clPromotions;
+
+		Histogram	m_clCallbackTime;
+		Histogram	m_clDispatchDelay;
+
+		void CopyTo(MonitorMetrics &metrics) const noexcept;
+	};
+
+	/**
+	* Everything WatchMetrics reports, kept by each watch
+	*
+	*/
+	struct WatchCounters
+	{
+		Counter		m_clDeliveredEvents;
+		Counter		m_clFilteredEvents;
+		Counter		m_clCallbackTime;
+
+		void CopyTo(WatchMetrics &metrics) const noexcept;
+	};
+
+	/**
+	* Steady clock in ns, for MonitorOptions::m_fTimeCallbacks
+	*
+	*/
+	inline uint64_t GetTimestamp() noexcept
+	{
+		return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+	}
+}
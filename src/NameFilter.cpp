@@ -0,0 +1,300 @@
+// Copyright (C) 2023 - Bruno Sanches. See the COPYRIGHT
+// file at the top-level directory of this distribution.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+//
+// This Source Code Form is "Incompatible With Secondary Licenses", as
+// defined by the Mozilla Public License, v. 2.0.
+
+#include "NameFilter.h"
+
+#include <algorithm>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+namespace ldmonitor
+{
+	static inline uint64_t LoadKey(const char *data, size_t len) noexcept
+	{
+		uint64_t key = 0;
+		memcpy(&key, data, len);
+
+		return key;
+	}
+
+	/**
+	* True if any key is equal to value, no early exit so it is vectorized
+	*
+	*/
+	static inline bool ContainsKey(const std::vector<uint64_t> &keys, uint64_t value) noexcept
+	{
+		bool found = false;
+
+		for (auto key : keys)
+			found |= (key == value);
+
+		return found;
+	}
+
+	static void ThrowInvalidPattern(const std::string &pattern, const char *reason)
+	{
+		std::stringstream stream;
+		stream << "[NameFilter] Invalid pattern \"" << pattern << "\": " << reason;
+
+		throw std::invalid_argument(stream.str());
+	}
+
+	void PatternSet::Add(const std::string &pattern)
+	{
+		Glob_t glob;
+
+		//
+		//Compile
+		for (size_t i = 0; i < pattern.size(); ++i)
+		{
+			const char ch = pattern[i];
+
+			switch (ch)
+			{
+				case '*':
+					//consecutive stars are the same as one
+					if (glob.empty() || (glob.back().m_eType != TOKEN_STAR))
+						glob.push_back(Token{ TOKEN_STAR, 0, 0 });
+					break;
+
+				case '?':
+					glob.push_back(Token{ TOKEN_ANY, 0, 0 });
+					break;
+
+				case '\\':
+					if (++i == pattern.size())
+						ThrowInvalidPattern(pattern, "escape at the end");
+
+					glob.push_back(Token{ TOKEN_LITERAL, pattern[i], 0 });
+					break;
+
+				case '[':
+				{
+					std::bitset<256> chars;
+
+					size_t pos = i + 1;
+
+					const bool negate = (pos < pattern.size()) && ((pattern[pos] == '!') || (pattern[pos] == '^'));
+					if (negate)
+						++pos;
+
+					//a ']' right after the '[' is part of the class
+					for (bool first = true; (pos < pattern.size()) && (first || (pattern[pos] != ']')); first = false, ++pos)
+					{
+						const auto from = static_cast<unsigned char>(pattern[pos]);
+
+						if ((pos + 2 < pattern.size()) && (pattern[pos + 1] == '-') && (pattern[pos + 2] != ']'))
+						{
+							const auto to = static_cast<unsigned char>(pattern[pos + 2]);
+
+							for (unsigned c = from; c <= to; ++c)
+								chars.set(c);
+
+							pos += 2;
+						}
+						else
+						{
+							chars.set(from);
+						}
+					}
+
+					if (pos >= pattern.size())
+						ThrowInvalidPattern(pattern, "unterminated [");
+
+					if (negate)
+						chars.flip();
+
+					if (m_vecClasses.size() > UINT16_MAX)
+						ThrowInvalidPattern(pattern, "too many classes");
+
+					glob.push_back(Token{ TOKEN_CLASS, 0, static_cast<uint16_t>(m_vecClasses.size()) });
+					m_vecClasses.push_back(chars);
+
+					i = pos;
+					break;
+				}
+
+				default:
+					glob.push_back(Token{ TOKEN_LITERAL, ch, 0 });
+					break;
+			}
+		}
+
+		if (glob.empty())
+			ThrowInvalidPattern(pattern, "empty");
+
+		//
+		//Literal, suffix, prefix or everything?
+		const auto numLiterals = std::count_if(glob.begin(), glob.end(), [](const Token &token) { return token.m_eType == TOKEN_LITERAL; });
+		const auto numStars = std::count_if(glob.begin(), glob.end(), [](const Token &token) { return token.m_eType == TOKEN_STAR; });
+
+		const bool simple = static_cast<size_t>(numLiterals + numStars) == glob.size();
+
+		std::string literal;
+		for (auto &token : glob)
+		{
+			if (token.m_eType == TOKEN_LITERAL)
+				literal.push_back(token.m_chLiteral);
+		}
+
+		if (simple && (numStars == 0))
+		{
+			m_vecExact.insert(std::lower_bound(m_vecExact.begin(), m_vecExact.end(), literal), literal);
+		}
+		else if (simple && (numStars == 1) && (glob.size() == 1))
+		{
+			m_fMatchAll = true;
+		}
+		else if (simple && (numStars == 1) && (glob.front().m_eType == TOKEN_STAR))
+		{
+			if (literal.size() <= MAX_SHORT)
+			{
+				m_arShortSuffixes[literal.size() - 1].push_back(LoadKey(literal.data(), literal.size()));
+				m_u8ShortSuffixes |= 1 << (literal.size() - 1);
+			}
+			else
+			{
+				m_vecLongSuffixes.push_back(std::move(literal));
+			}
+		}
+		else if (simple && (numStars == 1) && (glob.back().m_eType == TOKEN_STAR))
+		{
+			if (literal.size() <= MAX_SHORT)
+			{
+				m_arShortPrefixes[literal.size() - 1].push_back(LoadKey(literal.data(), literal.size()));
+				m_u8ShortPrefixes |= 1 << (literal.size() - 1);
+			}
+			else
+			{
+				m_vecLongPrefixes.push_back(std::move(literal));
+			}
+		}
+		else
+		{
+			m_vecGlobs.push_back(std::move(glob));
+		}
+	}
+
+	bool PatternSet::Match(std::string_view name) const noexcept
+	{
+		if (m_fMatchAll)
+			return true;
+
+		const auto len = name.size();
+
+		for (size_t i = 0, bits = m_u8ShortSuffixes; bits && (i < len); ++i, bits >>= 1)
+		{
+			if ((bits & 1) && ContainsKey(m_arShortSuffixes[i], LoadKey(name.data() + len - (i + 1), i + 1)))
+				return true;
+		}
+
+		for (size_t i = 0, bits = m_u8ShortPrefixes; bits && (i < len); ++i, bits >>= 1)
+		{
+			if ((bits & 1) && ContainsKey(m_arShortPrefixes[i], LoadKey(name.data(), i + 1)))
+				return true;
+		}
+
+		for (auto &suffix : m_vecLongSuffixes)
+		{
+			if ((len >= suffix.size()) && !memcmp(name.data() + len - suffix.size(), suffix.data(), suffix.size()))
+				return true;
+		}
+
+		for (auto &prefix : m_vecLongPrefixes)
+		{
+			if ((len >= prefix.size()) && !memcmp(name.data(), prefix.data(), prefix.size()))
+				return true;
+		}
+
+		if (!m_vecExact.empty() && std::binary_search(m_vecExact.begin(), m_vecExact.end(), name, [](std::string_view lhs, std::string_view rhs) { return lhs < rhs; }))
+			return true;
+
+		for (auto &glob : m_vecGlobs)
+		{
+			if (this->MatchGlob(glob, name))
+				return true;
+		}
+
+		return false;
+	}
+
+	bool PatternSet::MatchGlob(const Glob_t &glob, std::string_view name) const noexcept
+	{
+		//
+		//A star only needs to remember the last one seen: when something fails after it, it eats one more char and tries again
+		size_t tokenPos = 0;
+		size_t namePos = 0;
+
+		size_t starToken = SIZE_MAX;
+		size_t starName = 0;
+
+		while (namePos < name.size())
+		{
+			if (tokenPos < glob.size())
+			{
+				auto &token = glob[tokenPos];
+				const auto ch = static_cast<unsigned char>(name[namePos]);
+
+				bool matched;
+
+				switch (token.m_eType)
+				{
+					case TOKEN_STAR:
+						starToken = tokenPos++;
+						starName = namePos;
+						continue;
+
+					case TOKEN_ANY:
+						matched = true;
+						break;
+
+					case TOKEN_CLASS:
+						matched = m_vecClasses[token.m_u16Class].test(ch);
+						break;
+
+					default:
+						matched = static_cast<unsigned char>(token.m_chLiteral) == ch;
+						break;
+				}
+
+				if (matched)
+				{
+					++tokenPos;
+					++namePos;
+
+					continue;
+				}
+			}
+
+			if (starToken == SIZE_MAX)
+				return false;
+
+			tokenPos = starToken + 1;
+			namePos = ++starName;
+		}
+
+		while ((tokenPos < glob.size()) && (glob[tokenPos].m_eType == TOKEN_STAR))
+			++tokenPos;
+
+		return tokenPos == glob.size();
+	}
+
+	NameFilter::NameFilter(const std::vector<std::string> &include, const std::vector<std::string> &exclude)
+	{
+		for (auto &pattern : include)
+			m_clInclude.Add(pattern);
+
+		for (auto &pattern : exclude)
+			m_clExclude.Add(pattern);
+
+		m_fInclude = !m_clInclude.IsEmpty();
+	}
+}
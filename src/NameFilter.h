@@ -0,0 +1,113 @@
+// Copyright (C) 2023 - Bruno Sanches. See the COPYRIGHT
+// file at the top-level directory of this distribution.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+//
+// This Source Code Form is "Incompatible With Secondary Licenses", as
+// defined by the Mozilla Public License, v. 2.0.
+
+#pragma once
+
+#include <array>
+#include <bitset>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace ldmonitor
+{
+	/**
+	* Set of glob patterns (*, ?, [abc], [a-z], [!abc] and \ for escaping) compiled for matching file names
+	*
+	* Most patterns are a literal name, a suffix (*.tmp) or a prefix (.~lock*), these go to tables and never
+	* run the glob matcher. Suffixes and prefixes up to 8 chars are kept as integers grouped by length,
+	* so each length costs one load of the name and a compare against an array, which compilers vectorize.
+	*
+	*/
+	class PatternSet
+	{
+		public:
+			/**
+			* Throws std::invalid_argument for a malformed pattern
+			*
+			*/
+			void Add(const std::string &pattern);
+
+			bool Match(std::string_view name) const noexcept;
+
+			inline bool IsEmpty() const noexcept
+			{
+				return !m_fMatchAll && m_vecExact.empty() && m_vecLongSuffixes.empty() && m_vecLongPrefixes.empty() && m_vecGlobs.empty() && !m_u8ShortSuffixes && !m_u8ShortPrefixes;
+			}
+
+		private:
+			enum TokenTypes: uint8_t
+			{
+				TOKEN_LITERAL,
+				TOKEN_ANY,
+				TOKEN_STAR,
+				TOKEN_CLASS
+			};
+
+			struct Token
+			{
+				TokenTypes		m_eType;
+				char			m_chLiteral;
+
+				//index on m_vecClasses
+				uint16_t		m_u16Class;
+			};
+
+			typedef std::vector<Token> Glob_t;
+
+			static constexpr size_t MAX_SHORT = 8;
+
+			bool MatchGlob(const Glob_t &glob, std::string_view name) const noexcept;
+
+		private:
+			bool							m_fMatchAll = false;
+
+			//sorted
+			std::vector<std::string>		m_vecExact;
+
+			//keys of length i + 1 on index i, bit i of the masks is set when there are keys of that length
+			std::array<std::vector<uint64_t>, MAX_SHORT>	m_arShortSuffixes;
+			std::array<std::vector<uint64_t>, MAX_SHORT>	m_arShortPrefixes;
+			uint8_t							m_u8ShortSuffixes = 0;
+			uint8_t							m_u8ShortPrefixes = 0;
+
+			std::vector<std::string>		m_vecLongSuffixes;
+			std::vector<std::string>		m_vecLongPrefixes;
+
+			std::vector<Glob_t>				m_vecGlobs;
+			std::vector<std::bitset<256>>	m_vecClasses;
+	};
+
+	/**
+	* Include and exclude patterns of a watch
+	*
+	*/
+	class NameFilter
+	{
+		public:
+			NameFilter(const std::vector<std::string> &include, const std::vector<std::string> &exclude);
+
+			/**
+			* True if name matches an include pattern (or there are none) and no exclude pattern
+			*
+			*/
+			inline bool Match(std::string_view name) const noexcept
+			{
+				return (!m_fInclude || m_clInclude.Match(name)) && !m_clExclude.Match(name);
+			}
+
+		private:
+			PatternSet	m_clInclude;
+			PatternSet	m_clExclude;
+
+			bool		m_fInclude;
+	};
+}
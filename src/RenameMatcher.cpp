@@ -0,0 +1,126 @@
+// Copyright (C) 2023 - Bruno Sanches. See the COPYRIGHT
+// file at the top-level directory of this distribution.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+//
+// This Source Code Form is "Incompatible With Secondary Licenses", as
+// defined by the Mozilla Public License, v. 2.0.
+
+#include "RenameMatcher.h"
+
+#include <algorithm>
+#include <cassert>
+
+namespace ldmonitor
+{
+	RenameMatcher::RenameMatcher(size_t capacity) :
+		m_szCapacity{ std::max(capacity, size_t{ 1 }) }
+	{
+		//empty
+	}
+
+	std::optional<RenameMatcher::Half> RenameMatcher::Push(uint32_t cookie, std::shared_ptr<DirectoryMonitor> owner, std::string fileName, Time_t expire)
+	{
+		std::optional<Half> evicted;
+
+		if (m_szSize == m_szCapacity)
+		{
+			auto &front = m_dqEntries.front();
+			assert(!front.m_fTaken);
+
+			this->EraseCookie(front.m_u32Cookie, m_u64FrontSeq);
+
+			evicted = std::move(front.m_stHalf);
+			front.m_fTaken = true;
+			--m_szSize;
+
+			this->DropTaken();
+		}
+
+		m_mapCookies.emplace(cookie, m_u64FrontSeq + m_dqEntries.size());
+		m_dqEntries.push_back(Entry{ Half{ std::move(owner), std::move(fileName) }, expire, cookie, false });
+
+		++m_szSize;
+
+		return evicted;
+	}
+
+	std::optional<RenameMatcher::Half> RenameMatcher::Take(uint32_t cookie, const Predicate_t &pred)
+	{
+		auto range = m_mapCookies.equal_range(cookie);
+
+		for (auto it = range.first; it != range.second; ++it)
+		{
+			auto &entry = m_dqEntries[it->second - m_u64FrontSeq];
+
+			if (!pred(*entry.m_stHalf.m_spOwner))
+				continue;
+
+			Half half = std::move(entry.m_stHalf);
+
+			entry.m_fTaken = true;
+			m_mapCookies.erase(it);
+			--m_szSize;
+
+			this->DropTaken();
+
+			return half;
+		}
+
+		return std::nullopt;
+	}
+
+	void RenameMatcher::Expire(Time_t now, const ExpireCallback_t &expired)
+	{
+		while (!m_dqEntries.empty() && (m_dqEntries.front().m_tExpire <= now))
+		{
+			auto &front = m_dqEntries.front();
+
+			this->EraseCookie(front.m_u32Cookie, m_u64FrontSeq);
+
+			Half half = std::move(front.m_stHalf);
+			--m_szSize;
+
+			m_dqEntries.pop_front();
+			++m_u64FrontSeq;
+
+			this->DropTaken();
+
+			expired(std::move(half));
+		}
+	}
+
+	int RenameMatcher::GetTimeout(Time_t now) const noexcept
+	{
+		if (m_dqEntries.empty())
+			return -1;
+
+		return static_cast<int>(std::max(Time_t{ 0 }, m_dqEntries.front().m_tExpire - now).count());
+	}
+
+	void RenameMatcher::EraseCookie(uint32_t cookie, uint64_t seq)
+	{
+		auto range = m_mapCookies.equal_range(cookie);
+
+		for (auto it = range.first; it != range.second; ++it)
+		{
+			if (it->second == seq)
+			{
+				m_mapCookies.erase(it);
+
+				return;
+			}
+		}
+	}
+
+	void RenameMatcher::DropTaken()
+	{
+		while (!m_dqEntries.empty() && m_dqEntries.front().m_fTaken)
+		{
+			m_dqEntries.pop_front();
+			++m_u64FrontSeq;
+		}
+	}
+}
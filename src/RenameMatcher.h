@@ -0,0 +1,118 @@
+// Copyright (C) 2023 - Bruno Sanches. See the COPYRIGHT
+// file at the top-level directory of this distribution.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+//
+// This Source Code Form is "Incompatible With Secondary Licenses", as
+// defined by the Mozilla Public License, v. 2.0.
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+
+namespace ldmonitor
+{
+	struct DirectoryMonitor;
+
+	/**
+	* Old names of renames waiting for the new name with the same inotify cookie
+	*
+	* The kernel queues both halves together, but they may be split between reads and the new name never comes
+	* when the file was moved to a directory that is not watched, so old names only wait for a short time.
+	* All of them wait the same time, so arrival order is also expiration order and expiring only looks at the front.
+	*
+	* Not thread safe, owned by the monitor thread.
+	*
+	*/
+	class RenameMatcher
+	{
+		public:
+			typedef std::chrono::milliseconds Time_t;
+
+			struct Half
+			{
+				std::shared_ptr<DirectoryMonitor>	m_spOwner;
+
+				//relative to the owner root
+				std::string							m_strFileName;
+			};
+
+			typedef std::function<void(Half &&half)> ExpireCallback_t;
+			typedef std::function<bool(const DirectoryMonitor &owner)> Predicate_t;
+
+			explicit RenameMatcher(size_t capacity);
+
+			RenameMatcher(const RenameMatcher &) = delete;
+			RenameMatcher &operator=(const RenameMatcher &) = delete;
+
+			/**
+			* Keeps an old name until expire, when full the oldest one is removed and returned
+			*
+			*/
+			std::optional<Half> Push(uint32_t cookie, std::shared_ptr<DirectoryMonitor> owner, std::string fileName, Time_t expire);
+
+			/**
+			* Removes and returns an old name with cookie whose owner satisfies pred
+			*
+			*/
+			std::optional<Half> Take(uint32_t cookie, const Predicate_t &pred);
+
+			/**
+			* Removes all old names that expired until now
+			*
+			*/
+			void Expire(Time_t now, const ExpireCallback_t &expired);
+
+			/**
+			* Time in ms until the next old name expires or -1 if there is none, suitable for poll
+			*
+			*/
+			int GetTimeout(Time_t now) const noexcept;
+
+			inline bool IsEmpty() const noexcept
+			{
+				return m_szSize == 0;
+			}
+
+		private:
+			struct Entry
+			{
+				Half		m_stHalf;
+				Time_t		m_tExpire;
+
+				uint32_t	m_u32Cookie;
+
+				//matched, removed when it reaches the front
+				bool		m_fTaken;
+			};
+
+			void EraseCookie(uint32_t cookie, uint64_t seq);
+
+			/**
+			* Keeps the front on an entry that was not taken, so expiring never looks at the others
+			*
+			*/
+			void DropTaken();
+
+		private:
+			std::deque<Entry>							m_dqEntries;
+
+			//entries are numbered by arrival, this is the number of m_dqEntries.front()
+			uint64_t									m_u64FrontSeq = 0;
+
+			//cookie to the number of each entry not taken
+			std::unordered_multimap<uint32_t, uint64_t>	m_mapCookies;
+
+			size_t										m_szSize = 0;
+			size_t										m_szCapacity;
+	};
+}
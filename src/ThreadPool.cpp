@@ -0,0 +1,207 @@
+// Copyright (C) 2023 - Bruno Sanches. See the COPYRIGHT
+// file at the top-level directory of this distribution.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+//
+// This Source Code Form is "Incompatible With Secondary Licenses", as
+// defined by the Mozilla Public License, v. 2.0.
+
+#include "DirectoryMonitor.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace ldmonitor
+{
+	typedef std::function<void()> Task_t;
+
+	struct WorkQueue
+	{
+		std::mutex			m_clLock;
+		std::deque<Task_t>	m_dqTasks;
+	};
+
+	//
+	//Workers keep a reference to Impl, so a pool destroyed from one of its own tasks can still finish that thread safely
+	struct ThreadPool::Impl: std::enable_shared_from_this<ThreadPool::Impl>
+	{
+		std::vector<WorkQueue>		m_vecQueues;
+		std::vector<std::thread>	m_vecThreads;
+
+		std::mutex					m_clSleepLock;
+		std::condition_variable		m_clWakeUp;
+
+		std::atomic<size_t>			m_szPending = 0;
+		std::atomic<size_t>			m_szNextQueue = 0;
+
+		bool						m_fStop = false;
+
+		//worker threads know their pool and queue, so tasks posted from them stay local
+		static thread_local Impl	*t_pCurrentPool;
+		static thread_local size_t	t_szCurrentQueue;
+
+		explicit Impl(size_t numThreads) :
+			m_vecQueues(numThreads)
+		{
+			//empty
+		}
+
+		void Start();
+		void Stop();
+
+		void Push(Task_t task);
+
+		bool TryPop(size_t index, Task_t &task);
+
+		void WorkerProc(size_t index);
+	};
+
+	thread_local ThreadPool::Impl	*ThreadPool::Impl::t_pCurrentPool = nullptr;
+	thread_local size_t				ThreadPool::Impl::t_szCurrentQueue = 0;
+
+	void ThreadPool::Impl::Start()
+	{
+		auto self = this->shared_from_this();
+
+		m_vecThreads.reserve(m_vecQueues.size());
+		for (size_t i = 0; i < m_vecQueues.size(); ++i)
+			m_vecThreads.emplace_back([self, i] { self->WorkerProc(i); });
+	}
+
+	void ThreadPool::Impl::Stop()
+	{
+		{
+			std::lock_guard lock{m_clSleepLock};
+
+			m_fStop = true;
+		}
+
+		m_clWakeUp.notify_all();
+
+		for (auto &thread : m_vecThreads)
+		{
+			//pool released by one of its tasks, this thread exits when the task returns
+			if (thread.get_id() == std::this_thread::get_id())
+				thread.detach();
+			else
+				thread.join();
+		}
+	}
+
+	void ThreadPool::Impl::Push(Task_t task)
+	{
+		size_t index = (t_pCurrentPool == this) ? t_szCurrentQueue : m_szNextQueue.fetch_add(1, std::memory_order_relaxed) % m_vecQueues.size();
+
+		{
+			auto &queue = m_vecQueues[index];
+
+			std::lock_guard lock{queue.m_clLock};
+			queue.m_dqTasks.push_back(std::move(task));
+		}
+
+		m_szPending.fetch_add(1);
+
+		{
+			//empty lock, just make sure a worker about to sleep sees m_szPending
+			std::lock_guard lock{m_clSleepLock};
+		}
+
+		m_clWakeUp.notify_one();
+	}
+
+	bool ThreadPool::Impl::TryPop(size_t index, Task_t &task)
+	{
+		//own queue first, oldest task
+		{
+			auto &queue = m_vecQueues[index];
+
+			std::lock_guard lock{queue.m_clLock};
+			if (!queue.m_dqTasks.empty())
+			{
+				task = std::move(queue.m_dqTasks.front());
+				queue.m_dqTasks.pop_front();
+
+				return true;
+			}
+		}
+
+		//steal the newest task from someone else, so we do not fight with the owner
+		for (size_t i = 1; i < m_vecQueues.size(); ++i)
+		{
+			auto &queue = m_vecQueues[(index + i) % m_vecQueues.size()];
+
+			std::lock_guard lock{queue.m_clLock};
+			if (!queue.m_dqTasks.empty())
+			{
+				task = std::move(queue.m_dqTasks.back());
+				queue.m_dqTasks.pop_back();
+
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	void ThreadPool::Impl::WorkerProc(size_t index)
+	{
+		t_pCurrentPool = this;
+		t_szCurrentQueue = index;
+
+		Task_t task;
+
+		for (;;)
+		{
+			if (this->TryPop(index, task))
+			{
+				m_szPending.fetch_sub(1);
+
+				task();
+				task = nullptr;
+
+				continue;
+			}
+
+			std::unique_lock lock{m_clSleepLock};
+
+			//on stop, keep running until all tasks are done
+			if (m_fStop && (m_szPending == 0))
+				break;
+
+			m_clWakeUp.wait(lock, [this] { return m_fStop || (m_szPending > 0); });
+		}
+
+		t_pCurrentPool = nullptr;
+	}
+
+	ThreadPool::ThreadPool(size_t numThreads)
+	{
+		if (numThreads == 0)
+			numThreads = std::max(1u, std::thread::hardware_concurrency());
+
+		m_spImpl = std::make_shared<Impl>(numThreads);
+		m_spImpl->Start();
+	}
+
+	ThreadPool::~ThreadPool()
+	{
+		m_spImpl->Stop();
+	}
+
+	void ThreadPool::Post(std::function<void()> task)
+	{
+		m_spImpl->Push(std::move(task));
+	}
+
+	size_t ThreadPool::GetNumThreads() const noexcept
+	{
+		return m_spImpl->m_vecQueues.size();
+	}
+}
@@ -0,0 +1,137 @@
+// Copyright (C) 2023 - Bruno Sanches. See the COPYRIGHT
+// file at the top-level directory of this distribution.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+//
+// This Source Code Form is "Incompatible With Secondary Licenses", as
+// defined by the Mozilla Public License, v. 2.0.
+
+#include "Trace.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+
+#include <unistd.h>
+
+namespace ldmonitor
+{
+	static constexpr char TRACE_MAGIC[8] = { 'L', 'D', 'M', 'T', 'R', 'A', 'C', 'E' };
+	static constexpr uint32_t TRACE_VERSION = 1;
+
+	struct TraceHeader
+	{
+		char		m_arMagic[8];
+		uint32_t	m_u32Version;
+		uint32_t	m_u32RecordSize;
+
+		uint64_t	m_u64Count;
+	};
+
+	static_assert(sizeof(TraceHeader) == 24);
+	static_assert(sizeof(TraceRecord) == 32);
+
+	static const char *g_arStageNames[] = { "kernel_wait", "read", "lookup", "lock", "callback" };
+
+#ifdef LDMONITOR_TRACE
+
+	std::vector<TraceRecord> TraceRing::Read() const
+	{
+		const auto head = m_u64Head.load(std::memory_order_acquire);
+		const auto first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+
+		std::vector<TraceRecord> records;
+		records.reserve(head - first);
+
+		for (auto i = first; i < head; ++i)
+		{
+			auto &slot = m_upSlots[i & (TRACE_RING_SIZE - 1)];
+
+			const auto stageWd = slot.m_arWords[3].load(std::memory_order_relaxed);
+
+			records.push_back(TraceRecord{
+				slot.m_arWords[0].load(std::memory_order_relaxed),
+				slot.m_arWords[1].load(std::memory_order_relaxed),
+				slot.m_arWords[2].load(std::memory_order_relaxed),
+				static_cast<int32_t>(static_cast<uint32_t>(stageWd)),
+				static_cast<uint32_t>(stageWd >> 32)
+			});
+		}
+
+		//
+		//The writer may have gone around the ring while we copied, slots of records before (newHead - size)
+		//and the one being written were replaced
+		std::atomic_thread_fence(std::memory_order_acquire);
+
+		const auto newHead = m_u64Head.load(std::memory_order_relaxed);
+
+		if (newHead + 1 > TRACE_RING_SIZE)
+		{
+			const auto firstValid = newHead + 1 - TRACE_RING_SIZE;
+
+			if (firstValid > first)
+				records.erase(records.begin(), records.begin() + static_cast<ptrdiff_t>(std::min<uint64_t>(firstValid - first, records.size())));
+		}
+
+		return records;
+	}
+
+#endif
+
+	static void WriteChromeTrace(std::ostream &out, const std::vector<TraceRecord> &records)
+	{
+		//relative times, so they fit the precision of the doubles used by viewers
+		const uint64_t base = records.empty() ? 0 : records.front().m_u64Start;
+		const auto pid = getpid();
+
+		out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+
+		out.setf(std::ios::fixed);
+		out.precision(3);
+
+		for (size_t i = 0; i < records.size(); ++i)
+		{
+			auto &record = records[i];
+
+			const char *name = record.m_u32Stage < std::size(g_arStageNames) ? g_arStageNames[record.m_u32Stage] : "unknown";
+
+			out << (i ? ",\n" : "\n")
+				<< "{\"name\":\"" << name << "\",\"cat\":\"ldmonitor\",\"ph\":\"X\",\"pid\":" << pid << ",\"tid\":1"
+				<< ",\"ts\":" << (record.m_u64Start - base) / 1000.0
+				<< ",\"dur\":" << record.m_u64Duration / 1000.0
+				<< ",\"args\":{\"event\":" << record.m_u64Event << ",\"wd\":" << record.m_i32Wd << "}}";
+		}
+
+		out << "\n]}\n";
+	}
+
+	bool WriteTrace(const std::string &path, const std::vector<TraceRecord> &records, TraceFormat format)
+	{
+		std::ofstream out{ path, std::ios::binary | std::ios::trunc };
+		if (!out)
+			return false;
+
+		if (format == TRACE_FORMAT_CHROME)
+		{
+			WriteChromeTrace(out, records);
+		}
+		else
+		{
+			TraceHeader header;
+
+			memcpy(header.m_arMagic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+			header.m_u32Version = TRACE_VERSION;
+			header.m_u32RecordSize = sizeof(TraceRecord);
+			header.m_u64Count = records.size();
+
+			out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+			out.write(reinterpret_cast<const char *>(records.data()), static_cast<std::streamsize>(records.size() * sizeof(TraceRecord)));
+		}
+
+		out.flush();
+
+		return static_cast<bool>(out);
+	}
+}
@@ -0,0 +1,181 @@
+// Copyright (C) 2023 - Bruno Sanches. See the COPYRIGHT
+// file at the top-level directory of this distribution.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+//
+// This Source Code Form is "Incompatible With Secondary Licenses", as
+// defined by the Mozilla Public License, v. 2.0.
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "DirectoryMonitor.h"
+#include "Metrics.h"
+
+namespace ldmonitor
+{
+	enum TraceStages : uint32_t
+	{
+		TRACE_KERNEL_WAIT,
+		TRACE_READ,
+		TRACE_LOOKUP,
+		TRACE_LOCK,
+		TRACE_CALLBACK
+	};
+
+	struct TraceRecord
+	{
+		//steady clock ns
+		uint64_t	m_u64Start;
+		uint64_t	m_u64Duration;
+
+		//sequence of the last inotify event read, so waits and reads are followed by the events they got
+		uint64_t	m_u64Event;
+
+		int32_t		m_i32Wd;
+		uint32_t	m_u32Stage;
+	};
+
+#ifdef LDMONITOR_TRACE
+
+	/**
+	* Last TRACE_RING_SIZE records of a monitor thread
+	*
+	* Only the monitor thread writes, without waiting for anyone: old records are overwritten. Readers copy the
+	* slots and check the head again to drop any overwritten while copying, like a seqlock.
+	*
+	*/
+	class TraceRing
+	{
+		public:
+			static constexpr size_t TRACE_RING_SIZE = 64 * 1024;
+
+			TraceRing() :
+				m_upSlots{ std::make_unique<Slot[]>(TRACE_RING_SIZE) }
+			{
+				//empty
+			}
+
+			inline void Record(uint32_t stage, uint64_t start, uint64_t end, int wd) noexcept
+			{
+				const auto head = m_u64Head.load(std::memory_order_relaxed);
+
+				//readers that see any of the stores bellow also see head, so they know the slot is being replaced
+				std::atomic_thread_fence(std::memory_order_release);
+
+				auto &slot = m_upSlots[head & (TRACE_RING_SIZE - 1)];
+
+				slot.m_arWords[0].store(start, std::memory_order_relaxed);
+				slot.m_arWords[1].store(end - start, std::memory_order_relaxed);
+				slot.m_arWords[2].store(m_u64Event, std::memory_order_relaxed);
+				slot.m_arWords[3].store((uint64_t{ stage } << 32) | static_cast<uint32_t>(wd), std::memory_order_relaxed);
+
+				m_u64Head.store(head + 1, std::memory_order_release);
+			}
+
+			/**
+			* Called by the monitor thread for each event read, the following records belong to it
+			*
+			*/
+			inline void NextEvent() noexcept
+			{
+				++m_u64Event;
+			}
+
+			/**
+			* Records still on the ring, oldest first, safe from any thread
+			*
+			*/
+			std::vector<TraceRecord> Read() const;
+
+		private:
+			struct Slot
+			{
+				std::array<std::atomic<uint64_t>, 4> m_arWords = {};
+			};
+
+			std::unique_ptr<Slot[]>	m_upSlots;
+
+			std::atomic<uint64_t>	m_u64Head{ 0 };
+
+			//monitor thread only
+			uint64_t				m_u64Event = 0;
+	};
+
+	/**
+	* Records stage from its construction to its destruction
+	*
+	*/
+	class TraceScope
+	{
+		public:
+			inline TraceScope(TraceRing &ring, uint32_t stage, int wd = -1) noexcept :
+				m_rclRing{ ring },
+				m_u64Start{ GetTimestamp() },
+				m_u32Stage{ stage },
+				m_iWd{ wd }
+			{
+				//empty
+			}
+
+			inline ~TraceScope()
+			{
+				m_rclRing.Record(m_u32Stage, m_u64Start, GetTimestamp(), m_iWd);
+			}
+
+			TraceScope(const TraceScope &) = delete;
+			TraceScope &operator=(const TraceScope &) = delete;
+
+		private:
+			TraceRing	&m_rclRing;
+
+			uint64_t	m_u64Start;
+			uint32_t	m_u32Stage;
+			int			m_iWd;
+	};
+
+#else
+
+	//tracing not built, everything bellow is empty and compiled away
+
+	class TraceRing
+	{
+		public:
+			inline void NextEvent() noexcept
+			{
+				//empty
+			}
+
+			inline std::vector<TraceRecord> Read() const
+			{
+				return {};
+			}
+	};
+
+	class TraceScope
+	{
+		public:
+			inline TraceScope(TraceRing &, uint32_t, int = -1) noexcept
+			{
+				//empty
+			}
+
+			TraceScope(const TraceScope &) = delete;
+			TraceScope &operator=(const TraceScope &) = delete;
+	};
+
+#endif
+
+	/**
+	* Writes records to path, returns false if it cannot be written
+	*
+	*/
+	bool WriteTrace(const std::string &path, const std::vector<TraceRecord> &records, TraceFormat format);
+}
@@ -0,0 +1,178 @@
+// Copyright (C) 2023 - Bruno Sanches. See the COPYRIGHT
+// file at the top-level directory of this distribution.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+//
+// This Source Code Form is "Incompatible With Secondary Licenses", as
+// defined by the Mozilla Public License, v. 2.0.
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+namespace ldmonitor
+{
+	/**
+	* Map of inotify wds to nodes, copies share all pages that were not changed after the copy
+	*
+	* The kernel hands out wds sequentially, so they are used directly as indexes into fixed size pages and
+	* lookups are O(1). Copying a table only copies the page index, so publishing a changed copy costs
+	* O(n / PAGE_SIZE) instead of O(n).
+	*
+	* Not thread safe, a table must not be changed after being shared with other threads.
+	*
+	*/
+	template <typename T>
+	class WatchTable
+	{
+		public:
+			typedef std::shared_ptr<const T> Value_t;
+
+			static constexpr size_t PAGE_BITS = 8;
+			static constexpr size_t PAGE_SIZE = size_t{ 1 } << PAGE_BITS;
+
+			/**
+			* Returns the node of wd or null
+			*
+			*/
+			const T *Find(int wd) const noexcept
+			{
+				if (wd < 0)
+					return nullptr;
+
+				const auto page = static_cast<size_t>(wd) >> PAGE_BITS;
+				if ((page >= m_vecPages.size()) || !m_vecPages[page])
+					return nullptr;
+
+				return m_vecPages[page]->m_arSlots[wd & (PAGE_SIZE - 1)].get();
+			}
+
+			/**
+			* Returns false if wd is already on the table
+			*
+			*/
+			bool Insert(int wd, Value_t value)
+			{
+				if ((wd < 0) || this->Find(wd))
+					return false;
+
+				auto &page = this->GetPage(static_cast<size_t>(wd) >> PAGE_BITS);
+
+				page.m_arSlots[wd & (PAGE_SIZE - 1)] = std::move(value);
+				++page.m_szUsed;
+
+				++m_szSize;
+
+				return true;
+			}
+
+			/**
+			* Changes the node of wd, returns false if wd is not on the table
+			*
+			*/
+			bool Replace(int wd, Value_t value)
+			{
+				if (!this->Find(wd))
+					return false;
+
+				auto &page = this->GetPage(static_cast<size_t>(wd) >> PAGE_BITS);
+
+				page.m_arSlots[wd & (PAGE_SIZE - 1)] = std::move(value);
+
+				return true;
+			}
+
+			bool Erase(int wd)
+			{
+				if (!this->Find(wd))
+					return false;
+
+				const auto index = static_cast<size_t>(wd) >> PAGE_BITS;
+				auto &page = this->GetPage(index);
+
+				page.m_arSlots[wd & (PAGE_SIZE - 1)].reset();
+				--m_szSize;
+
+				if (--page.m_szUsed == 0)
+				{
+					m_vecPages[index].reset();
+
+					while (!m_vecPages.empty() && !m_vecPages.back())
+						m_vecPages.pop_back();
+				}
+
+				return true;
+			}
+
+			/**
+			* Calls func(wd, node) for every node, ordered by wd
+			*
+			*/
+			template <typename F>
+			void ForEach(F &&func) const
+			{
+				for (size_t i = 0; i < m_vecPages.size(); ++i)
+				{
+					if (!m_vecPages[i])
+						continue;
+
+					auto &slots = m_vecPages[i]->m_arSlots;
+
+					for (size_t j = 0; j < PAGE_SIZE; ++j)
+					{
+						if (slots[j])
+							func(static_cast<int>((i << PAGE_BITS) | j), *slots[j]);
+					}
+				}
+			}
+
+			inline size_t GetSize() const noexcept
+			{
+				return m_szSize;
+			}
+
+			inline bool IsEmpty() const noexcept
+			{
+				return m_szSize == 0;
+			}
+
+		private:
+			struct Page
+			{
+				std::array<Value_t, PAGE_SIZE>	m_arSlots;
+				size_t							m_szUsed = 0;
+			};
+
+			/**
+			* Returns a page owned only by this table, so it can be changed
+			*
+			*/
+			Page &GetPage(size_t index)
+			{
+				if (index >= m_vecPages.size())
+					m_vecPages.resize(index + 1);
+
+				auto &page = m_vecPages[index];
+
+				//
+				//A page referenced only by us cannot be reached by other threads, any other owner
+				//is a published copy, so copy it before changing
+				if (!page)
+					page = std::make_shared<Page>();
+				else if (page.use_count() > 1)
+					page = std::make_shared<Page>(*page);
+
+				return *page;
+			}
+
+		private:
+			std::vector<std::shared_ptr<Page>>	m_vecPages;
+
+			size_t								m_szSize = 0;
+	};
+}
@@ -0,0 +1,121 @@
+// Copyright (C) 2023 - Bruno Sanches. See the COPYRIGHT
+// file at the top-level directory of this distribution.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+//
+// This Source Code Form is "Incompatible With Secondary Licenses", as
+// defined by the Mozilla Public License, v. 2.0.
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <cstdlib>
+#include <fstream>
+#include <new>
+#include <thread>
+
+#include "ldmonitor/DirectoryMonitor.h"
+
+using namespace std::chrono_literals;
+
+//
+//
+// Counts the allocations of each thread, replaces the global operator new of this executable
+//
+//
+
+static thread_local size_t t_szAllocations = 0;
+
+void *operator new(size_t size)
+{
+	++t_szAllocations;
+
+	if (auto ptr = std::malloc(size ? size : 1))
+		return ptr;
+
+	throw std::bad_alloc{};
+}
+
+void operator delete(void *ptr) noexcept
+{
+	std::free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+	std::free(ptr);
+}
+
+#ifndef WIN32
+
+TEST(ldmonitor, EventCallbackAllocationTest)
+{
+	auto tmpPath = ldmonitor::fs::temp_directory_path();
+
+	tmpPath.append("testDirAllocation");
+
+	ldmonitor::fs::remove_all(tmpPath);
+	ldmonitor::fs::create_directories(tmpPath / "subdirectory");
+
+	//names bigger than any small string buffer
+	const std::string longName = "a_file_name_that_does_not_fit_on_small_string_optimization_";
+
+	const int numWarmUp = 64;
+	const int numEvents = 512;
+
+	std::atomic_int received = 0;
+	std::atomic<size_t> warmAllocations = 0;
+	std::atomic<size_t> endAllocations = 0;
+	std::atomic_bool badName = false;
+
+	ldmonitor::WatchOptions options;
+	options.m_fRecursive = true;
+
+	//the read buffer grows with bursts, keep it at the minimum so it is allocated only once
+	ldmonitor::MonitorOptions monitorOptions;
+	monitorOptions.m_szMaxReadBuffer = 0;
+
+	ldmonitor::Monitor monitor{ monitorOptions };
+
+	monitor.WatchEvents(
+		tmpPath,
+		[&](const ldmonitor::Event &event)
+		{
+			//runs on the monitor thread, so these are its allocations
+			if (event.m_svFileName.compare(0, 13, "subdirectory/") || (event.m_iWd < 0))
+				badName = true;
+
+			auto count = ++received;
+
+			if (count == numWarmUp)
+				warmAllocations = t_szAllocations;
+			else if (count == numWarmUp + numEvents)
+				endAllocations = t_szAllocations;
+		},
+		ldmonitor::MONITOR_ACTION_FILE_CREATE,
+		options
+	);
+
+	auto basePath = (tmpPath / "subdirectory").string() + '/' + longName;
+
+	for (int i = 0; i < numWarmUp + numEvents; ++i)
+	{
+		std::ofstream ofs(basePath + std::to_string(i));
+	}
+
+	for (int i = 0; (i < 5000) && (received < numWarmUp + numEvents); ++i)
+		std::this_thread::sleep_for(1ms);
+
+	monitor.Unwatch(tmpPath);
+
+	ASSERT_EQ(received, numWarmUp + numEvents);
+	ASSERT_FALSE(badName);
+	ASSERT_GT(warmAllocations.load(), 0u);
+	ASSERT_EQ(endAllocations.load(), warmAllocations.load());
+
+	ldmonitor::fs::remove_all(tmpPath);
+}
+
+#endif
@@ -10,8 +10,14 @@
 
 #include <gtest/gtest.h>
 
+#include <algorithm>
+#include <atomic>
 #include <thread>
 #include <fstream>
+#include <map>
+#include <mutex>
+#include <set>
+#include <vector>
 
 #include "ldmonitor/DirectoryMonitor.h"
 
@@ -288,4 +294,2894 @@ TEST(ldmonitor, BasicTest)
 	}
 		
 	ldmonitor::Unwatch(tmpPath);
-}
\ No newline at end of file
+}
+
+//
+//
+//
+//
+//
+
+#ifndef WIN32
+
+#include <poll.h>
+#include <sys/inotify.h>
+
+static std::mutex g_clBatchLock;
+static std::set<std::string> g_setBatchFiles;
+static size_t g_szBatchCount = 0;
+
+static void BatchCallback(const ldmonitor::fs::path &path, const ldmonitor::Event *events, size_t count, std::chrono::milliseconds time)
+{
+	std::lock_guard lock{g_clBatchLock};
+
+	++g_szBatchCount;
+
+	for (size_t i = 0; i < count; ++i)
+	{
+		ASSERT_EQ(events[i].m_u32Action, ldmonitor::MONITOR_ACTION_FILE_CREATE);
+
+		g_setBatchFiles.emplace(events[i].m_svFileName);
+	}
+}
+
+TEST(ldmonitor, BatchTest)
+{
+	auto tmpPath = ldmonitor::fs::temp_directory_path();
+
+	tmpPath.append("testBatchDir");
+
+	ldmonitor::fs::remove_all(tmpPath);
+	ldmonitor::fs::create_directories(tmpPath);
+
+	ldmonitor::WatchBatch(tmpPath, BatchCallback, ldmonitor::MONITOR_ACTION_FILE_CREATE);
+
+	const size_t numFiles = 32;
+
+	for (size_t i = 0; i < numFiles; ++i)
+	{
+		auto filePath = tmpPath;
+		filePath.append("batch_" + std::to_string(i) + ".txt");
+
+		std::ofstream ofs(filePath);
+	}
+
+	for (;;)
+	{
+		{
+			std::lock_guard lock{g_clBatchLock};
+
+			if (g_setBatchFiles.size() == numFiles)
+				break;
+		}
+
+		std::this_thread::sleep_for(1ms);
+	}
+
+	ldmonitor::Unwatch(tmpPath);
+
+	ASSERT_TRUE(g_setBatchFiles.count("batch_0.txt"));
+	ASSERT_TRUE(g_setBatchFiles.count("batch_31.txt"));
+	ASSERT_LE(g_szBatchCount, numFiles);
+}
+
+//
+//
+//
+//
+//
+
+static std::atomic_bool g_fSlowCallbackEntered = false;
+static std::atomic_bool g_fSlowCallbackRelease = false;
+static std::atomic_int g_iSlowCallbackCount = 0;
+
+static void SlowCallback(const ldmonitor::fs::path &path, std::string fileName, uint32_t flags, std::chrono::milliseconds time)
+{
+	++g_iSlowCallbackCount;
+	g_fSlowCallbackEntered = true;
+
+	while (!g_fSlowCallbackRelease)
+		std::this_thread::sleep_for(1ms);
+}
+
+TEST(ldmonitor, SlowCallbackTest)
+{
+	auto slowPath = ldmonitor::fs::temp_directory_path();
+	slowPath.append("testSlowDir");
+
+	auto otherPath = ldmonitor::fs::temp_directory_path();
+	otherPath.append("testOtherDir");
+
+	ldmonitor::fs::remove_all(slowPath);
+	ldmonitor::fs::create_directories(slowPath);
+	ldmonitor::fs::create_directories(otherPath);
+
+	ldmonitor::Watch(slowPath, SlowCallback, ldmonitor::MONITOR_ACTION_FILE_CREATE);
+
+	{
+		auto filePath = slowPath;
+		filePath.append("slow.txt");
+
+		std::ofstream ofs(filePath);
+	}
+
+	while (!g_fSlowCallbackEntered)
+		std::this_thread::sleep_for(1ms);
+
+	//callback is blocked on the monitor thread, registration must still work
+	ldmonitor::Watch(otherPath, NullFileCallback, ldmonitor::MONITOR_ACTION_FILE_CREATE);
+	ASSERT_TRUE(ldmonitor::Unwatch(otherPath));
+	ASSERT_TRUE(ldmonitor::detail::IsThreadWaiting(slowPath).value());
+
+	//queue more events for the slow watcher, they must be discarded after Unwatch
+	for (int i = 0; i < 8; ++i)
+	{
+		auto filePath = slowPath;
+		filePath.append("slow_" + std::to_string(i) + ".txt");
+
+		std::ofstream ofs(filePath);
+	}
+
+	//keep a second watch alive, so the thread keeps running after Unwatch
+	ldmonitor::Watch(otherPath, NullFileCallback, ldmonitor::MONITOR_ACTION_FILE_CREATE);
+
+	std::thread releaser{ [] { std::this_thread::sleep_for(20ms); g_fSlowCallbackRelease = true; } };
+
+	ldmonitor::Unwatch(slowPath);
+
+	const int count = g_iSlowCallbackCount;
+	ASSERT_EQ(count, 1);
+
+	std::this_thread::sleep_for(20ms);
+	ASSERT_EQ(g_iSlowCallbackCount, count);
+
+	releaser.join();
+
+	ldmonitor::Unwatch(otherPath);
+}
+
+TEST(ldmonitor, SlowCallbackRegistrationTest)
+{
+	auto tmpPath = ldmonitor::fs::temp_directory_path();
+	tmpPath.append("testSlowRegistrationDir");
+
+	ldmonitor::fs::remove_all(tmpPath);
+	ldmonitor::fs::create_directories(tmpPath / "blocker");
+	ldmonitor::fs::create_directories(tmpPath / "other");
+
+	std::atomic_bool entered = false;
+	std::atomic_bool release = false;
+
+	ldmonitor::Watch(
+		tmpPath / "blocker",
+		[&entered, &release](const ldmonitor::fs::path &, std::string, uint32_t, std::chrono::milliseconds)
+		{
+			entered = true;
+
+			while (!release)
+				std::this_thread::sleep_for(1ms);
+		},
+		ldmonitor::MONITOR_ACTION_FILE_CREATE
+	);
+
+	std::ofstream{ tmpPath / "blocker" / "a.txt" };
+
+	while (!entered)
+		std::this_thread::sleep_for(1ms);
+
+	//each Watch leaves a scan for the monitor thread and wakes it, far more than it could take before
+	constexpr int NUM_WATCHES = 40;
+
+	ldmonitor::WatchOptions options;
+	options.m_fKeepIndex = true;
+
+	std::atomic_int done = 0;
+
+	std::thread registrar{ [&]()
+	{
+		for (int i = 0; i < NUM_WATCHES; ++i)
+		{
+			ldmonitor::Watch(tmpPath / "other", NullFileCallback, ldmonitor::MONITOR_ACTION_FILE_CREATE, options);
+			ldmonitor::Unwatch(tmpPath / "other");
+
+			++done;
+		}
+	} };
+
+	for (int i = 0; (i < 5000) && (done < NUM_WATCHES); ++i)
+		std::this_thread::sleep_for(1ms);
+
+	//a stuck Watch never returns, terminates on the joinable thread instead of hanging
+	ASSERT_EQ(done, NUM_WATCHES);
+
+	registrar.join();
+
+	release = true;
+
+	ldmonitor::Unwatch(tmpPath / "blocker");
+
+	ldmonitor::fs::remove_all(tmpPath);
+}
+
+//
+//
+//
+//
+//
+
+TEST(ldmonitor, ExecutorTest)
+{
+	auto orderedPath = ldmonitor::fs::temp_directory_path();
+	orderedPath.append("testOrderedDir");
+
+	auto blockedPath = ldmonitor::fs::temp_directory_path();
+	blockedPath.append("testBlockedDir");
+
+	ldmonitor::fs::remove_all(orderedPath);
+	ldmonitor::fs::remove_all(blockedPath);
+	ldmonitor::fs::create_directories(orderedPath);
+	ldmonitor::fs::create_directories(blockedPath);
+
+	ldmonitor::WatchOptions options;
+	options.m_spExecutor = std::make_shared<ldmonitor::ThreadPool>(4);
+
+	std::atomic_bool release = false;
+	std::atomic_bool blocked = false;
+
+	ldmonitor::Watch(
+		blockedPath,
+		[&release, &blocked](const ldmonitor::fs::path &path, std::string fileName, uint32_t flags, std::chrono::milliseconds time)
+		{
+			blocked = true;
+
+			while (!release)
+				std::this_thread::sleep_for(1ms);
+		},
+		ldmonitor::MONITOR_ACTION_FILE_CREATE,
+		options
+	);
+
+	std::mutex lock;
+	std::vector<std::string> received;
+	std::atomic_int running = 0;
+	bool concurrent = false;
+
+	ldmonitor::Watch(
+		orderedPath,
+		[&](const ldmonitor::fs::path &path, std::string fileName, uint32_t flags, std::chrono::milliseconds time)
+		{
+			if (++running > 1)
+				concurrent = true;
+
+			{
+				std::lock_guard guard{lock};
+				received.push_back(std::move(fileName));
+			}
+
+			--running;
+		},
+		ldmonitor::MONITOR_ACTION_FILE_CREATE,
+		options
+	);
+
+	{
+		auto filePath = blockedPath;
+		filePath.append("block.txt");
+
+		std::ofstream ofs(filePath);
+	}
+
+	while (!blocked)
+		std::this_thread::sleep_for(1ms);
+
+	//blocked callback is holding a worker, the other watch must keep going
+	const int numFiles = 200;
+	for (int i = 0; i < numFiles; ++i)
+	{
+		auto filePath = orderedPath;
+		filePath.append("ordered_" + std::to_string(i));
+
+		std::ofstream ofs(filePath);
+	}
+
+	for (;;)
+	{
+		{
+			std::lock_guard guard{lock};
+
+			if (received.size() == numFiles)
+				break;
+		}
+
+		std::this_thread::sleep_for(1ms);
+	}
+
+	ASSERT_FALSE(concurrent);
+	for (int i = 0; i < numFiles; ++i)
+		ASSERT_EQ(received[i], "ordered_" + std::to_string(i));
+
+	release = true;
+
+	ldmonitor::Unwatch(orderedPath);
+	ldmonitor::Unwatch(blockedPath);
+}
+
+//
+//
+//
+//
+//
+
+TEST(ldmonitor, RecursiveTest)
+{
+	auto tmpPath = ldmonitor::fs::temp_directory_path();
+	tmpPath.append("testRecursiveDir");
+
+	ldmonitor::fs::remove_all(tmpPath);
+
+	auto existingPath = tmpPath;
+	existingPath.append("a/b");
+	ldmonitor::fs::create_directories(existingPath);
+
+	std::mutex lock;
+	std::set<std::string> created;
+
+	ldmonitor::WatchOptions options;
+	options.m_fRecursive = true;
+
+	ldmonitor::Watch(
+		tmpPath,
+		[&lock, &created](const ldmonitor::fs::path &path, std::string fileName, uint32_t flags, std::chrono::milliseconds time)
+		{
+			std::lock_guard guard{lock};
+			created.insert(std::move(fileName));
+		},
+		ldmonitor::MONITOR_ACTION_FILE_CREATE,
+		options
+	);
+
+	auto WaitFile = [&lock, &created](const char *name)
+	{
+		for (;;)
+		{
+			{
+				std::lock_guard guard{lock};
+
+				if (created.count(name))
+					return;
+			}
+
+			std::this_thread::sleep_for(1ms);
+		}
+	};
+
+	//subdirectory that existed before the watch
+	{
+		auto filePath = existingPath;
+		filePath.append("f1.txt");
+
+		std::ofstream ofs(filePath);
+	}
+
+	WaitFile("a/b/f1.txt");
+
+	//new tree and a file created right away, probably before the monitor thread watches it
+	auto newPath = tmpPath;
+	newPath.append("c/d/e");
+	ldmonitor::fs::create_directories(newPath);
+
+	newPath.append("f2.txt");
+	{
+		std::ofstream ofs(newPath);
+	}
+
+	WaitFile("c");
+	WaitFile("c/d/e/f2.txt");
+
+	//directory moved in the tree must keep working with its new name
+	auto movedPath = tmpPath;
+	movedPath.append("moved");
+	ldmonitor::fs::rename(existingPath, movedPath);
+
+	//contents of directories moved in are reported as created
+	WaitFile("moved/f1.txt");
+
+	movedPath.append("f3.txt");
+	{
+		std::ofstream ofs(movedPath);
+	}
+
+	WaitFile("moved/f3.txt");
+
+	ldmonitor::Unwatch(tmpPath);
+}
+
+//
+//
+//
+//
+//
+
+TEST(ldmonitor, CoalesceTest)
+{
+	auto tmpPath = ldmonitor::fs::temp_directory_path();
+	tmpPath.append("testCoalesceDir");
+
+	ldmonitor::fs::remove_all(tmpPath);
+	ldmonitor::fs::create_directories(tmpPath);
+
+	std::mutex lock;
+	std::vector<std::pair<std::string, uint32_t>> events;
+
+	ldmonitor::WatchOptions options;
+	options.m_tCoalesceWindow = 50ms;
+
+	ldmonitor::Watch(
+		tmpPath,
+		[&lock, &events](const ldmonitor::fs::path &path, std::string fileName, uint32_t flags, std::chrono::milliseconds time)
+		{
+			std::lock_guard guard{lock};
+			events.emplace_back(std::move(fileName), flags);
+		},
+		ldmonitor::MONITOR_ACTION_FILE_CREATE | ldmonitor::MONITOR_ACTION_FILE_DELETE | ldmonitor::MONITOR_ACTION_FILE_MODIFY,
+		options
+	);
+
+	auto filePath = tmpPath;
+	filePath.append("burst.txt");
+
+	auto tempPath = tmpPath;
+	tempPath.append("temp.txt");
+
+	{
+		std::ofstream ofs(filePath);
+
+		for (int i = 0; i < 10; ++i)
+		{
+			ofs << "line " << i << '\n';
+			ofs.flush();
+		}
+
+		//created and deleted, must never show up
+		std::ofstream tmp(tempPath);
+		tmp << "temp";
+		tmp.close();
+
+		ldmonitor::fs::remove(tempPath);
+	}
+
+	auto WaitEvents = [&lock, &events](size_t count)
+	{
+		for (;;)
+		{
+			{
+				std::lock_guard guard{lock};
+
+				if (events.size() >= count)
+					return;
+			}
+
+			std::this_thread::sleep_for(1ms);
+		}
+	};
+
+	WaitEvents(1);
+
+	//wait a few windows, nothing else should come
+	std::this_thread::sleep_for(150ms);
+
+	{
+		std::lock_guard guard{lock};
+
+		ASSERT_EQ(events.size(), 1);
+		ASSERT_EQ(events[0].first, "burst.txt");
+		ASSERT_EQ(events[0].second, ldmonitor::MONITOR_ACTION_FILE_CREATE);
+	}
+
+	{
+		std::ofstream ofs(filePath, std::ios_base::app);
+
+		for (int i = 0; i < 10; ++i)
+		{
+			ofs << "more " << i << '\n';
+			ofs.flush();
+		}
+	}
+
+	WaitEvents(2);
+	std::this_thread::sleep_for(150ms);
+
+	ldmonitor::Unwatch(tmpPath);
+
+	ASSERT_EQ(events.size(), 2);
+	ASSERT_EQ(events[1].second, ldmonitor::MONITOR_ACTION_FILE_MODIFY);
+}
+
+//
+//
+//
+//
+//
+
+TEST(ldmonitor, OverflowReconcileTest)
+{
+	size_t maxQueuedEvents = 16384;
+	{
+		std::ifstream ifs("/proc/sys/fs/inotify/max_queued_events");
+		ifs >> maxQueuedEvents;
+	}
+
+	auto tmpPath = ldmonitor::fs::temp_directory_path();
+	tmpPath.append("testOverflowDir");
+
+	ldmonitor::fs::remove_all(tmpPath);
+	ldmonitor::fs::create_directories(tmpPath);
+
+	auto MakeName = [&tmpPath](const char *prefix, size_t index)
+	{
+		auto filePath = tmpPath;
+		filePath.append(prefix + std::to_string(index));
+
+		return filePath;
+	};
+
+	//some files that will be deleted and modified while events are lost
+	const size_t numExisting = 100;
+	for (size_t i = 0; i < numExisting; ++i)
+	{
+		std::ofstream ofs(MakeName("old_", i));
+		ofs << "old";
+	}
+
+	std::mutex lock;
+	std::set<std::string> known;
+	std::set<std::string> modified;
+	for (size_t i = 0; i < numExisting; ++i)
+		known.insert("old_" + std::to_string(i));
+
+	std::atomic_bool release = false;
+	std::atomic_bool blocked = false;
+	std::atomic_bool overflow = false;
+
+	ldmonitor::WatchOptions options;
+	options.m_fReconcileOnOverflow = true;
+
+	ldmonitor::Watch(
+		tmpPath,
+		[&](const ldmonitor::fs::path &path, std::string fileName, uint32_t flags, std::chrono::milliseconds time)
+		{
+			//hold the monitor thread, so the kernel queue fills up
+			blocked = true;
+			while (!release)
+				std::this_thread::sleep_for(1ms);
+
+			std::lock_guard guard{lock};
+
+			if (flags & ldmonitor::MONITOR_ACTION_QUEUE_OVERFLOW)
+				overflow = true;
+			else if (flags & ldmonitor::MONITOR_ACTION_FILE_CREATE)
+				known.insert(fileName);
+			else if (flags & ldmonitor::MONITOR_ACTION_FILE_DELETE)
+				known.erase(fileName);
+			else if (flags & ldmonitor::MONITOR_ACTION_FILE_MODIFY)
+				modified.insert(fileName);
+		},
+		ldmonitor::MONITOR_ACTION_FILE_CREATE | ldmonitor::MONITOR_ACTION_FILE_DELETE | ldmonitor::MONITOR_ACTION_FILE_MODIFY | ldmonitor::MONITOR_ACTION_QUEUE_OVERFLOW,
+		options
+	);
+
+	{
+		std::ofstream ofs(MakeName("first_", 0));
+	}
+
+	while (!blocked)
+		std::this_thread::sleep_for(1ms);
+
+	//enough creates to overflow the queue, each file generates create and modify
+	const size_t numNew = maxQueuedEvents / 2 + 1024;
+	for (size_t i = 0; i < numNew; ++i)
+	{
+		std::ofstream ofs(MakeName("new_", i));
+		ofs << "new";
+	}
+
+	//changes that are only visible by the rescan
+	for (size_t i = 0; i < numExisting / 2; ++i)
+		ldmonitor::fs::remove(MakeName("old_", i));
+
+	for (size_t i = numExisting / 2; i < numExisting; ++i)
+	{
+		std::ofstream ofs(MakeName("old_", i), std::ios_base::app);
+		ofs << "changed";
+	}
+
+	release = true;
+
+	std::set<std::string> actual;
+	for (auto &entry : ldmonitor::fs::directory_iterator(tmpPath))
+		actual.insert(entry.path().filename().string());
+
+	bool converged = false;
+	for (int i = 0; (i < 10000) && !converged; ++i)
+	{
+		std::this_thread::sleep_for(1ms);
+
+		std::lock_guard guard{lock};
+		converged = overflow && (known == actual) && modified.count("old_" + std::to_string(numExisting - 1));
+	}
+
+	ldmonitor::Unwatch(tmpPath);
+
+	ASSERT_TRUE(overflow);
+	ASSERT_EQ(known, actual);
+	ASSERT_TRUE(modified.count("old_" + std::to_string(numExisting - 1)));
+
+	ldmonitor::fs::remove_all(tmpPath);
+}
+
+//
+//
+//
+//
+//
+
+TEST(ldmonitor, PathIndexTest)
+{
+	auto tmpPath = ldmonitor::fs::temp_directory_path();
+
+	tmpPath.append("testDirPathIndex");
+
+	ldmonitor::fs::remove_all(tmpPath);
+	ldmonitor::fs::create_directories(tmpPath);
+
+	auto pathStr = tmpPath.string();
+
+	ldmonitor::Watch(pathStr + "/", NullFileCallback, ldmonitor::MONITOR_ACTION_FILE_CREATE);
+
+	//same directory, spelled differently
+	ASSERT_THROW(ldmonitor::Watch(tmpPath, NullFileCallback, ldmonitor::MONITOR_ACTION_FILE_CREATE), std::invalid_argument);
+	ASSERT_THROW(ldmonitor::Watch(pathStr + "/./", NullFileCallback, ldmonitor::MONITOR_ACTION_FILE_CREATE), std::invalid_argument);
+
+	ASSERT_FALSE(ldmonitor::Unwatch(pathStr + "/other"));
+	ASSERT_TRUE(ldmonitor::Unwatch(pathStr + "//"));
+	ASSERT_FALSE(ldmonitor::Unwatch(tmpPath));
+
+	//many watches, so the table spans several pages
+	std::vector<ldmonitor::fs::path> dirs;
+	for (int i = 0; i < 600; ++i)
+	{
+		auto dir = tmpPath;
+		dir.append("d" + std::to_string(i));
+
+		ldmonitor::fs::create_directories(dir);
+		ldmonitor::Watch(dir, NullFileCallback, ldmonitor::MONITOR_ACTION_FILE_CREATE);
+
+		dirs.push_back(std::move(dir));
+	}
+
+	for (size_t i = 0; i < dirs.size(); i += 2)
+		ASSERT_TRUE(ldmonitor::Unwatch(dirs[i]));
+
+	for (size_t i = 0; i < dirs.size(); ++i)
+		ASSERT_EQ(ldmonitor::Unwatch(dirs[i]), (i % 2) == 1);
+
+	ldmonitor::fs::remove_all(tmpPath);
+}
+
+//
+//
+//
+//
+//
+
+TEST(ldmonitor, MonitorInstanceTest)
+{
+	auto tmpPath = ldmonitor::fs::temp_directory_path();
+
+	tmpPath.append("testDirMonitor");
+
+	ldmonitor::fs::remove_all(tmpPath);
+	ldmonitor::fs::create_directories(tmpPath);
+
+	std::atomic_int first = 0;
+	std::atomic_int second = 0;
+	std::atomic_int global = 0;
+
+	{
+		ldmonitor::Monitor monitor1;
+		ldmonitor::Monitor monitor2;
+
+		//each instance has its own table, so the same directory can be watched by both and by the default instance
+		monitor1.Watch(tmpPath, [&first](const ldmonitor::fs::path &, std::string, uint32_t, std::chrono::milliseconds) { ++first; }, ldmonitor::MONITOR_ACTION_FILE_CREATE);
+		monitor2.Watch(tmpPath, [&second](const ldmonitor::fs::path &, std::string, uint32_t, std::chrono::milliseconds) { ++second; }, ldmonitor::MONITOR_ACTION_FILE_CREATE);
+		ldmonitor::Watch(tmpPath, [&global](const ldmonitor::fs::path &, std::string, uint32_t, std::chrono::milliseconds) { ++global; }, ldmonitor::MONITOR_ACTION_FILE_CREATE);
+
+		ASSERT_THROW(monitor1.Watch(tmpPath, NullFileCallback, ldmonitor::MONITOR_ACTION_FILE_CREATE), std::invalid_argument);
+		ASSERT_TRUE(monitor1.IsRunning());
+
+		{
+			auto filePath = tmpPath;
+			filePath.append("f1.txt");
+
+			std::ofstream ofs(filePath);
+		}
+
+		for (int i = 0; (i < 5000) && ((first == 0) || (second == 0) || (global == 0)); ++i)
+			std::this_thread::sleep_for(1ms);
+
+		ASSERT_TRUE(monitor2.Unwatch(tmpPath));
+		ASSERT_FALSE(monitor2.IsRunning());
+
+		//monitor1 is destroyed with its watch
+	}
+
+	ASSERT_TRUE(ldmonitor::Unwatch(tmpPath));
+
+	ASSERT_EQ(first, 1);
+	ASSERT_EQ(second, 1);
+	ASSERT_EQ(global, 1);
+
+	ldmonitor::fs::remove_all(tmpPath);
+}
+
+TEST(ldmonitor, ShardedMonitorTest)
+{
+	auto tmpPath = ldmonitor::fs::temp_directory_path();
+
+	tmpPath.append("testDirSharded");
+
+	ldmonitor::fs::remove_all(tmpPath);
+
+	ldmonitor::ShardedMonitor monitor{ 4 };
+	ASSERT_EQ(monitor.GetNumShards(), 4);
+
+	std::mutex lock;
+	std::set<std::string> received;
+
+	const int numDirs = 16;
+
+	std::vector<ldmonitor::fs::path> dirs;
+	for (int i = 0; i < numDirs; ++i)
+	{
+		auto dir = tmpPath;
+		dir.append("d" + std::to_string(i));
+
+		ldmonitor::fs::create_directories(dir);
+
+		monitor.Watch(
+			dir,
+			[&lock, &received](const ldmonitor::fs::path &path, std::string fileName, uint32_t, std::chrono::milliseconds)
+			{
+				std::lock_guard guard{lock};
+
+				received.insert(path.filename().string() + '/' + fileName);
+			},
+			ldmonitor::MONITOR_ACTION_FILE_CREATE
+		);
+
+		dirs.push_back(std::move(dir));
+	}
+
+	//already watched, even when placed on another shard
+	ASSERT_THROW(monitor.Watch(dirs[0], NullFileCallback, ldmonitor::MONITOR_ACTION_FILE_CREATE), std::invalid_argument);
+	ASSERT_THROW(monitor.Watch((monitor.GetShard(dirs[0]) + 1) % 4, dirs[0], NullFileCallback, ldmonitor::MONITOR_ACTION_FILE_CREATE), std::invalid_argument);
+
+	auto extraDir = tmpPath;
+	extraDir.append("extra");
+	ldmonitor::fs::create_directories(extraDir);
+
+	ASSERT_THROW(monitor.Watch(4, extraDir, NullFileCallback, ldmonitor::MONITOR_ACTION_FILE_CREATE), std::out_of_range);
+	monitor.Watch(3, extraDir, NullFileCallback, ldmonitor::MONITOR_ACTION_FILE_CREATE);
+
+	for (auto &dir : dirs)
+	{
+		auto filePath = dir;
+		filePath.append("f.txt");
+
+		std::ofstream ofs(filePath);
+	}
+
+	for (int i = 0; i < 5000; ++i)
+	{
+		{
+			std::lock_guard guard{lock};
+
+			if (received.size() == numDirs)
+				break;
+		}
+
+		std::this_thread::sleep_for(1ms);
+	}
+
+	for (auto &dir : dirs)
+		ASSERT_TRUE(monitor.Unwatch(dir));
+
+	ASSERT_FALSE(monitor.Unwatch(dirs[0]));
+	ASSERT_TRUE(monitor.Unwatch(extraDir));
+
+	ASSERT_EQ(received.size(), numDirs);
+	ASSERT_TRUE(received.count("d0/f.txt"));
+
+	ldmonitor::fs::remove_all(tmpPath);
+}
+
+TEST(ldmonitor, ReadBufferTest)
+{
+	auto tmpPath = ldmonitor::fs::temp_directory_path();
+
+	tmpPath.append("testDirReadBuffer");
+
+	ldmonitor::fs::remove_all(tmpPath);
+	ldmonitor::fs::create_directories(tmpPath);
+
+	//smaller than a single event with a long name, must be rounded up
+	ldmonitor::MonitorOptions monitorOptions;
+	monitorOptions.m_szMaxReadBuffer = 1;
+
+	ldmonitor::Monitor monitor{ monitorOptions };
+
+	std::atomic_int received = 0;
+
+	monitor.Watch(tmpPath, [&received](const ldmonitor::fs::path &, std::string, uint32_t, std::chrono::milliseconds) { ++received; }, ldmonitor::MONITOR_ACTION_FILE_CREATE);
+
+	const int numFiles = 512;
+	const std::string longName(200, 'x');
+
+	for (int i = 0; i < numFiles; ++i)
+	{
+		auto filePath = tmpPath;
+		filePath.append(longName + std::to_string(i));
+
+		std::ofstream ofs(filePath);
+	}
+
+	for (int i = 0; (i < 5000) && (received < numFiles); ++i)
+		std::this_thread::sleep_for(1ms);
+
+	monitor.Unwatch(tmpPath);
+
+	ASSERT_EQ(received, numFiles);
+
+	ldmonitor::fs::remove_all(tmpPath);
+}
+
+//
+//
+//
+//
+//
+
+TEST(ldmonitor, ThreadlessTest)
+{
+	auto tmpPath = ldmonitor::fs::temp_directory_path();
+
+	tmpPath.append("testDirThreadless");
+
+	ldmonitor::fs::remove_all(tmpPath);
+	ldmonitor::fs::create_directories(tmpPath);
+
+	{
+		ldmonitor::Monitor threaded;
+
+		ASSERT_THROW(threaded.ProcessEvents(), std::logic_error);
+		ASSERT_THROW(threaded.GetFileDescriptor(), std::logic_error);
+	}
+
+	ldmonitor::MonitorOptions monitorOptions;
+	monitorOptions.m_fThreadless = true;
+
+	ldmonitor::Monitor monitor{ monitorOptions };
+
+	//available before any watch, so it can be added to an event loop once
+	const int fd = monitor.GetFileDescriptor();
+	ASSERT_NE(fd, -1);
+	ASSERT_EQ(monitor.GetTimeout(), -1);
+	ASSERT_EQ(monitor.ProcessEvents(), 0);
+
+	const auto caller = std::this_thread::get_id();
+
+	std::vector<std::string> received;
+	bool unwatchThrown = false;
+
+	monitor.Watch(
+		tmpPath,
+		[&](const ldmonitor::fs::path &path, std::string fileName, uint32_t, std::chrono::milliseconds)
+		{
+			ASSERT_EQ(std::this_thread::get_id(), caller);
+
+			if (received.empty())
+			{
+				try
+				{
+					monitor.Unwatch(path);
+				}
+				catch (const std::logic_error &)
+				{
+					unwatchThrown = true;
+				}
+			}
+
+			received.push_back(std::move(fileName));
+		},
+		ldmonitor::MONITOR_ACTION_FILE_CREATE
+	);
+
+	const size_t numFiles = 8;
+
+	for (size_t i = 0; i < numFiles; ++i)
+	{
+		auto filePath = tmpPath;
+		filePath.append("f" + std::to_string(i));
+
+		std::ofstream ofs(filePath);
+	}
+
+	pollfd pfd = {};
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+
+	ASSERT_EQ(poll(&pfd, 1, 5000), 1);
+
+	//one at a time, the remaining ones stay for the next call
+	ASSERT_EQ(monitor.ProcessEvents(1), 1);
+	ASSERT_EQ(received.size(), 1);
+
+	for (int i = 0; (i < 5000) && (received.size() < numFiles); ++i)
+	{
+		if (monitor.ProcessEvents(2) == 0)
+			poll(&pfd, 1, 1);
+	}
+
+	ASSERT_TRUE(unwatchThrown);
+	ASSERT_EQ(received.size(), numFiles);
+	ASSERT_EQ(received.front(), "f0");
+	ASSERT_EQ(received.back(), "f" + std::to_string(numFiles - 1));
+
+	ASSERT_TRUE(monitor.Unwatch(tmpPath));
+	ASSERT_FALSE(monitor.IsRunning());
+
+	//still usable after the last watch is removed
+	ASSERT_EQ(monitor.GetFileDescriptor(), fd);
+
+	ldmonitor::fs::remove_all(tmpPath);
+}
+
+TEST(ldmonitor, ThreadlessShardedTest)
+{
+	auto tmpPath = ldmonitor::fs::temp_directory_path();
+
+	tmpPath.append("testDirThreadlessSharded");
+
+	ldmonitor::fs::remove_all(tmpPath);
+
+	ldmonitor::MonitorOptions monitorOptions;
+	monitorOptions.m_fThreadless = true;
+
+	ldmonitor::ShardedMonitor monitor{ 3, monitorOptions };
+
+	std::set<std::string> received;
+
+	std::vector<ldmonitor::fs::path> dirs;
+	for (size_t i = 0; i < monitor.GetNumShards(); ++i)
+	{
+		auto dir = tmpPath;
+		dir.append("d" + std::to_string(i));
+
+		ldmonitor::fs::create_directories(dir);
+
+		monitor.Watch(
+			i,
+			dir,
+			[&received](const ldmonitor::fs::path &path, std::string fileName, uint32_t, std::chrono::milliseconds)
+			{
+				received.insert(path.filename().string() + '/' + fileName);
+			},
+			ldmonitor::MONITOR_ACTION_FILE_CREATE
+		);
+
+		dirs.push_back(std::move(dir));
+	}
+
+	for (auto &dir : dirs)
+	{
+		auto filePath = dir;
+		filePath.append("f.txt");
+
+		std::ofstream ofs(filePath);
+	}
+
+	pollfd pfd = {};
+	pfd.fd = monitor.GetFileDescriptor();
+	pfd.events = POLLIN;
+
+	for (int i = 0; (i < 5000) && (received.size() < dirs.size()); ++i)
+	{
+		poll(&pfd, 1, 1);
+		monitor.ProcessEvents();
+	}
+
+	for (auto &dir : dirs)
+		ASSERT_TRUE(monitor.Unwatch(dir));
+
+	ASSERT_EQ(received.size(), dirs.size());
+	ASSERT_TRUE(received.count("d2/f.txt"));
+
+	ldmonitor::fs::remove_all(tmpPath);
+}
+
+//
+//
+//
+//
+//
+
+TEST(ldmonitor, IoUringTest)
+{
+	auto tmpPath = ldmonitor::fs::temp_directory_path();
+
+	tmpPath.append("testDirIoUring");
+
+	ldmonitor::fs::remove_all(tmpPath);
+	ldmonitor::fs::create_directories(tmpPath);
+
+	{
+		ldmonitor::MonitorOptions threadlessOptions;
+		threadlessOptions.m_fThreadless = true;
+		threadlessOptions.m_fUseIoUring = true;
+
+		ldmonitor::Monitor threadless{ threadlessOptions };
+
+		ASSERT_FALSE(threadless.IsUsingIoUring());
+	}
+
+	//small buffers, so a burst uses all of them and the read is armed again. Without io_uring the poll path is tested
+	ldmonitor::MonitorOptions monitorOptions;
+	monitorOptions.m_szMaxReadBuffer = 0;
+	monitorOptions.m_fUseIoUring = true;
+
+	ldmonitor::Monitor monitor{ monitorOptions };
+
+	std::mutex lock;
+	std::vector<std::string> names;
+
+	monitor.Watch(
+		tmpPath,
+		[&lock, &names](const ldmonitor::fs::path &, std::string fileName, uint32_t, std::chrono::milliseconds)
+		{
+			std::lock_guard guard{ lock };
+
+			names.push_back(std::move(fileName));
+		},
+		ldmonitor::MONITOR_ACTION_FILE_CREATE
+	);
+
+	const int numFiles = 512;
+	const std::string longName(200, 'x');
+
+	for (int i = 0; i < numFiles; ++i)
+	{
+		auto filePath = tmpPath;
+		filePath.append(longName + std::to_string(i));
+
+		std::ofstream ofs(filePath);
+	}
+
+	auto countNames = [&lock, &names]()
+	{
+		std::lock_guard guard{ lock };
+
+		return names.size();
+	};
+
+	for (int i = 0; (i < 5000) && (countNames() < numFiles); ++i)
+		std::this_thread::sleep_for(1ms);
+
+	ASSERT_TRUE(monitor.Unwatch(tmpPath));
+	ASSERT_FALSE(monitor.IsRunning());
+
+	ASSERT_EQ(names.size(), numFiles);
+	for (int i = 0; i < numFiles; ++i)
+		ASSERT_EQ(names[i], longName + std::to_string(i));
+
+	//
+	//Thread started again on the same ring, also waiting for a coalescing timer
+	ldmonitor::WatchOptions options;
+	options.m_tCoalesceWindow = 50ms;
+
+	std::atomic_int received = 0;
+
+	monitor.Watch(tmpPath, [&received](const ldmonitor::fs::path &, std::string, uint32_t, std::chrono::milliseconds) { ++received; }, ldmonitor::MONITOR_ACTION_FILE_CREATE | ldmonitor::MONITOR_ACTION_FILE_MODIFY, options);
+
+	{
+		std::ofstream ofs(tmpPath / "coalesced.txt");
+
+		ofs << "data";
+	}
+
+	for (int i = 0; (i < 2000) && (received == 0); ++i)
+		std::this_thread::sleep_for(1ms);
+
+	monitor.Unwatch(tmpPath);
+
+	ASSERT_EQ(received, 1);
+
+	ldmonitor::fs::remove_all(tmpPath);
+}
+
+//
+//
+//
+//
+//
+
+static ldmonitor::Event MakeQueueEvent(std::string_view name, uint32_t action)
+{
+	ldmonitor::Event event;
+
+	event.m_svFileName = name;
+	event.m_u32Action = action;
+
+	return event;
+}
+
+static std::vector<std::string> PopNames(ldmonitor::EventQueue &queue)
+{
+	std::vector<std::string> names;
+	ldmonitor::QueuedEvent events[3];
+
+	while (auto count = queue.PopBatch(events, 3))
+	{
+		for (size_t i = 0; i < count; ++i)
+			names.push_back(events[i].m_strFileName + ':' + std::to_string(events[i].m_u32Action));
+	}
+
+	return names;
+}
+
+TEST(ldmonitor, EventQueuePolicyTest)
+{
+	ldmonitor::QueueOptions options;
+	options.m_szCapacity = 4;
+	options.m_szMaxNameLength = 8;
+
+	{
+		options.m_ePolicy = ldmonitor::QUEUE_POLICY_DROP_NEWEST;
+		ldmonitor::EventQueue queue{ options };
+
+		for (int i = 0; i < 10; ++i)
+			queue.Push(MakeQueueEvent(std::to_string(i), ldmonitor::MONITOR_ACTION_FILE_CREATE));
+
+		ASSERT_FALSE(queue.Push(MakeQueueEvent("too_long_name", ldmonitor::MONITOR_ACTION_FILE_CREATE)));
+		ASSERT_EQ(queue.GetSize(), 4);
+
+		ASSERT_EQ(PopNames(queue), (std::vector<std::string>{ "0:1", "1:1", "2:1", "3:1" }));
+
+		auto stats = queue.GetStats();
+		ASSERT_EQ(stats.m_u64Pushed, 4);
+		ASSERT_EQ(stats.m_u64Popped, 4);
+		ASSERT_EQ(stats.m_u64Dropped, 7);
+	}
+
+	{
+		options.m_ePolicy = ldmonitor::QUEUE_POLICY_DROP_OLDEST;
+		ldmonitor::EventQueue queue{ options };
+
+		for (int i = 0; i < 10; ++i)
+			ASSERT_TRUE(queue.Push(MakeQueueEvent(std::to_string(i), ldmonitor::MONITOR_ACTION_FILE_CREATE)));
+
+		ASSERT_EQ(PopNames(queue), (std::vector<std::string>{ "6:1", "7:1", "8:1", "9:1" }));
+		ASSERT_EQ(queue.GetStats().m_u64Dropped, 6);
+	}
+
+	{
+		options.m_ePolicy = ldmonitor::QUEUE_POLICY_COALESCE;
+		ldmonitor::EventQueue queue{ options };
+
+		for (int i = 0; i < 4; ++i)
+			queue.Push(MakeQueueEvent(std::to_string(i), ldmonitor::MONITOR_ACTION_FILE_CREATE));
+
+		//full from here
+		queue.Push(MakeQueueEvent("a", ldmonitor::MONITOR_ACTION_FILE_CREATE));
+		for (int i = 0; i < 5; ++i)
+			queue.Push(MakeQueueEvent("a", ldmonitor::MONITOR_ACTION_FILE_MODIFY));
+
+		//merged into nothing, so they take no room
+		for (int i = 0; i < 10; ++i)
+		{
+			ASSERT_TRUE(queue.Push(MakeQueueEvent("b", ldmonitor::MONITOR_ACTION_FILE_CREATE)));
+			ASSERT_TRUE(queue.Push(MakeQueueEvent("b", ldmonitor::MONITOR_ACTION_FILE_DELETE)));
+		}
+
+		queue.Push(MakeQueueEvent("c", ldmonitor::MONITOR_ACTION_FILE_MODIFY));
+		queue.Push(MakeQueueEvent("c", ldmonitor::MONITOR_ACTION_FILE_RENAME_OLD_NAME));
+		ASSERT_TRUE(queue.Push(MakeQueueEvent("c", ldmonitor::MONITOR_ACTION_FILE_MODIFY)));
+
+		//waiting events are also limited by the capacity
+		ASSERT_FALSE(queue.Push(MakeQueueEvent("d", ldmonitor::MONITOR_ACTION_FILE_CREATE)));
+
+		ASSERT_EQ(
+			PopNames(queue), 
+			(std::vector<std::string>{ "0:1", "1:1", "2:1", "3:1", "a:1", "c:4", "c:8", "c:4" })
+		);
+
+		auto stats = queue.GetStats();
+		ASSERT_EQ(stats.m_u64Coalesced, 15);
+		ASSERT_EQ(stats.m_u64Dropped, 1);
+		ASSERT_EQ(stats.m_u64Popped, 8);
+	}
+
+	{
+		options.m_ePolicy = ldmonitor::QUEUE_POLICY_BLOCK;
+		ldmonitor::EventQueue queue{ options };
+
+		const int numEvents = 10000;
+
+		std::thread producer{ [&queue]()
+		{
+			for (int i = 0; i < numEvents; ++i)
+				queue.Push(MakeQueueEvent(std::to_string(i), ldmonitor::MONITOR_ACTION_FILE_CREATE));
+		} };
+
+		ldmonitor::QueuedEvent event;
+
+		for (int i = 0; i < numEvents;)
+		{
+			if (!queue.TryPop(event))
+			{
+				std::this_thread::yield();
+
+				continue;
+			}
+
+			ASSERT_EQ(event.m_strFileName, std::to_string(i));
+			++i;
+		}
+
+		producer.join();
+
+		ASSERT_EQ(queue.GetStats().m_u64Dropped, 0);
+
+		//a blocked producer is released by Close
+		for (int i = 0; i < 4; ++i)
+			queue.Push(MakeQueueEvent("x", ldmonitor::MONITOR_ACTION_FILE_CREATE));
+
+		std::thread blocked{ [&queue]() { queue.Push(MakeQueueEvent("y", ldmonitor::MONITOR_ACTION_FILE_CREATE)); } };
+
+		std::this_thread::sleep_for(10ms);
+		queue.Close();
+
+		blocked.join();
+
+		ASSERT_EQ(queue.GetStats().m_u64Dropped, 1);
+	}
+}
+
+TEST(ldmonitor, EventQueueWatchTest)
+{
+	auto tmpPath = ldmonitor::fs::temp_directory_path();
+
+	tmpPath.append("testDirEventQueue");
+
+	ldmonitor::fs::remove_all(tmpPath);
+	ldmonitor::fs::create_directories(tmpPath / "a");
+	ldmonitor::fs::create_directories(tmpPath / "b");
+
+	ldmonitor::QueueOptions options;
+	options.m_szCapacity = 64;
+
+	auto queue = std::make_shared<ldmonitor::EventQueue>(options);
+
+	//two monitors, so two producer threads
+	ldmonitor::Monitor monitorA, monitorB;
+
+	monitorA.WatchQueue(tmpPath / "a", queue, ldmonitor::MONITOR_ACTION_FILE_CREATE, {}, 1);
+	monitorB.WatchQueue(tmpPath / "b", queue, ldmonitor::MONITOR_ACTION_FILE_CREATE, {}, 2);
+
+	const int numFiles = 512;
+
+	std::thread creator{ [&tmpPath]()
+	{
+		for (int i = 0; i < numFiles; ++i)
+		{
+			std::ofstream a(tmpPath / "a" / std::to_string(i));
+			std::ofstream b(tmpPath / "b" / std::to_string(i));
+		}
+	} };
+
+	int next[3] = { 0, 0, 0 };
+	bool ordered = true;
+
+	ldmonitor::QueuedEvent events[16];
+
+	for (int i = 0; (i < 5000) && (next[1] + next[2] < 2 * numFiles); ++i)
+	{
+		auto count = queue->PopBatch(events, 16);
+		if (!count)
+			std::this_thread::sleep_for(1ms);
+
+		for (size_t j = 0; j < count; ++j)
+		{
+			auto &source = next[events[j].m_u32Source];
+
+			ordered = ordered && (events[j].m_strFileName == std::to_string(source));
+			++source;
+		}
+	}
+
+	creator.join();
+
+	monitorA.Unwatch(tmpPath / "a");
+	monitorB.Unwatch(tmpPath / "b");
+
+	ASSERT_TRUE(ordered);
+	ASSERT_EQ(next[0], 0);
+	ASSERT_EQ(next[1], numFiles);
+	ASSERT_EQ(next[2], numFiles);
+	ASSERT_EQ(queue->GetStats().m_u64Dropped, 0);
+
+	ldmonitor::fs::remove_all(tmpPath);
+}
+
+//
+//
+//
+//
+//
+
+TEST(ldmonitor, FilterTest)
+{
+	auto tmpPath = ldmonitor::fs::temp_directory_path();
+
+	tmpPath.append("testDirFilter");
+
+	ldmonitor::fs::remove_all(tmpPath);
+	ldmonitor::fs::create_directories(tmpPath);
+
+	ldmonitor::Monitor monitor;
+
+	{
+		ldmonitor::WatchOptions badOptions;
+		badOptions.m_vecExclude = { "*.tmp", "[abc" };
+
+		ASSERT_THROW(monitor.Watch(tmpPath, [](const ldmonitor::fs::path &, std::string, uint32_t, std::chrono::milliseconds) {}, ldmonitor::MONITOR_ACTION_FILE_CREATE, badOptions), std::invalid_argument);
+		ASSERT_FALSE(monitor.IsRunning());
+	}
+
+	ldmonitor::WatchOptions options;
+	options.m_fRecursive = true;
+	options.m_vecInclude = { "*.txt", "data[0-9].csv", "file?.dat", "[!x]*.md", "README", "a_long_prefix_*", "*.a_long_suffix" };
+	options.m_vecExclude = { "*.tmp", ".~lock*", "c.*", "*skip*" };
+
+	std::mutex lock;
+	std::set<std::string> names;
+
+	monitor.Watch(
+		tmpPath,
+		[&lock, &names](const ldmonitor::fs::path &, std::string fileName, uint32_t, std::chrono::milliseconds)
+		{
+			std::lock_guard guard{ lock };
+
+			names.insert(std::move(fileName));
+		},
+		ldmonitor::MONITOR_ACTION_FILE_CREATE,
+		options
+	);
+
+	const char *arFiles[] = 
+	{
+		"a.txt", "b.tmp", ".~lock.a.txt#", "c.txt", "data1.csv", "dataX.csv", "file1.dat", "file12.dat", "y.md", "x.md",
+		"README", "README.old", "a_long_prefix_1", "x.a_long_suffix", "skip_me.txt", ".txt", "last.txt"
+	};
+
+	for (auto file : arFiles)
+	{
+		std::ofstream ofs(tmpPath / file);
+	}
+
+	//not reported, but still watched
+	ldmonitor::fs::create_directories(tmpPath / "subdirectory");
+	std::this_thread::sleep_for(50ms);
+
+	{
+		std::ofstream ofs(tmpPath / "subdirectory" / "sub.txt");
+		std::ofstream ofs2(tmpPath / "subdirectory" / "sub.tmp");
+	}
+
+	const std::set<std::string> expected = 
+	{ 
+		"a.txt", "data1.csv", "file1.dat", "y.md", "README", "a_long_prefix_1", "x.a_long_suffix", ".txt", "last.txt", "subdirectory/sub.txt" 
+	};
+
+	auto countNames = [&lock, &names]()
+	{
+		std::lock_guard guard{ lock };
+
+		return names.size();
+	};
+
+	for (int i = 0; (i < 2000) && (countNames() < expected.size()); ++i)
+		std::this_thread::sleep_for(1ms);
+
+	//anything else would arrive with them
+	std::this_thread::sleep_for(20ms);
+
+	monitor.Unwatch(tmpPath);
+
+	ASSERT_EQ(names, expected);
+
+	ldmonitor::fs::remove_all(tmpPath);
+}
+
+TEST(ldmonitor, SubscriptionTest)
+{
+	auto tmpPath = ldmonitor::fs::temp_directory_path();
+
+	tmpPath.append("testDirSubscription");
+
+	auto linkPath = ldmonitor::fs::temp_directory_path();
+	linkPath.append("testDirSubscriptionLink");
+
+	ldmonitor::fs::remove_all(tmpPath);
+	ldmonitor::fs::remove(linkPath);
+
+	ldmonitor::fs::create_directories(tmpPath / "sub");
+	ldmonitor::fs::create_directory_symlink(tmpPath, linkPath);
+
+	std::mutex lock;
+	std::map<std::string, std::set<std::string>> names;
+
+	auto makeCallback = [&lock, &names](std::string watch)
+	{
+		return [&lock, &names, watch](const ldmonitor::fs::path &, std::string fileName, uint32_t, std::chrono::milliseconds)
+		{
+			std::lock_guard guard{ lock };
+
+			names[watch].insert(std::move(fileName));
+		};
+	};
+
+	auto waitNames = [&lock, &names](const std::string &watch, size_t count)
+	{
+		for (int i = 0; i < 2000; ++i)
+		{
+			{
+				std::lock_guard guard{ lock };
+
+				if (names[watch].size() >= count)
+					break;
+			}
+
+			std::this_thread::sleep_for(1ms);
+		}
+	};
+
+	ldmonitor::Monitor monitor;
+
+	ldmonitor::WatchOptions recursive;
+	recursive.m_fRecursive = true;
+
+	//all of them share the kernel watches of tmpPath and sub
+	monitor.Watch(tmpPath, makeCallback("watch"), ldmonitor::MONITOR_ACTION_FILE_CREATE, recursive);
+	auto modify = monitor.Subscribe(tmpPath, makeCallback("modify"), ldmonitor::MONITOR_ACTION_FILE_MODIFY);
+	auto sub = monitor.Subscribe(tmpPath / "sub", makeCallback("sub"), ldmonitor::MONITOR_ACTION_FILE_CREATE);
+	monitor.Watch(linkPath, makeCallback("link"), ldmonitor::MONITOR_ACTION_FILE_CREATE);
+
+	ASSERT_THROW(monitor.Watch(tmpPath, makeCallback("duplicated"), ldmonitor::MONITOR_ACTION_FILE_CREATE), std::invalid_argument);
+
+	{
+		std::ofstream ofs(tmpPath / "a.txt");
+		ofs << "data";
+	}
+
+	{
+		std::ofstream ofs(tmpPath / "sub" / "b.txt");
+	}
+
+	waitNames("watch", 2);
+	waitNames("modify", 1);
+	waitNames("sub", 1);
+	waitNames("link", 1);
+
+	std::this_thread::sleep_for(20ms);
+
+	{
+		std::lock_guard guard{ lock };
+
+		ASSERT_EQ(names["watch"], (std::set<std::string>{ "a.txt", "sub/b.txt" }));
+		ASSERT_EQ(names["modify"], (std::set<std::string>{ "a.txt" }));
+		ASSERT_EQ(names["sub"], (std::set<std::string>{ "b.txt" }));
+		ASSERT_EQ(names["link"], (std::set<std::string>{ "a.txt" }));
+
+		names.clear();
+	}
+
+	//
+	//Only the subscriber is removed, the others still have their kernel watches
+	ASSERT_TRUE(monitor.Unwatch(sub));
+	ASSERT_FALSE(monitor.Unwatch(sub));
+	ASSERT_TRUE(monitor.Unwatch(tmpPath));
+
+	{
+		std::ofstream ofs(tmpPath / "sub" / "c.txt");
+	}
+
+	{
+		std::ofstream ofs(tmpPath / "d.txt");
+		ofs << "data";
+	}
+
+	waitNames("modify", 1);
+	waitNames("link", 1);
+
+	std::this_thread::sleep_for(20ms);
+
+	{
+		std::lock_guard guard{ lock };
+
+		ASSERT_TRUE(names["watch"].empty());
+		ASSERT_TRUE(names["sub"].empty());
+		ASSERT_EQ(names["modify"], (std::set<std::string>{ "d.txt" }));
+		ASSERT_EQ(names["link"], (std::set<std::string>{ "d.txt" }));
+	}
+
+	ASSERT_TRUE(monitor.Unwatch(modify));
+	ASSERT_TRUE(monitor.IsRunning());
+
+	ASSERT_TRUE(monitor.Unwatch(linkPath));
+	ASSERT_FALSE(monitor.IsRunning());
+
+	ldmonitor::fs::remove(linkPath);
+	ldmonitor::fs::remove_all(tmpPath);
+}
+
+/**
+* Kernel masks of an inotify fd, from its fdinfo
+*
+*/
+static std::vector<uint32_t> ReadINotifyMasks(int fd)
+{
+	std::ifstream file("/proc/self/fdinfo/" + std::to_string(fd));
+
+	std::vector<uint32_t> masks;
+
+	for (std::string line; std::getline(file, line);)
+	{
+		auto pos = line.find(" mask:");
+		if ((line.compare(0, 8, "inotify ") == 0) && (pos != std::string::npos))
+			masks.push_back(static_cast<uint32_t>(std::stoul(line.substr(pos + 6), nullptr, 16)));
+	}
+
+	return masks;
+}
+
+TEST(ldmonitor, SharedMaskTest)
+{
+	auto tmpPath = ldmonitor::fs::temp_directory_path();
+
+	tmpPath.append("testDirSharedMask");
+
+	ldmonitor::fs::remove_all(tmpPath);
+	ldmonitor::fs::create_directories(tmpPath);
+
+	ldmonitor::MonitorOptions options;
+	options.m_fThreadless = true;
+
+	ldmonitor::Monitor monitor{ options };
+
+	auto callback = [](const ldmonitor::fs::path &, std::string, uint32_t, std::chrono::milliseconds) {};
+
+	auto create = monitor.Subscribe(tmpPath, callback, ldmonitor::MONITOR_ACTION_FILE_CREATE);
+	auto modify = monitor.Subscribe(tmpPath, callback, ldmonitor::MONITOR_ACTION_FILE_MODIFY);
+
+	auto masks = ReadINotifyMasks(monitor.GetFileDescriptor());
+
+	ASSERT_EQ(masks.size(), 1u);
+	ASSERT_TRUE(masks[0] & IN_CREATE);
+	ASSERT_TRUE(masks[0] & IN_MODIFY);
+
+	//only what is left is asked from the kernel
+	ASSERT_TRUE(monitor.Unwatch(modify));
+
+	masks = ReadINotifyMasks(monitor.GetFileDescriptor());
+
+	ASSERT_EQ(masks.size(), 1u);
+	ASSERT_TRUE(masks[0] & IN_CREATE);
+	ASSERT_FALSE(masks[0] & IN_MODIFY);
+
+	ASSERT_TRUE(monitor.Unwatch(create));
+	ASSERT_TRUE(ReadINotifyMasks(monitor.GetFileDescriptor()).empty());
+
+	ldmonitor::fs::remove_all(tmpPath);
+}
+
+TEST(ldmonitor, RenamePairTest)
+{
+	auto tmpPath = ldmonitor::fs::temp_directory_path();
+
+	tmpPath.append("testDirRenamePair");
+
+	ldmonitor::fs::remove_all(tmpPath);
+	ldmonitor::fs::create_directories(tmpPath / "a");
+	ldmonitor::fs::create_directories(tmpPath / "b");
+	ldmonitor::fs::create_directories(tmpPath / "outside");
+
+	std::mutex lock;
+	std::vector<std::string> events;
+
+	auto countEvents = [&lock, &events]()
+	{
+		std::lock_guard guard{ lock };
+
+		return events.size();
+	};
+
+	auto waitEvents = [&countEvents](size_t count)
+	{
+		for (int i = 0; (i < 2000) && (countEvents() < count); ++i)
+			std::this_thread::sleep_for(1ms);
+
+		//anything else would arrive with them
+		std::this_thread::sleep_for(30ms);
+	};
+
+	auto makeCallback = [&lock, &events](std::string watch)
+	{
+		return [&lock, &events, watch](const ldmonitor::fs::path &, std::string fileName, uint32_t action, std::chrono::milliseconds)
+		{
+			std::lock_guard guard{ lock };
+
+			events.push_back(watch + ' ' + std::to_string(action) + ' ' + fileName);
+		};
+	};
+
+	auto makeOptions = [&lock, &events](std::string watch)
+	{
+		ldmonitor::WatchOptions options;
+
+		options.m_pfnRenameCallback = [&lock, &events, watch](const ldmonitor::RenameEvent &event)
+		{
+			std::lock_guard guard{ lock };
+
+			events.push_back(watch + " rename " + event.m_pthOldWatch.filename().string() + '/' + event.m_strOldName + " " + event.m_pthNewWatch.filename().string() + '/' + event.m_strNewName);
+		};
+
+		return options;
+	};
+
+	const uint32_t flags = ldmonitor::MONITOR_ACTION_FILE_CREATE | ldmonitor::MONITOR_ACTION_FILE_DELETE | ldmonitor::MONITOR_ACTION_FILE_RENAME_OLD_NAME | ldmonitor::MONITOR_ACTION_FILE_RENAME_NEW_NAME;
+
+	ldmonitor::Monitor monitor;
+
+	monitor.Watch(tmpPath / "a", makeCallback("A"), flags, makeOptions("A"));
+	monitor.Watch(tmpPath / "b", makeCallback("B"), flags, makeOptions("B"));
+
+	//does not pair, gets both halves as before
+	auto plain = monitor.Subscribe(tmpPath / "b", makeCallback("C"), flags);
+
+	{
+		std::ofstream ofs(tmpPath / "a" / "f1");
+	}
+
+	waitEvents(1);
+
+	ldmonitor::fs::rename(tmpPath / "a" / "f1", tmpPath / "a" / "f2");
+	waitEvents(2);
+
+	ldmonitor::fs::rename(tmpPath / "a" / "f2", tmpPath / "b" / "f3");
+	waitEvents(5);
+
+	{
+		std::lock_guard guard{ lock };
+
+		const std::vector<std::string> expected =
+		{
+			"A 1 f1",
+			"A rename a/f1 a/f2",
+			"A rename a/f2 b/f3",
+			"B rename a/f2 b/f3",
+			"C 16 f3"
+		};
+
+		ASSERT_EQ(events, expected);
+
+		events.clear();
+	}
+
+	//unmatched halves
+	ldmonitor::fs::rename(tmpPath / "b" / "f3", tmpPath / "outside" / "f4");
+	waitEvents(2);
+
+	ldmonitor::fs::rename(tmpPath / "outside" / "f4", tmpPath / "a" / "f5");
+	waitEvents(3);
+
+	{
+		std::lock_guard guard{ lock };
+
+		const std::vector<std::string> expected =
+		{
+			"C 8 f3",
+			"B 2 f3",
+			"A 1 f5"
+		};
+
+		ASSERT_EQ(events, expected);
+	}
+
+	monitor.Unwatch(plain);
+	monitor.Unwatch(tmpPath / "a");
+	monitor.Unwatch(tmpPath / "b");
+
+	ldmonitor::fs::remove_all(tmpPath);
+}
+
+TEST(ldmonitor, SkipUnchangedWritesTest)
+{
+	auto tmpPath = ldmonitor::fs::temp_directory_path();
+
+	tmpPath.append("testDirSkipUnchanged");
+
+	ldmonitor::fs::remove_all(tmpPath);
+	ldmonitor::fs::create_directories(tmpPath);
+
+	std::mutex lock;
+	std::vector<std::string> skipped;
+	size_t plainCount = 0;
+
+	ldmonitor::Monitor monitor;
+
+	ldmonitor::WatchOptions options;
+	options.m_fSkipUnchangedWrites = true;
+
+	monitor.Watch(
+		tmpPath,
+		[&lock, &skipped](const ldmonitor::fs::path &, std::string fileName, uint32_t, std::chrono::milliseconds)
+		{
+			std::lock_guard guard{ lock };
+
+			skipped.push_back(std::move(fileName));
+		},
+		ldmonitor::MONITOR_ACTION_FILE_MODIFY,
+		options
+	);
+
+	//shares the kernel watch, still gets every write
+	auto plain = monitor.Subscribe(
+		tmpPath,
+		[&lock, &plainCount](const ldmonitor::fs::path &, std::string, uint32_t, std::chrono::milliseconds)
+		{
+			std::lock_guard guard{ lock };
+
+			++plainCount;
+		},
+		ldmonitor::MONITOR_ACTION_FILE_MODIFY
+	);
+
+	auto countSkipped = [&lock, &skipped]()
+	{
+		std::lock_guard guard{ lock };
+
+		return skipped.size();
+	};
+
+	auto write = [&tmpPath, &countSkipped](const char *name, const std::string &content, size_t expected)
+	{
+		{
+			std::ofstream ofs(tmpPath / name, std::ios::trunc);
+			ofs << content;
+		}
+
+		for (int i = 0; (i < 2000) && (countSkipped() < expected); ++i)
+			std::this_thread::sleep_for(1ms);
+
+		//anything else would arrive with them
+		std::this_thread::sleep_for(30ms);
+	};
+
+	//bigger than a read chunk
+	const std::string big(200 * 1024, 'x');
+
+	write("a.txt", "one", 1);
+	write("a.txt", "one", 1);
+	write("a.txt", "two", 2);
+	write("b.txt", big, 3);
+	write("b.txt", big, 3);
+	write("b.txt", big + "y", 4);
+
+	//digest dropped, so it is reported again
+	ldmonitor::fs::remove(tmpPath / "a.txt");
+	write("a.txt", "two", 5);
+
+	ldmonitor::fs::rename(tmpPath / "a.txt", tmpPath / "c.txt");
+	write("c.txt", "two", 6);
+
+	//created and closed empty, like touch does
+	write("d.txt", "", 6);
+	ASSERT_EQ(countSkipped(), 6u);
+
+	write("d.txt", "one", 7);
+
+	{
+		std::lock_guard guard{ lock };
+
+		const std::vector<std::string> expected = { "a.txt", "a.txt", "b.txt", "b.txt", "a.txt", "c.txt", "d.txt" };
+
+		ASSERT_EQ(skipped, expected);
+		ASSERT_GE(plainCount, 10u);
+	}
+
+	monitor.Unwatch(plain);
+	monitor.Unwatch(tmpPath);
+
+	ldmonitor::fs::remove_all(tmpPath);
+}
+
+TEST(ldmonitor, IndexTest)
+{
+	using namespace std::chrono_literals;
+
+	auto tmpPath = ldmonitor::fs::temp_directory_path();
+
+	tmpPath.append("testDirIndex");
+
+	ldmonitor::fs::remove_all(tmpPath);
+	ldmonitor::fs::create_directories(tmpPath / "sub");
+
+	//enough for the index to grow while scanning
+	for (int i = 0; i < 1500; ++i)
+		std::ofstream{ tmpPath / ("file" + std::to_string(i)) };
+
+	{
+		std::ofstream ofs(tmpPath / "sub" / "s.txt");
+		ofs << "sub";
+	}
+
+	ldmonitor::Monitor monitor;
+
+	ldmonitor::WatchOptions options;
+	options.m_fRecursive = true;
+	options.m_fKeepIndex = true;
+
+	monitor.Watch(tmpPath, [](const ldmonitor::fs::path &, std::string, uint32_t, std::chrono::milliseconds) {}, ldmonitor::MONITOR_ACTION_FILE_CREATE, options);
+
+	auto before = monitor.GetIndex(tmpPath);
+
+	ASSERT_TRUE(before.IsValid());
+	ASSERT_EQ(before.GetSize(), 1502u);
+	ASSERT_NE(before.Find("file1499"), nullptr);
+	ASSERT_NE(before.Find("sub"), nullptr);
+	ASSERT_TRUE(before.Find("sub")->m_fDirectory);
+	ASSERT_EQ(before.Find("sub/s.txt")->m_u64Size, 3u);
+	ASSERT_EQ(before.Find("missing"), nullptr);
+
+	size_t count = 0;
+	before.ForEach([&count](const ldmonitor::IndexEntry &) { ++count; });
+	ASSERT_EQ(count, 1502u);
+
+	{
+		std::ofstream ofs(tmpPath / "sub" / "s.txt", std::ios::app);
+		ofs << "12345";
+	}
+
+	ldmonitor::fs::remove(tmpPath / "file0");
+	ldmonitor::fs::rename(tmpPath / "file1", tmpPath / "renamed");
+	ldmonitor::fs::create_directories(tmpPath / "new");
+	std::ofstream{ tmpPath / "new" / "n.txt" };
+
+	auto isDone = [](const ldmonitor::IndexSnapshot &index)
+	{
+		return index.Find("new/n.txt") && index.Find("renamed") && !index.Find("file0") && (index.Find("sub/s.txt")->m_u64Size == 8);
+	};
+
+	auto after = monitor.GetIndex(tmpPath);
+	for (int i = 0; (i < 2000) && !isDone(after); ++i)
+	{
+		std::this_thread::sleep_for(1ms);
+
+		after = monitor.GetIndex(tmpPath);
+	}
+
+	ASSERT_TRUE(isDone(after));
+	ASSERT_EQ(after.Find("file1"), nullptr);
+	ASSERT_EQ(after.GetSize(), 1503u);
+	ASSERT_EQ(after.Find("renamed")->m_u64Inode, before.Find("file1")->m_u64Inode);
+
+	//the old snapshot did not change
+	ASSERT_EQ(before.GetSize(), 1502u);
+	ASSERT_NE(before.Find("file0"), nullptr);
+	ASSERT_EQ(before.Find("sub/s.txt")->m_u64Size, 3u);
+
+	//a removed directory takes its contents with it
+	ldmonitor::fs::remove_all(tmpPath / "new");
+
+	for (int i = 0; (i < 2000) && monitor.GetIndex(tmpPath).Find("new"); ++i)
+		std::this_thread::sleep_for(1ms);
+
+	after = monitor.GetIndex(tmpPath);
+	ASSERT_EQ(after.Find("new/n.txt"), nullptr);
+	ASSERT_EQ(after.GetSize(), 1501u);
+
+	//watches without an index
+	auto plain = monitor.Subscribe(tmpPath / "sub", [](const ldmonitor::fs::path &, std::string, uint32_t, std::chrono::milliseconds) {}, ldmonitor::MONITOR_ACTION_FILE_CREATE);
+
+	ASSERT_FALSE(monitor.GetIndex(plain).IsValid());
+	ASSERT_FALSE(monitor.GetIndex(tmpPath / "sub").IsValid());
+
+	monitor.Unwatch(plain);
+	monitor.Unwatch(tmpPath);
+
+	ASSERT_FALSE(monitor.GetIndex(tmpPath).IsValid());
+
+	//still usable after the watch is gone
+	ASSERT_EQ(after.GetSize(), 1501u);
+
+	ldmonitor::fs::remove_all(tmpPath);
+}
+
+TEST(ldmonitor, IndexScanTest)
+{
+	using namespace std::chrono_literals;
+
+	auto tmpPath = ldmonitor::fs::temp_directory_path();
+
+	tmpPath.append("testDirIndexScan");
+
+	ldmonitor::fs::remove_all(tmpPath);
+	ldmonitor::fs::create_directories(tmpPath / "other");
+
+	//long enough to scan for events to come during it
+	for (int i = 0; i < 20; ++i)
+	{
+		auto dir = tmpPath / "big" / std::to_string(i);
+
+		ldmonitor::fs::create_directories(dir);
+
+		for (int j = 0; j < 1000; ++j)
+			std::ofstream{ dir / (std::to_string(j) + ".txt") };
+	}
+
+	std::atomic_int delivered = 0;
+
+	ldmonitor::Monitor monitor;
+
+	ldmonitor::WatchOptions options;
+	options.m_fRecursive = true;
+
+	//new subdirectories are registered with the lock, so the monitor thread stops if Watch holds it
+	monitor.Watch(
+		tmpPath / "other",
+		[&delivered](const ldmonitor::fs::path &, std::string, uint32_t, std::chrono::milliseconds)
+		{
+			++delivered;
+		},
+		ldmonitor::MONITOR_ACTION_FILE_CREATE,
+		options
+	);
+
+	options.m_fKeepIndex = true;
+
+	std::atomic_bool watching = true;
+	std::chrono::steady_clock::duration watchTime;
+
+	std::thread watcher{ [&]()
+	{
+		const auto start = std::chrono::steady_clock::now();
+		monitor.Watch(tmpPath / "big", [](const ldmonitor::fs::path &, std::string, uint32_t, std::chrono::milliseconds) {}, ldmonitor::MONITOR_ACTION_FILE_CREATE, options);
+		watchTime = std::chrono::steady_clock::now() - start;
+
+		watching = false;
+	} };
+
+	//while the tree is scanned the other watch gets each event right away, and the new files end in the index
+	std::chrono::steady_clock::duration maxWait{ 0 };
+	int created = 0;
+
+	for (; watching; ++created)
+	{
+		std::ofstream{ tmpPath / "big" / "7" / ("live" + std::to_string(created) + ".txt") };
+
+		const auto start = std::chrono::steady_clock::now();
+		ldmonitor::fs::create_directories(tmpPath / "other" / std::to_string(created));
+
+		while (delivered <= created)
+			std::this_thread::sleep_for(100us);
+
+		maxWait = std::max(maxWait, std::chrono::steady_clock::now() - start);
+	}
+
+	watcher.join();
+
+	ASSERT_LT(maxWait * 4, watchTime);
+
+	auto isDone = [created](const ldmonitor::IndexSnapshot &index)
+	{
+		for (int i = 0; i < created; ++i)
+		{
+			if (!index.Find("7/live" + std::to_string(i) + ".txt"))
+				return false;
+		}
+
+		return true;
+	};
+
+	auto index = monitor.GetIndex(tmpPath / "big");
+	for (int i = 0; (i < 2000) && !isDone(index); ++i)
+	{
+		std::this_thread::sleep_for(1ms);
+
+		index = monitor.GetIndex(tmpPath / "big");
+	}
+
+	ASSERT_TRUE(isDone(index));
+	ASSERT_EQ(index.GetSize(), 20u + 20000u + created);
+
+	monitor.Unwatch(tmpPath / "big");
+	monitor.Unwatch(tmpPath / "other");
+
+	ldmonitor::fs::remove_all(tmpPath);
+}
+
+TEST(ldmonitor, CheckpointTest)
+{
+	using namespace std::chrono_literals;
+
+	auto tmpPath = ldmonitor::fs::temp_directory_path();
+
+	auto checkpointPath = tmpPath / "testDirCheckpoint.ckpt";
+	tmpPath.append("testDirCheckpoint");
+
+	ldmonitor::fs::remove_all(tmpPath);
+	ldmonitor::fs::remove(checkpointPath);
+	ldmonitor::fs::create_directories(tmpPath / "sub");
+
+	std::ofstream{ tmpPath / "a.txt" };
+	std::ofstream{ tmpPath / "b.txt" };
+	std::ofstream{ tmpPath / "sub" / "c.txt" };
+
+	std::mutex lock;
+	std::vector<std::pair<std::string, uint32_t>> events;
+
+	auto callback = [&lock, &events](const ldmonitor::fs::path &, std::string fileName, uint32_t action, std::chrono::milliseconds)
+	{
+		std::lock_guard guard{ lock };
+
+		events.emplace_back(std::move(fileName), action);
+	};
+
+	auto waitEvents = [&lock, &events](size_t count)
+	{
+		for (int i = 0; i < 2000; ++i)
+		{
+			{
+				std::lock_guard guard{ lock };
+
+				if (events.size() >= count)
+					break;
+			}
+
+			std::this_thread::sleep_for(1ms);
+		}
+
+		//anything else would arrive with them
+		std::this_thread::sleep_for(30ms);
+
+		std::lock_guard guard{ lock };
+
+		return events;
+	};
+
+	ldmonitor::WatchOptions options;
+	options.m_fRecursive = true;
+	options.m_pthCheckpoint = checkpointPath;
+
+	const auto flags = ldmonitor::MONITOR_ACTION_FILE_CREATE | ldmonitor::MONITOR_ACTION_FILE_DELETE | ldmonitor::MONITOR_ACTION_FILE_MODIFY;
+
+	ldmonitor::Monitor monitor;
+
+	//first run, nothing to compare with
+	monitor.Watch(tmpPath, callback, flags, options);
+
+	ASSERT_TRUE(monitor.GetIndex(tmpPath).IsValid());
+	ASSERT_TRUE(waitEvents(1).empty());
+
+	monitor.Unwatch(tmpPath);
+	ASSERT_TRUE(ldmonitor::fs::exists(checkpointPath));
+
+	//while offline
+	ldmonitor::fs::remove(tmpPath / "a.txt");
+	{
+		std::ofstream ofs(tmpPath / "b.txt");
+		ofs << "changed";
+	}
+	std::ofstream{ tmpPath / "d.txt" };
+	std::ofstream{ tmpPath / "sub" / "e.txt" };
+
+	monitor.Watch(tmpPath, callback, flags, options);
+
+	std::ofstream{ tmpPath / "live.txt" };
+
+	{
+		auto received = waitEvents(5);
+
+		ASSERT_EQ(received.size(), 5u);
+
+		//live events always come after the offline ones
+		ASSERT_EQ(received.back(), std::make_pair(std::string{ "live.txt" }, uint32_t{ ldmonitor::MONITOR_ACTION_FILE_CREATE }));
+
+		received.pop_back();
+		std::sort(received.begin(), received.end());
+
+		const std::vector<std::pair<std::string, uint32_t>> expected =
+		{
+			{ "a.txt", ldmonitor::MONITOR_ACTION_FILE_DELETE },
+			{ "b.txt", ldmonitor::MONITOR_ACTION_FILE_MODIFY },
+			{ "d.txt", ldmonitor::MONITOR_ACTION_FILE_CREATE },
+			{ "sub/e.txt", ldmonitor::MONITOR_ACTION_FILE_CREATE }
+		};
+
+		ASSERT_EQ(received, expected);
+
+		events.clear();
+	}
+
+	//written now, so the next watch sees no changes
+	monitor.Checkpoint();
+	monitor.Unwatch(tmpPath);
+
+	monitor.Watch(tmpPath, callback, flags, options);
+	ASSERT_TRUE(waitEvents(1).empty());
+	monitor.Unwatch(tmpPath);
+
+	//damaged files are ignored
+	{
+		std::fstream file(checkpointPath, std::ios::in | std::ios::out | std::ios::binary);
+		file.seekp(60);
+		file.put('X');
+	}
+
+	ldmonitor::fs::remove(tmpPath / "d.txt");
+
+	monitor.Watch(tmpPath, callback, flags, options);
+	ASSERT_TRUE(waitEvents(1).empty());
+	monitor.Unwatch(tmpPath);
+
+	ldmonitor::fs::remove_all(tmpPath);
+	ldmonitor::fs::remove(checkpointPath);
+}
+
+TEST(ldmonitor, CheckpointWritersTest)
+{
+	using namespace std::chrono_literals;
+
+	auto tmpPath = ldmonitor::fs::temp_directory_path();
+
+	auto checkpointPath = tmpPath / "testDirCheckpointWriters.ckpt";
+	tmpPath.append("testDirCheckpointWriters");
+
+	ldmonitor::fs::remove_all(tmpPath);
+	ldmonitor::fs::remove(checkpointPath);
+
+	for (auto name : { "a", "b" })
+	{
+		ldmonitor::fs::create_directories(tmpPath / name);
+
+		for (int i = 0; i < 2000; ++i)
+			std::ofstream{ tmpPath / name / ("file" + std::to_string(i)) };
+	}
+
+	std::atomic_int events = 0;
+
+	auto callback = [&events](const ldmonitor::fs::path &, std::string, uint32_t, std::chrono::milliseconds)
+	{
+		++events;
+	};
+
+	const auto flags = ldmonitor::MONITOR_ACTION_FILE_CREATE | ldmonitor::MONITOR_ACTION_FILE_DELETE | ldmonitor::MONITOR_ACTION_FILE_MODIFY;
+
+	ldmonitor::WatchOptions options;
+	options.m_pthCheckpoint = checkpointPath;
+
+	ldmonitor::Monitor monitor;
+
+	//both write the same file
+	monitor.Watch(tmpPath / "a", callback, flags, options);
+	monitor.Watch(tmpPath / "b", callback, flags, options);
+
+	std::vector<std::thread> writers;
+
+	for (int i = 0; i < 4; ++i)
+	{
+		writers.emplace_back([&monitor]()
+		{
+			for (int j = 0; j < 20; ++j)
+				monitor.Checkpoint();
+		});
+	}
+
+	std::this_thread::sleep_for(5ms);
+	monitor.Unwatch(tmpPath / "a");
+
+	for (auto &writer : writers)
+		writer.join();
+
+	monitor.Unwatch(tmpPath / "b");
+
+	//whole and of b, so it has nothing to report
+	monitor.Watch(tmpPath / "b", callback, flags, options);
+	std::this_thread::sleep_for(50ms);
+
+	ASSERT_EQ(events, 0);
+
+	monitor.Unwatch(tmpPath / "b");
+
+	//no temporary files left
+	for (auto &entry : ldmonitor::fs::directory_iterator(checkpointPath.parent_path()))
+		ASSERT_NE(entry.path().filename().string().rfind("testDirCheckpointWriters.ckpt.", 0), 0u);
+
+	ldmonitor::fs::remove_all(tmpPath);
+	ldmonitor::fs::remove(checkpointPath);
+}
+
+TEST(ldmonitor, PollingTest)
+{
+	using namespace std::chrono_literals;
+
+	auto tmpPath = ldmonitor::fs::temp_directory_path();
+
+	tmpPath.append("testDirPolling");
+
+	ldmonitor::fs::remove_all(tmpPath);
+	ldmonitor::fs::create_directories(tmpPath / "sub");
+
+	std::mutex lock;
+	std::vector<std::pair<std::string, uint32_t>> events;
+
+	auto waitEvents = [&lock, &events](size_t count)
+	{
+		for (int i = 0; i < 2000; ++i)
+		{
+			{
+				std::lock_guard guard{ lock };
+
+				if (events.size() >= count)
+					break;
+			}
+
+			std::this_thread::sleep_for(1ms);
+		}
+
+		std::lock_guard guard{ lock };
+
+		auto received = std::move(events);
+		events.clear();
+
+		std::sort(received.begin(), received.end());
+
+		return received;
+	};
+
+	ldmonitor::Monitor monitor;
+
+	ldmonitor::WatchOptions options;
+	options.m_fRecursive = true;
+	options.m_fPolling = true;
+	options.m_tPollInterval = 10ms;
+	options.m_tMaxPollInterval = 80ms;
+
+	ASSERT_THROW(monitor.Watch(tmpPath / "missing", [](const ldmonitor::fs::path &, std::string, uint32_t, std::chrono::milliseconds) {}, ldmonitor::MONITOR_ACTION_FILE_CREATE, options), std::invalid_argument);
+	ASSERT_FALSE(monitor.IsRunning());
+
+	monitor.Watch(
+		tmpPath,
+		[&lock, &events](const ldmonitor::fs::path &, std::string fileName, uint32_t action, std::chrono::milliseconds)
+		{
+			std::lock_guard guard{ lock };
+
+			events.emplace_back(std::move(fileName), action);
+		},
+		ldmonitor::MONITOR_ACTION_FILE_CREATE | ldmonitor::MONITOR_ACTION_FILE_DELETE | ldmonitor::MONITOR_ACTION_FILE_MODIFY,
+		options
+	);
+
+	//no inotify watch, but the thread is running the scans
+	ASSERT_TRUE(monitor.IsRunning());
+
+	std::ofstream{ tmpPath / "a.txt" };
+	std::ofstream{ tmpPath / "sub" / "b.txt" };
+
+	{
+		const std::vector<std::pair<std::string, uint32_t>> expected =
+		{
+			{ "a.txt", ldmonitor::MONITOR_ACTION_FILE_CREATE },
+			{ "sub/b.txt", ldmonitor::MONITOR_ACTION_FILE_CREATE }
+		};
+
+		ASSERT_EQ(waitEvents(2), expected);
+	}
+
+	//cold by now, still noticed on the longest interval
+	std::this_thread::sleep_for(200ms);
+
+	{
+		std::ofstream ofs(tmpPath / "a.txt");
+		ofs << "changed";
+	}
+
+	ldmonitor::fs::remove(tmpPath / "sub" / "b.txt");
+
+	{
+		const std::vector<std::pair<std::string, uint32_t>> expected =
+		{
+			{ "a.txt", ldmonitor::MONITOR_ACTION_FILE_MODIFY },
+			{ "sub/b.txt", ldmonitor::MONITOR_ACTION_FILE_DELETE }
+		};
+
+		ASSERT_EQ(waitEvents(2), expected);
+	}
+
+	monitor.Unwatch(tmpPath);
+	ASSERT_FALSE(monitor.IsRunning());
+
+	ldmonitor::fs::remove_all(tmpPath);
+}
+
+TEST(ldmonitor, PollingBlockedCallbackTest)
+{
+	using namespace std::chrono_literals;
+
+	auto tmpPath = ldmonitor::fs::temp_directory_path();
+
+	tmpPath.append("testDirPollingBlocked");
+
+	constexpr int NUM_POLLS = 40;
+
+	for (bool useIoUring : { false, true })
+	{
+		ldmonitor::fs::remove_all(tmpPath);
+		ldmonitor::fs::create_directories(tmpPath / "blocker");
+
+		for (int i = 0; i < NUM_POLLS; ++i)
+			ldmonitor::fs::create_directories(tmpPath / std::to_string(i));
+
+		std::atomic_bool entered = false;
+		std::atomic_bool release = false;
+
+		ldmonitor::MonitorOptions monitorOptions;
+		monitorOptions.m_fUseIoUring = useIoUring;
+
+		ldmonitor::Monitor monitor{ monitorOptions };
+
+		monitor.Watch(
+			tmpPath / "blocker",
+			[&entered, &release](const ldmonitor::fs::path &, std::string, uint32_t, std::chrono::milliseconds)
+			{
+				entered = true;
+
+				while (!release)
+					std::this_thread::sleep_for(1ms);
+			},
+			ldmonitor::MONITOR_ACTION_FILE_CREATE
+		);
+
+		std::ofstream{ tmpPath / "blocker" / "a.txt" };
+
+		while (!entered)
+			std::this_thread::sleep_for(1ms);
+
+		ldmonitor::WatchOptions options;
+		options.m_fPolling = true;
+		options.m_tPollInterval = 10ms;
+
+		//each one has work for the monitor thread, more than the wakes it could take before
+		std::atomic_int added = 0;
+
+		std::thread adder{ [&]()
+		{
+			for (int i = 0; i < NUM_POLLS; ++i)
+			{
+				monitor.Watch(tmpPath / std::to_string(i), [](const ldmonitor::fs::path &, std::string, uint32_t, std::chrono::milliseconds) {}, ldmonitor::MONITOR_ACTION_FILE_CREATE, options);
+
+				++added;
+			}
+		} };
+
+		for (int i = 0; (i < 5000) && (added < NUM_POLLS); ++i)
+			std::this_thread::sleep_for(1ms);
+
+		//a stuck Watch never returns, terminates on the joinable thread instead of hanging
+		ASSERT_EQ(added, NUM_POLLS);
+
+		adder.join();
+
+		release = true;
+
+		//the thread takes them once the callback returns
+		std::ofstream{ tmpPath / "7" / "b.txt" };
+
+		for (int i = 0; (i < 2000) && (monitor.GetMetrics().m_u64DeliveredEvents < 2); ++i)
+			std::this_thread::sleep_for(1ms);
+
+		ASSERT_EQ(monitor.GetMetrics().m_u64DeliveredEvents, 2u);
+
+		for (int i = 0; i < NUM_POLLS; ++i)
+			monitor.Unwatch(tmpPath / std::to_string(i));
+
+		monitor.Unwatch(tmpPath / "blocker");
+	}
+
+	ldmonitor::fs::remove_all(tmpPath);
+}
+
+TEST(ldmonitor, MetricsTest)
+{
+	using namespace std::chrono_literals;
+
+	//buckets: exact up to 15, then 16 per power of 2, the last one ends at the highest value
+	for (size_t i = 0; i < ldmonitor::LatencyHistogram::SUB_BUCKETS; ++i)
+		ASSERT_EQ(ldmonitor::LatencyHistogram::GetBucketLimit(i), i);
+
+	ASSERT_EQ(ldmonitor::LatencyHistogram::GetBucketLimit(32), 33u);
+	ASSERT_EQ(ldmonitor::LatencyHistogram::GetBucketLimit(ldmonitor::LatencyHistogram::NUM_BUCKETS - 1), UINT64_MAX);
+
+	for (size_t i = 1; i < ldmonitor::LatencyHistogram::NUM_BUCKETS; ++i)
+		ASSERT_LT(ldmonitor::LatencyHistogram::GetBucketLimit(i - 1), ldmonitor::LatencyHistogram::GetBucketLimit(i));
+
+	{
+		ldmonitor::LatencyHistogram histogram;
+
+		ASSERT_EQ(histogram.GetPercentile(0.5), 0u);
+
+		histogram.m_arCounts[3] = 98;
+		histogram.m_arCounts[40] = 1;
+		histogram.m_arCounts[50] = 1;
+
+		ASSERT_EQ(histogram.GetCount(), 100u);
+		ASSERT_EQ(histogram.GetPercentile(0.5), 3u);
+		ASSERT_EQ(histogram.GetPercentile(0.99), ldmonitor::LatencyHistogram::GetBucketLimit(40));
+		ASSERT_EQ(histogram.GetPercentile(1), ldmonitor::LatencyHistogram::GetBucketLimit(50));
+	}
+
+	auto tmpPath = ldmonitor::fs::temp_directory_path();
+
+	tmpPath.append("testDirMetrics");
+
+	ldmonitor::fs::remove_all(tmpPath);
+	ldmonitor::fs::create_directories(tmpPath);
+
+	ldmonitor::MonitorOptions monitorOptions;
+	monitorOptions.m_fTimeCallbacks = true;
+
+	ldmonitor::Monitor monitor{ monitorOptions };
+
+	ldmonitor::WatchOptions options;
+	options.m_vecExclude = { "*.tmp" };
+
+	std::atomic_int received = 0;
+
+	monitor.Watch(
+		tmpPath,
+		[&received](const ldmonitor::fs::path &, std::string, uint32_t, std::chrono::milliseconds)
+		{
+			std::this_thread::sleep_for(1ms);
+
+			++received;
+		},
+		ldmonitor::MONITOR_ACTION_FILE_CREATE,
+		options
+	);
+
+	std::ofstream{ tmpPath / "a.txt" };
+	std::ofstream{ tmpPath / "b.tmp" };
+	std::ofstream{ tmpPath / "c.txt" };
+
+	for (int i = 0; (i < 2000) && ((received < 2) || (monitor.GetMetrics(tmpPath).m_u64FilteredEvents < 1)); ++i)
+		std::this_thread::sleep_for(1ms);
+
+	const auto metrics = monitor.GetMetrics();
+
+	ASSERT_GE(metrics.m_u64Reads, 1u);
+	ASSERT_GT(metrics.m_u64BytesRead, 0u);
+
+	//opens and closes are also read, no watch asked for them
+	ASSERT_GE(metrics.m_u64Events, 3u);
+	ASSERT_EQ(metrics.m_u64FilteredEvents, 1u);
+	ASSERT_EQ(metrics.m_u64DeliveredEvents, 2u);
+	ASSERT_EQ(metrics.m_u64Overflows, 0u);
+
+	ASSERT_EQ(metrics.m_stCallbackTime.GetCount(), 2u);
+	ASSERT_GE(metrics.m_stCallbackTime.GetPercentile(0), 1000000u);
+	ASSERT_EQ(metrics.m_stDispatchDelay.GetCount(), 2u);
+
+	const auto watchMetrics = monitor.GetMetrics(tmpPath);
+
+	ASSERT_EQ(watchMetrics.m_u64DeliveredEvents, 2u);
+	ASSERT_EQ(watchMetrics.m_u64FilteredEvents, 1u);
+	ASSERT_GE(watchMetrics.m_u64CallbackTime, 2000000u);
+
+	ASSERT_EQ(monitor.GetMetrics(tmpPath / "missing").m_u64DeliveredEvents, 0u);
+
+	const auto text = ldmonitor::FormatMetrics(metrics);
+
+	ASSERT_NE(text.find("delivered: 2"), std::string::npos);
+	ASSERT_NE(text.find("callback_time: 2"), std::string::npos);
+
+	monitor.Unwatch(tmpPath);
+
+	ldmonitor::fs::remove_all(tmpPath);
+}
+
+TEST(ldmonitor, TraceTest)
+{
+	using namespace std::chrono_literals;
+
+	auto tmpPath = ldmonitor::fs::temp_directory_path();
+
+	tmpPath.append("testDirTrace");
+
+	ldmonitor::fs::remove_all(tmpPath);
+	ldmonitor::fs::create_directories(tmpPath / "watched");
+
+	ldmonitor::Monitor monitor;
+
+	std::atomic_int received = 0;
+
+	monitor.Watch(
+		tmpPath / "watched",
+		[&received](const ldmonitor::fs::path &, std::string, uint32_t, std::chrono::milliseconds)
+		{
+			++received;
+		},
+		ldmonitor::MONITOR_ACTION_FILE_CREATE
+	);
+
+	std::ofstream{ tmpPath / "watched" / "a.txt" };
+
+	for (int i = 0; (i < 2000) && (received == 0); ++i)
+		std::this_thread::sleep_for(1ms);
+
+	ASSERT_EQ(received, 1);
+
+#ifdef LDMONITOR_TRACE
+	ASSERT_TRUE(monitor.DumpTrace(tmpPath / "trace.json"));
+
+	{
+		std::ifstream file{ tmpPath / "trace.json" };
+		std::string json{ std::istreambuf_iterator<char>{ file }, std::istreambuf_iterator<char>{} };
+
+		for (auto stage : { "kernel_wait", "read", "lookup", "lock", "callback" })
+			ASSERT_NE(json.find(std::string{ "\"name\":\"" } + stage + '"'), std::string::npos) << stage;
+	}
+
+	ASSERT_TRUE(monitor.DumpTrace(tmpPath / "trace.bin", ldmonitor::TRACE_FORMAT_BINARY));
+
+	{
+		const auto size = ldmonitor::fs::file_size(tmpPath / "trace.bin");
+
+		//header and 32 byte records
+		ASSERT_GT(size, 24u);
+		ASSERT_EQ((size - 24) % 32, 0u);
+
+		std::ifstream file{ tmpPath / "trace.bin", std::ios::binary };
+
+		char magic[8];
+		file.read(magic, sizeof(magic));
+
+		ASSERT_EQ(std::string(magic, sizeof(magic)), "LDMTRACE");
+	}
+
+	ASSERT_THROW(monitor.DumpTrace(tmpPath / "missing" / "trace.json"), std::runtime_error);
+#else
+	//not built, nothing recorded
+	ASSERT_FALSE(monitor.DumpTrace(tmpPath / "trace.json"));
+	ASSERT_FALSE(ldmonitor::fs::exists(tmpPath / "trace.json"));
+#endif
+
+	monitor.Unwatch(tmpPath / "watched");
+
+	ldmonitor::fs::remove_all(tmpPath);
+}
+
+TEST(ldmonitor, WatchBudgetTest)
+{
+	using namespace std::chrono_literals;
+
+	auto tmpPath = ldmonitor::fs::temp_directory_path();
+
+	tmpPath.append("testDirWatchBudget");
+
+	ldmonitor::fs::remove_all(tmpPath);
+
+	for (auto name : { "a", "b", "c" })
+		ldmonitor::fs::create_directories(tmpPath / name);
+
+	std::mutex lock;
+	std::set<std::string> events;
+
+	auto waitEvents = [&lock, &events](size_t count)
+	{
+		for (int i = 0; i < 2000; ++i)
+		{
+			{
+				std::lock_guard guard{ lock };
+
+				if (events.size() >= count)
+					break;
+			}
+
+			std::this_thread::sleep_for(1ms);
+		}
+
+		std::lock_guard guard{ lock };
+
+		auto received = std::move(events);
+		events.clear();
+
+		return received;
+	};
+
+	ldmonitor::MonitorOptions monitorOptions;
+	monitorOptions.m_fWatchBudget = true;
+	monitorOptions.m_szMaxWatches = 2;
+	monitorOptions.m_tColdAfter = 50ms;
+
+	//from fs.inotify.max_user_watches
+	{
+		ldmonitor::MonitorOptions defaultOptions;
+		defaultOptions.m_fWatchBudget = true;
+
+		ASSERT_GT(ldmonitor::Monitor{ defaultOptions }.GetWatchBudget().m_szLimit, 0u);
+	}
+
+	ldmonitor::Monitor monitor{ monitorOptions };
+
+	ldmonitor::WatchOptions options;
+	options.m_tPollInterval = 10ms;
+	options.m_tMaxPollInterval = 80ms;
+
+	for (auto name : { "a", "b", "c" })
+	{
+		monitor.Watch(
+			tmpPath / name,
+			[&lock, &events](const ldmonitor::fs::path &path, std::string fileName, uint32_t, std::chrono::milliseconds)
+			{
+				std::lock_guard guard{ lock };
+
+				events.insert(path.filename().string() + '/' + fileName);
+			},
+			ldmonitor::MONITOR_ACTION_FILE_CREATE,
+			options
+		);
+
+		//so a is the coldest
+		std::this_thread::sleep_for(20ms);
+	}
+
+	//no room for c, a is polled now
+	auto budget = monitor.GetWatchBudget();
+
+	ASSERT_EQ(budget.m_szLimit, 2u);
+	ASSERT_EQ(budget.m_szUsed, 2u);
+	ASSERT_EQ(budget.m_szDemoted, 1u);
+	ASSERT_EQ(monitor.GetMetrics().m_u64Demotions, 1u);
+
+	//b idle for longer than m_tColdAfter
+	std::this_thread::sleep_for(100ms);
+
+	std::ofstream{ tmpPath / "c" / "x.txt" };
+	std::ofstream{ tmpPath / "a" / "y.txt" };
+
+	{
+		const std::set<std::string> expected = { "a/y.txt", "c/x.txt" };
+
+		ASSERT_EQ(waitEvents(2), expected);
+	}
+
+	//a is hot, b makes room for it
+	for (int i = 0; (i < 2000) && (monitor.GetMetrics().m_u64Promotions == 0); ++i)
+		std::this_thread::sleep_for(1ms);
+
+	ASSERT_EQ(monitor.GetMetrics().m_u64Promotions, 1u);
+	ASSERT_EQ(monitor.GetMetrics().m_u64Demotions, 2u);
+
+	budget = monitor.GetWatchBudget();
+
+	ASSERT_EQ(budget.m_szDemoted, 1u);
+
+	//nothing lost by any of them
+	std::ofstream{ tmpPath / "a" / "w.txt" };
+	std::ofstream{ tmpPath / "b" / "z.txt" };
+
+	{
+		const std::set<std::string> expected = { "a/w.txt", "b/z.txt" };
+
+		ASSERT_EQ(waitEvents(2), expected);
+	}
+
+	for (auto name : { "a", "b", "c" })
+		monitor.Unwatch(tmpPath / name);
+
+	ASSERT_FALSE(monitor.IsRunning());
+
+	budget = monitor.GetWatchBudget();
+
+	ASSERT_EQ(budget.m_szUsed, 0u);
+	ASSERT_EQ(budget.m_szDemoted, 0u);
+
+	ldmonitor::fs::remove_all(tmpPath);
+}
+
+TEST(ldmonitor, WatchBudgetDemotionTest)
+{
+	using namespace std::chrono_literals;
+
+	auto tmpPath = ldmonitor::fs::temp_directory_path();
+
+	tmpPath.append("testDirWatchBudgetDemotion");
+
+	ldmonitor::fs::remove_all(tmpPath);
+	ldmonitor::fs::create_directories(tmpPath / "small");
+
+	//big enough for a scan to stand out
+	for (int i = 0; i < 20; ++i)
+	{
+		auto dir = tmpPath / "big" / std::to_string(i);
+
+		ldmonitor::fs::create_directories(dir);
+
+		for (int j = 0; j < 500; ++j)
+			std::ofstream{ dir / (std::to_string(j) + ".txt") };
+	}
+
+	std::mutex lock;
+	std::set<std::string> events;
+
+	auto callback = [&lock, &events](const ldmonitor::fs::path &, std::string fileName, uint32_t, std::chrono::milliseconds)
+	{
+		std::lock_guard guard{ lock };
+
+		events.insert(std::move(fileName));
+	};
+
+	ldmonitor::WatchOptions options;
+	options.m_fRecursive = true;
+	options.m_tPollInterval = 10ms;
+
+	//what a scan of the tree costs
+	std::chrono::steady_clock::duration scanTime;
+	{
+		ldmonitor::WatchOptions pollOptions = options;
+		pollOptions.m_fPolling = true;
+
+		ldmonitor::Monitor reference;
+
+		const auto start = std::chrono::steady_clock::now();
+		reference.Watch(tmpPath / "big", callback, ldmonitor::MONITOR_ACTION_FILE_CREATE, pollOptions);
+		scanTime = std::chrono::steady_clock::now() - start;
+	}
+
+	ldmonitor::MonitorOptions monitorOptions;
+	monitorOptions.m_fWatchBudget = true;
+	monitorOptions.m_szMaxWatches = 21;
+
+	ldmonitor::Monitor monitor{ monitorOptions };
+
+	monitor.Watch(tmpPath / "big", callback, ldmonitor::MONITOR_ACTION_FILE_CREATE, options);
+
+	//no room, big is demoted without being scanned by us
+	const auto start = std::chrono::steady_clock::now();
+	monitor.Watch(tmpPath / "small", callback, ldmonitor::MONITOR_ACTION_FILE_CREATE, options);
+	const auto watchTime = std::chrono::steady_clock::now() - start;
+
+	ASSERT_EQ(monitor.GetWatchBudget().m_szDemoted, 1u);
+	ASSERT_LT(watchTime * 4, scanTime);
+
+	//time for the monitor thread to scan it, the polls see what comes next
+	std::this_thread::sleep_for(100ms);
+
+	std::ofstream{ tmpPath / "big" / "7" / "new.txt" };
+	std::ofstream{ tmpPath / "small" / "new.txt" };
+
+	for (int i = 0; i < 2000; ++i)
+	{
+		{
+			std::lock_guard guard{ lock };
+
+			if (events.size() >= 2)
+				break;
+		}
+
+		std::this_thread::sleep_for(1ms);
+	}
+
+	{
+		std::lock_guard guard{ lock };
+
+		const std::set<std::string> expected = { "7/new.txt", "new.txt" };
+
+		ASSERT_EQ(events, expected);
+	}
+
+	monitor.Unwatch(tmpPath / "big");
+	monitor.Unwatch(tmpPath / "small");
+
+	ldmonitor::fs::remove_all(tmpPath);
+}
+
+TEST(ldmonitor, WatchBudgetBlockedCallbackTest)
+{
+	using namespace std::chrono_literals;
+
+	auto tmpPath = ldmonitor::fs::temp_directory_path();
+
+	tmpPath.append("testDirWatchBudgetBlocked");
+
+	constexpr int NUM_WATCHES = 40;
+
+	ldmonitor::fs::remove_all(tmpPath);
+	ldmonitor::fs::create_directories(tmpPath / "blocker");
+
+	for (int i = 0; i < NUM_WATCHES; ++i)
+		ldmonitor::fs::create_directories(tmpPath / std::to_string(i));
+
+	std::atomic_bool entered = false;
+	std::atomic_bool release = false;
+
+	ldmonitor::MonitorOptions monitorOptions;
+	monitorOptions.m_fWatchBudget = true;
+	monitorOptions.m_szMaxWatches = 2;
+
+	ldmonitor::Monitor monitor{ monitorOptions };
+
+	monitor.Watch(
+		tmpPath / "blocker",
+		[&entered, &release](const ldmonitor::fs::path &, std::string, uint32_t, std::chrono::milliseconds)
+		{
+			entered = true;
+
+			while (!release)
+				std::this_thread::sleep_for(1ms);
+		},
+		ldmonitor::MONITOR_ACTION_FILE_CREATE
+	);
+
+	std::ofstream{ tmpPath / "blocker" / "a.txt" };
+
+	while (!entered)
+		std::this_thread::sleep_for(1ms);
+
+	ldmonitor::WatchOptions options;
+	options.m_tPollInterval = 10ms;
+
+	//each one demotes another, so each has work for the monitor thread
+	std::atomic_int added = 0;
+
+	std::thread adder{ [&]()
+	{
+		for (int i = 0; i < NUM_WATCHES; ++i)
+		{
+			monitor.Watch(tmpPath / std::to_string(i), [](const ldmonitor::fs::path &, std::string, uint32_t, std::chrono::milliseconds) {}, ldmonitor::MONITOR_ACTION_FILE_CREATE, options);
+
+			++added;
+		}
+	} };
+
+	for (int i = 0; (i < 5000) && (added < NUM_WATCHES); ++i)
+		std::this_thread::sleep_for(1ms);
+
+	//a stuck Watch never returns, terminates on the joinable thread instead of hanging
+	ASSERT_EQ(added, NUM_WATCHES);
+
+	adder.join();
+
+	ASSERT_EQ(monitor.GetWatchBudget().m_szDemoted, NUM_WATCHES - 1u);
+
+	release = true;
+
+	for (int i = 0; i < NUM_WATCHES; ++i)
+		monitor.Unwatch(tmpPath / std::to_string(i));
+
+	monitor.Unwatch(tmpPath / "blocker");
+
+	ldmonitor::fs::remove_all(tmpPath);
+}
+
+#endif
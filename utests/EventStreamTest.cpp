@@ -0,0 +1,196 @@
+// Copyright (C) 2023 - Bruno Sanches. See the COPYRIGHT
+// file at the top-level directory of this distribution.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+//
+// This Source Code Form is "Incompatible With Secondary Licenses", as
+// defined by the Mozilla Public License, v. 2.0.
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <fstream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "ldmonitor/EventStream.h"
+
+using namespace std::chrono_literals;
+
+//
+//
+// Coroutine that starts right away and frees itself when done
+//
+//
+
+struct Detached
+{
+	struct promise_type
+	{
+		Detached get_return_object() noexcept { return {}; }
+
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+
+		void return_void() noexcept {}
+		void unhandled_exception() noexcept { std::terminate(); }
+	};
+};
+
+struct Consumer
+{
+	std::mutex					m_clLock;
+	std::vector<std::string>	m_vecNames;
+	std::thread::id				m_tidResumed;
+
+	std::atomic_bool			m_fDone = false;
+
+	size_t GetCount()
+	{
+		std::lock_guard lock{ m_clLock };
+
+		return m_vecNames.size();
+	}
+};
+
+static Detached Consume(ldmonitor::EventStream &stream, Consumer &consumer)
+{
+	while (auto event = co_await stream.Next())
+	{
+		std::lock_guard lock{ consumer.m_clLock };
+
+		consumer.m_vecNames.push_back(std::move(event->m_strFileName));
+		consumer.m_tidResumed = std::this_thread::get_id();
+	}
+
+	consumer.m_fDone = true;
+}
+
+static ldmonitor::fs::path MakeTestDir(const char *name)
+{
+	auto tmpPath = ldmonitor::fs::temp_directory_path();
+
+	tmpPath.append(name);
+
+	ldmonitor::fs::remove_all(tmpPath);
+	ldmonitor::fs::create_directories(tmpPath);
+
+	return tmpPath;
+}
+
+static void CreateFiles(const ldmonitor::fs::path &path, int count)
+{
+	for (int i = 0; i < count; ++i)
+	{
+		std::ofstream ofs(path / ("file" + std::to_string(i)));
+	}
+}
+
+static void CheckNames(Consumer &consumer, int count)
+{
+	for (int i = 0; (i < 5000) && (consumer.GetCount() < static_cast<size_t>(count)); ++i)
+		std::this_thread::sleep_for(1ms);
+
+	std::lock_guard lock{ consumer.m_clLock };
+
+	ASSERT_EQ(consumer.m_vecNames.size(), count);
+
+	for (int i = 0; i < count; ++i)
+		ASSERT_EQ(consumer.m_vecNames[i], "file" + std::to_string(i));
+}
+
+TEST(ldmonitor, EventStreamTest)
+{
+	auto tmpPath = MakeTestDir("testDirEventStream");
+
+	ldmonitor::Monitor monitor;
+	Consumer consumer;
+
+	{
+		ldmonitor::EventStream stream{ monitor, tmpPath, ldmonitor::MONITOR_ACTION_FILE_CREATE };
+
+		Consume(stream, consumer);
+
+		const int numFiles = 256;
+
+		CreateFiles(tmpPath, numFiles);
+		CheckNames(consumer, numFiles);
+
+		ASSERT_FALSE(consumer.m_fDone);
+
+		//resumed directly by the monitor thread
+		ASSERT_NE(consumer.m_tidResumed, std::this_thread::get_id());
+	}
+
+	//closing resumes the consumer with no event
+	ASSERT_TRUE(consumer.m_fDone);
+	ASSERT_FALSE(monitor.IsRunning());
+
+	ldmonitor::fs::remove_all(tmpPath);
+}
+
+TEST(ldmonitor, EventStreamExecutorTest)
+{
+	auto tmpPath = MakeTestDir("testDirEventStreamExecutor");
+
+	ldmonitor::Monitor monitor;
+	Consumer consumer;
+
+	ldmonitor::StreamOptions options;
+	options.m_spExecutor = std::make_shared<ldmonitor::ThreadPool>(1);
+
+	{
+		ldmonitor::EventStream stream{ monitor, tmpPath, ldmonitor::MONITOR_ACTION_FILE_CREATE, options };
+
+		Consume(stream, consumer);
+
+		const int numFiles = 256;
+
+		CreateFiles(tmpPath, numFiles);
+		CheckNames(consumer, numFiles);
+	}
+
+	for (int i = 0; (i < 1000) && !consumer.m_fDone; ++i)
+		std::this_thread::sleep_for(1ms);
+
+	ASSERT_TRUE(consumer.m_fDone);
+
+	ldmonitor::fs::remove_all(tmpPath);
+}
+
+TEST(ldmonitor, EventStreamCapacityTest)
+{
+	auto tmpPath = MakeTestDir("testDirEventStreamCapacity");
+
+	ldmonitor::Monitor monitor;
+	Consumer consumer;
+
+	ldmonitor::StreamOptions options;
+	options.m_szCapacity = 4;
+
+	ldmonitor::EventStream stream{ monitor, tmpPath, ldmonitor::MONITOR_ACTION_FILE_CREATE, options };
+
+	const int numFiles = 128;
+
+	//nobody consuming, the monitor thread waits once the stream is full
+	CreateFiles(tmpPath, numFiles);
+
+	for (int i = 0; (i < 1000) && (stream.GetPending() < options.m_szCapacity); ++i)
+		std::this_thread::sleep_for(1ms);
+
+	std::this_thread::sleep_for(20ms);
+	ASSERT_EQ(stream.GetPending(), options.m_szCapacity);
+
+	//late consumer gets everything in order
+	Consume(stream, consumer);
+	CheckNames(consumer, numFiles);
+
+	stream.Close();
+
+	ASSERT_TRUE(consumer.m_fDone);
+
+	ldmonitor::fs::remove_all(tmpPath);
+}